@@ -9,15 +9,23 @@ LOCAL_SRC_FILES:= \
 	anonymous.c anonymous.h \
 	authors.c authors.h \
 	buffer.c buffer.h \
+	cache.c cache.h \
 	child.c child.h \
+	chunked.c chunked.h \
 	common.h \
 	conf.c conf.h \
+	conn-pool.c conn-pool.h \
 	conns.c conns.h \
 	daemon.c daemon.h \
+	dns.c dns.h \
+	event-loop.c event-loop.h \
 	hashmap.c hashmap.h \
+	header-map.c header-map.h \
 	heap.c heap.h \
 	html-error.c html-error.h \
+	http-head.c http-head.h \
 	http-message.c http-message.h \
+	http-parser.c http-parser.h \
 	log.c log.h \
 	network.c network.h \
 	reqs.c reqs.h \
@@ -31,6 +39,7 @@ LOCAL_SRC_FILES:= \
 	upstream.c upstream.h \
 	connect-ports.c connect-ports.h \
 	filter.c filter.h \
+	pattern-set.c pattern-set.h \
 	transparent-proxy.c transparent-proxy.h
 
 #LOCAL_SHARED_LIBRARIES := librtmp
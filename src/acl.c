@@ -19,11 +19,20 @@
 /* This system handles Access Control for use of this daemon. A list of
  * domains, or IP addresses (including IP blocks) are stored in a list
  * which is then used to compare incoming connections.
+ *
+ * The numeric entries are kept in a radix tree over the binary IPv6 form
+ * of the address (IPv4 addresses are mapped into ::ffff:0:0/96), so that
+ * a client is checked against thousands of networks by following one
+ * path down the tree.  Every network in the tree remembers the position
+ * of the first entry naming it; the first entry which matches the client
+ * is the smallest position on that path, or a domain name entry given
+ * before it.
  */
 
 #include "main.h"
 
 #include "acl.h"
+#include "dns.h"
 #include "heap.h"
 #include "log.h"
 #include "network.h"
@@ -34,31 +43,42 @@
 
 /* Define how long an IPv6 address is in bytes (128 bits, 16 bytes) */
 #define IPV6_LEN 16
+#define IPV6_BITS (8 * IPV6_LEN)
 
-enum acl_type {
-        ACL_STRING,
-        ACL_NUMERIC
+/*
+ * A domain name entry, and where it came in the list.
+ */
+struct acl_s {
+        acl_access_t access;
+        unsigned int position;
+        char *string;
 };
 
 /*
- * Hold the information about a particular access control.  We store
- * whether it's an ALLOW or DENY entry, and also whether it's a string
- * entry (like a domain name) or an IP entry.
+ * A node of the radix tree.  Its network is the first "bits" bits of
+ * "network" (the rest are zero), and both children lie inside it.  A
+ * node which only joins two others holds no entry ("position" is
+ * NO_ENTRY.)
  */
-struct acl_s {
+#define NO_ENTRY UINT_MAX
+
+struct acl_node {
+        unsigned char network[IPV6_LEN];
+        unsigned int bits;
+        unsigned int position;
         acl_access_t access;
-        enum acl_type type;
-        union {
-                char *string;
-                struct {
-                        unsigned char network[IPV6_LEN];
-                        unsigned char mask[IPV6_LEN];
-                } ip;
-        } address;
+        struct acl_node *child[2];
+};
+
+struct acl_list_s {
+        vector_t strings;
+        struct acl_node *root;
+        unsigned int entries;
 };
 
 /*
- * Fills in the netmask array given a numeric value.
+ * Works out the prefix length of an IP block from the text after the
+ * slash.
  *
  * Returns:
  *   0 on success
@@ -66,10 +86,8 @@ struct acl_s {
  *
  */
 static int
-fill_netmask_array (char *bitmask_string, int v6,
-                    unsigned char array[], size_t len)
+get_prefix_length (char *bitmask_string, int v6, unsigned int *bits)
 {
-        unsigned int i;
         unsigned long int mask;
         char *endptr;
 
@@ -89,32 +107,228 @@ fill_netmask_array (char *bitmask_string, int v6,
         }
 
         /* check valid range for a bit mask */
-        if (mask > (8 * len))
+        if (mask > IPV6_BITS)
                 return -1;
 
-        /* we have a valid range to fill in the array */
-        for (i = 0; i != len; ++i) {
-                if (mask >= 8) {
-                        array[i] = 0xff;
-                        mask -= 8;
-                } else if (mask > 0) {
-                        array[i] = (unsigned char) (0xff << (8 - mask));
-                        mask = 0;
+        *bits = (unsigned int) mask;
+        return 0;
+}
+
+/*
+ * Clear the bits of the address past the prefix length.
+ */
+static void mask_address (unsigned char address[], unsigned int bits)
+{
+        unsigned int i;
+
+        for (i = 0; i != IPV6_LEN; ++i) {
+                if (bits >= 8) {
+                        bits -= 8;
+                } else if (bits > 0) {
+                        address[i] &= (unsigned char) (0xff << (8 - bits));
+                        bits = 0;
                 } else {
-                        array[i] = 0;
+                        address[i] = 0;
+                }
+        }
+}
+
+/*
+ * Return the value of one bit of the address, counting from the top.
+ */
+static unsigned int address_bit (const unsigned char address[],
+                                 unsigned int bit)
+{
+        return (address[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+ * Return how many leading bits the two addresses share, up to "limit".
+ */
+static unsigned int
+common_bits (const unsigned char a[], const unsigned char b[],
+             unsigned int limit)
+{
+        unsigned int bits = 0, i;
+        unsigned char x;
+
+        for (i = 0; bits < limit; ++i) {
+                x = a[i] ^ b[i];
+                if (x == 0) {
+                        bits += 8;
+                        continue;
+                }
+
+                while (!(x & 0x80)) {
+                        x <<= 1;
+                        bits++;
                 }
+                break;
+        }
+
+        return bits < limit ? bits : limit;
+}
+
+static struct acl_node *new_node (const unsigned char network[],
+                                  unsigned int bits)
+{
+        struct acl_node *node;
+
+        node = (struct acl_node *) safecalloc (1, sizeof (struct acl_node));
+        if (!node)
+                return NULL;
+
+        memcpy (node->network, network, IPV6_LEN);
+        mask_address (node->network, bits);
+        node->bits = bits;
+        node->position = NO_ENTRY;
+
+        return node;
+}
+
+/*
+ * Add a network to the radix tree.  If it is already there, the entry
+ * which named it first is kept.
+ *
+ * Returns:
+ *    -1 on failure
+ *     0 otherwise.
+ */
+static int
+insert_network (struct acl_list_s *list, const unsigned char network[],
+                unsigned int bits, acl_access_t access)
+{
+        struct acl_node **link = &list->root;
+        struct acl_node *node, *entry, *join;
+        unsigned int common;
+
+        while ((node = *link) != NULL) {
+                common = common_bits (network, node->network,
+                                      bits < node->bits ? bits : node->bits);
+
+                if (common == node->bits) {
+                        if (common == bits) {
+                                /* The very same network */
+                                entry = node;
+                                goto found;
+                        }
+
+                        /* Inside this node's network, so carry on down */
+                        link = &node->child[address_bit (network, common)];
+                        continue;
+                }
+
+                /*
+                 * The new network and this node part ways before the
+                 * end of the node's prefix, so the node must hang below
+                 * either the new network or a new node joining the two.
+                 */
+                entry = new_node (network, bits);
+                if (!entry)
+                        return -1;
+
+                if (common == bits) {
+                        entry->child[address_bit (node->network, common)] =
+                                node;
+                        *link = entry;
+                        goto found;
+                }
+
+                join = new_node (network, common);
+                if (!join) {
+                        safefree (entry);
+                        return -1;
+                }
+                join->child[address_bit (network, common)] = entry;
+                join->child[address_bit (node->network, common)] = node;
+                *link = join;
+                goto found;
+        }
+
+        entry = new_node (network, bits);
+        if (!entry)
+                return -1;
+        *link = entry;
+
+found:
+        if (entry->position == NO_ENTRY) {
+                entry->position = list->entries;
+                entry->access = access;
         }
 
         return 0;
 }
 
+/*
+ * Find the first numeric entry which matches the address, or NULL if
+ * none does.
+ */
+static const struct acl_node *
+lookup_network (const struct acl_list_s *list, const unsigned char address[])
+{
+        const struct acl_node *node = list->root, *first = NULL;
+
+        while (node
+               && common_bits (address, node->network,
+                               node->bits) == node->bits) {
+                if (node->position < (first ? first->position : NO_ENTRY))
+                        first = node;
+
+                if (node->bits == IPV6_BITS)
+                        break;
+                node = node->child[address_bit (address, node->bits)];
+        }
+
+        return first;
+}
+
+static void free_nodes (struct acl_node *node)
+{
+        if (!node)
+                return;
+
+        free_nodes (node->child[0]);
+        free_nodes (node->child[1]);
+        safefree (node);
+}
+
+/*
+ * Convert the client's address into the IPv6 form used by the tree.
+ *
+ * Returns:
+ *    -1 if it is not an IP address
+ *     0 otherwise.
+ */
+static int
+get_network_address (const struct sockaddr *addr, unsigned char address[])
+{
+        switch (addr->sa_family) {
+        case AF_INET:
+                memset (address, 0, 10);
+                memset (address + 10, 0xff, 2);
+                memcpy (address + 12,
+                        &((const struct sockaddr_in *) addr)->sin_addr, 4);
+                return 0;
+
+        case AF_INET6:
+                memcpy (address,
+                        &((const struct sockaddr_in6 *) addr)->sin6_addr,
+                        IPV6_LEN);
+                return 0;
+
+        default:
+                return -1;
+        }
+}
+
 /**
  * If the access list has not been set up, create it.
  */
-static int init_access_list(vector_t *access_list)
+static int init_access_list(acl_list_t *access_list)
 {
         if (!*access_list) {
-                *access_list = vector_create ();
+                *access_list = (struct acl_list_s *)
+                        safecalloc (1, sizeof (struct acl_list_s));
                 if (!*access_list) {
                         log_message (LOG_ERR,
                                      "Unable to allocate memory for access list");
@@ -135,11 +349,14 @@ static int init_access_list(vector_t *access_list)
  *     0 otherwise.
  */
 int
-insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
+insert_acl (char *location, acl_access_t access_type, acl_list_t *access_list)
 {
+        struct acl_list_s *list;
         struct acl_s acl;
         int ret;
-        char *p, ip_dst[IPV6_LEN];
+        unsigned int bits;
+        char *p;
+        unsigned char ip_dst[IPV6_LEN];
 
         assert (location != NULL);
 
@@ -147,23 +364,14 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
         if (ret != 0) {
                 return -1;
         }
-
-        /*
-         * Start populating the access control structure.
-         */
-        memset (&acl, 0, sizeof (struct acl_s));
-        acl.access = access_type;
+        list = *access_list;
 
         /*
          * Check for a valid IP address (the simplest case) first.
          */
         if (full_inet_pton (location, ip_dst) > 0) {
-                acl.type = ACL_NUMERIC;
-                memcpy (acl.address.ip.network, ip_dst, IPV6_LEN);
-                memset (acl.address.ip.mask, 0xff, IPV6_LEN);
+                ret = insert_network (list, ip_dst, IPV6_BITS, access_type);
         } else {
-                int i;
-
                 /*
                  * At this point we're either a hostname or an
                  * IP address with a slash.
@@ -181,8 +389,6 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
                         if (full_inet_pton (location, ip_dst) <= 0)
                                 return -1;
 
-                        acl.type = ACL_NUMERIC;
-
                         /* Check if the IP address before the netmask is
                          * an IPv6 address */
                         if (inet_pton(AF_INET6, location, dst) > 0)
@@ -190,24 +396,34 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
                         else
                                 v6 = 0;
 
-                        if (fill_netmask_array
-                            (p + 1, v6, &(acl.address.ip.mask[0]), IPV6_LEN)
-                            < 0)
+                        if (get_prefix_length (p + 1, v6, &bits) < 0)
                                 return -1;
 
-                        for (i = 0; i < IPV6_LEN; i++)
-                                acl.address.ip.network[i] = ip_dst[i] &
-                                        acl.address.ip.mask[i];
+                        ret = insert_network (list, ip_dst, bits,
+                                              access_type);
                 } else {
                         /* In all likelihood a string */
-                        acl.type = ACL_STRING;
-                        acl.address.string = safestrdup (location);
-                        if (!acl.address.string)
+                        if (!list->strings) {
+                                list->strings = vector_create ();
+                                if (!list->strings)
+                                        return -1;
+                        }
+
+                        acl.access = access_type;
+                        acl.position = list->entries;
+                        acl.string = safestrdup (location);
+                        if (!acl.string)
                                 return -1;
+
+                        ret = vector_append (list->strings, &acl,
+                                             sizeof (struct acl_s));
+                        if (ret != 0)
+                                safefree (acl.string);
                 }
         }
 
-        ret = vector_append (*access_list, &acl, sizeof (struct acl_s));
+        if (ret == 0)
+                list->entries++;
         return ret;
 }
 
@@ -216,47 +432,53 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
  * the ACL.  From here we do both a text based string comparison, along with
  * a reverse name lookup comparison of the IP addresses.
  *
+ * The client's host name is only needed for the text comparison, so it
+ * is looked up by the caller when it is asked for.  The entry's addresses
+ * are found with "resolve", if given, so that the caller doesn't have to
+ * wait for them; otherwise they are looked up here.
+ *
  * Return: 0 if host is denied
  *         1 if host is allowed
  *        -1 if no tests match, so skip
+ *        -2 if the host name is needed ("string_address" is NULL)
+ *        -3 if the entry's addresses are being looked up
  */
 static int
 acl_string_processing (struct acl_s *acl,
-                       const char *ip_address, const char *string_address)
+                       const char *ip_address, const char *string_address,
+                       acl_resolver resolve, void *arg)
 {
         int match;
-        struct addrinfo hints, *res, *ressave;
+        struct addrinfo *res, *ressave = NULL;
         size_t test_length, match_length;
         char ipbuf[512];
 
-        assert (acl && acl->type == ACL_STRING);
+        assert (acl != NULL);
         assert (ip_address && strlen (ip_address) > 0);
-        assert (string_address && strlen (string_address) > 0);
+        assert (!string_address || strlen (string_address) > 0);
 
         /*
          * If the first character of the ACL string is a period, we need to
          * do a string based test only; otherwise, we can do a reverse
          * lookup test as well.
          */
-        if (acl->address.string[0] != '.') {
-                memset (&hints, 0, sizeof (struct addrinfo));
-                hints.ai_family = AF_UNSPEC;
-                hints.ai_socktype = SOCK_STREAM;
-                if (getaddrinfo (acl->address.string, NULL, &hints, &res) != 0)
-                        goto STRING_TEST;
-
-                ressave = res;
+        if (acl->string[0] != '.') {
+                if (!resolve) {
+                        res = ressave = dns_resolve (acl->string, 0);
+                } else if ((*resolve) (arg, acl->string, &res) == 0) {
+                        return -3;
+                }
 
                 match = FALSE;
-                do {
+                for (; res; res = res->ai_next) {
                         get_ip_string (res->ai_addr, ipbuf, sizeof (ipbuf));
                         if (strcmp (ip_address, ipbuf) == 0) {
                                 match = TRUE;
                                 break;
                         }
-                } while ((res = res->ai_next) != NULL);
+                }
 
-                freeaddrinfo (ressave);
+                dns_free_addrs (ressave);
 
                 if (match) {
                         if (acl->access == ACL_DENY)
@@ -266,9 +488,11 @@ acl_string_processing (struct acl_s *acl,
                 }
         }
 
-STRING_TEST:
+        if (!string_address)
+                return -2;
+
         test_length = strlen (string_address);
-        match_length = strlen (acl->address.string);
+        match_length = strlen (acl->string);
 
         /*
          * If the string length is shorter than AC string, return a -1 so
@@ -279,7 +503,7 @@ STRING_TEST:
 
         if (strcasecmp
             (string_address + (test_length - match_length),
-             acl->address.string) == 0) {
+             acl->string) == 0) {
                 if (acl->access == ACL_DENY)
                         return 0;
                 else
@@ -291,52 +515,29 @@ STRING_TEST:
 }
 
 /*
- * Compare the supplied numeric IP address with the supplied ACL structure.
- *
- * Return:
- *   1  IP address is allowed
- *   0  IP address is denied
- *  -1  neither allowed nor denied.
- */
-static int check_numeric_acl (const struct acl_s *acl, const char *ip)
-{
-        uint8_t addr[IPV6_LEN], x, y;
-        int i;
-
-        assert (acl && acl->type == ACL_NUMERIC);
-        assert (ip && strlen (ip) > 0);
-
-        if (full_inet_pton (ip, &addr) <= 0)
-                return -1;
-
-        for (i = 0; i != IPV6_LEN; ++i) {
-                x = addr[i] & acl->address.ip.mask[i];
-                y = acl->address.ip.network[i];
-
-                /* If x and y don't match, the IP addresses don't match */
-                if (x != y)
-                        return -1;
-        }
-
-        /* The addresses match, return the permission */
-        return (acl->access == ACL_ALLOW);
-}
-
-/*
- * Checks whether a connection is allowed.
+ * Checks whether a connection is allowed.  "host" is the client's host
+ * name, or NULL if it has not been looked up yet.  The addresses of the
+ * entries naming a host are found with "resolve" (see acl_resolver), or
+ * looked up and waited for if it is NULL.
  *
  * Returns:
  *     1 if allowed
  *     0 if denied
+ *    -1 if it depends on the host name, so look it up and ask again
+ *    -2 if an entry's addresses are being looked up, so ask again once
+ *       they are known
  */
-int check_acl (const char *ip, const char *host, vector_t access_list)
+int check_acl (const struct sockaddr *addr, const char *ip, const char *host,
+               acl_list_t access_list, acl_resolver resolve, void *arg)
 {
+        const struct acl_node *numeric = NULL;
         struct acl_s *acl;
-        int perm = 0;
-        size_t i;
+        unsigned char address[IPV6_LEN];
+        unsigned int first;
+        int perm;
+        size_t i, n;
 
         assert (ip != NULL);
-        assert (host != NULL);
 
         /*
          * If there is no access list allow everything.
@@ -344,39 +545,52 @@ int check_acl (const char *ip, const char *host, vector_t access_list)
         if (!access_list)
                 return 1;
 
-        for (i = 0; i != (size_t) vector_length (access_list); ++i) {
-                acl = (struct acl_s *) vector_getentry (access_list, i, NULL);
-                switch (acl->type) {
-                case ACL_STRING:
-                        perm = acl_string_processing (acl, ip, host);
-                        break;
+        if (addr && access_list->root
+            && get_network_address (addr, address) == 0)
+                numeric = lookup_network (access_list, address);
+        first = numeric ? numeric->position : NO_ENTRY;
 
-                case ACL_NUMERIC:
-                        if (ip[0] == '\0')
-                                continue;
-                        perm = check_numeric_acl (acl, ip);
+        /*
+         * A domain name entry still comes first if it was given before
+         * the network which matched.
+         */
+        n = access_list->strings ?
+                (size_t) vector_length (access_list->strings) : 0;
+        for (i = 0; i != n; ++i) {
+                acl = (struct acl_s *)
+                        vector_getentry (access_list->strings, i, NULL);
+                if (acl->position > first)
                         break;
-                }
 
-                /*
-                 * Check the return value too see if the IP address is
-                 * allowed or denied.
-                 */
+                perm = acl_string_processing (acl, ip, host, resolve, arg);
                 if (perm == 0)
-                        break;
+                        goto denied;
                 else if (perm == 1)
                         return perm;
+                else if (perm == -2)
+                        return -1;
+                else if (perm == -3)
+                        return -2;
         }
 
+        if (numeric && numeric->access == ACL_ALLOW)
+                return 1;
+
         /*
          * Deny all connections by default.
          */
-        log_message (LOG_NOTICE, "Unauthorized connection from \"%s\" [%s].",
-                     host, ip);
+denied:
+        if (host)
+                log_message (LOG_NOTICE,
+                             "Unauthorized connection from \"%s\" [%s].",
+                             host, ip);
+        else
+                log_message (LOG_NOTICE,
+                             "Unauthorized connection from [%s].", ip);
         return 0;
 }
 
-void flush_access_list (vector_t access_list)
+void flush_access_list (acl_list_t access_list)
 {
         struct acl_s *acl;
         size_t i;
@@ -390,12 +604,17 @@ void flush_access_list (vector_t access_list)
          * before we can free the acl entries themselves.
          * A hierarchical memory system would be great...
          */
-        for (i = 0; i != (size_t) vector_length (access_list); ++i) {
-                acl = (struct acl_s *) vector_getentry (access_list, i, NULL);
-                if (acl->type == ACL_STRING) {
-                        safefree (acl->address.string);
+        if (access_list->strings) {
+                for (i = 0; i != (size_t) vector_length (access_list->strings);
+                     ++i) {
+                        acl = (struct acl_s *)
+                                vector_getentry (access_list->strings, i,
+                                                 NULL);
+                        safefree (acl->string);
                 }
+                vector_delete (access_list->strings);
         }
 
-        vector_delete (access_list);
+        free_nodes (access_list->root);
+        safefree (access_list);
 }
@@ -21,14 +21,30 @@
 #ifndef TINYPROXY_ACL_H
 #define TINYPROXY_ACL_H
 
-#include "vector.h"
+struct sockaddr;
+struct addrinfo;
 
 typedef enum { ACL_ALLOW, ACL_DENY } acl_access_t;
 
+/*
+ * The Allow and Deny entries, in the order they were given.  The
+ * details are hidden in 'acl.c'.
+ */
+typedef struct acl_list_s *acl_list_t;
+
+/*
+ * Finds the addresses of an entry naming a host, for check_acl().
+ * Returns 1 with the addresses (NULL if there are none), which stay the
+ * caller's, or 0 if they are being looked up.
+ */
+typedef int (*acl_resolver) (void *arg, const char *name,
+                             struct addrinfo **addrs);
+
 extern int insert_acl (char *location, acl_access_t access_type,
-                       vector_t *access_list);
-extern int check_acl (const char *ip_address, const char *string_address,
-                      vector_t access_list);
-extern void flush_access_list (vector_t access_list);
+                       acl_list_t *access_list);
+extern int check_acl (const struct sockaddr *addr, const char *ip_address,
+                      const char *string_address, acl_list_t access_list,
+                      acl_resolver resolve, void *arg);
+extern void flush_access_list (acl_list_t access_list);
 
 #endif
@@ -15,14 +15,13 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
-
-/* The buffer used in each connection is a linked list of lines. As the lines
- * are read in and written out the buffer expands and contracts. Basically,
- * by using this method we can increase the buffer size dynamically. However,
- * we have a hard limit of 64 KB for the size of the buffer. The buffer can be
- * thought of as a queue were we act on both the head and tail. The various
- * functions act on each end (the names are taken from what Perl uses to act on
- * the ends of an array. :)
+/* The buffer used in each connection is a queue of fixed-size segments. As
+ * data is read in it goes straight into the free space at the end of the
+ * last segment (and into fresh segments as needed), and it is written out
+ * of as many segments at once as the socket will take. Segments which have
+ * been emptied go back on a free list, so a busy connection hardly ever has
+ * to call the allocator. The buffer can be thought of as a queue were we
+ * act on both the head and tail.
  */
 
 #include "main.h"
@@ -30,74 +29,138 @@
 #include "buffer.h"
 #include "heap.h"
 #include "log.h"
+#include "conf.h"
 
 #define BUFFER_HEAD(x) (x)->head
 #define BUFFER_TAIL(x) (x)->tail
 
-struct bufline_s {
-        unsigned char *string;  /* the actual string of data */
-        struct bufline_s *next; /* pointer to next in linked list */
-        size_t length;          /* length of the string of data */
-        size_t pos;             /* start sending from this offset */
+/*
+ * The size of a segment, and the most segments handed to a single
+ * readv() or sendmsg() call.  The latter also caps "ReadBufferSize".
+ */
+#define SEGMENT_SIZE (1024 * 4)
+#define SEGMENT_IOV  64
+
+/*
+ * With "AdaptiveBuffers" a buffer starts out reading MIN_READ_SIZE bytes
+ * at a time, and holding at most READS_BUFFERED reads' worth of data.
+ * Both double when reads keep filling the space offered, up to the
+ * configured limits, and halve again when reads come back mostly empty.
+ */
+#define MIN_READ_SIZE  (1024 * 2)
+#define READS_BUFFERED 8
+
+/*
+ * How many unused segments are kept for reuse; any more are freed.
+ */
+#define SEGMENT_POOL_MAX 256
+
+#ifdef HAVE_SPLICE
+/*
+ * How much is spliced into a pipe at most; the default capacity of a
+ * pipe on Linux.
+ */
+#define PIPE_BUFFER_SIZE (1024 * 64)
+#endif
+
+struct bufseg_s {
+        struct bufseg_s *next;  /* pointer to next in linked list */
+        size_t start;           /* start sending from this offset */
+        size_t end;             /* end of the data in the segment */
+        unsigned char data[SEGMENT_SIZE];
 };
 
 /*
- * The buffer structure points to the beginning and end of the buffer list
- * (and includes the total size)
+ * The buffer structure points to the beginning and end of the segment
+ * list (and includes the total size)
  */
 struct buffer_s {
-        struct bufline_s *head; /* top of the buffer */
-        struct bufline_s *tail; /* bottom of the buffer */
+        struct bufseg_s *head;  /* top of the buffer */
+        struct bufseg_s *tail;  /* bottom of the buffer */
         size_t size;            /* total size of the buffer */
+
+        size_t read_size;       /* bytes asked for by each read */
+        size_t limit;           /* stop reading once this much is held */
+        size_t max_read_size;   /* "ReadBufferSize" */
+        size_t max_limit;       /* "MaxBufferSize" */
+        unsigned int adaptive;  /* "AdaptiveBuffers" */
+
+        /* Where a copy of the data added goes, if anywhere */
+        buffer_tee_t tee;
+        void *tee_arg;
+
+#ifdef HAVE_SPLICE
+        /*
+         * Once buffer_splice() has been called, data read into the
+         * buffer is held in a pipe instead of the segments.
+         */
+        int pipefd[2];
+        size_t pipe_size;       /* bytes held in the pipe */
+        unsigned int pipe_full; /* the pipe would take no more */
+#endif
 };
 
 /*
- * Take a string of data and a length and make a new line which can be added
- * to the buffer. The data IS copied, so make sure if you allocated your
- * data buffer on the heap, delete it because you now have TWO copies.
+ * The segments not in use by any buffer.  Worker threads share them.
  */
-static struct bufline_s *makenewline (unsigned char *data, size_t length)
-{
-        struct bufline_s *newline;
+static struct bufseg_s *free_segments;
+static unsigned int free_segment_count;
 
-        assert (data != NULL);
-        assert (length > 0);
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define SEGMENT_LOCK()   pthread_mutex_lock (&segment_lock)
+#  define SEGMENT_UNLOCK() pthread_mutex_unlock (&segment_lock)
+#else
+#  define SEGMENT_LOCK()
+#  define SEGMENT_UNLOCK()
+#endif
 
-        newline = (struct bufline_s *) safemalloc (sizeof (struct bufline_s));
-        if (!newline)
-                return NULL;
+/*
+ * Get an empty segment, from the free list if there is one.
+ */
+static struct bufseg_s *new_segment (void)
+{
+        struct bufseg_s *seg;
 
-        newline->string = (unsigned char *) safemalloc (length);
-        if (!newline->string) {
-                safefree (newline);
-                return NULL;
+        SEGMENT_LOCK ();
+        seg = free_segments;
+        if (seg) {
+                free_segments = seg->next;
+                free_segment_count--;
         }
+        SEGMENT_UNLOCK ();
 
-        memcpy (newline->string, data, length);
-
-        newline->next = NULL;
-        newline->length = length;
+        if (!seg) {
+                seg = (struct bufseg_s *) safemalloc (sizeof (struct bufseg_s));
+                if (!seg)
+                        return NULL;
+        }
 
-        /* Position our "read" pointer at the beginning of the data */
-        newline->pos = 0;
+        seg->next = NULL;
+        seg->start = seg->end = 0;
 
-        return newline;
+        return seg;
 }
 
 /*
- * Free the allocated buffer line
+ * Put a segment back on the free list, or free it if the list is long
+ * enough already.
  */
-static void free_line (struct bufline_s *line)
+static void free_segment (struct bufseg_s *seg)
 {
-        assert (line != NULL);
-
-        if (!line)
-                return;
-
-        if (line->string)
-                safefree (line->string);
+        assert (seg != NULL);
+
+        SEGMENT_LOCK ();
+        if (free_segment_count < SEGMENT_POOL_MAX) {
+                seg->next = free_segments;
+                free_segments = seg;
+                free_segment_count++;
+                seg = NULL;
+        }
+        SEGMENT_UNLOCK ();
 
-        safefree (line);
+        if (seg)
+                safefree (seg);
 }
 
 /*
@@ -119,41 +182,191 @@ struct buffer_s *new_buffer (void)
         BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = NULL;
         buffptr->size = 0;
 
+        buffptr->max_read_size = min (config.readbuffersize,
+                                      SEGMENT_SIZE * SEGMENT_IOV);
+        buffptr->max_limit = config.maxbuffersize;
+        buffptr->adaptive = config.adaptivebuffers;
+
+        if (buffptr->adaptive) {
+                buffptr->read_size = min (MIN_READ_SIZE,
+                                          buffptr->max_read_size);
+                buffptr->limit = min (buffptr->read_size * READS_BUFFERED,
+                                      buffptr->max_limit);
+        } else {
+                buffptr->read_size = buffptr->max_read_size;
+                buffptr->limit = buffptr->max_limit;
+        }
+
+        buffptr->tee = NULL;
+        buffptr->tee_arg = NULL;
+
+#ifdef HAVE_SPLICE
+        buffptr->pipefd[0] = buffptr->pipefd[1] = -1;
+        buffptr->pipe_size = 0;
+        buffptr->pipe_full = FALSE;
+#endif
+
         return buffptr;
 }
 
 /*
- * Delete all the lines in the buffer and the buffer itself
+ * Delete all the segments in the buffer and the buffer itself
  */
 void delete_buffer (struct buffer_s *buffptr)
 {
-        struct bufline_s *next;
+        struct bufseg_s *next;
 
         assert (buffptr != NULL);
 
         while (BUFFER_HEAD (buffptr)) {
                 next = BUFFER_HEAD (buffptr)->next;
-                free_line (BUFFER_HEAD (buffptr));
+                free_segment (BUFFER_HEAD (buffptr));
                 BUFFER_HEAD (buffptr) = next;
         }
 
+#ifdef HAVE_SPLICE
+        if (buffptr->pipefd[0] >= 0) {
+                close (buffptr->pipefd[0]);
+                close (buffptr->pipefd[1]);
+        }
+#endif
+
         safefree (buffptr);
 }
 
+/*
+ * Have the data read into the buffer from now on go through a pipe with
+ * splice(), so it is never copied into user space.  This is only for
+ * data which is passed on untouched.  Data already in the buffer is
+ * still written out first.  Returns -1 if the buffer keeps using its
+ * segments.
+ */
+int buffer_splice (struct buffer_s *buffptr)
+{
+#ifdef HAVE_SPLICE
+        assert (buffptr != NULL);
+
+        if (buffptr->pipefd[0] >= 0)
+                return 0;
+
+        /* The data has to be seen by the tee */
+        if (buffptr->tee)
+                return -1;
+
+        if (pipe (buffptr->pipefd) < 0) {
+                log_message (LOG_WARNING,
+                             "Could not create a pipe for splice(): %s",
+                             strerror (errno));
+                buffptr->pipefd[0] = buffptr->pipefd[1] = -1;
+                return -1;
+        }
+
+        return 0;
+#else
+        return -1;
+#endif
+}
+
+/*
+ * Hand a copy of the data added to the buffer to "func" from now on.  A
+ * buffer which splice()s its data stops doing so, since the data has to
+ * be seen; returns -1 if that can't be done yet because the pipe still
+ * holds some.
+ */
+int buffer_tee (struct buffer_s *buffptr, buffer_tee_t func, void *arg)
+{
+        assert (buffptr != NULL);
+
+#ifdef HAVE_SPLICE
+        if (func && buffptr->pipefd[0] >= 0) {
+                if (buffptr->pipe_size > 0)
+                        return -1;
+
+                close (buffptr->pipefd[0]);
+                close (buffptr->pipefd[1]);
+                buffptr->pipefd[0] = buffptr->pipefd[1] = -1;
+                buffptr->pipe_full = FALSE;
+        }
+#endif
+
+        buffptr->tee = func;
+        buffptr->tee_arg = arg;
+        return 0;
+}
+
 /*
  * Return the current size of the buffer.
  */
 size_t buffer_size (struct buffer_s *buffptr)
 {
+#ifdef HAVE_SPLICE
+        return buffptr->size + buffptr->pipe_size;
+#else
         return buffptr->size;
+#endif
 }
 
 /*
- * Push a new line on to the end of the buffer.
+ * Return whether the buffer is too full to read any more into it.
  */
-int add_to_buffer (struct buffer_s *buffptr, unsigned char *data, size_t length)
+unsigned int buffer_full (struct buffer_s *buffptr)
 {
-        struct bufline_s *newline;
+#ifdef HAVE_SPLICE
+        if (buffptr->pipefd[0] >= 0)
+                return buffptr->pipe_full
+                    || buffptr->pipe_size >= PIPE_BUFFER_SIZE;
+#endif
+        return buffptr->size >= buffptr->limit;
+}
+
+/*
+ * Adjust an adaptive buffer after a read of "bytesin" bytes, when
+ * "wanted" were asked for.  Bulk transfers fill each read, so those get
+ * larger reads and more room; an interactive connection sending a few
+ * bytes at a time goes back to small ones.
+ */
+static void adapt_buffer (struct buffer_s *buffptr, size_t bytesin,
+                          size_t wanted)
+{
+        if (bytesin >= wanted) {
+                if (buffptr->read_size >= buffptr->max_read_size)
+                        return;
+                buffptr->read_size = min (buffptr->read_size * 2,
+                                          buffptr->max_read_size);
+        } else if (bytesin < buffptr->read_size / 4) {
+                if (buffptr->read_size <= MIN_READ_SIZE)
+                        return;
+                buffptr->read_size = max (buffptr->read_size / 2,
+                                          MIN_READ_SIZE);
+        } else {
+                return;
+        }
+
+        buffptr->limit = min (buffptr->read_size * READS_BUFFERED,
+                              buffptr->max_limit);
+}
+
+/*
+ * Link a segment on to the end of the buffer.
+ */
+static void append_segment (struct buffer_s *buffptr, struct bufseg_s *seg)
+{
+        if (BUFFER_TAIL (buffptr))
+                BUFFER_TAIL (buffptr)->next = seg;
+        else
+                BUFFER_HEAD (buffptr) = seg;
+        BUFFER_TAIL (buffptr) = seg;
+}
+
+/*
+ * Push new data on to the end of the buffer. The data IS copied, filling
+ * up the last segment before new ones are added.
+ */
+int add_to_buffer (struct buffer_s *buffptr, const unsigned char *data,
+                   size_t length)
+{
+        struct bufseg_s *seg;
+        size_t len;
 
         assert (buffptr != NULL);
         assert (data != NULL);
@@ -168,73 +381,210 @@ int add_to_buffer (struct buffer_s *buffptr, unsigned char *data, size_t length)
         else
                 assert (buffptr->size > 0);
 
-        /*
-         * Make a new line so we can add it to the buffer.
-         */
-        if (!(newline = makenewline (data, length)))
-                return -1;
+        if (buffptr->tee)
+                buffptr->tee (buffptr->tee_arg, data, length);
 
-        if (buffptr->size == 0)
-                BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = newline;
-        else {
-                BUFFER_TAIL (buffptr)->next = newline;
-                BUFFER_TAIL (buffptr) = newline;
-        }
+        while (length > 0) {
+                seg = BUFFER_TAIL (buffptr);
+                if (!seg || seg->end == SEGMENT_SIZE) {
+                        if (!(seg = new_segment ()))
+                                return -1;
+                        append_segment (buffptr, seg);
+                }
+
+                len = min (length, SEGMENT_SIZE - seg->end);
+                memcpy (seg->data + seg->end, data, len);
+                seg->end += len;
+                buffptr->size += len;
 
-        buffptr->size += length;
+                data += len;
+                length -= len;
+        }
 
         return 0;
 }
 
 /*
- * Remove the first line from the top of the buffer
+ * Remove "length" bytes from the top of the buffer, freeing the segments
+ * which have been emptied.
  */
-static struct bufline_s *remove_from_buffer (struct buffer_s *buffptr)
+static void remove_from_buffer (struct buffer_s *buffptr, size_t length)
 {
-        struct bufline_s *line;
+        struct bufseg_s *seg;
+        size_t len;
 
         assert (buffptr != NULL);
-        assert (BUFFER_HEAD (buffptr) != NULL);
+        assert (length <= buffptr->size);
+
+        buffptr->size -= length;
 
-        line = BUFFER_HEAD (buffptr);
-        BUFFER_HEAD (buffptr) = line->next;
+        while ((seg = BUFFER_HEAD (buffptr)) != NULL) {
+                len = min (length, seg->end - seg->start);
+                seg->start += len;
+                length -= len;
 
-        buffptr->size -= line->length;
+                if (seg->start < seg->end)
+                        break;
 
-        return line;
+                BUFFER_HEAD (buffptr) = seg->next;
+                if (BUFFER_TAIL (buffptr) == seg)
+                        BUFFER_TAIL (buffptr) = NULL;
+                free_segment (seg);
+        }
 }
 
+#ifdef HAVE_SPLICE
+/*
+ * Splice the bytes from the socket into the buffer's pipe.
+ */
+static ssize_t read_pipe (int fd, struct buffer_s *buffptr)
+{
+        ssize_t bytesin;
+
+        bytesin = splice (fd, NULL, buffptr->pipefd[1], NULL,
+                          PIPE_BUFFER_SIZE - buffptr->pipe_size,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (bytesin > 0) {
+                buffptr->pipe_size += bytesin;
+                return bytesin;
+        } else if (bytesin == 0) {
+                /* connection was closed by client */
+                return -1;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+                /*
+                 * Either the socket or the pipe had no more room.  If
+                 * the pipe holds anything, take it to be full until it
+                 * has been written out.
+                 */
+                if (buffptr->pipe_size > 0)
+                        buffptr->pipe_full = TRUE;
+                return 0;
+        case EINTR:
+                return 0;
+        default:
+                log_message (LOG_ERR,
+                             "readbuff: splice() error \"%s\" on file descriptor %d",
+                             strerror (errno), fd);
+                return -1;
+        }
+}
+
+/*
+ * Splice the bytes in the buffer's pipe out to the socket.
+ */
+static ssize_t write_pipe (int fd, struct buffer_s *buffptr)
+{
+        ssize_t bytessent;
+
+        bytessent = splice (buffptr->pipefd[0], NULL, fd, NULL,
+                            buffptr->pipe_size,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (bytessent >= 0) {
+                buffptr->pipe_size -= bytessent;
+                buffptr->pipe_full = FALSE;
+                return bytessent;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+        case EINTR:
+                return 0;
+        default:
+                log_message (LOG_ERR,
+                             "writebuff: splice() error \"%s\" on file descriptor %d",
+                             strerror (errno), fd);
+                return -1;
+        }
+}
+#endif /* HAVE_SPLICE */
+
 /*
  * Reads the bytes from the socket, and adds them to the buffer.
  * Takes a connection and returns the number of bytes read.
  */
-#define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_buffer (int fd, struct buffer_s * buffptr)
 {
+        return read_buffer_max (fd, buffptr, buffptr->read_size);
+}
+
+/*
+ * Like read_buffer(), but reads no more than "max" bytes, so that
+ * whatever follows them is left in the socket.
+ *
+ * The data is read straight into the free space of the last segment,
+ * and of as many new segments as are needed for the read size.
+ */
+ssize_t read_buffer_max (int fd, struct buffer_s * buffptr, size_t max)
+{
+        struct bufseg_s *segs[SEGMENT_IOV];
+        struct iovec iov[SEGMENT_IOV];
+        struct bufseg_s *tail;
         ssize_t bytesin;
-        unsigned char *buffer;
+        size_t size, want = 0, len;
+        int count = 0, nsegs = 0, i;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
+        assert (max > 0);
 
         /*
-         * Don't allow the buffer to grow larger than MAXBUFFSIZE
+         * Don't allow the buffer to grow larger than its limit
          */
-        if (buffptr->size >= MAXBUFFSIZE)
+        if (buffer_full (buffptr))
                 return 0;
 
-        buffer = (unsigned char *) safemalloc (READ_BUFFER_SIZE);
-        if (!buffer) {
-                return -ENOMEM;
+#ifdef HAVE_SPLICE
+        if (buffptr->pipefd[0] >= 0) {
+                assert (max == buffptr->read_size);
+                return read_pipe (fd, buffptr);
+        }
+#endif
+
+        size = min (buffptr->read_size, max);
+
+        tail = BUFFER_TAIL (buffptr);
+        if (tail && tail->end < SEGMENT_SIZE) {
+                iov[0].iov_base = tail->data + tail->end;
+                iov[0].iov_len = min (size, SEGMENT_SIZE - tail->end);
+                want = iov[0].iov_len;
+                count = 1;
+        } else {
+                tail = NULL;
+        }
+
+        while (want < size && count < SEGMENT_IOV) {
+                if (!(segs[nsegs] = new_segment ()))
+                        break;
+                iov[count].iov_base = segs[nsegs]->data;
+                iov[count].iov_len = min (size - want, SEGMENT_SIZE);
+                want += iov[count].iov_len;
+                count++;
+                nsegs++;
         }
 
-        bytesin = read (fd, buffer, READ_BUFFER_SIZE);
+        if (count == 0)
+                return -ENOMEM;
+
+        bytesin = readv (fd, iov, count);
 
         if (bytesin > 0) {
-                if (add_to_buffer (buffptr, buffer, bytesin) < 0) {
-                        log_message (LOG_ERR,
-                                     "readbuff: add_to_buffer() error.");
-                        bytesin = -1;
+                buffptr->size += bytesin;
+                if (buffptr->adaptive && size == buffptr->read_size)
+                        adapt_buffer (buffptr, bytesin, want);
+
+                len = bytesin;
+                for (i = 0; buffptr->tee && len > 0; i++) {
+                        size_t part = min (len, iov[i].iov_len);
+
+                        buffptr->tee (buffptr->tee_arg,
+                                      (unsigned char *) iov[i].iov_base,
+                                      part);
+                        len -= part;
                 }
         } else {
                 if (bytesin == 0) {
@@ -262,38 +612,72 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
                 }
         }
 
-        safefree (buffer);
+        /*
+         * Account for the data in the segments it went into, and hand
+         * back the new segments which were not needed.
+         */
+        len = bytesin > 0 ? (size_t) bytesin : 0;
+        if (tail) {
+                tail->end += min (len, iov[0].iov_len);
+                len -= min (len, iov[0].iov_len);
+        }
+        for (i = 0; i < nsegs; i++) {
+                if (len > 0) {
+                        segs[i]->end = min (len, SEGMENT_SIZE);
+                        len -= segs[i]->end;
+                        append_segment (buffptr, segs[i]);
+                } else {
+                        free_segment (segs[i]);
+                }
+        }
+
         return bytesin;
 }
 
 /*
  * Write the bytes in the buffer to the socket.
  * Takes a connection and returns the number of bytes written.
+ *
+ * As many segments as possible are handed to one sendmsg() call.
  */
 ssize_t write_buffer (int fd, struct buffer_s * buffptr)
 {
+        struct iovec iov[SEGMENT_IOV];
+        struct msghdr msg;
+        struct bufseg_s *seg;
         ssize_t bytessent;
-        struct bufline_s *line;
+        int count = 0;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
 
-        if (buffptr->size == 0)
+        if (buffptr->size == 0) {
+#ifdef HAVE_SPLICE
+                if (buffptr->pipe_size > 0)
+                        return write_pipe (fd, buffptr);
+#endif
                 return 0;
+        }
 
         /* Sanity check. It would be bad to be using a NULL pointer! */
         assert (BUFFER_HEAD (buffptr) != NULL);
-        line = BUFFER_HEAD (buffptr);
 
-        bytessent =
-            send (fd, line->string + line->pos, line->length - line->pos,
-                  MSG_NOSIGNAL);
+        for (seg = BUFFER_HEAD (buffptr); seg && count < SEGMENT_IOV;
+             seg = seg->next) {
+                iov[count].iov_base = seg->data + seg->start;
+                iov[count].iov_len = seg->end - seg->start;
+                count++;
+        }
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        bytessent = sendmsg (fd, &msg, MSG_NOSIGNAL);
 
         if (bytessent >= 0) {
                 /* bytes sent, adjust buffer */
-                line->pos += bytessent;
-                if (line->pos == line->length)
-                        free_line (remove_from_buffer (buffptr));
+                remove_from_buffer (buffptr, bytessent);
                 return bytessent;
         } else {
                 switch (errno) {
@@ -27,14 +27,26 @@ struct buffer_s;
 extern struct buffer_s *new_buffer (void);
 extern void delete_buffer (struct buffer_s *buffptr);
 extern size_t buffer_size (struct buffer_s *buffptr);
+extern unsigned int buffer_full (struct buffer_s *buffptr);
+extern int buffer_splice (struct buffer_s *buffptr);
+
+/*
+ * Have a copy of the data added to the buffer from now on handed to a
+ * function as well (or no longer, if "func" is NULL.)
+ */
+typedef void (*buffer_tee_t) (void *arg, const unsigned char *data,
+                              size_t length);
+extern int buffer_tee (struct buffer_s *buffptr, buffer_tee_t func,
+                       void *arg);
 
 /*
  * Add a new line to the given buffer. The data IS copied into the structure.
  */
-extern int add_to_buffer (struct buffer_s *buffptr, unsigned char *data,
-                          size_t length);
+extern int add_to_buffer (struct buffer_s *buffptr,
+                          const unsigned char *data, size_t length);
 
 extern ssize_t read_buffer (int fd, struct buffer_s *buffptr);
+extern ssize_t read_buffer_max (int fd, struct buffer_s *buffptr, size_t max);
 extern ssize_t write_buffer (int fd, struct buffer_s *buffptr);
 
 #endif /* __BUFFER_H_ */
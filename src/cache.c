@@ -0,0 +1,1630 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A cache of the responses to reverse proxied requests.  The responses
+ * HTTP lets a shared cache keep (RFC 7234) are written to files in the
+ * "CacheDir" directory, and the most recently used ones are also held in
+ * the memory of each worker.  An index in shared memory says which
+ * responses are kept, so all the workers use the same ones.  It also
+ * marks the responses being fetched, so that requests for one of them
+ * from other workers wait for it rather than all going to the server.
+ * The least recently used responses make way once the files take up
+ * more than "CacheSize" bytes.
+ *
+ * A kept response which has gone stale is asked for again with the
+ * validators it came with (If-None-Match and If-Modified-Since), and is
+ * sent on, with the headers of the server's answer, if the server says
+ * it has not changed.  Kept responses go out through process_response()
+ * like any other, so they get the same treatment on the way.
+ */
+
+#include "main.h"
+#include "cache.h"
+
+#include "buffer.h"
+#include "conns.h"
+#include "heap.h"
+#include "http-head.h"
+#include "log.h"
+#include "reqs.h"
+#include "utils.h"
+#include "conf.h"
+
+/*
+ * The most responses kept at once, and the most of the index used so it
+ * stays quick to search.  (A power of two.)
+ */
+#define CACHE_SLOTS (1024 * 16)
+#define CACHE_SLOTS_USED (CACHE_SLOTS / 4 * 3)
+
+/*
+ * How long the others wait for a worker fetching a response, in seconds,
+ * before going to the server themselves.
+ */
+#define CACHE_FETCH_TIME 10
+
+/*
+ * The longest a response is taken to stay fresh for just because of how
+ * long ago it was last modified.
+ */
+#define HEURISTIC_LIFETIME (60 * 60 * 24)
+
+#define MEMORY_BUCKETS 1024
+#define CACHE_PATH_LENGTH 1024
+
+#define CACHE_MAGIC "tpcache1"
+#define CACHE_MAGIC_LEN 8
+
+/*
+ * What is known about a kept response.  Each file starts with this, and
+ * goes on with the key, the head and the body.
+ */
+struct cache_meta {
+        char magic[CACHE_MAGIC_LEN];
+        uint32_t hash, check;
+        unsigned long generation;       /* which copy of the response */
+        unsigned int status;
+
+        time_t response_time;           /* when it arrived */
+        long initial_age;               /* how old it was then */
+        long lifetime;                  /* how long it stays fresh */
+        unsigned int no_cache;          /* it has to be checked every time */
+
+        size_t key_len, head_len, body_len;
+};
+
+struct cache_object {
+        struct cache_meta meta;
+        char *data;
+
+        unsigned int refs;
+        struct cache_object *prev, *next;       /* oldest first */
+        struct cache_object *chain;             /* in the same bucket */
+};
+
+#define OBJECT_KEY(obj)  ((obj)->data)
+#define OBJECT_HEAD(obj) ((obj)->data + (obj)->meta.key_len)
+#define OBJECT_BODY(obj) (OBJECT_HEAD (obj) + (obj)->meta.head_len)
+#define OBJECT_SIZE(obj) (sizeof (struct cache_meta) + (obj)->meta.key_len \
+                          + (obj)->meta.head_len + (obj)->meta.body_len)
+
+/*
+ * An entry of the shared index.  It is "stored" while there is a file,
+ * and "fetching" while a worker is fetching the response.
+ */
+#define SLOT_STORED   1
+#define SLOT_FETCHING 2
+
+struct cache_slot {
+        uint32_t hash, check;
+        unsigned int flags;
+        unsigned long generation;       /* of the file */
+        unsigned long fetch;            /* the fetch under way */
+        time_t fetch_started;
+        size_t size;
+        unsigned long used;             /* when, by the index's clock */
+};
+
+struct cache_table {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;
+#endif
+        unsigned long clock;
+        unsigned long generation;
+        size_t size;                    /* of all the files */
+        unsigned int count;
+        struct cache_slot slots[CACHE_SLOTS];
+};
+
+static struct cache_table *table;
+static char *cache_dir;         /* as it was at startup */
+
+#ifdef HAVE_PTHREAD_H
+#  define TABLE_LOCK()   pthread_mutex_lock (&table->lock)
+#  define TABLE_UNLOCK() pthread_mutex_unlock (&table->lock)
+#else
+#  define TABLE_LOCK()
+#  define TABLE_UNLOCK()
+#endif
+
+/*
+ * The responses held in memory by this worker, which worker threads
+ * share.
+ */
+static struct cache_object *buckets[MEMORY_BUCKETS];
+static struct cache_object *oldest, *newest;
+static size_t memory_size;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define MEMORY_LOCK()   pthread_mutex_lock (&memory_lock)
+#  define MEMORY_UNLOCK() pthread_mutex_unlock (&memory_lock)
+#else
+#  define MEMORY_LOCK()
+#  define MEMORY_UNLOCK()
+#endif
+
+/*
+ * What the cache is doing with a connection's current request.
+ */
+enum cache_state {
+        REQUEST_FETCHING,       /* keeping the response if it may be */
+        REQUEST_REVALIDATING,   /* asking whether the kept one has changed */
+        REQUEST_SERVING,        /* sending on the kept one */
+        REQUEST_PASSING         /* leaving it alone */
+};
+
+struct cache_request {
+        enum cache_state state;
+
+        char *key;
+        size_t key_len;
+        uint32_t hash, check;
+
+        unsigned long fetch;            /* claimed in the index, if any */
+        unsigned long generation;       /* of the copy revalidated */
+        time_t request_time;
+        time_t wait_started;
+
+        /* What the client asked for */
+        char *if_none_match;
+        time_t if_modified_since;
+        unsigned int no_cache;
+        long max_age;
+
+        long age;                       /* of the copy being sent */
+
+        /* The response being fetched */
+        struct cache_object *object;
+        size_t received;
+        unsigned int overflow;
+};
+
+/*
+ * A string being put together.
+ */
+struct text {
+        char *data;
+        size_t len, size;
+};
+
+static int text_add (struct text *text, const char *data, size_t len)
+{
+        char *tmp;
+        size_t size;
+
+        if (text->len + len > text->size) {
+                size = max (text->size * 2, text->len + len + 256);
+                tmp = (char *) saferealloc (text->data, size);
+                if (!tmp)
+                        return -1;
+
+                text->data = tmp;
+                text->size = size;
+        }
+
+        memcpy (text->data + text->len, data, len);
+        text->len += len;
+        return 0;
+}
+
+/*
+ * FNV-1a, from two starting points to give 64 bits to tell the keys
+ * apart by.
+ */
+static uint32_t hash_key (const char *key, size_t len, uint32_t hash)
+{
+        while (len--) {
+                hash ^= (unsigned char) *key++;
+                hash *= 16777619;
+        }
+
+        return hash;
+}
+
+/*
+ * Parse an HTTP date: the preferred form, or the obsolete RFC 850 and
+ * asctime() ones.  Returns -1 if it is none of them.
+ */
+static long days_from_civil (long y, int m, int d)
+{
+        long era;
+        long yoe, doy, doe;
+
+        y -= m <= 2;
+        era = (y >= 0 ? y : y - 399) / 400;
+        yoe = y - era * 400;
+        doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+        doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+        return era * 146097 + doe - 719468;
+}
+
+static time_t parse_date (const char *date)
+{
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        char mon[4];
+        const char *m;
+        int day, year, hour, min, sec;
+
+        if (sscanf (date, "%*3s, %d %3s %d %d:%d:%d",
+                    &day, mon, &year, &hour, &min, &sec) != 6
+            && sscanf (date, "%*[A-Za-z], %d-%3s-%d %d:%d:%d",
+                       &day, mon, &year, &hour, &min, &sec) != 6
+            && sscanf (date, "%*3s %3s %d %d:%d:%d %d",
+                       mon, &day, &hour, &min, &sec, &year) != 6)
+                return -1;
+
+        mon[3] = '\0';
+        m = strstr (months, mon);
+        if (!m || strlen (mon) != 3 || (m - months) % 3 != 0)
+                return -1;
+
+        if (year < 70)
+                year += 2000;
+        else if (year < 100)
+                year += 1900;
+
+        if (day < 1 || day > 31 || hour < 0 || hour > 23
+            || min < 0 || min > 59 || sec < 0 || sec > 60)
+                return -1;
+
+        return (time_t) days_from_civil (year, (m - months) / 3 + 1, day)
+            * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+/*
+ * Look for a directive among the ones in all the "field" headers (like
+ * Cache-Control.)  If it has a number for its value, that goes in
+ * "value", which is left alone otherwise.
+ */
+static unsigned int
+has_directive (struct header_map *headers, const char *field,
+               const char *directive, long *value)
+{
+        size_t len = strlen (directive);
+        header_map_iter iter = 0;
+        const char *name;
+        char *p;
+
+        if (!header_map_get (headers, field))
+                return FALSE;
+
+        while (header_map_next (headers, &iter, &name, &p)) {
+                if (strcasecmp (name, field) != 0)
+                        continue;
+
+                while (*p) {
+                        p += strspn (p, " \t,");
+                        if (strncasecmp (p, directive, len) == 0
+                            && strchr (" \t,=", p[len])) {
+                                p += len;
+                                p += strspn (p, " \t");
+                                if (value && *p == '=') {
+                                        p += strspn (p + 1, " \t\"") + 1;
+                                        if (isdigit ((unsigned char) *p))
+                                                *value = strtol (p, NULL, 10);
+                                }
+                                return TRUE;
+                        }
+
+                        /* On to the next, past any quoted value */
+                        while (*p && *p != ',') {
+                                if (*p++ != '"')
+                                        continue;
+                                while (*p && *p != '"')
+                                        p++;
+                                if (*p)
+                                        p++;
+                        }
+                }
+        }
+
+        return FALSE;
+}
+
+/*
+ * Find a field in a head kept as text, and copy its value out.
+ */
+static unsigned int
+head_field (const struct cache_object *obj, const char *name, char *buf,
+            size_t size)
+{
+        const char *p = OBJECT_HEAD (obj);
+        const char *end = p + obj->meta.head_len;
+        const char *eol, *value;
+        size_t len = strlen (name);
+
+        for (; p < end; p = eol + 2) {
+                eol = p;
+                while (eol + 1 < end && (eol[0] != '\r' || eol[1] != '\n'))
+                        eol++;
+                if (eol + 1 >= end)
+                        break;
+
+                if ((size_t) (eol - p) <= len || p[len] != ':'
+                    || strncasecmp (p, name, len) != 0)
+                        continue;
+
+                value = p + len + 1;
+                while (value < eol && (*value == ' ' || *value == '\t'))
+                        value++;
+                if ((size_t) (eol - value) >= size)
+                        return FALSE;
+
+                memcpy (buf, value, eol - value);
+                buf[eol - value] = '\0';
+                return TRUE;
+        }
+
+        return FALSE;
+}
+
+/*
+ * Append the header fields of "head" to the text, either only those in
+ * "names" or all but those.
+ */
+static int
+add_fields (struct text *text, struct http_head_s *head,
+            const char *const *names, unsigned int only)
+{
+        const struct http_field_s *field;
+        unsigned int listed;
+        size_t i, j;
+
+        for (i = 0; i != head->nfields; i++) {
+                field = &head->fields[i];
+
+                listed = FALSE;
+                for (j = 0; names[j] && !listed; j++)
+                        listed = strlen (names[j]) == field->name.len
+                            && strncasecmp (head->data + field->name.off,
+                                            names[j], field->name.len) == 0;
+                if (listed != only)
+                        continue;
+
+                if (text_add (text, head->data + field->name.off,
+                              field->name.len) < 0
+                    || text_add (text, ": ", 2) < 0
+                    || text_add (text, head->data + field->value.off,
+                                 field->value.len) < 0
+                    || text_add (text, "\r\n", 2) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int add_start_line (struct text *text, struct http_head_s *head)
+{
+        if (text_add (text, head->data + head->parser.line.off,
+                      head->parser.line.len) < 0
+            || text_add (text, "\r\n", 2) < 0)
+                return -1;
+        return 0;
+}
+
+/*
+ * Work out how old a response was when it arrived, and for how long it
+ * stays fresh (RFC 7234, section 4.2.)
+ */
+static void
+set_freshness (struct cache_meta *meta, struct header_map *headers,
+               time_t request_time, time_t response_time)
+{
+        const char *value;
+        time_t date, expires, modified;
+        long age = 0, lifetime = -1;
+
+        value = header_map_get_id (headers, HEADER_DATE);
+        date = value ? parse_date (value) : -1;
+        if (date < 0)
+                date = response_time;
+
+        value = header_map_get_id (headers, HEADER_AGE);
+        if (value)
+                age = max (strtol (value, NULL, 10), 0);
+
+        meta->response_time = response_time;
+        meta->initial_age = max ((long) (response_time - date), 0);
+        meta->initial_age = max (meta->initial_age,
+                                 age + (long) (response_time - request_time));
+        meta->no_cache = has_directive (headers, "cache-control", "no-cache",
+                                        NULL);
+
+        has_directive (headers, "cache-control", "s-maxage", &lifetime);
+        if (lifetime < 0)
+                has_directive (headers, "cache-control", "max-age",
+                               &lifetime);
+
+        if (lifetime < 0
+            && (value = header_map_get_id (headers, HEADER_EXPIRES))) {
+                expires = parse_date (value);
+                lifetime = expires > date ? (long) (expires - date) : 0;
+        }
+
+        if (lifetime < 0
+            && (value = header_map_get_id (headers, HEADER_LAST_MODIFIED))) {
+                modified = parse_date (value);
+                if (modified >= 0 && modified < date)
+                        lifetime = min ((long) (date - modified) / 10,
+                                        HEURISTIC_LIFETIME);
+        }
+
+        meta->lifetime = max (lifetime, 0);
+}
+
+static long current_age (const struct cache_object *obj, time_t now)
+{
+        return obj->meta.initial_age
+            + max ((long) (now - obj->meta.response_time), 0);
+}
+
+static void
+object_path (char *path, uint32_t hash, uint32_t check)
+{
+        snprintf (path, CACHE_PATH_LENGTH, "%s/%08x%08x", cache_dir,
+                  (unsigned int) hash, (unsigned int) check);
+}
+
+/*
+ * The responses held in memory.  An object is freed once neither the
+ * memory nor any request refers to it any more.
+ */
+static void put_object (struct cache_object *obj)
+{
+        unsigned int refs;
+
+        if (!obj)
+                return;
+
+        MEMORY_LOCK ();
+        refs = --obj->refs;
+        MEMORY_UNLOCK ();
+
+        if (refs == 0) {
+                safefree (obj->data);
+                safefree (obj);
+        }
+}
+
+/*
+ * Drop an object from memory.  It has to be locked.
+ */
+static void memory_remove (struct cache_object *obj)
+{
+        struct cache_object **p;
+
+        for (p = &buckets[obj->meta.hash % MEMORY_BUCKETS]; *p != obj;
+             p = &(*p)->chain) ;
+        *p = obj->chain;
+
+        if (obj->prev)
+                obj->prev->next = obj->next;
+        else
+                oldest = obj->next;
+        if (obj->next)
+                obj->next->prev = obj->prev;
+        else
+                newest = obj->prev;
+
+        memory_size -= OBJECT_SIZE (obj);
+        if (--obj->refs == 0) {
+                safefree (obj->data);
+                safefree (obj);
+        }
+}
+
+static struct cache_object *
+memory_find (uint32_t hash, uint32_t check, unsigned long generation)
+{
+        struct cache_object *obj;
+
+        MEMORY_LOCK ();
+        for (obj = buckets[hash % MEMORY_BUCKETS]; obj; obj = obj->chain)
+                if (obj->meta.hash == hash && obj->meta.check == check)
+                        break;
+
+        if (obj && obj->meta.generation != generation) {
+                memory_remove (obj);
+                obj = NULL;
+        } else if (obj) {
+                /* Move it to the newest end */
+                if (obj != newest) {
+                        if (obj->prev)
+                                obj->prev->next = obj->next;
+                        else
+                                oldest = obj->next;
+                        obj->next->prev = obj->prev;
+
+                        obj->prev = newest;
+                        obj->next = NULL;
+                        newest->next = obj;
+                        newest = obj;
+                }
+                obj->refs++;
+        }
+        MEMORY_UNLOCK ();
+
+        return obj;
+}
+
+static void memory_add (struct cache_object *obj)
+{
+        struct cache_object *old;
+
+        if (OBJECT_SIZE (obj) > config.cache_memory)
+                return;
+
+        MEMORY_LOCK ();
+        for (old = buckets[obj->meta.hash % MEMORY_BUCKETS]; old;
+             old = old->chain)
+                if (old->meta.hash == obj->meta.hash
+                    && old->meta.check == obj->meta.check)
+                        break;
+        if (old)
+                memory_remove (old);
+
+        obj->chain = buckets[obj->meta.hash % MEMORY_BUCKETS];
+        buckets[obj->meta.hash % MEMORY_BUCKETS] = obj;
+
+        obj->prev = newest;
+        obj->next = NULL;
+        if (newest)
+                newest->next = obj;
+        else
+                oldest = obj;
+        newest = obj;
+
+        obj->refs++;
+        memory_size += OBJECT_SIZE (obj);
+
+        while (memory_size > config.cache_memory)
+                memory_remove (oldest);
+        MEMORY_UNLOCK ();
+}
+
+static int read_all (int fd, void *data, size_t len)
+{
+        ssize_t ret;
+
+        while (len > 0) {
+                ret = read (fd, data, len);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret <= 0)
+                        return -1;
+
+                data = (char *) data + ret;
+                len -= ret;
+        }
+
+        return 0;
+}
+
+/*
+ * Read a kept response from its file.
+ */
+static struct cache_object *
+read_object (uint32_t hash, uint32_t check, unsigned long generation)
+{
+        char path[CACHE_PATH_LENGTH];
+        struct cache_object *obj;
+        struct stat st;
+        int fd;
+
+        object_path (path, hash, check);
+        fd = open (path, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+
+        obj = (struct cache_object *)
+            safecalloc (1, sizeof (struct cache_object));
+        if (!obj)
+                goto fail;
+
+        if (fstat (fd, &st) < 0
+            || read_all (fd, &obj->meta, sizeof (obj->meta)) < 0
+            || memcmp (obj->meta.magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0
+            || obj->meta.hash != hash || obj->meta.check != check
+            || obj->meta.generation != generation
+            || (off_t) OBJECT_SIZE (obj) != st.st_size)
+                goto fail;
+
+        obj->data = (char *) safemalloc (st.st_size - sizeof (obj->meta));
+        if (!obj->data
+            || read_all (fd, obj->data, st.st_size - sizeof (obj->meta)) < 0)
+                goto fail;
+
+        close (fd);
+        obj->refs = 1;
+        return obj;
+
+fail:
+        close (fd);
+        if (obj)
+                safefree (obj->data);
+        safefree (obj);
+        return NULL;
+}
+
+/*
+ * Get hold of the kept copy of the request's response, from memory if
+ * it is there.
+ */
+static struct cache_object *
+get_object (struct cache_request *cr, unsigned long generation)
+{
+        struct cache_object *obj;
+
+        obj = memory_find (cr->hash, cr->check, generation);
+        if (!obj) {
+                obj = read_object (cr->hash, cr->check, generation);
+                if (obj)
+                        memory_add (obj);
+        }
+
+        if (obj && (obj->meta.key_len != cr->key_len
+                    || memcmp (OBJECT_KEY (obj), cr->key, cr->key_len))) {
+                put_object (obj);
+                obj = NULL;
+        }
+
+        return obj;
+}
+
+/*
+ * The index.  It has to be locked for all of these.
+ */
+static struct cache_slot *find_slot (uint32_t hash, uint32_t check)
+{
+        unsigned int i = hash & (CACHE_SLOTS - 1);
+
+        while (table->slots[i].flags) {
+                if (table->slots[i].hash == hash
+                    && table->slots[i].check == check)
+                        return &table->slots[i];
+                i = (i + 1) & (CACHE_SLOTS - 1);
+        }
+
+        return NULL;
+}
+
+static struct cache_slot *add_slot (uint32_t hash, uint32_t check)
+{
+        unsigned int i = hash & (CACHE_SLOTS - 1);
+
+        while (table->slots[i].flags)
+                i = (i + 1) & (CACHE_SLOTS - 1);
+
+        memset (&table->slots[i], 0, sizeof (struct cache_slot));
+        table->slots[i].hash = hash;
+        table->slots[i].check = check;
+        table->count++;
+
+        return &table->slots[i];
+}
+
+/*
+ * Take a slot out, moving the ones after it back so that none of them
+ * is cut off from where its search starts.
+ */
+static void remove_slot (struct cache_slot *slot)
+{
+        unsigned int i = slot - table->slots, j = i, k;
+
+        for (;;) {
+                j = (j + 1) & (CACHE_SLOTS - 1);
+                if (!table->slots[j].flags)
+                        break;
+
+                k = table->slots[j].hash & (CACHE_SLOTS - 1);
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+
+                table->slots[i] = table->slots[j];
+                i = j;
+        }
+
+        memset (&table->slots[i], 0, sizeof (struct cache_slot));
+        table->count--;
+}
+
+/*
+ * Forget the kept copy in a slot, and remove its file.
+ */
+static void drop_stored (struct cache_slot *slot)
+{
+        char path[CACHE_PATH_LENGTH];
+
+        object_path (path, slot->hash, slot->check);
+        unlink (path);
+
+        table->size -= slot->size;
+        slot->size = 0;
+        slot->flags &= ~SLOT_STORED;
+        if (!slot->flags)
+                remove_slot (slot);
+}
+
+/*
+ * Remove the least recently used kept response (which nobody is
+ * fetching again.)  Returns -1 if there is none.
+ */
+static int evict_oldest (void)
+{
+        struct cache_slot *slot, *victim = NULL;
+        unsigned int i;
+
+        for (i = 0; i != CACHE_SLOTS; i++) {
+                slot = &table->slots[i];
+                if (slot->flags == SLOT_STORED
+                    && (!victim || slot->used < victim->used))
+                        victim = slot;
+        }
+
+        if (!victim)
+                return -1;
+
+        log_message (LOG_DEBUG, "Evicting %08x%08x from the cache",
+                     (unsigned int) victim->hash,
+                     (unsigned int) victim->check);
+        drop_stored (victim);
+        return 0;
+}
+
+static void make_room (void)
+{
+        while (table->size > config.cache_size && evict_oldest () == 0) ;
+}
+
+/*
+ * Mark the request's response as being fetched by this request.
+ * Returns 0 if another request is fetching it already, and -1 if the
+ * index has no room for it.
+ */
+static int claim_fetch (struct cache_request *cr)
+{
+        struct cache_slot *slot;
+        time_t now = get_monotonic_time ();
+        int ret = 1;
+
+        TABLE_LOCK ();
+        slot = find_slot (cr->hash, cr->check);
+        if (!slot && (table->count < CACHE_SLOTS_USED
+                      || evict_oldest () == 0))
+                slot = add_slot (cr->hash, cr->check);
+
+        if (!slot) {
+                ret = -1;
+        } else if ((slot->flags & SLOT_FETCHING)
+                   && now - slot->fetch_started < CACHE_FETCH_TIME) {
+                ret = 0;
+        } else {
+                slot->flags |= SLOT_FETCHING;
+                slot->fetch = cr->fetch = ++table->generation;
+                slot->fetch_started = now;
+        }
+        TABLE_UNLOCK ();
+
+        return ret;
+}
+
+static void release_fetch (struct cache_request *cr)
+{
+        struct cache_slot *slot;
+
+        if (!cr->fetch)
+                return;
+
+        TABLE_LOCK ();
+        slot = find_slot (cr->hash, cr->check);
+        if (slot && (slot->flags & SLOT_FETCHING)
+            && slot->fetch == cr->fetch) {
+                slot->flags &= ~SLOT_FETCHING;
+                if (!slot->flags)
+                        remove_slot (slot);
+        }
+        TABLE_UNLOCK ();
+
+        cr->fetch = 0;
+}
+
+/*
+ * A kept copy could not be read; don't look for it again.
+ */
+static void forget_object (struct cache_request *cr, unsigned long generation)
+{
+        struct cache_slot *slot;
+
+        TABLE_LOCK ();
+        slot = find_slot (cr->hash, cr->check);
+        if (slot && (slot->flags & SLOT_STORED)
+            && slot->generation == generation)
+                drop_stored (slot);
+        TABLE_UNLOCK ();
+}
+
+/*
+ * Write a response fetched by the request to its file, and make it the
+ * kept copy if the fetch is still the request's own.
+ */
+static int store_object (struct cache_request *cr, struct cache_object *obj)
+{
+        char tmp[CACHE_PATH_LENGTH], path[CACHE_PATH_LENGTH];
+        struct cache_slot *slot;
+        struct iovec iov[2];
+        size_t size = OBJECT_SIZE (obj);
+        ssize_t written;
+        int fd, ret = -1;
+
+        memcpy (obj->meta.magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+        obj->meta.hash = cr->hash;
+        obj->meta.check = cr->check;
+        obj->meta.generation = cr->fetch;
+
+        snprintf (tmp, sizeof (tmp), "%s/.%08x%08x.%lu", cache_dir,
+                  (unsigned int) cr->hash, (unsigned int) cr->check,
+                  cr->fetch);
+        object_path (path, cr->hash, cr->check);
+
+        fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+                log_message (LOG_WARNING, "Could not create \"%s\": %s",
+                             tmp, strerror (errno));
+                return -1;
+        }
+
+        iov[0].iov_base = (void *) &obj->meta;
+        iov[0].iov_len = sizeof (obj->meta);
+        iov[1].iov_base = obj->data;
+        iov[1].iov_len = size - sizeof (obj->meta);
+
+        written = writev (fd, iov, 2);
+        if (close (fd) < 0 || written != (ssize_t) size) {
+                log_message (LOG_WARNING, "Could not write \"%s\"", tmp);
+                unlink (tmp);
+                return -1;
+        }
+
+        TABLE_LOCK ();
+        slot = find_slot (cr->hash, cr->check);
+        if (slot && (slot->flags & SLOT_FETCHING)
+            && slot->fetch == cr->fetch && rename (tmp, path) == 0) {
+                table->size -= slot->size;
+                table->size += size;
+                slot->flags = SLOT_STORED;
+                slot->generation = cr->fetch;
+                slot->size = size;
+                slot->used = ++table->clock;
+                cr->fetch = 0;
+
+                make_room ();
+                ret = 0;
+        }
+        TABLE_UNLOCK ();
+
+        if (ret < 0) {
+                unlink (tmp);
+                return -1;
+        }
+
+        obj->refs = 1;
+        memory_add (obj);
+        put_object (obj);
+
+        log_message (LOG_INFO, "Stored %s in the cache (%lu bytes)",
+                     cr->key, (unsigned long) size);
+        return 0;
+}
+
+/*
+ * Whether the client's own conditions show it has the kept response
+ * already (RFC 7232, section 6.)
+ */
+static unsigned int
+client_has_it (struct cache_request *cr, const struct cache_object *obj)
+{
+        char etag[256], date[64];
+        const char *p, *tag;
+        size_t len;
+        time_t modified;
+
+        if (obj->meta.status != 200)
+                return FALSE;
+
+        if (cr->if_none_match) {
+                if (!head_field (obj, "etag", etag, sizeof (etag)))
+                        return FALSE;
+
+                /* Weak comparison: the W/ prefix makes no difference */
+                tag = strncmp (etag, "W/", 2) == 0 ? etag + 2 : etag;
+                len = strlen (tag);
+
+                for (p = cr->if_none_match; *p; p += strcspn (p, ",")) {
+                        p += strspn (p, " \t,");
+                        if (*p == '*')
+                                return TRUE;
+                        if (strncmp (p, "W/", 2) == 0)
+                                p += 2;
+                        if (strncmp (p, tag, len) == 0
+                            && strchr (" \t,", p[len]))
+                                return TRUE;
+                }
+                return FALSE;
+        }
+
+        if (cr->if_modified_since >= 0
+            && head_field (obj, "last-modified", date, sizeof (date))) {
+                modified = parse_date (date);
+                return modified >= 0 && modified <= cr->if_modified_since;
+        }
+
+        return FALSE;
+}
+
+/*
+ * Send the kept response to the client: its head goes out now, through
+ * process_response(), and its body is left in the client's buffer.
+ */
+static int
+serve_object (struct conn_s *connptr, struct cache_request *cr,
+              struct cache_object *obj)
+{
+        static const char *const not_modified_fields[] = {
+                "cache-control", "content-location", "date", "etag",
+                "expires", "last-modified", "vary", NULL
+        };
+
+        struct http_head_s head;
+        struct text text = { NULL, 0, 0 };
+        unsigned int not_modified;
+        int ret;
+
+        cr->state = REQUEST_SERVING;
+        cr->age = current_age (obj, time (NULL));
+
+        http_head_init (&head, HTTP_PARSE_RESPONSE);
+        ret = http_head_parse (&head, OBJECT_HEAD (obj), obj->meta.head_len);
+
+        not_modified = client_has_it (cr, obj);
+        if (ret == 0 && not_modified) {
+                ret = text_add (&text, "HTTP/1.1 304 Not Modified\r\n", 27);
+                if (ret == 0)
+                        ret = add_fields (&text, &head, not_modified_fields,
+                                          TRUE);
+                if (ret == 0)
+                        ret = text_add (&text, "\r\n", 2);
+                if (ret == 0) {
+                        http_head_reset (&head, HTTP_PARSE_RESPONSE);
+                        ret = http_head_parse (&head, text.data, text.len);
+                }
+        }
+
+        if (ret == 0)
+                ret = process_response (connptr, &head);
+
+        if (ret == 0 && !not_modified && !connptr->head_method
+            && obj->meta.body_len > 0)
+                ret = add_to_buffer (connptr->sbuffer,
+                                     (unsigned char *) OBJECT_BODY (obj),
+                                     obj->meta.body_len);
+
+        connptr->content_length.server = 0;
+        if (ret < 0)
+                connptr->keep_alive = FALSE;
+
+        log_message (LOG_INFO, "Answered %s from the cache%s", cr->key,
+                     not_modified ? " (not modified)" : "");
+
+        http_head_free (&head);
+        safefree (text.data);
+        return ret;
+}
+
+/*
+ * Whether the request can be answered from the cache, and its response
+ * kept in it.
+ */
+static unsigned int
+cache_wanted (struct conn_s *connptr, struct request_s *request,
+              struct header_map *hashofheaders)
+{
+        if (!table || !config.reversepath_list)
+                return FALSE;
+
+        if (connptr->connect_method || connptr->content_length.client > 0)
+                return FALSE;
+
+        if (strcmp (request->method, "GET") != 0
+            && strcmp (request->method, "HEAD") != 0)
+                return FALSE;
+
+        if (header_map_get_id (hashofheaders, HEADER_AUTHORIZATION)
+            || header_map_get_id (hashofheaders, HEADER_RANGE)
+            || header_map_get_id (hashofheaders, HEADER_TRANSFER_ENCODING))
+                return FALSE;
+
+        return !has_directive (hashofheaders, "cache-control", "no-store",
+                               NULL);
+}
+
+static void free_cache_request (struct cache_request *cr)
+{
+        if (cr->object) {
+                safefree (cr->object->data);
+                safefree (cr->object);
+        }
+        safefree (cr->if_none_match);
+        safefree (cr->key);
+        safefree (cr);
+}
+
+static struct cache_request *
+new_cache_request (struct request_s *request,
+                   struct header_map *hashofheaders)
+{
+        struct cache_request *cr;
+        const char *value;
+        size_t len;
+        char *p;
+
+        cr = (struct cache_request *)
+            safecalloc (1, sizeof (struct cache_request));
+        if (!cr)
+                return NULL;
+
+        /* The URL the request is sent on to */
+        len = strlen (request->host) + strlen (request->path) + 16;
+        cr->key = (char *) safemalloc (len);
+        if (!cr->key) {
+                safefree (cr);
+                return NULL;
+        }
+
+        snprintf (cr->key, len, "%s:%u%s", request->host,
+                  (unsigned int) request->port, request->path);
+        for (p = cr->key; *p != ':'; p++)
+                *p = tolower ((unsigned char) *p);
+
+        cr->key_len = strlen (cr->key);
+        cr->hash = hash_key (cr->key, cr->key_len, 2166136261U);
+        cr->check = hash_key (cr->key, cr->key_len, 0x811c9dc5U ^ 0x5bd1e995U);
+
+        value = header_map_get_id (hashofheaders, HEADER_IF_NONE_MATCH);
+        if (value && !(cr->if_none_match = safestrdup (value))) {
+                free_cache_request (cr);
+                return NULL;
+        }
+
+        value = header_map_get_id (hashofheaders, HEADER_IF_MODIFIED_SINCE);
+        cr->if_modified_since = value ? parse_date (value) : -1;
+
+        cr->no_cache =
+            has_directive (hashofheaders, "cache-control", "no-cache", NULL)
+            || has_directive (hashofheaders, "pragma", "no-cache", NULL);
+        cr->max_age = -1;
+        has_directive (hashofheaders, "cache-control", "max-age",
+                       &cr->max_age);
+
+        return cr;
+}
+
+static unsigned int
+fresh_enough (struct cache_request *cr, const struct cache_object *obj)
+{
+        long age = current_age (obj, time (NULL));
+
+        if (cr->no_cache || obj->meta.no_cache)
+                return FALSE;
+        if (cr->max_age >= 0 && age > cr->max_age)
+                return FALSE;
+
+        return age < obj->meta.lifetime;
+}
+
+/*
+ * Ask the server whether the kept copy has changed, with the validators
+ * it came with, in place of any the client sent.
+ */
+static void
+add_validators (struct cache_object *obj, struct header_map *hashofheaders)
+{
+        char value[256];
+
+        header_map_remove_id (hashofheaders, HEADER_IF_NONE_MATCH);
+        header_map_remove_id (hashofheaders, HEADER_IF_MODIFIED_SINCE);
+
+        if (head_field (obj, "etag", value, sizeof (value)))
+                header_map_add_copy (hashofheaders, "If-None-Match", value);
+        if (head_field (obj, "last-modified", value, sizeof (value)))
+                header_map_add_copy (hashofheaders, "If-Modified-Since",
+                                     value);
+}
+
+static void stop_caching (struct conn_s *connptr)
+{
+        struct cache_request *cr = connptr->cache;
+
+        connptr->cache = NULL;
+        release_fetch (cr);
+        free_cache_request (cr);
+}
+
+/*
+ * Look for the response to a request among the kept ones, before it is
+ * sent on.  If the cache has it, and it is fresh, it is sent to the
+ * client straight away.  If another worker is fetching it, the caller
+ * asks again after a while (the wait is limited here.)  Otherwise the
+ * request goes to the server, with the validators of the copy kept, if
+ * there is one.
+ */
+cache_result_t
+cache_lookup (struct conn_s *connptr, struct request_s *request,
+              struct header_map *hashofheaders)
+{
+        struct cache_request *cr = connptr->cache;
+        struct cache_object *obj = NULL;
+        struct cache_slot *slot;
+        unsigned long generation = 0;
+        unsigned int busy = FALSE;
+        time_t now = get_monotonic_time ();
+        int ret;
+
+        if (!cr) {
+                if (!cache_wanted (connptr, request, hashofheaders))
+                        return CACHE_PASS;
+
+                cr = new_cache_request (request, hashofheaders);
+                if (!cr)
+                        return CACHE_PASS;
+                connptr->cache = cr;
+        }
+
+        TABLE_LOCK ();
+        slot = find_slot (cr->hash, cr->check);
+        if (slot && (slot->flags & SLOT_STORED)) {
+                generation = slot->generation;
+                slot->used = ++table->clock;
+        }
+        if (slot && (slot->flags & SLOT_FETCHING))
+                busy = now - slot->fetch_started < CACHE_FETCH_TIME;
+        TABLE_UNLOCK ();
+
+        if (generation) {
+                obj = get_object (cr, generation);
+                if (!obj)
+                        forget_object (cr, generation);
+        }
+
+        if (obj && fresh_enough (cr, obj)) {
+                serve_object (connptr, cr, obj);
+                put_object (obj);
+                return CACHE_HIT;
+        }
+
+        /* Only GET requests fetch responses to keep */
+        ret = busy ? 0 : -1;
+        if (!busy && !connptr->head_method)
+                ret = claim_fetch (cr);
+
+        if (ret == 0 && !connptr->head_method) {
+                if (!cr->wait_started)
+                        cr->wait_started = now;
+                if (now - cr->wait_started < CACHE_FETCH_TIME) {
+                        put_object (obj);
+                        return CACHE_WAIT;
+                }
+        }
+
+        if (ret <= 0) {
+                put_object (obj);
+                stop_caching (connptr);
+                return CACHE_PASS;
+        }
+
+        cr->state = REQUEST_FETCHING;
+        if (obj) {
+                cr->state = REQUEST_REVALIDATING;
+                cr->generation = generation;
+                add_validators (obj, hashofheaders);
+                put_object (obj);
+        }
+
+        cr->request_time = time (NULL);
+        return CACHE_MISS;
+}
+
+/*
+ * Whether the response may be kept (RFC 7234, section 3), and is worth
+ * keeping.  Responses which set cookies or vary with the request are
+ * left out.
+ */
+static unsigned int
+storable (struct conn_s *connptr, struct http_head_s *head,
+          struct header_map *hashofheaders, struct cache_meta *meta)
+{
+        const char *vary;
+
+        switch (head->parser.code) {
+        case 200:
+        case 203:
+        case 300:
+        case 301:
+        case 404:
+        case 410:
+                break;
+        default:
+                return FALSE;
+        }
+
+        if (connptr->content_length.server < 0
+            || connptr->content_length.server > (long) config.cache_max_object
+            || header_map_get_id (hashofheaders, HEADER_TRANSFER_ENCODING)
+            || header_map_get_id (hashofheaders, HEADER_SET_COOKIE)
+            || has_directive (hashofheaders, "cache-control", "no-store",
+                              NULL)
+            || has_directive (hashofheaders, "cache-control", "private",
+                              NULL))
+                return FALSE;
+
+        vary = header_map_get_id (hashofheaders, HEADER_VARY);
+        if (vary && vary[strspn (vary, " \t")])
+                return FALSE;
+
+        set_freshness (meta, hashofheaders, connptr->cache->request_time,
+                       time (NULL));
+        meta->status = head->parser.code;
+
+        return meta->lifetime > 0
+            || header_map_get_id (hashofheaders, HEADER_ETAG)
+            || header_map_get_id (hashofheaders, HEADER_LAST_MODIFIED);
+}
+
+/*
+ * Keep a copy of the body as it is read from the server.
+ */
+static void capture (void *arg, const unsigned char *data, size_t length)
+{
+        struct cache_request *cr = (struct cache_request *) arg;
+        struct cache_object *obj = cr->object;
+
+        if (length > obj->meta.body_len - cr->received) {
+                cr->overflow = TRUE;
+                return;
+        }
+
+        memcpy (OBJECT_BODY (obj) + cr->received, data, length);
+        cr->received += length;
+}
+
+/*
+ * Get ready to keep the response: its head now, and its body as it
+ * arrives.
+ */
+static int
+start_capture (struct conn_s *connptr, struct http_head_s *head,
+               struct cache_meta *meta)
+{
+        static const char *const skip[] = {
+                "age", "connection", "keep-alive", "proxy-authenticate",
+                "proxy-connection", NULL
+        };
+
+        struct cache_request *cr = connptr->cache;
+        struct text text = { NULL, 0, 0 };
+        struct cache_object *obj;
+
+        if (text_add (&text, cr->key, cr->key_len) < 0
+            || add_start_line (&text, head) < 0
+            || add_fields (&text, head, skip, FALSE) < 0
+            || text_add (&text, "\r\n", 2) < 0)
+                goto fail;
+
+        obj = (struct cache_object *)
+            safecalloc (1, sizeof (struct cache_object));
+        if (!obj)
+                goto fail;
+
+        obj->meta = *meta;
+        obj->meta.key_len = cr->key_len;
+        obj->meta.head_len = text.len - cr->key_len;
+        obj->meta.body_len = connptr->content_length.server;
+
+        obj->data = (char *) saferealloc (text.data,
+                                          text.len + obj->meta.body_len);
+        if (!obj->data) {
+                safefree (obj);
+                goto fail;
+        }
+
+        cr->object = obj;
+        cr->received = 0;
+        if (buffer_tee (connptr->sbuffer, capture, cr) < 0)
+                return -1;
+
+        return 0;
+
+fail:
+        safefree (text.data);
+        return -1;
+}
+
+/*
+ * The server says the kept copy has not changed.  Keep it again with the
+ * headers the server sent now, and send it on.
+ */
+static int
+revalidated (struct conn_s *connptr, struct http_head_s *head)
+{
+        static const char *const skip[] = {
+                "age", "connection", "content-length", "keep-alive",
+                "proxy-authenticate", "proxy-connection", "set-cookie",
+                "transfer-encoding", NULL
+        };
+
+        struct cache_request *cr = connptr->cache;
+        struct cache_object *old, *obj = NULL;
+        struct http_head_s merged;
+        struct text text = { NULL, 0, 0 };
+        const char *names[64];
+        struct header_map *headers = NULL;
+        unsigned int keep_alive;
+        size_t i, n = 0;
+        int ret = -1;
+
+        old = get_object (cr, cr->generation);
+        if (!old)
+                return -1;
+
+        /* The fields sent now replace those kept */
+        for (i = 0; i != head->nfields && n + 1 < 64; i++)
+                names[n++] = head->data + head->fields[i].name.off;
+        names[n] = NULL;
+
+        http_head_init (&merged, HTTP_PARSE_RESPONSE);
+        if (text_add (&text, cr->key, cr->key_len) < 0
+            || http_head_parse (&merged, OBJECT_HEAD (old),
+                                old->meta.head_len) < 0
+            || add_start_line (&text, &merged) < 0
+            || add_fields (&text, &merged, names, FALSE) < 0
+            || add_fields (&text, head, skip, FALSE) < 0
+            || text_add (&text, "\r\n", 2) < 0)
+                goto done;
+
+        http_head_reset (&merged, HTTP_PARSE_RESPONSE);
+        headers = header_map_create (&connptr->arena);
+        if (!headers
+            || http_head_parse (&merged, text.data + cr->key_len,
+                                text.len - cr->key_len) < 0
+            || add_headers_to_connection (headers, &merged) < 0)
+                goto done;
+
+        obj = (struct cache_object *)
+            safecalloc (1, sizeof (struct cache_object));
+        if (!obj
+            || text_add (&text, OBJECT_BODY (old), old->meta.body_len) < 0)
+                goto done;
+
+        set_freshness (&obj->meta, headers, cr->request_time, time (NULL));
+        obj->meta.status = old->meta.status;
+        obj->meta.key_len = cr->key_len;
+        obj->meta.head_len = text.len - cr->key_len - old->meta.body_len;
+        obj->meta.body_len = old->meta.body_len;
+        obj->data = text.data;
+        text.data = NULL;
+
+        if (store_object (cr, obj) < 0) {
+                safefree (obj->data);
+                safefree (obj);
+                obj = old;
+        }
+
+        log_message (LOG_INFO, "Revalidated %s", cr->key);
+
+        /* What the server said about its connection still holds */
+        keep_alive = connptr->server_keep_alive;
+        ret = serve_object (connptr, cr, obj) < 0 ? -1 : 1;
+        connptr->server_keep_alive = keep_alive;
+
+done:
+        put_object (old);
+        safefree (text.data);
+        http_head_free (&merged);
+        return ret;
+}
+
+/*
+ * Called by process_response() for every response to a request the
+ * cache has looked at, before anything is sent to the client.  Returns
+ * 1 if the response has been dealt with (a kept copy was sent instead),
+ * and -1 if it could not be.
+ */
+int
+cache_response (struct conn_s *connptr, struct http_head_s *head,
+                struct header_map *hashofheaders)
+{
+        struct cache_request *cr = connptr->cache;
+        struct cache_meta meta;
+        char age[32];
+
+        if (!cr)
+                return 0;
+
+        switch (cr->state) {
+        case REQUEST_SERVING:
+                snprintf (age, sizeof (age), "%ld", cr->age);
+                header_map_remove_id (hashofheaders, HEADER_AGE);
+                header_map_add_copy (hashofheaders, "Age", age);
+                return 0;
+
+        case REQUEST_REVALIDATING:
+                if (head->parser.code == 304)
+                        return revalidated (connptr, head);
+                break;
+
+        case REQUEST_FETCHING:
+                break;
+
+        case REQUEST_PASSING:
+                return 0;
+        }
+
+        memset (&meta, 0, sizeof (meta));
+        if (connptr->head_method
+            || !storable (connptr, head, hashofheaders, &meta)
+            || start_capture (connptr, head, &meta) < 0) {
+                release_fetch (cr);
+                cr->state = REQUEST_PASSING;
+        }
+
+        return 0;
+}
+
+/*
+ * The connection is done with the request: keep the response fetched
+ * for it if all of it arrived.
+ */
+void cache_done (struct conn_s *connptr)
+{
+        struct cache_request *cr = connptr->cache;
+
+        if (!cr)
+                return;
+
+        if (cr->object) {
+                buffer_tee (connptr->sbuffer, NULL, NULL);
+
+                if (!cr->overflow
+                    && cr->received == cr->object->meta.body_len
+                    && store_object (cr, cr->object) == 0)
+                        cr->object = NULL;
+        }
+
+        stop_caching (connptr);
+}
+
+/*
+ * Take in the responses kept by an earlier run, and remove any files
+ * left half written.
+ */
+static void scan_cache_dir (void)
+{
+        char path[CACHE_PATH_LENGTH];
+        struct cache_meta meta;
+        struct cache_slot *slot;
+        struct dirent *entry;
+        struct stat st;
+        DIR *dir;
+        int fd;
+
+        dir = opendir (cache_dir);
+        if (!dir) {
+                log_message (LOG_WARNING, "Could not open CacheDir \"%s\": %s",
+                             cache_dir, strerror (errno));
+                return;
+        }
+
+        while ((entry = readdir (dir)) != NULL) {
+                if (entry->d_name[0] == '.') {
+                        if (strlen (entry->d_name) > 18
+                            && strspn (entry->d_name + 1,
+                                       "0123456789abcdef") == 16) {
+                                snprintf (path, sizeof (path), "%s/%s",
+                                          cache_dir, entry->d_name);
+                                unlink (path);
+                        }
+                        continue;
+                }
+
+                if (strlen (entry->d_name) != 16
+                    || strspn (entry->d_name, "0123456789abcdef") != 16)
+                        continue;
+
+                snprintf (path, sizeof (path), "%s/%s", cache_dir,
+                          entry->d_name);
+                fd = open (path, O_RDONLY);
+                if (fd < 0)
+                        continue;
+
+                if (fstat (fd, &st) < 0
+                    || read_all (fd, &meta, sizeof (meta)) < 0
+                    || memcmp (meta.magic, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0
+                    || (off_t) (sizeof (meta) + meta.key_len + meta.head_len
+                                + meta.body_len) != st.st_size
+                    || find_slot (meta.hash, meta.check)
+                    || table->count >= CACHE_SLOTS_USED) {
+                        close (fd);
+                        unlink (path);
+                        continue;
+                }
+                close (fd);
+
+                slot = add_slot (meta.hash, meta.check);
+                slot->flags = SLOT_STORED;
+                slot->generation = meta.generation;
+                slot->size = st.st_size;
+                slot->used = ++table->clock;
+                table->size += st.st_size;
+                table->generation = max (table->generation, meta.generation);
+        }
+
+        closedir (dir);
+        make_room ();
+
+        log_message (LOG_INFO, "Found %u responses in the cache (%lu bytes)",
+                     table->count, (unsigned long) table->size);
+}
+
+/*
+ * Set up the index shared by the workers, if there is to be a cache.
+ * (It is made once, so "CacheDir" is only taken up at startup.)
+ */
+void init_cache (void)
+{
+        if (!config.cache_dir)
+                return;
+
+        cache_dir = safestrdup (config.cache_dir);
+        if (!cache_dir)
+                return;
+
+        table = (struct cache_table *)
+            malloc_shared_memory (sizeof (struct cache_table));
+        if (table == MAP_FAILED) {
+                log_message (LOG_WARNING,
+                             "Could not allocate the cache index; "
+                             "going without a cache");
+                table = NULL;
+                return;
+        }
+
+        memset (table, 0, sizeof (struct cache_table));
+
+#ifdef HAVE_PTHREAD_H
+        {
+                pthread_mutexattr_t attr;
+
+                pthread_mutexattr_init (&attr);
+                pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutex_init (&table->lock, &attr);
+                pthread_mutexattr_destroy (&attr);
+        }
+#endif
+
+        scan_cache_dir ();
+}
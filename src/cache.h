@@ -0,0 +1,54 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'cache.c' for detailed information. */
+
+#ifndef TINYPROXY_CACHE_H
+#define TINYPROXY_CACHE_H
+
+#include "common.h"
+#include "header-map.h"
+
+/*
+ * How often a request waiting for another worker to fetch its response
+ * looks in the cache again, in milliseconds.
+ */
+#define CACHE_RETRY_INTERVAL 20
+
+/*
+ * What cache_lookup() did with a request.
+ */
+typedef enum {
+        CACHE_PASS,             /* ask the server; the cache stays out of it */
+        CACHE_MISS,             /* ask the server, and keep the response */
+        CACHE_HIT,              /* answered; the body waits in the buffer */
+        CACHE_WAIT              /* being fetched by another; ask again */
+} cache_result_t;
+
+struct conn_s;
+struct request_s;
+struct http_head_s;
+
+extern void init_cache (void);
+extern cache_result_t cache_lookup (struct conn_s *connptr,
+                                    struct request_s *request,
+                                    struct header_map *hashofheaders);
+extern int cache_response (struct conn_s *connptr, struct http_head_s *head,
+                           struct header_map *hashofheaders);
+extern void cache_done (struct conn_s *connptr);
+
+#endif
@@ -24,17 +24,26 @@
 
 #include "child.h"
 #include "daemon.h"
+#include "event-loop.h"
 #include "filter.h"
 #include "heap.h"
 #include "log.h"
 #include "reqs.h"
 #include "sock.h"
+#include "upstream.h"
 #include "utils.h"
 #include "conf.h"
 
 static int listenfd;
 static socklen_t addrlen;
 
+/*
+ * In the "threads" worker mode each thread has its own listening socket,
+ * bound to the same port with SO_REUSEPORT.
+ */
+static int *listenfds;
+static unsigned int listenfd_count;
+
 /*
  * Stores the internal data needed for each child (connection)
  */
@@ -50,12 +59,21 @@ struct child_s {
  * created when the program is started.
  */
 static struct child_s *child_ptr;
+static unsigned int child_count;        /* size of the child_ptr array */
 
 static struct child_config_s {
         unsigned int maxclients, maxrequestsperchild;
         unsigned int maxspareservers, minspareservers, startservers;
+        worker_mode_t workermode;
+        unsigned int workers;
 } child_config;
 
+/*
+ * The worker mode the pool was created with.  A changed "WorkerMode"
+ * only takes effect when tinyproxy is restarted.
+ */
+static worker_mode_t pool_mode;
+
 static unsigned int *servers_waiting;   /* servers waiting for a connection */
 
 /*
@@ -153,6 +171,12 @@ short int child_configure (child_config_t type, unsigned int val)
         case CHILD_MAXREQUESTSPERCHILD:
                 child_config.maxrequestsperchild = val;
                 break;
+        case CHILD_WORKERMODE:
+                child_config.workermode = (worker_mode_t) val;
+                break;
+        case CHILD_WORKERS:
+                child_config.workers = val;
+                break;
         default:
                 DEBUG2 ("Invalid type (%d)", type);
                 return -1;
@@ -161,22 +185,31 @@ short int child_configure (child_config_t type, unsigned int val)
         return 0;
 }
 
-/**
- * child signal handler for sighup
+/*
+ * Children only note the signal.  The configuration is reloaded between
+ * connections (or batches of events), since a connection which is being
+ * handled may still refer to it.
  */
 static void child_sighup_handler (int sig)
 {
-        if (sig == SIGHUP) {
-                /*
-                 * Ignore the return value of reload_config for now.
-                 * This should actually be handled somehow...
-                 */
-                reload_config ();
+        if (sig == SIGHUP)
+                received_sighup = TRUE;
+}
 
-#ifdef FILTER_ENABLE
-                filter_reload ();
-#endif /* FILTER_ENABLE */
-        }
+/*
+ * This is the main loop for a child in the "eventloop" worker mode.
+ * Each one handles up to MaxClients connections at once.
+ */
+static void child_event_main (struct child_s *ptr)
+{
+        ptr->status = T_CONNECTED;
+        ptr->connects = 0;
+
+        event_loop_run (listenfd, child_config.maxclients,
+                        child_config.maxrequestsperchild, TRUE);
+
+        ptr->status = T_EMPTY;
+        exit (0);
 }
 
 /*
@@ -223,6 +256,20 @@ static void child_main (struct child_s *ptr)
                 /*
                  * Make sure no error occurred...
                  */
+                if (received_sighup) {
+                        received_sighup = FALSE;
+
+                        /*
+                         * Ignore the return value of reload_config for now.
+                         * This should actually be handled somehow...
+                         */
+                        reload_config ();
+
+#ifdef FILTER_ENABLE
+                        filter_reload ();
+#endif /* FILTER_ENABLE */
+                }
+
                 if (connfd < 0) {
                         log_message (LOG_ERR,
                                      "Accept returned an error (%s) ... retrying.",
@@ -234,7 +281,7 @@ static void child_main (struct child_s *ptr)
 
                 SERVER_DEC ();
 
-                handle_connection (connfd);
+                handle_connection (connfd, cliaddr, clilen);
                 ptr->connects++;
 
                 if (child_config.maxrequestsperchild != 0) {
@@ -291,12 +338,150 @@ static pid_t child_make (struct child_s *ptr)
          */
         set_signal_handler (SIGCHLD, SIG_DFL);
         set_signal_handler (SIGTERM, SIG_DFL);
+
         set_signal_handler (SIGHUP, child_sighup_handler);
 
+        if (pool_mode == WORKER_MODE_EVENTLOOP)
+                child_event_main (ptr); /* never returns */
+
         child_main (ptr);       /* never returns */
         return -1;
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * This is the main loop for a thread in the "threads" worker mode.  All
+ * signals are left to the main thread, which also reloads the
+ * configuration.
+ */
+static void *child_thread_main (void *arg)
+{
+        struct child_s *ptr = (struct child_s *) arg;
+        unsigned int i = ptr - child_ptr;
+        sigset_t set;
+
+        sigfillset (&set);
+        pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+        event_loop_run (listenfds[i < listenfd_count ? i : 0],
+                        child_config.maxclients, 0, FALSE);
+
+        ptr->status = T_EMPTY;
+        return NULL;
+}
+
+/*
+ * Start (or restart) the worker threads for the "threads" mode.
+ */
+static void child_start_threads (void)
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+        unsigned int i;
+
+        pthread_attr_init (&attr);
+        pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+        for (i = 0; i != child_count; i++) {
+                if (child_ptr[i].status != T_EMPTY)
+                        continue;
+
+                child_ptr[i].status = T_CONNECTED;
+                child_ptr[i].tid = getpid ();
+
+                if (pthread_create (&thread, &attr, child_thread_main,
+                                    &child_ptr[i]) != 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not create thread number %d of %d",
+                                     i + 1, child_count);
+                        child_ptr[i].status = T_EMPTY;
+                } else {
+                        log_message (LOG_INFO,
+                                     "Creating thread number %d of %d ...",
+                                     i + 1, child_count);
+                }
+        }
+
+        pthread_attr_destroy (&attr);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Start (or restart) the workers for the "eventloop" mode.  A worker
+ * which has exited, or died, is replaced.
+ */
+static void child_start_workers (void)
+{
+        unsigned int i;
+
+        for (i = 0; i != child_count; i++) {
+                if (child_ptr[i].status != T_EMPTY
+                    && !(kill (child_ptr[i].tid, 0) < 0 && errno == ESRCH))
+                        continue;
+
+                child_ptr[i].status = T_CONNECTED;
+                child_ptr[i].tid = child_make (&child_ptr[i]);
+
+                if (child_ptr[i].tid < 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not create worker number %d of %d",
+                                     i + 1, child_count);
+                        child_ptr[i].status = T_EMPTY;
+                } else {
+                        log_message (LOG_INFO,
+                                     "Creating worker number %d of %d ...",
+                                     i + 1, child_count);
+                }
+        }
+}
+
+/*
+ * The number of workers for the "eventloop" and "threads" modes.  Unless
+ * set with the "Workers" directive, there is one for each processor.
+ */
+static unsigned int child_worker_count (void)
+{
+        long int n = child_config.workers;
+
+        if (n == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+                n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+                if (n <= 0)
+                        n = 1;
+        }
+
+        return n;
+}
+
+/*
+ * Create the pool of workers (processes or threads) for the "eventloop"
+ * and "threads" modes.
+ */
+static short int child_pool_create_workers (void)
+{
+        child_count = child_worker_count ();
+        child_ptr =
+            (struct child_s *) calloc_shared_memory (child_count,
+                                                     sizeof (struct child_s));
+        if (child_ptr == MAP_FAILED) {
+                log_message (LOG_ERR,
+                             "Could not allocate memory for children.");
+                return -1;
+        }
+
+#ifdef HAVE_PTHREAD_H
+        if (pool_mode == WORKER_MODE_THREADS)
+                child_start_threads ();
+        else
+#endif
+                child_start_workers ();
+
+        log_message (LOG_INFO, "Finished creating all workers.");
+
+        return 0;
+}
+
 /*
  * Create a pool of children to handle incoming connections
  */
@@ -315,6 +500,11 @@ short int child_pool_create (void)
                              "greater than zero.");
                 return -1;
         }
+
+        pool_mode = child_config.workermode;
+        if (pool_mode != WORKER_MODE_PREFORK)
+                return child_pool_create_workers ();
+
         if (child_config.startservers == 0) {
                 log_message (LOG_ERR,
                              "child_pool_create: \"StartServers\" must be "
@@ -322,8 +512,9 @@ short int child_pool_create (void)
                 return -1;
         }
 
+        child_count = child_config.maxclients;
         child_ptr =
-            (struct child_s *) calloc_shared_memory (child_config.maxclients,
+            (struct child_s *) calloc_shared_memory (child_count,
                                                      sizeof (struct child_s));
         if (!child_ptr) {
                 log_message (LOG_ERR,
@@ -354,7 +545,7 @@ short int child_pool_create (void)
                 child_config.startservers = child_config.maxclients;
         }
 
-        for (i = 0; i != child_config.maxclients; i++) {
+        for (i = 0; i != child_count; i++) {
                 child_ptr[i].status = T_EMPTY;
                 child_ptr[i].connects = 0;
         }
@@ -384,55 +575,84 @@ short int child_pool_create (void)
         return 0;
 }
 
+/*
+ * If there are not enough spare servers, create another one.
+ */
+static void child_spawn_spare_server (void)
+{
+        unsigned int i;
+
+        SERVER_COUNT_LOCK ();
+        if (*servers_waiting < child_config.minspareservers) {
+                log_message (LOG_NOTICE,
+                             "Waiting servers (%d) is less than MinSpareServers (%d). "
+                             "Creating new child.",
+                             *servers_waiting,
+                             child_config.minspareservers);
+
+                SERVER_COUNT_UNLOCK ();
+
+                for (i = 0; i != child_count; i++) {
+                        if (child_ptr[i].status == T_EMPTY) {
+                                child_ptr[i].status = T_WAITING;
+                                child_ptr[i].tid =
+                                    child_make (&child_ptr[i]);
+                                if (child_ptr[i].tid < 0) {
+                                        log_message (LOG_NOTICE,
+                                                     "Could not create child");
+
+                                        child_ptr[i].status = T_EMPTY;
+                                        break;
+                                }
+
+                                SERVER_INC ();
+
+                                break;
+                        }
+                }
+        } else {
+                SERVER_COUNT_UNLOCK ();
+        }
+}
+
 /*
  * Keep the proper number of servers running. This is the birth of the
  * servers. It monitors this at least once a second.
  */
 void child_main_loop (void)
 {
-        unsigned int i;
-
         while (1) {
                 if (config.quit)
                         return;
 
-                /* If there are not enough spare servers, create more */
-                SERVER_COUNT_LOCK ();
-                if (*servers_waiting < child_config.minspareservers) {
-                        log_message (LOG_NOTICE,
-                                     "Waiting servers (%d) is less than MinSpareServers (%d). "
-                                     "Creating new child.",
-                                     *servers_waiting,
-                                     child_config.minspareservers);
-
-                        SERVER_COUNT_UNLOCK ();
-
-                        for (i = 0; i != child_config.maxclients; i++) {
-                                if (child_ptr[i].status == T_EMPTY) {
-                                        child_ptr[i].status = T_WAITING;
-                                        child_ptr[i].tid =
-                                            child_make (&child_ptr[i]);
-                                        if (child_ptr[i].tid < 0) {
-                                                log_message (LOG_NOTICE,
-                                                             "Could not create child");
-
-                                                child_ptr[i].status = T_EMPTY;
-                                                break;
-                                        }
-
-                                        SERVER_INC ();
-
-                                        break;
-                                }
-                        }
-                } else {
-                        SERVER_COUNT_UNLOCK ();
+                switch (pool_mode) {
+                case WORKER_MODE_EVENTLOOP:
+                        child_start_workers ();
+                        break;
+#ifdef HAVE_PTHREAD_H
+                case WORKER_MODE_THREADS:
+                        child_start_threads ();
+                        break;
+#endif
+                default:
+                        child_spawn_spare_server ();
+                        break;
                 }
 
+#ifdef UPSTREAM_SUPPORT
+                upstream_check_health (config.upstream_list);
+#endif
+
                 sleep (5);
 
                 /* Handle log rotation if it was requested */
                 if (received_sighup) {
+                        /*
+                         * Worker threads share the configuration, so keep
+                         * them out while it is replaced.
+                         */
+                        config_write_lock ();
+
                         /*
                          * Ignore the return value of reload_config for now.
                          * This should actually be handled somehow...
@@ -443,6 +663,8 @@ void child_main_loop (void)
                         filter_reload ();
 #endif /* FILTER_ENABLE */
 
+                        config_unlock ();
+
                         /* propagate filter reload to all children */
                         child_kill_children (SIGHUP);
 
@@ -458,19 +680,74 @@ void child_kill_children (int sig)
 {
         unsigned int i;
 
-        for (i = 0; i != child_config.maxclients; i++) {
+        /* Threads are not separate processes; there is nothing to kill. */
+        if (pool_mode == WORKER_MODE_THREADS)
+                return;
+
+        for (i = 0; i != child_count; i++) {
                 if (child_ptr[i].status != T_EMPTY)
                         kill (child_ptr[i].tid, sig);
         }
 }
 
+/*
+ * Open one listening socket for each worker thread.  If the system does
+ * not let several sockets share the port, the threads share the first
+ * one instead.
+ */
+static int child_listening_socks (uint16_t port)
+{
+        unsigned int i, n = child_worker_count ();
+
+        listenfds = (int *) safemalloc (n * sizeof (int));
+        if (!listenfds)
+                return -1;
+
+        listenfd = listen_sock (port, &addrlen, TRUE);
+        if (listenfd < 0)
+                listenfd = listen_sock (port, &addrlen, FALSE);
+        if (listenfd < 0)
+                return listenfd;
+
+        listenfds[0] = listenfd;
+        for (listenfd_count = 1; listenfd_count != n; listenfd_count++) {
+                int fd = listen_sock (port, &addrlen, TRUE);
+
+                if (fd < 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not open a listening socket for "
+                                     "each thread; the threads share one.");
+                        for (i = 1; i != listenfd_count; i++)
+                                close (listenfds[i]);
+                        listenfd_count = 1;
+                        break;
+                }
+
+                listenfds[listenfd_count] = fd;
+        }
+
+        return listenfd;
+}
+
 int child_listening_sock (uint16_t port)
 {
-        listenfd = listen_sock (port, &addrlen);
+        if (child_config.workermode == WORKER_MODE_THREADS)
+                return child_listening_socks (port);
+
+        listenfd = listen_sock (port, &addrlen, FALSE);
         return listenfd;
 }
 
 void child_close_sock (void)
 {
+        unsigned int i;
+
+        if (listenfds) {
+                for (i = 1; i < listenfd_count; i++)
+                        close (listenfds[i]);
+                safefree (listenfds);
+                listenfd_count = 0;
+        }
+
         close (listenfd);
 }
@@ -26,9 +26,20 @@ typedef enum {
         CHILD_MAXSPARESERVERS,
         CHILD_MINSPARESERVERS,
         CHILD_STARTSERVERS,
-        CHILD_MAXREQUESTSPERCHILD
+        CHILD_MAXREQUESTSPERCHILD,
+        CHILD_WORKERMODE,
+        CHILD_WORKERS
 } child_config_t;
 
+/*
+ * How the children handle connections (the "WorkerMode" directive).
+ */
+typedef enum {
+        WORKER_MODE_PREFORK,    /* one connection per child at a time */
+        WORKER_MODE_EVENTLOOP,  /* many connections per child */
+        WORKER_MODE_THREADS     /* many connections per thread */
+} worker_mode_t;
+
 extern short int child_pool_create (void);
 extern int child_listening_sock (uint16_t port);
 extern void child_close_sock (void);
@@ -0,0 +1,301 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Follows a body sent with the chunked transfer coding as it is relayed,
+ * to find where it ends.  The body is passed on as it is; the decoder
+ * only looks at the data on its way through the connection's buffer,
+ * remembering where it is from one piece to the next, and skips over the
+ * chunks themselves without touching them.  At any point it can tell
+ * how many more bytes the body has at the least, so reading no more than
+ * that never takes anything which comes after it: the end of the body,
+ * trailers and all, is found exactly, and the connection can then carry
+ * the next message.  Lines may end with a bare LF as well as CRLF.
+ */
+
+#include "main.h"
+
+#include <limits.h>
+
+#include "buffer.h"
+#include "chunked.h"
+
+enum chunked_state {
+        CHUNKED_OFF,
+        CHUNKED_SIZE,           /* the chunk size */
+        CHUNKED_EXTENSION,      /* the rest of the chunk size line */
+        CHUNKED_SIZE_LF,        /* after a CR ending the chunk size */
+        CHUNKED_DATA,
+        CHUNKED_DATA_CR,        /* the line end after the chunk data */
+        CHUNKED_DATA_LF,
+        CHUNKED_TRAILER,        /* the start of a trailer line */
+        CHUNKED_TRAILER_LINE,
+        CHUNKED_END_LF,         /* after the CR of the final empty line */
+        CHUNKED_DONE,
+        CHUNKED_BAD
+};
+
+/*
+ * Anything bigger is taken to be an error, so what is left can still be
+ * counted in a long.
+ */
+#define MAX_CHUNK_SIZE ((unsigned long) LONG_MAX >> 5)
+
+/*
+ * Whether "chunked" is the last transfer coding listed, which is the
+ * only way the end of a body sent with any coding can be known.  It may
+ * not be applied more than once, so listed anywhere else it leaves the
+ * end of the body in doubt (RFC 7230, 3.3.1).
+ *
+ * Returns: negative if "chunked" comes before another coding
+ *          TRUE if it is the last one
+ *          FALSE otherwise
+ */
+int chunked_encoding (const char *transfer_encoding)
+{
+        const char *p = transfer_encoding;
+        unsigned int chunked = FALSE;
+        size_t len;
+
+        assert (transfer_encoding != NULL);
+
+        for (;;) {
+                while (*p == ' ' || *p == '\t' || *p == ',')
+                        p++;
+                if (*p == '\0')
+                        return chunked;
+
+                /* Any coding after "chunked" is one too many */
+                if (chunked)
+                        return -1;
+
+                len = strcspn (p, ",");
+                while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+                        len--;
+                chunked = len == 7 && strncasecmp (p, "chunked", 7) == 0;
+
+                p += strcspn (p, ",");
+        }
+}
+
+void chunked_start (struct chunked_s *chunked)
+{
+        chunked->state = CHUNKED_SIZE;
+        chunked->digits = 0;
+        chunked->size = 0;
+}
+
+void chunked_stop (struct chunked_s *chunked)
+{
+        chunked->state = CHUNKED_OFF;
+        chunked->digits = 0;
+        chunked->size = 0;
+}
+
+static int hex_value (char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
+
+/*
+ * After the chunk size line come the chunk's data or, after the last
+ * one, the trailers.
+ */
+static void size_line_done (struct chunked_s *chunked)
+{
+        chunked->state = chunked->size > 0 ? CHUNKED_DATA : CHUNKED_TRAILER;
+}
+
+/*
+ * Move on past the next "len" bytes of the body.  Returns how many of
+ * them belong to it: fewer than "len" once the end of the body is
+ * found, or if the data is not in the chunked coding (in which case
+ * chunked_left() says so.)
+ */
+size_t chunked_scan (struct chunked_s *chunked, const char *data,
+                     size_t len)
+{
+        size_t i = 0;
+        int value;
+
+        assert (chunked != NULL);
+        assert (chunked_active (chunked));
+
+        while (i < len) {
+                switch (chunked->state) {
+                case CHUNKED_SIZE:
+                        value = hex_value (data[i]);
+                        if (value >= 0) {
+                                if (chunked->size > MAX_CHUNK_SIZE)
+                                        goto bad;
+                                chunked->size = chunked->size * 16 + value;
+                                chunked->digits++;
+                        } else if (chunked->digits == 0) {
+                                goto bad;
+                        } else if (data[i] == '\n') {
+                                size_line_done (chunked);
+                        } else if (data[i] == '\r') {
+                                chunked->state = CHUNKED_SIZE_LF;
+                        } else if (data[i] == ';' || data[i] == ' '
+                                   || data[i] == '\t') {
+                                chunked->state = CHUNKED_EXTENSION;
+                        } else {
+                                goto bad;
+                        }
+                        i++;
+                        break;
+
+                case CHUNKED_EXTENSION:
+                        if (data[i++] == '\n')
+                                size_line_done (chunked);
+                        break;
+
+                case CHUNKED_SIZE_LF:
+                        if (data[i++] != '\n')
+                                goto bad;
+                        size_line_done (chunked);
+                        break;
+
+                case CHUNKED_DATA:
+                        if (len - i < chunked->size) {
+                                chunked->size -= len - i;
+                                i = len;
+                        } else {
+                                i += chunked->size;
+                                chunked->size = 0;
+                                chunked->state = CHUNKED_DATA_CR;
+                        }
+                        break;
+
+                case CHUNKED_DATA_CR:
+                        if (data[i] == '\r') {
+                                chunked->state = CHUNKED_DATA_LF;
+                                i++;
+                                break;
+                        }
+                        /* fall through */
+                case CHUNKED_DATA_LF:
+                        if (data[i++] != '\n')
+                                goto bad;
+                        chunked->state = CHUNKED_SIZE;
+                        chunked->digits = 0;
+                        break;
+
+                case CHUNKED_TRAILER:
+                        if (data[i] == '\n') {
+                                chunked->state = CHUNKED_DONE;
+                        } else if (data[i] == '\r') {
+                                chunked->state = CHUNKED_END_LF;
+                        } else {
+                                chunked->state = CHUNKED_TRAILER_LINE;
+                        }
+                        i++;
+                        break;
+
+                case CHUNKED_TRAILER_LINE:
+                        if (data[i++] == '\n')
+                                chunked->state = CHUNKED_TRAILER;
+                        break;
+
+                case CHUNKED_END_LF:
+                        if (data[i++] != '\n')
+                                goto bad;
+                        chunked->state = CHUNKED_DONE;
+                        break;
+
+                default:
+                        return i;
+                }
+        }
+
+        return i;
+
+bad:
+        chunked->state = CHUNKED_BAD;
+        return i;
+}
+
+/*
+ * How many more bytes the body has at the least: what is left of the
+ * current chunk and line, and a final empty chunk after them.  Returns
+ * 0 once the whole body has been seen, and -1 if it turned out not to
+ * be in the chunked coding, so where it ends can't be known.
+ */
+long int chunked_left (const struct chunked_s *chunked)
+{
+        assert (chunked != NULL);
+
+        switch (chunked->state) {
+        case CHUNKED_SIZE:
+                if (chunked->digits == 0)
+                        return 3;       /* "0\n\n" */
+                /* fall through */
+        case CHUNKED_EXTENSION:
+        case CHUNKED_SIZE_LF:
+                return chunked->size > 0 ? (long int) chunked->size + 5 : 2;
+        case CHUNKED_DATA:
+                return (long int) chunked->size + 4;
+        case CHUNKED_DATA_CR:
+        case CHUNKED_DATA_LF:
+                return 4;
+        case CHUNKED_TRAILER:
+        case CHUNKED_END_LF:
+                return 1;
+        case CHUNKED_TRAILER_LINE:
+                return 2;
+        case CHUNKED_DONE:
+                return 0;
+        default:
+                return -1;
+        }
+}
+
+static void see_data (void *arg, const unsigned char *data, size_t length)
+{
+        chunked_scan ((struct chunked_s *) arg, (const char *) data, length);
+}
+
+/*
+ * Read the next part of the body into the buffer, as much of it as is
+ * known to be there, and put in "*left" what chunked_left() says after
+ * seeing it.  Returns what read_buffer() does.  The decoder stops if
+ * the body turns out not to be in the chunked coding.
+ */
+ssize_t chunked_read (int fd, struct buffer_s *buffptr,
+                      struct chunked_s *chunked, long int *left)
+{
+        ssize_t len;
+
+        assert (chunked_active (chunked));
+        assert (*left > 0);
+
+        if (buffer_tee (buffptr, see_data, chunked) < 0)
+                return -1;
+        len = read_buffer_max (fd, buffptr, *left);
+        buffer_tee (buffptr, NULL, NULL);
+
+        *left = chunked_left (chunked);
+        if (*left < 0)
+                chunked_stop (chunked);
+
+        return len;
+}
@@ -0,0 +1,47 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'chunked.c' for detailed information. */
+
+#ifndef TINYPROXY_CHUNKED_H
+#define TINYPROXY_CHUNKED_H
+
+struct buffer_s;
+
+/*
+ * Where a chunked body has got to.  One which is all zeroes is not in
+ * use.
+ */
+struct chunked_s {
+        unsigned int state;
+        unsigned int digits;    /* of the chunk size read so far */
+        unsigned long size;     /* of the chunk, or what is left of it */
+};
+
+#define chunked_active(c) ((c)->state != 0)
+
+extern int chunked_encoding (const char *transfer_encoding);
+
+extern void chunked_start (struct chunked_s *chunked);
+extern void chunked_stop (struct chunked_s *chunked);
+extern size_t chunked_scan (struct chunked_s *chunked, const char *data,
+                            size_t len);
+extern long int chunked_left (const struct chunked_s *chunked);
+extern ssize_t chunked_read (int fd, struct buffer_s *buffptr,
+                             struct chunked_s *chunked, long int *left);
+
+#endif
@@ -48,6 +48,9 @@
 #  include	<stdint.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#  include	<sys/epoll.h>
+#endif
 #ifdef HAVE_SYS_IOCTL_H
 #  include	<sys/ioctl.h>
 #endif
@@ -72,6 +75,9 @@
 #  endif
 #endif
 
+#ifdef HAVE_SYS_RANDOM_H
+#  include      <sys/random.h>
+#endif
 #ifdef HAVE_SYS_RESOURCE_H
 #  include      <sys/resource.h>
 #endif
@@ -100,6 +106,9 @@
 #ifdef HAVE_CTYPE_H
 #  include      <ctype.h>
 #endif
+#ifdef HAVE_DIRENT_H
+#  include	<dirent.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #  include	<errno.h>
 #endif
@@ -115,6 +124,12 @@
 #ifdef HAVE_NETDB_H
 #  include	<netdb.h>
 #endif
+#ifdef HAVE_POLL_H
+#  include	<poll.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#  include	<pthread.h>
+#endif
 #ifdef HAVE_PWD_H
 #  include     	<pwd.h>
 #endif
@@ -28,6 +28,7 @@
 #include "acl.h"
 #include "anonymous.h"
 #include "child.h"
+#include "dns.h"
 #include "filter.h"
 #include "heap.h"
 #include "html-error.h"
@@ -118,6 +119,7 @@ static HANDLE_FUNC (handle_nop)
 static HANDLE_FUNC (handle_allow);
 static HANDLE_FUNC (handle_anonymous);
 static HANDLE_FUNC (handle_bind);
+static HANDLE_FUNC (handle_adaptivebuffers);
 static HANDLE_FUNC (handle_bindsame);
 static HANDLE_FUNC (handle_connectport);
 static HANDLE_FUNC (handle_defaulterrorfile);
@@ -142,6 +144,10 @@ static HANDLE_FUNC (handle_minspareservers);
 static HANDLE_FUNC (handle_pidfile);
 static HANDLE_FUNC (handle_port);
 #ifdef REVERSE_SUPPORT
+static HANDLE_FUNC (handle_cachedir);
+static HANDLE_FUNC (handle_cachemaxobjectsize);
+static HANDLE_FUNC (handle_cachememory);
+static HANDLE_FUNC (handle_cachesize);
 static HANDLE_FUNC (handle_reversebaseurl);
 static HANDLE_FUNC (handle_reversemagic);
 static HANDLE_FUNC (handle_reverseonly);
@@ -152,15 +158,31 @@ static HANDLE_FUNC (handle_statfile);
 static HANDLE_FUNC (handle_stathost);
 static HANDLE_FUNC (handle_syslog);
 static HANDLE_FUNC (handle_timeout);
+static HANDLE_FUNC (handle_readbuffersize);
+static HANDLE_FUNC (handle_maxbuffersize);
+static HANDLE_FUNC (handle_maxkeepaliverequests);
+static HANDLE_FUNC (handle_keepalivetimeout);
+static HANDLE_FUNC (handle_serverkeepalive);
+static HANDLE_FUNC (handle_serverkeepalivetimeout);
+static HANDLE_FUNC (handle_connecttimeout);
 
 static HANDLE_FUNC (handle_user);
 static HANDLE_FUNC (handle_viaproxyname);
+static HANDLE_FUNC (handle_workermode);
+static HANDLE_FUNC (handle_workers);
 static HANDLE_FUNC (handle_disableviaheader);
+static HANDLE_FUNC (handle_dnsserver);
 static HANDLE_FUNC (handle_xtinyproxy);
 
 #ifdef UPSTREAM_SUPPORT
 static HANDLE_FUNC (handle_upstream);
 static HANDLE_FUNC (handle_upstream_no);
+static HANDLE_FUNC (handle_upstream_group);
+static HANDLE_FUNC (handle_upstreamgroup);
+static HANDLE_FUNC (handle_upstreambalance);
+static HANDLE_FUNC (handle_upstreammaxfails);
+static HANDLE_FUNC (handle_upstreamfailtimeout);
+static HANDLE_FUNC (handle_upstreamhealthcheck);
 #endif
 
 static void config_free_regex (void);
@@ -210,6 +232,7 @@ struct {
         STDCONF ("syslog", BOOL, handle_syslog),
         STDCONF ("bindsame", BOOL, handle_bindsame),
         STDCONF ("disableviaheader", BOOL, handle_disableviaheader),
+        STDCONF ("adaptivebuffers", BOOL, handle_adaptivebuffers),
         /* integer arguments */
         STDCONF ("port", INT, handle_port),
         STDCONF ("maxclients", INT, handle_maxclients),
@@ -217,7 +240,17 @@ struct {
         STDCONF ("minspareservers", INT, handle_minspareservers),
         STDCONF ("startservers", INT, handle_startservers),
         STDCONF ("maxrequestsperchild", INT, handle_maxrequestsperchild),
+        STDCONF ("workermode", "(prefork|eventloop|threads)", handle_workermode),
+        STDCONF ("workers", INT, handle_workers),
         STDCONF ("timeout", INT, handle_timeout),
+        STDCONF ("readbuffersize", INT, handle_readbuffersize),
+        STDCONF ("maxbuffersize", INT, handle_maxbuffersize),
+        STDCONF ("maxkeepaliverequests", INT, handle_maxkeepaliverequests),
+        STDCONF ("keepalivetimeout", INT, handle_keepalivetimeout),
+        STDCONF ("serverkeepalive", INT, handle_serverkeepalive),
+        STDCONF ("serverkeepalivetimeout", INT,
+                 handle_serverkeepalivetimeout),
+        STDCONF ("connecttimeout", INT, handle_connecttimeout),
         STDCONF ("connectport", INT, handle_connectport),
         /* alphanumeric arguments */
         STDCONF ("user", ALNUM, handle_user),
@@ -229,6 +262,8 @@ struct {
         STDCONF ("deny", "(" "(" IPMASK "|" IPV6MASK ")" "|" ALNUM ")",
                  handle_deny),
         STDCONF ("bind", "(" IP "|" IPV6 ")", handle_bind),
+        STDCONF ("dnsserver", "(" IP "|" IPV6 ")" "(" WS INT ")?",
+                 handle_dnsserver),
         /* other */
         STDCONF ("errorfile", INT WS STR, handle_errorfile),
         STDCONF ("addheader",  STR WS STR, handle_addheader),
@@ -247,6 +282,10 @@ struct {
         STDCONF ("reverseonly", BOOL, handle_reverseonly),
         STDCONF ("reversemagic", BOOL, handle_reversemagic),
         STDCONF ("reversepath", STR "(" WS STR ")?", handle_reversepath),
+        STDCONF ("cachedir", STR, handle_cachedir),
+        STDCONF ("cachesize", INT, handle_cachesize),
+        STDCONF ("cachememory", INT, handle_cachememory),
+        STDCONF ("cachemaxobjectsize", INT, handle_cachemaxobjectsize),
 #endif
 #ifdef UPSTREAM_SUPPORT
         /* upstream is rather complicated */
@@ -257,6 +296,17 @@ struct {
                 BEGIN "(upstream)" WS ALNUM ":" ALNUM "@" "(" IP "|" ALNUM ")" ":" INT "(" WS STR
                       ")?" END, handle_upstream, NULL
         },
+        {
+                BEGIN "(upstream)" WS "group" WS STR "(" WS STR ")?" END,
+                handle_upstream_group, NULL
+        },
+        STDCONF ("upstreamgroup", STR WS "(" ALNUM ":" ALNUM "@)?"
+                 "(" IP "|" ALNUM ")" ":" INT, handle_upstreamgroup),
+        STDCONF ("upstreambalance", STR WS "(roundrobin|leastconn|hash)",
+                 handle_upstreambalance),
+        STDCONF ("upstreammaxfails", INT, handle_upstreammaxfails),
+        STDCONF ("upstreamfailtimeout", INT, handle_upstreamfailtimeout),
+        STDCONF ("upstreamhealthcheck", INT, handle_upstreamhealthcheck),
 #endif
         /* loglevel */
         STDCONF ("loglevel", "(critical|error|warning|notice|connect|info)",
@@ -281,7 +331,7 @@ free_added_headers (vector_t add_headers)
         vector_delete (add_headers);
 }
 
-static void free_config (struct config_s *conf)
+void free_config (struct config_s *conf)
 {
         safefree (conf->config_file);
         safefree (conf->logf_name);
@@ -295,6 +345,7 @@ static void free_config (struct config_s *conf)
 #ifdef REVERSE_SUPPORT
         free_reversepath_list(conf->reversepath_list);
         safefree (conf->reversebaseurl);
+        safefree (conf->cache_dir);
 #endif
 #ifdef UPSTREAM_SUPPORT
         free_upstream_list (conf->upstream_list);
@@ -308,6 +359,7 @@ static void free_config (struct config_s *conf)
         safefree (conf->statpage);
         flush_access_list (conf->access_list);
         free_connect_ports_list (conf->connect_ports);
+        vector_delete (conf->dns_servers);
         hashmap_delete (conf->anonymous_map);
 
         memset (conf, 0, sizeof(*conf));
@@ -484,17 +536,27 @@ static void initialize_with_defaults (struct config_s *conf,
 #endif
 
 #ifdef REVERSE_SUPPORT
-        /* struct reversepath *reversepath_list; */
+        /* struct reversepath_list *reversepath_list; */
         conf->reverseonly = defaults->reverseonly;
         conf->reversemagic = defaults->reversemagic;
 
         if (defaults->reversebaseurl) {
                 conf->reversebaseurl = safestrdup (defaults->reversebaseurl);
         }
+
+        if (defaults->cache_dir) {
+                conf->cache_dir = safestrdup (defaults->cache_dir);
+        }
+        conf->cache_size = defaults->cache_size;
+        conf->cache_memory = defaults->cache_memory;
+        conf->cache_max_object = defaults->cache_max_object;
 #endif
 
 #ifdef UPSTREAM_SUPPORT
-        /* struct upstream *upstream_list; */
+        /* struct upstream_list *upstream_list; */
+        conf->upstream_max_fails = defaults->upstream_max_fails;
+        conf->upstream_fail_timeout = defaults->upstream_fail_timeout;
+        conf->upstream_check_interval = defaults->upstream_check_interval;
 #endif                          /* UPSTREAM_SUPPORT */
 
         if (defaults->pidpath) {
@@ -502,6 +564,14 @@ static void initialize_with_defaults (struct config_s *conf,
         }
 
         conf->idletimeout = defaults->idletimeout;
+        conf->readbuffersize = defaults->readbuffersize;
+        conf->maxbuffersize = defaults->maxbuffersize;
+        conf->adaptivebuffers = defaults->adaptivebuffers;
+        conf->maxkeepaliverequests = defaults->maxkeepaliverequests;
+        conf->keepalivetimeout = defaults->keepalivetimeout;
+        conf->serverkeepalive = defaults->serverkeepalive;
+        conf->serverkeepalivetimeout = defaults->serverkeepalivetimeout;
+        conf->connecttimeout = defaults->connecttimeout;
 
         if (defaults->bind_address) {
                 conf->bind_address = safestrdup (defaults->bind_address);
@@ -523,8 +593,9 @@ static void initialize_with_defaults (struct config_s *conf,
                 conf->statpage = safestrdup (defaults->statpage);
         }
 
-        /* vector_t access_list; */
+        /* acl_list_t access_list; */
         /* vector_t connect_ports; */
+        /* vector_t dns_servers; */
         /* hashmap_t anonymous_map; */
 }
 
@@ -572,6 +643,33 @@ int reload_config_file (const char *config_fname, struct config_s *conf,
                 conf->idletimeout = MAX_IDLE_TIME;
         }
 
+        if (conf->readbuffersize == 0)
+                conf->readbuffersize = READBUFFSIZE;
+        if (conf->maxbuffersize == 0)
+                conf->maxbuffersize = MAXBUFFSIZE;
+        if (conf->maxkeepaliverequests == 0)
+                conf->maxkeepaliverequests = MAX_KEEPALIVE_REQUESTS;
+        if (conf->keepalivetimeout == 0)
+                conf->keepalivetimeout = KEEPALIVE_TIMEOUT;
+        if (conf->serverkeepalivetimeout == 0)
+                conf->serverkeepalivetimeout = SERVER_KEEPALIVE_TIMEOUT;
+        if (conf->connecttimeout == 0)
+                conf->connecttimeout = CONNECT_TIMEOUT;
+#ifdef UPSTREAM_SUPPORT
+        if (conf->upstream_max_fails == 0)
+                conf->upstream_max_fails = UPSTREAM_MAX_FAILS;
+        if (conf->upstream_fail_timeout == 0)
+                conf->upstream_fail_timeout = UPSTREAM_FAIL_TIMEOUT;
+#endif
+#ifdef REVERSE_SUPPORT
+        if (conf->cache_size == 0)
+                conf->cache_size = CACHE_SIZE;
+        if (conf->cache_memory == 0)
+                conf->cache_memory = CACHE_MEMORY;
+        if (conf->cache_max_object == 0)
+                conf->cache_max_object = CACHE_MAX_OBJECT;
+#endif
+
 done:
         return ret;
 }
@@ -823,11 +921,83 @@ static HANDLE_FUNC (handle_maxrequestsperchild)
         return 0;
 }
 
+static HANDLE_FUNC (handle_workermode)
+{
+        char *arg = get_string_arg (line, &match[2]);
+        int ret = 0;
+
+        if (!strcasecmp (arg, "prefork")) {
+                child_configure (CHILD_WORKERMODE, WORKER_MODE_PREFORK);
+#ifdef HAVE_SYS_EPOLL_H
+        } else if (!strcasecmp (arg, "eventloop")) {
+                child_configure (CHILD_WORKERMODE, WORKER_MODE_EVENTLOOP);
+#ifdef HAVE_PTHREAD_H
+        } else if (!strcasecmp (arg, "threads")) {
+                child_configure (CHILD_WORKERMODE, WORKER_MODE_THREADS);
+#endif
+#endif
+        } else {
+                fprintf (stderr,
+                         "WorkerMode \"%s\" is not supported on this system.\n",
+                         arg);
+                ret = 1;
+        }
+
+        safefree (arg);
+        return ret;
+}
+
+static HANDLE_FUNC (handle_workers)
+{
+        child_configure (CHILD_WORKERS, get_long_arg (line, &match[2]));
+        return 0;
+}
+
 static HANDLE_FUNC (handle_timeout)
 {
         return set_int_arg (&conf->idletimeout, line, &match[2]);
 }
 
+static HANDLE_FUNC (handle_readbuffersize)
+{
+        return set_int_arg (&conf->readbuffersize, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_maxbuffersize)
+{
+        return set_int_arg (&conf->maxbuffersize, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_maxkeepaliverequests)
+{
+        return set_int_arg (&conf->maxkeepaliverequests, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_keepalivetimeout)
+{
+        return set_int_arg (&conf->keepalivetimeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_serverkeepalive)
+{
+        return set_int_arg (&conf->serverkeepalive, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_serverkeepalivetimeout)
+{
+        return set_int_arg (&conf->serverkeepalivetimeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_connecttimeout)
+{
+        return set_int_arg (&conf->connecttimeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_adaptivebuffers)
+{
+        return set_bool_arg (&conf->adaptivebuffers, line, &match[2]);
+}
+
 static HANDLE_FUNC (handle_connectport)
 {
         add_connect_port_allowed (get_long_arg (line, &match[2]),
@@ -880,6 +1050,23 @@ static HANDLE_FUNC (handle_bind)
 #endif
 }
 
+/*
+ * The optional port follows the address.
+ */
+static HANDLE_FUNC (handle_dnsserver)
+{
+        char *arg = get_string_arg (line, &match[2]);
+        int port = atoi (line + match[2].rm_eo);
+        int r;
+
+        if (!arg)
+                return -1;
+
+        r = dns_add_server (arg, port, &conf->dns_servers);
+        safefree (arg);
+        return r < 0 ? 1 : 0;
+}
+
 static HANDLE_FUNC (handle_listen)
 {
         int r = set_string_arg (&conf->ipAddr, line, &match[2]);
@@ -1040,6 +1227,26 @@ static HANDLE_FUNC (handle_reversepath)
         }
         return 0;
 }
+
+static HANDLE_FUNC (handle_cachedir)
+{
+        return set_string_arg (&conf->cache_dir, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachesize)
+{
+        return set_int_arg (&conf->cache_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachememory)
+{
+        return set_int_arg (&conf->cache_memory, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_cachemaxobjectsize)
+{
+        return set_int_arg (&conf->cache_max_object, line, &match[2]);
+}
 #endif
 
 #ifdef UPSTREAM_SUPPORT
@@ -1086,4 +1293,105 @@ static HANDLE_FUNC (handle_upstream_no)
 
         return 0;
 }
+
+static HANDLE_FUNC (handle_upstream_group)
+{
+        char *name;
+        char *domain = NULL;
+
+        name = get_string_arg (line, &match[2]);
+        if (!name)
+                return -1;
+
+        if (match[4].rm_so != -1) {
+                domain = get_string_arg (line, &match[4]);
+                if (!domain) {
+                        safefree (name);
+                        return -1;
+                }
+        }
+
+        upstream_add_group (name, domain, &conf->upstream_list);
+
+        safefree (domain);
+        safefree (name);
+
+        return 0;
+}
+
+static HANDLE_FUNC (handle_upstreamgroup)
+{
+        char *name;
+        char *user = NULL;
+        char *pwd = NULL;
+        char *host;
+        int port;
+
+        name = get_string_arg (line, &match[2]);
+        host = get_string_arg (line, &match[6]);
+        if (!name || !host) {
+                safefree (name);
+                safefree (host);
+                return -1;
+        }
+
+        if (match[3].rm_so != -1) {
+                user = get_string_arg (line, &match[4]);
+                pwd = get_string_arg (line, &match[5]);
+        }
+        port = (int) get_long_arg (line, &match[11]);
+
+        upstream_add_parent (name, user, pwd, host, port,
+                             &conf->upstream_list);
+
+        safefree (name);
+        safefree (user);
+        safefree (pwd);
+        safefree (host);
+
+        return 0;
+}
+
+static HANDLE_FUNC (handle_upstreambalance)
+{
+        char *name, *balance;
+
+        name = get_string_arg (line, &match[2]);
+        balance = get_string_arg (line, &match[3]);
+        if (!name || !balance) {
+                safefree (name);
+                safefree (balance);
+                return -1;
+        }
+
+        if (strcasecmp (balance, "leastconn") == 0)
+                upstream_set_balance (name, UPSTREAM_LEAST_CONN,
+                                      &conf->upstream_list);
+        else if (strcasecmp (balance, "hash") == 0)
+                upstream_set_balance (name, UPSTREAM_HASH,
+                                      &conf->upstream_list);
+        else
+                upstream_set_balance (name, UPSTREAM_ROUND_ROBIN,
+                                      &conf->upstream_list);
+
+        safefree (name);
+        safefree (balance);
+
+        return 0;
+}
+
+static HANDLE_FUNC (handle_upstreammaxfails)
+{
+        return set_int_arg (&conf->upstream_max_fails, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_upstreamfailtimeout)
+{
+        return set_int_arg (&conf->upstream_fail_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_upstreamhealthcheck)
+{
+        return set_int_arg (&conf->upstream_check_interval, line, &match[2]);
+}
 #endif
@@ -22,6 +22,7 @@
 #ifndef TINYPROXY_CONF_H
 #define TINYPROXY_CONF_H
 
+#include "acl.h"
 #include "hashmap.h"
 #include "vector.h"
 
@@ -57,16 +58,66 @@ struct config_s {
         unsigned int add_xtinyproxy; /* boolean */
 #endif
 #ifdef REVERSE_SUPPORT
-        struct reversepath *reversepath_list;
+        struct reversepath_list *reversepath_list;
         unsigned int reverseonly;       /* boolean */
         unsigned int reversemagic;      /* boolean */
         char *reversebaseurl;
+
+        /*
+         * Where the response cache keeps its files (none without it), how
+         * much it may keep there and in the memory of each worker, and
+         * the largest response it keeps, all in bytes.
+         */
+        char *cache_dir;
+        unsigned int cache_size;
+        unsigned int cache_memory;
+        unsigned int cache_max_object;
 #endif
 #ifdef UPSTREAM_SUPPORT
-        struct upstream *upstream_list;
+        struct upstream_list *upstream_list;
+
+        /*
+         * A proxy of an upstream group which fails this many connections
+         * in a row is left out for "upstream_fail_timeout" seconds.  All
+         * of them are checked every "upstream_check_interval" seconds,
+         * unless it is zero.
+         */
+        unsigned int upstream_max_fails;
+        unsigned int upstream_fail_timeout;
+        unsigned int upstream_check_interval;
 #endif                          /* UPSTREAM_SUPPORT */
         char *pidpath;
         unsigned int idletimeout;
+
+        /*
+         * How much is read from a socket at once, and how much may be
+         * held in a connection's buffer before reading stops.  With
+         * adaptive buffers these are upper limits which each buffer
+         * works up to as it is kept busy.
+         */
+        unsigned int readbuffersize;
+        unsigned int maxbuffersize;
+        unsigned int adaptivebuffers;   /* boolean */
+
+        /*
+         * How many requests a client may send over one connection, and
+         * how long an open connection may wait for the next one.
+         */
+        unsigned int maxkeepaliverequests;
+        unsigned int keepalivetimeout;
+
+        /*
+         * How many idle connections to each server are kept for reuse
+         * (none if zero), and for how long.
+         */
+        unsigned int serverkeepalive;
+        unsigned int serverkeepalivetimeout;
+
+        /*
+         * How long to try connecting to a server before giving up.
+         */
+        unsigned int connecttimeout;
+
         char *bind_address;
         unsigned int bindsame;
 
@@ -93,13 +144,18 @@ struct config_s {
          */
         char *statpage;
 
-        vector_t access_list;
+        acl_list_t access_list;
 
         /*
          * Store the list of port allowed by CONNECT.
          */
         vector_t connect_ports;
 
+        /*
+         * The name servers to ask instead of those in /etc/resolv.conf.
+         */
+        vector_t dns_servers;
+
         /*
          * Map of headers which should be let through when the
          * anonymous feature is turned on.
@@ -114,6 +170,7 @@ struct config_s {
 
 extern int reload_config_file (const char *config_fname, struct config_s *conf,
                                struct config_s *defaults);
+extern void free_config (struct config_s *conf);
 
 int config_compile_regex (void);
 
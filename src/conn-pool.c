@@ -0,0 +1,226 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Idle connections to servers (and upstream proxies), kept so that the
+ * next request for the same host and port can skip the lookup and the
+ * handshake.  A connection is filed under the host and port it was made
+ * to and the address it was bound to.  At most "ServerKeepAlive" are kept
+ * for each, for "ServerKeepAliveTimeout" seconds, and a connection is
+ * checked for having been closed by the server before it is handed out.
+ * The pool belongs to the process, so worker threads share it.
+ */
+
+#include "main.h"
+
+#include "conn-pool.h"
+#include "heap.h"
+#include "log.h"
+#include "utils.h"
+#include "conf.h"
+
+/*
+ * How many idle connections are kept in all; the oldest go first.
+ */
+#define CONN_POOL_MAX 256
+
+struct pooled_conn {
+        struct pooled_conn *prev, *next;
+        char *host;
+        int port;
+        char *bind_to;          /* NULL if not bound */
+        int fd;
+        time_t idle_since;
+};
+
+/*
+ * Most recently returned first.
+ */
+static struct pooled_conn *newest, *oldest;
+static unsigned int pool_count;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define POOL_LOCK()   pthread_mutex_lock (&pool_lock)
+#  define POOL_UNLOCK() pthread_mutex_unlock (&pool_lock)
+#else
+#  define POOL_LOCK()
+#  define POOL_UNLOCK()
+#endif
+
+static int
+same_key (const struct pooled_conn *conn, const char *host, int port,
+          const char *bind_to)
+{
+        if (conn->port != port || strcasecmp (conn->host, host) != 0)
+                return FALSE;
+
+        if (conn->bind_to == NULL || bind_to == NULL)
+                return conn->bind_to == bind_to;
+
+        return strcmp (conn->bind_to, bind_to) == 0;
+}
+
+static void unlink_pooled (struct pooled_conn *conn)
+{
+        if (conn->prev)
+                conn->prev->next = conn->next;
+        else
+                newest = conn->next;
+
+        if (conn->next)
+                conn->next->prev = conn->prev;
+        else
+                oldest = conn->prev;
+
+        pool_count--;
+}
+
+/*
+ * Close the connection and forget about it.  The lock must be held.
+ */
+static void drop_pooled (struct pooled_conn *conn)
+{
+        unlink_pooled (conn);
+
+        close (conn->fd);
+        safefree (conn->host);
+        safefree (conn->bind_to);
+        safefree (conn);
+}
+
+/*
+ * Check that the server has neither closed an idle connection nor sent
+ * anything on it.  Either way it can't take another request.
+ */
+static int conn_is_usable (int fd)
+{
+        char c;
+        ssize_t len;
+
+        len = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return len < 0 && errno == EAGAIN;
+}
+
+static void expire_locked (time_t now)
+{
+        while (oldest && now - oldest->idle_since
+               >= (time_t) config.serverkeepalivetimeout)
+                drop_pooled (oldest);
+}
+
+/*
+ * Take an idle connection to "host" and "port" out of the pool.  Returns
+ * the socket (in whatever blocking mode it was returned in), or -1 if
+ * there is none.
+ */
+int conn_pool_get (const char *host, int port, const char *bind_to)
+{
+        struct pooled_conn *conn, *next;
+        int fd = -1;
+
+        POOL_LOCK ();
+        expire_locked (get_monotonic_time ());
+
+        for (conn = newest; conn; conn = next) {
+                next = conn->next;
+                if (!same_key (conn, host, port, bind_to))
+                        continue;
+
+                if (!conn_is_usable (conn->fd)) {
+                        drop_pooled (conn);
+                        continue;
+                }
+
+                fd = conn->fd;
+                unlink_pooled (conn);
+                safefree (conn->host);
+                safefree (conn->bind_to);
+                safefree (conn);
+                break;
+        }
+        POOL_UNLOCK ();
+
+        return fd;
+}
+
+/*
+ * Hand a connection which can take another request to the pool.  It is
+ * closed if the pool is turned off or has no room for it.
+ */
+void conn_pool_put (const char *host, int port, const char *bind_to, int fd)
+{
+        struct pooled_conn *conn, *last = NULL;
+        unsigned int count = 0;
+
+        if (config.serverkeepalive == 0) {
+                close (fd);
+                return;
+        }
+
+        conn = (struct pooled_conn *) safecalloc (1, sizeof (*conn));
+        if (!conn) {
+                close (fd);
+                return;
+        }
+
+        conn->host = safestrdup (host);
+        conn->bind_to = bind_to ? safestrdup (bind_to) : NULL;
+        if (!conn->host || (bind_to && !conn->bind_to)) {
+                safefree (conn->host);
+                safefree (conn);
+                close (fd);
+                return;
+        }
+        conn->port = port;
+        conn->fd = fd;
+        conn->idle_since = get_monotonic_time ();
+
+        POOL_LOCK ();
+
+        /* Make room by dropping the oldest connection to the same place */
+        for (conn->next = newest; conn->next; conn->next = conn->next->next) {
+                if (same_key (conn->next, host, port, bind_to)) {
+                        last = conn->next;
+                        count++;
+                }
+        }
+        if (count >= config.serverkeepalive)
+                drop_pooled (last);
+        if (pool_count >= CONN_POOL_MAX)
+                drop_pooled (oldest);
+
+        conn->prev = NULL;
+        conn->next = newest;
+        if (newest)
+                newest->prev = conn;
+        else
+                oldest = conn;
+        newest = conn;
+        pool_count++;
+
+        POOL_UNLOCK ();
+}
+
+/*
+ * Close the connections which have been idle for too long.
+ */
+void conn_pool_expire (void)
+{
+        POOL_LOCK ();
+        expire_locked (get_monotonic_time ());
+        POOL_UNLOCK ();
+}
@@ -25,19 +25,21 @@
 #include "main.h"
 
 #include "buffer.h"
+#include "cache.h"
 #include "conns.h"
 #include "heap.h"
 #include "log.h"
 #include "stats.h"
 
-struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
-                                const char *string_addr,
+struct conn_s *initialize_conn (int client_fd, const struct sockaddr *addr,
+                                socklen_t addrlen, const char *ipaddr,
                                 const char *sock_ipaddr)
 {
         struct conn_s *connptr;
         struct buffer_s *cbuffer, *sbuffer;
 
         assert (client_fd >= 0);
+        assert (addrlen <= sizeof (connptr->client_addr));
 
         /*
          * Allocate the memory for all the internal components
@@ -60,6 +62,9 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
 
         connptr->cbuffer = cbuffer;
         connptr->sbuffer = sbuffer;
+        connptr->client_pending = connptr->server_pending = NULL;
+
+        arena_init (&connptr->arena);
 
         connptr->request_line = NULL;
 
@@ -70,23 +75,44 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
 
         connptr->connect_method = FALSE;
         connptr->show_stats = FALSE;
+        connptr->head_method = FALSE;
+        connptr->keep_alive = FALSE;
+        connptr->server_keep_alive = FALSE;
+        connptr->requests = 0;
 
         connptr->protocol.major = connptr->protocol.minor = 0;
 
         /* There is _no_ content length initially */
         connptr->content_length.server = connptr->content_length.client = -1;
+        chunked_stop (&connptr->chunked.server);
+        chunked_stop (&connptr->chunked.client);
 
         connptr->server_ip_addr = (sock_ipaddr ?
-                                   safestrdup (sock_ipaddr) : NULL);
-        connptr->client_ip_addr = safestrdup (ipaddr);
-        connptr->client_string_addr = safestrdup (string_addr);
+                                   arena_strdup (&connptr->arena,
+                                                 sock_ipaddr) : NULL);
+        memset (&connptr->client_addr, 0, sizeof (connptr->client_addr));
+        memcpy (&connptr->client_addr, addr, addrlen);
+        connptr->client_ip_addr = arena_strdup (&connptr->arena, ipaddr);
+        connptr->client_string_addr = NULL;
+        if (!connptr->client_ip_addr) {
+                arena_free (&connptr->arena);
+                safefree (connptr);
+                goto error_exit;
+        }
+
+        /* What comes after this only lasts as long as the request */
+        arena_save (&connptr->arena, &connptr->request_mark);
 
         connptr->upstream_proxy = NULL;
+        connptr->upstream_use.slot = -1;
+        connptr->upstream_use.tried = 0;
+        connptr->generation = config_hold ();
 
         update_stats (STAT_OPEN);
 
 #ifdef REVERSE_SUPPORT
         connptr->reversepath = NULL;
+        connptr->cache = NULL;
 #endif
 
         return connptr;
@@ -103,6 +129,68 @@ error_exit:
         return NULL;
 }
 
+/*
+ * Queue what can't be written to the sockets straight away, for the
+ * caller to write once they are writable.
+ */
+int conn_queue_writes (struct conn_s *connptr)
+{
+        assert (connptr != NULL);
+
+        if (!connptr->client_pending)
+                connptr->client_pending = new_buffer ();
+        if (!connptr->server_pending)
+                connptr->server_pending = new_buffer ();
+
+        return connptr->client_pending && connptr->server_pending ? 0 : -1;
+}
+
+/*
+ * Get the connection ready for the client's next request: the server
+ * connection is closed and everything about the last request is
+ * forgotten.
+ */
+void reset_conn (struct conn_s *connptr)
+{
+        assert (connptr != NULL);
+
+        if (connptr->server_fd != -1) {
+                if (close (connptr->server_fd) < 0)
+                        log_message (LOG_INFO, "Server (%d) close message: %s",
+                                     connptr->server_fd, strerror (errno));
+                connptr->server_fd = -1;
+        }
+
+        connptr->request_line = NULL;
+        connptr->error_variables = NULL;
+        connptr->error_string = NULL;
+        connptr->error_number = -1;
+
+        connptr->connect_method = FALSE;
+        connptr->show_stats = FALSE;
+        connptr->head_method = FALSE;
+        connptr->keep_alive = FALSE;
+        connptr->server_keep_alive = FALSE;
+
+        connptr->protocol.major = connptr->protocol.minor = 0;
+        connptr->content_length.server = connptr->content_length.client = -1;
+        chunked_stop (&connptr->chunked.server);
+        chunked_stop (&connptr->chunked.client);
+
+#ifdef UPSTREAM_SUPPORT
+        upstream_release (&connptr->upstream_use);
+#endif
+        connptr->upstream_proxy = NULL;
+
+#ifdef REVERSE_SUPPORT
+        connptr->reversepath = NULL;
+        cache_done (connptr);
+#endif
+
+        /* Everything the request allocated goes in one go */
+        arena_restore (&connptr->arena, &connptr->request_mark);
+}
+
 void destroy_conn (struct conn_s *connptr)
 {
         assert (connptr != NULL);
@@ -116,32 +204,25 @@ void destroy_conn (struct conn_s *connptr)
                         log_message (LOG_INFO, "Server (%d) close message: %s",
                                      connptr->server_fd, strerror (errno));
 
+#ifdef REVERSE_SUPPORT
+        cache_done (connptr);
+#endif
+
         if (connptr->cbuffer)
                 delete_buffer (connptr->cbuffer);
         if (connptr->sbuffer)
                 delete_buffer (connptr->sbuffer);
+        if (connptr->client_pending)
+                delete_buffer (connptr->client_pending);
+        if (connptr->server_pending)
+                delete_buffer (connptr->server_pending);
 
-        if (connptr->request_line)
-                safefree (connptr->request_line);
-
-        if (connptr->error_variables)
-                hashmap_delete (connptr->error_variables);
-
-        if (connptr->error_string)
-                safefree (connptr->error_string);
-
-        if (connptr->server_ip_addr)
-                safefree (connptr->server_ip_addr);
-        if (connptr->client_ip_addr)
-                safefree (connptr->client_ip_addr);
-        if (connptr->client_string_addr)
-                safefree (connptr->client_string_addr);
-
-#ifdef REVERSE_SUPPORT
-        if (connptr->reversepath)
-                safefree (connptr->reversepath);
+#ifdef UPSTREAM_SUPPORT
+        upstream_release (&connptr->upstream_use);
 #endif
+        config_release (connptr->generation);
 
+        arena_free (&connptr->arena);
         safefree (connptr);
 
         update_stats (STAT_CLOSE);
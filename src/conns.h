@@ -22,7 +22,10 @@
 #define TINYPROXY_CONNS_H
 
 #include "main.h"
-#include "hashmap.h"
+#include "chunked.h"
+#include "header-map.h"
+#include "heap.h"
+#include "upstream.h"
 
 /*
  * Connection Definition
@@ -34,36 +37,75 @@ struct conn_s {
         struct buffer_s *cbuffer;
         struct buffer_s *sbuffer;
 
+        /*
+         * What tinyproxy sends itself (the message heads, error and
+         * statistics pages) that the client or the server socket would
+         * not take yet.  It goes out before what is in the buffers
+         * above.  NULL unless conn_queue_writes() was called, in which
+         * case nothing waits for the sockets to become writable.
+         */
+        struct buffer_s *client_pending;
+        struct buffer_s *server_pending;
+
+        /*
+         * Where the strings and structures hanging off the connection
+         * are allocated.  What was allocated after "request_mark" is
+         * given back when the request is over (see reset_conn().)
+         */
+        struct arena arena;
+        struct arena_mark request_mark;
+
         /* The request line (first line) from the client */
         char *request_line;
 
         /* Booleans */
         unsigned int connect_method;
         unsigned int show_stats;
+        unsigned int head_method;       /* no body follows the response */
+        unsigned int keep_alive;        /* client connection stays open */
+        unsigned int server_keep_alive; /* server connection can be reused */
+
+        /* How many requests have been read from the client */
+        unsigned int requests;
 
         /*
          * This structure stores key -> value mappings for substitution
          * in the error HTML files.
          */
-        hashmap_t error_variables;
+        struct header_map *error_variables;
 
         int error_number;
         char *error_string;
 
-        /* A Content-Length value from the remote server */
+        /*
+         * The bytes of the response body still to come from the server,
+         * and of the request body still to come from the client (-1 if
+         * not known.)  For a chunked body it is as many as are known to
+         * be still to come, and is 0 once its end has been seen.
+         */
         struct {
                 long int server;
                 long int client;
         } content_length;
 
+        /*
+         * Where a chunked response or request body has got to
+         */
+        struct {
+                struct chunked_s server;
+                struct chunked_s client;
+        } chunked;
+
         /*
          * Store the server's IP (for BindSame)
          */
         char *server_ip_addr;
 
         /*
-         * Store the client's IP and hostname information
+         * Store the client's address, and its IP and hostname
+         * information.  The hostname is NULL until it is looked up.
          */
+        struct sockaddr_storage client_addr;
         char *client_ip_addr;
         char *client_string_addr;
 
@@ -80,20 +122,37 @@ struct conn_s {
          * Place to store the current per-connection reverse proxy path
          */
         char *reversepath;
+
+        /*
+         * What the response cache is doing with the current request
+         */
+        struct cache_request *cache;
 #endif
 
         /*
          * Pointer to upstream proxy.
          */
         struct upstream *upstream_proxy;
+        struct upstream_use upstream_use;
+
+        /*
+         * The configuration the current request started under, which
+         * the upstream proxy belongs to.  A reload does not free it
+         * while it is held here.
+         */
+        struct config_generation *generation;
 };
 
 /*
  * Functions for the creation and destruction of a connection structure.
  */
-extern struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
-                                       const char *string_addr,
+extern struct conn_s *initialize_conn (int client_fd,
+                                       const struct sockaddr *addr,
+                                       socklen_t addrlen,
+                                       const char *ipaddr,
                                        const char *sock_ipaddr);
+extern int conn_queue_writes (struct conn_s *connptr);
+extern void reset_conn (struct conn_s *connptr);
 extern void destroy_conn (struct conn_s *connptr);
 
 #endif
@@ -0,0 +1,1750 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A small DNS resolver with a cache of its own.  getaddrinfo() blocks
+ * the worker until the answer comes, and asks again for every request to
+ * a popular host.  Here the A and AAAA queries for a name are sent from
+ * a non-blocking UDP socket of their own, which the event loop waits on
+ * (through an epoll instance of the resolver's) along with its
+ * connections.  The socket is bound to a random port, and the query IDs
+ * are random as well, so that a forged answer can't easily be slipped
+ * into the shared cache (RFC 5452).  The answers are kept for as long as their TTL says,
+ * and so are the names which don't resolve (as in RFC 2308).  The cache
+ * is in shared memory, so all the children (processes or threads) use
+ * the same one.
+ *
+ * Numeric addresses and the names in /etc/hosts are answered right away.
+ * The name servers are the ones in /etc/resolv.conf, unless "DNSServer"
+ * gives others (like a stand-in server for testing).  getaddrinfo() is
+ * still used for what this resolver doesn't handle: when no name server
+ * is known, for names without a dot (which may need the search list),
+ * and when an answer was truncated.  Since it blocks, it is called from
+ * a helper thread, which hands the lookup back to the event loop through
+ * a pipe once it is done.
+ *
+ * The name of a client's address (a PTR query) is looked up the same
+ * way, with getnameinfo() standing in for getaddrinfo(), and kept in a
+ * cache of its own.
+ */
+
+#include "main.h"
+
+#include "dns.h"
+#include "heap.h"
+#include "log.h"
+#include "utils.h"
+#include "conf.h"
+#include "sock.h"
+#include "text.h"
+
+#define DNS_PORT 53
+#define DNS_HEADER_SIZE 12
+#define DNS_PACKET_SIZE 512     /* the most a UDP query may hold */
+#define DNS_MAX_NAME 255
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA   6
+#define DNS_TYPE_PTR   12
+#define DNS_TYPE_AAAA  28
+#define DNS_CLASS_IN   1
+
+#define DNS_RCODE_NOERROR  0
+#define DNS_RCODE_NXDOMAIN 3
+
+/*
+ * How many seconds to wait for an answer before asking the next name
+ * server, and how many times to go through all of them.
+ */
+#define DNS_TIMEOUT  2
+#define DNS_ATTEMPTS 2
+
+/*
+ * The ports a lookup's socket may be bound to, and how many of them are
+ * tried before the system is left to pick one.
+ */
+#define DNS_MIN_PORT      1024
+#define DNS_BIND_ATTEMPTS 8
+
+#define DNS_EVENTS 16           /* taken from epoll at a time */
+
+#define DNS_MAX_SERVERS 3       /* read from resolv.conf */
+#define DNS_MAX_ADDRS   16      /* kept for each name */
+#define DNS_CACHE_SIZE  256
+
+/*
+ * Answers are kept for DNS_MAX_TTL seconds at most.  DNS_DEFAULT_TTL is
+ * for answers which don't say, like those from getaddrinfo().
+ */
+#define DNS_MAX_TTL     3600
+#define DNS_DEFAULT_TTL 30
+
+#define QUERY_A    0
+#define QUERY_AAAA 1
+
+struct dns_addr {
+        int family;
+        unsigned char addr[16];
+};
+
+/*
+ * The addresses of a name, or none if it doesn't resolve.
+ */
+struct dns_entry {
+        char host[DNS_MAX_NAME + 1];
+        time_t expires;
+        unsigned int naddrs;
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+/*
+ * The name of an address, or an empty one if it has none.
+ */
+struct dns_name {
+        struct dns_addr addr;
+        time_t expires;
+        char name[DNS_MAX_NAME + 1];
+};
+
+struct hosts_entry {
+        char *name;
+        struct dns_addr addr;
+};
+
+/*
+ * The cache has a fixed number of slots, chosen by a hash of the name
+ * (or of the address, for the names of addresses.)  A new name pushes
+ * out whatever was in its slot.
+ */
+struct dns_cache {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;
+#endif
+        struct dns_entry entries[DNS_CACHE_SIZE];
+        struct dns_name names[DNS_CACHE_SIZE];
+};
+
+static struct dns_cache *cache;
+
+static struct hosts_entry *hosts;
+static unsigned int nhosts;
+
+static struct sockaddr_storage resolv_servers[DNS_MAX_SERVERS];
+static unsigned int nresolv_servers;
+
+#ifdef HAVE_PTHREAD_H
+#  define CACHE_LOCK()   pthread_mutex_lock (&cache->lock)
+#  define CACHE_UNLOCK() pthread_mutex_unlock (&cache->lock)
+#else
+#  define CACHE_LOCK()
+#  define CACHE_UNLOCK()
+#endif
+
+/*
+ * Someone waiting for a lookup, and the port to put in the addresses.
+ */
+struct dns_waiter {
+        struct dns_waiter *next;
+        void *arg;
+        int port;
+};
+
+/*
+ * A name being looked up.  The A and AAAA queries go to the same name
+ * server at the same time.  When the name of an address is looked up
+ * ("reverse" is set), "entry" holds the address and the name queried
+ * for it, and only the first query is made, for the PTR record.
+ */
+struct dns_lookup {
+        struct dns_lookup *next;
+        struct dns_waiter *waiters;
+        unsigned int reverse:1;
+
+        unsigned char qname[DNS_MAX_NAME + 1];  /* the name in DNS form */
+        size_t qlen;
+
+        uint16_t id[2];
+        unsigned int answered[2];
+        unsigned int failed:1;          /* no usable answer */
+        unsigned int truncated:1;
+        unsigned int fallback:1;        /* left to a helper thread */
+
+#ifdef HAVE_PTHREAD_H
+        pthread_t thread;
+        int done_fd;                    /* where it says it is done */
+#endif
+
+        int fd;                         /* the queries were sent from */
+        struct sockaddr_storage server; /* and to */
+        socklen_t serverlen;
+        unsigned int tries;
+        time_t sent;
+
+        struct dns_entry entry;
+        char name[DNS_MAX_NAME + 1];    /* found for the address */
+        unsigned long int ttl;
+};
+
+struct dns_resolver {
+        int fd;                 /* an epoll instance for the lookups */
+        int notify[2];          /* the helper threads' finished lookups */
+        dns_callback done;
+        dns_name_callback name_done;
+        struct dns_lookup *lookups;
+};
+
+/*
+ * Read an address, given as a string, into a socket address.
+ */
+static int
+parse_address (const char *addr, int port, struct sockaddr_storage *ss)
+{
+        struct addrinfo hints, *res;
+        char portstr[6];
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+        snprintf (portstr, sizeof (portstr), "%d", port);
+
+        if (getaddrinfo (addr, portstr, &hints, &res) != 0)
+                return -1;
+
+        memset (ss, 0, sizeof (*ss));
+        memcpy (ss, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo (res);
+
+        return 0;
+}
+
+/*
+ * Add a name server from the "DNSServer" directive, on the usual port if
+ * "port" is zero.
+ */
+int dns_add_server (const char *addr, int port, vector_t *servers)
+{
+        struct sockaddr_storage ss;
+
+        if (port == 0)
+                port = DNS_PORT;
+
+        if (port < 0 || port > 65535 || parse_address (addr, port, &ss) < 0) {
+                log_message (LOG_WARNING, "Invalid name server address %s",
+                             addr);
+                return -1;
+        }
+
+        if (!*servers) {
+                *servers = vector_create ();
+                if (!*servers)
+                        return -1;
+        }
+
+        return vector_append (*servers, &ss, sizeof (ss));
+}
+
+static unsigned int count_servers (void)
+{
+        if (config.dns_servers && vector_length (config.dns_servers) > 0)
+                return vector_length (config.dns_servers);
+
+        return nresolv_servers;
+}
+
+static struct sockaddr_storage *get_server (unsigned int i)
+{
+        if (config.dns_servers && vector_length (config.dns_servers) > 0)
+                return (struct sockaddr_storage *)
+                    vector_getentry (config.dns_servers, i, NULL);
+
+        return &resolv_servers[i];
+}
+
+static void
+add_address (struct dns_entry *entry, int family, const void *addr)
+{
+        if (entry->naddrs == DNS_MAX_ADDRS)
+                return;
+
+        entry->addrs[entry->naddrs].family = family;
+        memcpy (entry->addrs[entry->naddrs].addr, addr,
+                family == AF_INET ? 4 : 16);
+        entry->naddrs++;
+}
+
+/*
+ * Set up the cache, and read the name servers from /etc/resolv.conf and
+ * the names and addresses from /etc/hosts.  This has to be done before
+ * the children are created.
+ */
+void dns_init (void)
+{
+        char line[1024], *p, *addr, *name;
+        struct dns_entry entry;
+        FILE *f;
+
+        cache = (struct dns_cache *) malloc_shared_memory (sizeof (*cache));
+        if (cache == MAP_FAILED) {
+                log_message (LOG_WARNING,
+                             "Could not create the DNS cache, "
+                             "host names are not cached");
+                cache = NULL;
+        } else {
+                memset (cache, 0, sizeof (*cache));
+
+#ifdef HAVE_PTHREAD_H
+                {
+                        pthread_mutexattr_t attr;
+
+                        pthread_mutexattr_init (&attr);
+                        pthread_mutexattr_setpshared (&attr,
+                                                      PTHREAD_PROCESS_SHARED);
+                        pthread_mutex_init (&cache->lock, &attr);
+                        pthread_mutexattr_destroy (&attr);
+                }
+#endif
+        }
+
+        f = fopen ("/etc/resolv.conf", "r");
+        while (f && fgets (line, sizeof (line), f)
+               && nresolv_servers < DNS_MAX_SERVERS) {
+                p = strtok (line, " \t\r\n");
+                if (!p || strcmp (p, "nameserver") != 0)
+                        continue;
+
+                addr = strtok (NULL, " \t\r\n");
+                if (addr && parse_address (addr, DNS_PORT,
+                                           &resolv_servers[nresolv_servers])
+                    == 0)
+                        nresolv_servers++;
+        }
+        if (f)
+                fclose (f);
+
+        f = fopen ("/etc/hosts", "r");
+        while (f && fgets (line, sizeof (line), f)) {
+                p = strchr (line, '#');
+                if (p)
+                        *p = '\0';
+
+                addr = strtok (line, " \t\r\n");
+                if (!addr)
+                        continue;
+
+                entry.naddrs = 0;
+                memset (&entry.addrs[0], 0, sizeof (entry.addrs[0]));
+                if (inet_pton (AF_INET, addr, entry.addrs[0].addr) > 0)
+                        entry.addrs[0].family = AF_INET;
+                else if (inet_pton (AF_INET6, addr, entry.addrs[0].addr) > 0)
+                        entry.addrs[0].family = AF_INET6;
+                else
+                        continue;
+
+                while ((name = strtok (NULL, " \t\r\n")) != NULL) {
+                        struct hosts_entry *tmp;
+
+                        tmp = (struct hosts_entry *)
+                            saferealloc (hosts, (nhosts + 1) * sizeof (*hosts));
+                        if (!tmp)
+                                break;
+                        hosts = tmp;
+
+                        hosts[nhosts].name = safestrdup (name);
+                        if (!hosts[nhosts].name)
+                                break;
+                        hosts[nhosts].addr = entry.addrs[0];
+                        nhosts++;
+                }
+        }
+        if (f)
+                fclose (f);
+
+        if (nresolv_servers == 0)
+                log_message (LOG_NOTICE,
+                             "No name servers in /etc/resolv.conf, "
+                             "host names are looked up with getaddrinfo()");
+}
+
+static unsigned int cache_slot (const char *host)
+{
+        unsigned int hash = 5381;
+
+        for (; *host; host++)
+                hash = hash * 33 + tolower ((unsigned char) *host);
+
+        return hash % DNS_CACHE_SIZE;
+}
+
+/*
+ * Copy the cached addresses of "host" into "entry".  Returns 0 if the
+ * host is not in the cache (or has expired.)
+ */
+static int cache_find (const char *host, struct dns_entry *entry)
+{
+        struct dns_entry *cached;
+        int found = 0;
+
+        if (!cache)
+                return 0;
+
+        CACHE_LOCK ();
+        cached = &cache->entries[cache_slot (host)];
+        if (strcasecmp (cached->host, host) == 0
+            && cached->expires > get_monotonic_time ()) {
+                entry->naddrs = cached->naddrs;
+                memcpy (entry->addrs, cached->addrs,
+                        cached->naddrs * sizeof (struct dns_addr));
+                found = 1;
+        }
+        CACHE_UNLOCK ();
+
+        return found;
+}
+
+static void
+cache_store (const char *host, const struct dns_entry *entry,
+             unsigned long int ttl)
+{
+        struct dns_entry *cached;
+
+        if (!cache || ttl == 0 || strlen (host) > DNS_MAX_NAME)
+                return;
+
+        CACHE_LOCK ();
+        cached = &cache->entries[cache_slot (host)];
+        strlcpy (cached->host, host, sizeof (cached->host));
+        cached->expires = get_monotonic_time () + min (ttl, DNS_MAX_TTL);
+        cached->naddrs = entry->naddrs;
+        memcpy (cached->addrs, entry->addrs,
+                entry->naddrs * sizeof (struct dns_addr));
+        CACHE_UNLOCK ();
+}
+
+/*
+ * Read the address out of a socket address, with an IPv4 address mapped
+ * into IPv6 as the plain IPv4 address.
+ */
+static int get_address (const struct sockaddr *sa, struct dns_addr *addr)
+{
+        const struct sockaddr_in6 *sin6;
+
+        memset (addr, 0, sizeof (*addr));
+
+        switch (sa->sa_family) {
+        case AF_INET:
+                addr->family = AF_INET;
+                memcpy (addr->addr,
+                        &((const struct sockaddr_in *) sa)->sin_addr, 4);
+                return 0;
+
+        case AF_INET6:
+                sin6 = (const struct sockaddr_in6 *) sa;
+                if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr)) {
+                        addr->family = AF_INET;
+                        memcpy (addr->addr, &sin6->sin6_addr.s6_addr[12], 4);
+                } else {
+                        addr->family = AF_INET6;
+                        memcpy (addr->addr, &sin6->sin6_addr, 16);
+                }
+                return 0;
+
+        default:
+                return -1;
+        }
+}
+
+static unsigned int name_slot (const struct dns_addr *addr)
+{
+        unsigned int hash = 5381, i;
+
+        for (i = 0; i != (addr->family == AF_INET ? 4U : 16U); i++)
+                hash = hash * 33 + addr->addr[i];
+
+        return hash % DNS_CACHE_SIZE;
+}
+
+/*
+ * Copy the cached name of "addr" into "name".  Returns 0 if the address
+ * is not in the cache (or has expired.)
+ */
+static int
+name_cache_find (const struct dns_addr *addr, char *name, size_t size)
+{
+        struct dns_name *cached;
+        int found = 0;
+
+        if (!cache)
+                return 0;
+
+        CACHE_LOCK ();
+        cached = &cache->names[name_slot (addr)];
+        if (memcmp (&cached->addr, addr, sizeof (*addr)) == 0
+            && cached->expires > get_monotonic_time ()) {
+                strlcpy (name, cached->name, size);
+                found = 1;
+        }
+        CACHE_UNLOCK ();
+
+        return found;
+}
+
+static void
+name_cache_store (const struct dns_addr *addr, const char *name,
+                  unsigned long int ttl)
+{
+        struct dns_name *cached;
+
+        if (!cache || ttl == 0)
+                return;
+
+        CACHE_LOCK ();
+        cached = &cache->names[name_slot (addr)];
+        cached->addr = *addr;
+        cached->expires = get_monotonic_time () + min (ttl, DNS_MAX_TTL);
+        strlcpy (cached->name, name, sizeof (cached->name));
+        CACHE_UNLOCK ();
+}
+
+static int hosts_find (const char *host, struct dns_entry *entry)
+{
+        unsigned int i;
+
+        entry->naddrs = 0;
+        for (i = 0; i != nhosts; i++)
+                if (strcasecmp (hosts[i].name, host) == 0)
+                        add_address (entry, hosts[i].addr.family,
+                                     hosts[i].addr.addr);
+
+        return entry->naddrs > 0;
+}
+
+/*
+ * The first name given for the address in /etc/hosts.
+ */
+static int
+hosts_find_name (const struct dns_addr *addr, char *name, size_t size)
+{
+        unsigned int i;
+
+        for (i = 0; i != nhosts; i++) {
+                if (memcmp (&hosts[i].addr, addr, sizeof (*addr)) == 0) {
+                        strlcpy (name, hosts[i].name, size);
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Look the host up with getaddrinfo().
+ */
+static void resolve_fallback (const char *host, struct dns_entry *entry)
+{
+        struct addrinfo hints, *res, *ai;
+        int ret;
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        entry->naddrs = 0;
+
+        ret = getaddrinfo (host, NULL, &hints, &res);
+        if (ret != 0) {
+                /* Only remember that the name doesn't exist */
+                if (ret == EAI_NONAME)
+                        cache_store (host, entry, DNS_DEFAULT_TTL);
+                return;
+        }
+
+        for (ai = res; ai; ai = ai->ai_next) {
+                if (ai->ai_family == AF_INET)
+                        add_address (entry, AF_INET,
+                                     &((struct sockaddr_in *) ai->ai_addr)->
+                                     sin_addr);
+                else if (ai->ai_family == AF_INET6)
+                        add_address (entry, AF_INET6,
+                                     &((struct sockaddr_in6 *) ai->ai_addr)->
+                                     sin6_addr);
+        }
+        freeaddrinfo (res);
+
+        cache_store (host, entry, DNS_DEFAULT_TTL);
+}
+
+/*
+ * Look the name of the address up with getnameinfo().
+ */
+static void
+resolve_name_fallback (const struct dns_addr *addr, char *name, size_t size)
+{
+        struct sockaddr_storage ss;
+        socklen_t sslen;
+
+        memset (&ss, 0, sizeof (ss));
+        if (addr->family == AF_INET) {
+                ((struct sockaddr_in *) &ss)->sin_family = AF_INET;
+                memcpy (&((struct sockaddr_in *) &ss)->sin_addr, addr->addr,
+                        4);
+                sslen = sizeof (struct sockaddr_in);
+        } else {
+                ((struct sockaddr_in6 *) &ss)->sin6_family = AF_INET6;
+                memcpy (&((struct sockaddr_in6 *) &ss)->sin6_addr,
+                        addr->addr, 16);
+                sslen = sizeof (struct sockaddr_in6);
+        }
+
+        if (getnameinfo ((struct sockaddr *) &ss, sslen, name, size,
+                         NULL, 0, NI_NAMEREQD) != 0)
+                name[0] = '\0';
+
+        name_cache_store (addr, name, DNS_DEFAULT_TTL);
+}
+
+/*
+ * Find the addresses without asking a name server, if possible.  Returns
+ * 0 if a lookup is needed.
+ */
+static int resolve_now (const char *host, struct dns_entry *entry)
+{
+        entry->naddrs = 0;
+
+        if (inet_pton (AF_INET, host, entry->addrs[0].addr) > 0) {
+                entry->addrs[0].family = AF_INET;
+                entry->naddrs = 1;
+                return 1;
+        }
+        if (inet_pton (AF_INET6, host, entry->addrs[0].addr) > 0) {
+                entry->addrs[0].family = AF_INET6;
+                entry->naddrs = 1;
+                return 1;
+        }
+
+        if (hosts_find (host, entry) || cache_find (host, entry))
+                return 1;
+
+        return 0;
+}
+
+/*
+ * Whether the host has to be left to getaddrinfo().
+ */
+static int needs_fallback (const char *host)
+{
+        return count_servers () == 0 || !strchr (host, '.');
+}
+
+/*
+ * Find the name of the address without asking a name server, if
+ * possible.  Returns 0 if a lookup is needed.
+ */
+static int
+resolve_name_now (const struct dns_addr *addr, char *name, size_t size)
+{
+        if (hosts_find_name (addr, name, size)
+            || name_cache_find (addr, name, size))
+                return 1;
+
+        return 0;
+}
+
+/*
+ * Turn the addresses into a list for connecting to "port", with the
+ * IPv4 addresses first.
+ */
+static struct addrinfo *make_addrs (const struct dns_entry *entry, int port)
+{
+        struct addrinfo *addrs = NULL, **tail = &addrs, *ai;
+        struct sockaddr_in *sin;
+        struct sockaddr_in6 *sin6;
+        unsigned int i, pass;
+
+        for (pass = 0; pass != 2; pass++) {
+                for (i = 0; i != entry->naddrs; i++) {
+                        if ((entry->addrs[i].family == AF_INET) != (pass == 0))
+                                continue;
+
+                        ai = (struct addrinfo *)
+                            safecalloc (1, sizeof (struct addrinfo)
+                                        + sizeof (struct sockaddr_storage));
+                        if (!ai)
+                                return addrs;
+
+                        ai->ai_family = entry->addrs[i].family;
+                        ai->ai_socktype = SOCK_STREAM;
+                        ai->ai_protocol = IPPROTO_TCP;
+                        ai->ai_addr = (struct sockaddr *) (ai + 1);
+
+                        if (ai->ai_family == AF_INET) {
+                                sin = (struct sockaddr_in *) ai->ai_addr;
+                                sin->sin_family = AF_INET;
+                                sin->sin_port = htons (port);
+                                memcpy (&sin->sin_addr, entry->addrs[i].addr,
+                                        4);
+                                ai->ai_addrlen = sizeof (*sin);
+                        } else {
+                                sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+                                sin6->sin6_family = AF_INET6;
+                                sin6->sin6_port = htons (port);
+                                memcpy (&sin6->sin6_addr,
+                                        entry->addrs[i].addr, 16);
+                                ai->ai_addrlen = sizeof (*sin6);
+                        }
+
+                        *tail = ai;
+                        tail = &ai->ai_next;
+                }
+        }
+
+        return addrs;
+}
+
+/*
+ * Release a list of addresses returned by dns_resolve() or dns_lookup().
+ */
+void dns_free_addrs (struct addrinfo *addrs)
+{
+        struct addrinfo *next;
+
+        for (; addrs; addrs = next) {
+                next = addrs->ai_next;
+                safefree (addrs);
+        }
+}
+
+/*
+ * Fill "buf" with bytes which can't be guessed from the ones seen before.
+ */
+static void random_bytes (void *buf, size_t len)
+{
+#ifdef HAVE_ARC4RANDOM_BUF
+        arc4random_buf (buf, len);
+#else
+        unsigned char *p = (unsigned char *) buf;
+        ssize_t ret;
+        int fd;
+
+#  ifdef HAVE_GETRANDOM
+        while (len > 0) {
+                ret = getrandom (p, len, 0);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                p += ret;
+                len -= ret;
+        }
+        if (len == 0)
+                return;
+#  endif
+
+        fd = open ("/dev/urandom", O_RDONLY);
+        while (fd >= 0 && len > 0) {
+                ret = read (fd, p, len);
+                if (ret <= 0) {
+                        if (ret < 0 && errno == EINTR)
+                                continue;
+                        break;
+                }
+                p += ret;
+                len -= ret;
+        }
+        if (fd >= 0)
+                close (fd);
+
+        if (len > 0) {
+                log_message (LOG_ERR, "Could not read /dev/urandom: %s",
+                             strerror (errno));
+                while (len--)
+                        *p++ = (unsigned char) random ();
+        }
+#endif
+}
+
+static uint16_t random_id (void)
+{
+        uint16_t id;
+
+        random_bytes (&id, sizeof (id));
+        return id;
+}
+
+/*
+ * Write "host" as a sequence of labels.
+ */
+static int encode_name (const char *host, unsigned char *out, size_t *outlen)
+{
+        size_t len = 0, label;
+
+        while (*host) {
+                label = strcspn (host, ".");
+                if (label == 0 || label > 63 || len + label + 2 > DNS_MAX_NAME)
+                        return -1;
+
+                out[len++] = (unsigned char) label;
+                memcpy (out + len, host, label);
+                len += label;
+
+                host += label;
+                if (*host == '.')
+                        host++;
+        }
+
+        if (len == 0)
+                return -1;
+
+        out[len++] = 0;
+        *outlen = len;
+        return 0;
+}
+
+/*
+ * Write the name a PTR record for the address is found under: the bytes
+ * (or, for IPv6, the nibbles) in reverse, under in-addr.arpa or ip6.arpa.
+ */
+static void
+reverse_name (const struct dns_addr *addr, char *host, size_t size)
+{
+        static const char digits[] = "0123456789abcdef";
+        size_t len = 0;
+        int i;
+
+        if (addr->family == AF_INET) {
+                snprintf (host, size, "%u.%u.%u.%u.in-addr.arpa",
+                          addr->addr[3], addr->addr[2], addr->addr[1],
+                          addr->addr[0]);
+                return;
+        }
+
+        for (i = 15; i >= 0 && len + 4 < size; i--) {
+                host[len++] = digits[addr->addr[i] & 0x0f];
+                host[len++] = '.';
+                host[len++] = digits[addr->addr[i] >> 4];
+                host[len++] = '.';
+        }
+        host[len] = '\0';
+        strlcat (host, "ip6.arpa", size);
+}
+
+static uint16_t query_type (const struct dns_lookup *lookup,
+                            unsigned int query)
+{
+        if (lookup->reverse)
+                return DNS_TYPE_PTR;
+
+        return query == QUERY_A ? DNS_TYPE_A : DNS_TYPE_AAAA;
+}
+
+static int
+send_query (struct dns_resolver *resolver, struct dns_lookup *lookup,
+            unsigned int query)
+{
+        unsigned char pkt[DNS_PACKET_SIZE];
+        size_t len = 0;
+        uint16_t type = query_type (lookup, query);
+
+        lookup->id[query] = random_id ();
+
+        memset (pkt, 0, DNS_HEADER_SIZE);
+        pkt[0] = lookup->id[query] >> 8;
+        pkt[1] = lookup->id[query] & 0xff;
+        pkt[2] = 0x01;          /* recursion desired */
+        pkt[5] = 1;             /* one question */
+        len = DNS_HEADER_SIZE;
+
+        memcpy (pkt + len, lookup->qname, lookup->qlen);
+        len += lookup->qlen;
+        pkt[len++] = type >> 8;
+        pkt[len++] = type & 0xff;
+        pkt[len++] = 0;
+        pkt[len++] = DNS_CLASS_IN;
+
+        if (sendto (lookup->fd, pkt, len, 0,
+                    (struct sockaddr *) &lookup->server,
+                    lookup->serverlen) < 0)
+                return -1;
+
+        return 0;
+}
+
+/*
+ * Open a socket for the queries to a server of the family, bound to a
+ * port picked at random, and have the resolver wait on it.
+ */
+static int open_query_socket (struct dns_resolver *resolver, int family)
+{
+        struct sockaddr_storage ss;
+        socklen_t sslen;
+        uint16_t port;
+        unsigned int i;
+        int fd;
+
+#ifdef HAVE_SYS_EPOLL_H
+        struct epoll_event ev;
+#endif
+
+        fd = socket (family, SOCK_DGRAM, 0);
+        if (fd < 0)
+                return -1;
+
+        memset (&ss, 0, sizeof (ss));
+        ss.ss_family = family;
+        sslen = family == AF_INET6 ? sizeof (struct sockaddr_in6)
+            : sizeof (struct sockaddr_in);
+
+        /* If all the ports tried are taken, sendto() picks one */
+        for (i = 0; i != DNS_BIND_ATTEMPTS; i++) {
+                random_bytes (&port, sizeof (port));
+                port = DNS_MIN_PORT + port % (65536 - DNS_MIN_PORT);
+                if (family == AF_INET6)
+                        ((struct sockaddr_in6 *) &ss)->sin6_port =
+                            htons (port);
+                else
+                        ((struct sockaddr_in *) &ss)->sin_port = htons (port);
+
+                if (bind (fd, (struct sockaddr *) &ss, sslen) == 0)
+                        break;
+        }
+
+        socket_nonblocking (fd);
+
+#ifdef HAVE_SYS_EPOLL_H
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl (resolver->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                close (fd);
+                return -1;
+        }
+#endif
+
+        return fd;
+}
+
+static void close_query_socket (struct dns_lookup *lookup)
+{
+        if (lookup->fd >= 0) {
+                close (lookup->fd);
+                lookup->fd = -1;
+        }
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *fallback_thread (void *arg)
+{
+        struct dns_lookup *lookup = (struct dns_lookup *) arg;
+
+        if (lookup->reverse)
+                resolve_name_fallback (&lookup->entry.addrs[0], lookup->name,
+                                       sizeof (lookup->name));
+        else
+                resolve_fallback (lookup->entry.host, &lookup->entry);
+
+        while (write (lookup->done_fd, &lookup, sizeof (lookup)) < 0
+               && errno == EINTR) ;
+
+        return NULL;
+}
+#endif
+
+/*
+ * Have a helper thread look the name up with getaddrinfo() (or the
+ * address with getnameinfo()), which takes as long as the system's
+ * resolver likes.  Its answer is cached there, and the lookup is
+ * finished once the thread is done.  Returns -1 if no thread could be
+ * started.
+ */
+static int
+start_fallback (struct dns_resolver *resolver, struct dns_lookup *lookup)
+{
+#ifdef HAVE_PTHREAD_H
+        sigset_t set, old;
+        int ret;
+
+        close_query_socket (lookup);
+        lookup->fallback = TRUE;
+        lookup->done_fd = resolver->notify[1];
+
+        /* Signals are for the worker */
+        sigfillset (&set);
+        pthread_sigmask (SIG_BLOCK, &set, &old);
+        ret = pthread_create (&lookup->thread, NULL, fallback_thread, lookup);
+        pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+        if (ret == 0)
+                return 0;
+
+        log_message (LOG_WARNING, "Could not start a DNS helper thread: %s",
+                     strerror (ret));
+        lookup->fallback = FALSE;
+#endif
+        return -1;
+}
+
+/*
+ * Send the queries still unanswered to the next name server, from a new
+ * socket.  Returns -1 once all the tries have been used up.
+ */
+static int send_lookup (struct dns_resolver *resolver, struct dns_lookup *lookup)
+{
+        unsigned int nservers = count_servers ();
+        struct sockaddr_storage *server;
+        unsigned int query;
+
+        while (lookup->tries < nservers * DNS_ATTEMPTS) {
+                server = get_server (lookup->tries++ % nservers);
+
+                close_query_socket (lookup);
+                lookup->fd = open_query_socket (resolver, server->ss_family);
+                if (lookup->fd < 0)
+                        continue;
+
+                lookup->server = *server;
+                lookup->serverlen = server->ss_family == AF_INET6
+                    ? sizeof (struct sockaddr_in6)
+                    : sizeof (struct sockaddr_in);
+
+                for (query = 0; query != 2; query++)
+                        if (!lookup->answered[query]
+                            && send_query (resolver, lookup, query) < 0)
+                                break;
+
+                if (query == 2) {
+                        lookup->sent = get_monotonic_time ();
+                        return 0;
+                }
+        }
+
+        close_query_socket (lookup);
+        return -1;
+}
+
+/*
+ * Move past a (possibly compressed) name.
+ */
+static int skip_name (const unsigned char *pkt, size_t len, size_t *pos)
+{
+        size_t p = *pos;
+
+        while (p < len) {
+                if (pkt[p] == 0) {
+                        *pos = p + 1;
+                        return 0;
+                }
+                if ((pkt[p] & 0xc0) == 0xc0) {
+                        if (p + 2 > len)
+                                return -1;
+                        *pos = p + 2;
+                        return 0;
+                }
+                if (pkt[p] & 0xc0)
+                        return -1;
+                p += pkt[p] + 1;
+        }
+
+        return -1;
+}
+
+/*
+ * Read a (possibly compressed) name into dotted form.
+ */
+static int
+read_name (const unsigned char *pkt, size_t len, size_t pos, char *name,
+           size_t size)
+{
+        size_t out = 0, i;
+        unsigned int label, jumps = 0;
+
+        while (pos < len) {
+                label = pkt[pos];
+                if (label == 0) {
+                        if (out == 0)
+                                return -1;
+                        name[out - 1] = '\0';
+                        return 0;
+                }
+
+                if ((label & 0xc0) == 0xc0) {
+                        /* A pointer; a loop of them gives up eventually */
+                        if (pos + 2 > len || ++jumps > 32)
+                                return -1;
+                        pos = ((label & 0x3f) << 8) | pkt[pos + 1];
+                        continue;
+                }
+                if (label & 0xc0 || pos + 1 + label > len
+                    || out + label + 1 >= size)
+                        return -1;
+
+                /* Nothing which could upset a log file or a header */
+                for (i = 0; i != label; i++)
+                        if (!isgraph (pkt[pos + 1 + i])
+                            || pkt[pos + 1 + i] == '.')
+                                return -1;
+
+                memcpy (name + out, pkt + pos + 1, label);
+                out += label;
+                name[out++] = '.';
+                pos += label + 1;
+        }
+
+        return -1;
+}
+
+static unsigned int get16 (const unsigned char *p)
+{
+        return (p[0] << 8) | p[1];
+}
+
+static unsigned long int get32 (const unsigned char *p)
+{
+        return ((unsigned long int) p[0] << 24) | (p[1] << 16)
+            | (p[2] << 8) | p[3];
+}
+
+/*
+ * Take the addresses out of the answer section, and the time a negative
+ * answer may be kept for out of the SOA record in the authority section.
+ */
+static int
+parse_answer (struct dns_lookup *lookup, unsigned int query,
+              const unsigned char *pkt, size_t len)
+{
+        unsigned int nanswers, nauthority, type, rclass, rdlen, i;
+        unsigned int found = 0;
+        unsigned long int ttl, minimum;
+        size_t pos = DNS_HEADER_SIZE + lookup->qlen + 4, rdata;
+
+        nanswers = get16 (pkt + 6);
+        nauthority = get16 (pkt + 8);
+
+        for (i = 0; i != nanswers + nauthority; i++) {
+                if (skip_name (pkt, len, &pos) < 0 || pos + 10 > len)
+                        return -1;
+
+                type = get16 (pkt + pos);
+                rclass = get16 (pkt + pos + 2);
+                ttl = get32 (pkt + pos + 4);
+                rdlen = get16 (pkt + pos + 8);
+                rdata = pos + 10;
+                pos = rdata + rdlen;
+                if (pos > len)
+                        return -1;
+
+                if (rclass != DNS_CLASS_IN)
+                        continue;
+
+                if (i < nanswers) {
+                        if (lookup->reverse) {
+                                if (type == DNS_TYPE_PTR && !found) {
+                                        if (read_name (pkt, len, rdata,
+                                                       lookup->name,
+                                                       sizeof (lookup->name))
+                                            < 0)
+                                                return -1;
+                                        found++;
+                                } else if (type != DNS_TYPE_CNAME) {
+                                        continue;
+                                }
+                        } else if (type == DNS_TYPE_A && rdlen == 4
+                                   && query == QUERY_A) {
+                                add_address (&lookup->entry, AF_INET,
+                                             pkt + rdata);
+                                found++;
+                        } else if (type == DNS_TYPE_AAAA && rdlen == 16
+                                   && query == QUERY_AAAA) {
+                                add_address (&lookup->entry, AF_INET6,
+                                             pkt + rdata);
+                                found++;
+                        } else if (type != DNS_TYPE_CNAME) {
+                                continue;
+                        }
+                        lookup->ttl = min (lookup->ttl, ttl);
+                } else if (type == DNS_TYPE_SOA && !found) {
+                        /* The SOA MINIMUM is the last field */
+                        if (rdlen < 20)
+                                return -1;
+                        minimum = get32 (pkt + rdata + rdlen - 4);
+                        lookup->ttl = min (lookup->ttl, min (ttl, minimum));
+                        found = 1;
+                }
+        }
+
+        /* A negative answer without an SOA record */
+        if (!found)
+                lookup->ttl = min (lookup->ttl, DNS_DEFAULT_TTL);
+
+        return 0;
+}
+
+/*
+ * The lookup is over: remember the answer, and pass it on to everyone
+ * waiting for it.
+ */
+static void
+finish_lookup (struct dns_resolver *resolver, struct dns_lookup *lookup)
+{
+        struct dns_lookup **prev;
+        struct dns_waiter *waiter;
+
+        for (prev = &resolver->lookups; *prev != lookup;
+             prev = &(*prev)->next) ;
+        *prev = lookup->next;
+
+        close_query_socket (lookup);
+
+        if (lookup->reverse) {
+                if (lookup->fallback)
+                        ;       /* cached by the helper thread */
+                else if (lookup->truncated)
+                        resolve_name_fallback (&lookup->entry.addrs[0],
+                                               lookup->name,
+                                               sizeof (lookup->name));
+                else if (!lookup->failed)
+                        name_cache_store (&lookup->entry.addrs[0],
+                                          lookup->name, lookup->ttl);
+
+                while ((waiter = lookup->waiters) != NULL) {
+                        lookup->waiters = waiter->next;
+                        (*resolver->name_done) (waiter->arg,
+                                                lookup->name[0] ?
+                                                lookup->name : NULL);
+                        safefree (waiter);
+                }
+
+                safefree (lookup);
+                return;
+        }
+
+        if (lookup->fallback)
+                ;               /* cached by the helper thread */
+        else if (lookup->truncated)
+                resolve_fallback (lookup->entry.host, &lookup->entry);
+        else if (lookup->entry.naddrs > 0 || !lookup->failed)
+                cache_store (lookup->entry.host, &lookup->entry, lookup->ttl);
+
+        while ((waiter = lookup->waiters) != NULL) {
+                lookup->waiters = waiter->next;
+                (*resolver->done) (waiter->arg,
+                                   make_addrs (&lookup->entry, waiter->port));
+                safefree (waiter);
+        }
+
+        safefree (lookup);
+}
+
+/*
+ * Take in an answer which came on the lookup's socket.  Returns 1 once
+ * no more answers are wanted on it.
+ */
+static int
+handle_answer (struct dns_resolver *resolver, struct dns_lookup *lookup,
+               const unsigned char *pkt, size_t len,
+               const struct sockaddr_storage *from)
+{
+        unsigned int id, query, i, rcode;
+
+        if (len < DNS_HEADER_SIZE)
+                return 0;
+
+        id = get16 (pkt);
+        for (query = 0; query != 2; query++)
+                if (!lookup->answered[query] && lookup->id[query] == id)
+                        break;
+
+        /*
+         * The answer has to come from the server asked, and be for the
+         * question asked.
+         */
+        if (query == 2
+            || !same_sockaddr ((const struct sockaddr *) from,
+                               (const struct sockaddr *) &lookup->server)
+            || !(pkt[2] & 0x80) || get16 (pkt + 4) != 1
+            || len < DNS_HEADER_SIZE + lookup->qlen + 4
+            || get16 (pkt + DNS_HEADER_SIZE + lookup->qlen)
+            != query_type (lookup, query))
+                return 0;
+        for (i = 0; i != lookup->qlen; i++)
+                if (tolower (pkt[DNS_HEADER_SIZE + i])
+                    != tolower (lookup->qname[i]))
+                        return 0;
+
+        rcode = pkt[3] & 0x0f;
+        if (pkt[2] & 0x02) {
+                /* Ask getaddrinfo(), which knows how to use TCP */
+                if (start_fallback (resolver, lookup) == 0)
+                        return 1;
+                lookup->truncated = TRUE;
+        } else if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+                /* Ask the next server, if there is one left */
+                if (send_lookup (resolver, lookup) == 0)
+                        return 0;
+                lookup->failed = TRUE;
+                lookup->answered[0] = lookup->answered[1] = TRUE;
+        } else if (parse_answer (lookup, query, pkt, len) < 0) {
+                lookup->failed = TRUE;
+        }
+
+        lookup->answered[query] = TRUE;
+        if (!lookup->answered[QUERY_A] || !lookup->answered[QUERY_AAAA])
+                return 0;
+
+        finish_lookup (resolver, lookup);
+        return 1;
+}
+
+/*
+ * Read the answers which have arrived on one of the lookups' sockets.
+ */
+static void read_answers (struct dns_resolver *resolver, int fd)
+{
+        unsigned char pkt[DNS_PACKET_SIZE * 2];
+        struct dns_lookup *lookup;
+        struct sockaddr_storage from;
+        socklen_t fromlen;
+        ssize_t len;
+
+        for (lookup = resolver->lookups; lookup; lookup = lookup->next)
+                if (lookup->fd == fd)
+                        break;
+        if (!lookup)
+                return;
+
+        for (;;) {
+                fromlen = sizeof (from);
+                memset (&from, 0, sizeof (from));
+
+                len = recvfrom (fd, pkt, sizeof (pkt), 0,
+                                (struct sockaddr *) &from, &fromlen);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+
+                if (handle_answer (resolver, lookup, pkt, len, &from))
+                        return;
+        }
+}
+
+/*
+ * Finish the lookups which the helper threads are done with.
+ */
+static void read_fallbacks (struct dns_resolver *resolver)
+{
+#ifdef HAVE_PTHREAD_H
+        struct dns_lookup *lookup;
+        ssize_t len;
+
+        for (;;) {
+                len = read (resolver->notify[0], &lookup, sizeof (lookup));
+                if (len != sizeof (lookup)) {
+                        if (len < 0 && errno == EINTR)
+                                continue;
+                        return;
+                }
+
+                pthread_join (lookup->thread, NULL);
+                finish_lookup (resolver, lookup);
+        }
+#endif
+}
+
+/*
+ * Read the answers which have arrived for any of the lookups.
+ */
+void dns_resolver_read (struct dns_resolver *resolver)
+{
+#ifdef HAVE_SYS_EPOLL_H
+        struct epoll_event events[DNS_EVENTS];
+        int n, i;
+
+        while ((n = epoll_wait (resolver->fd, events, DNS_EVENTS, 0)) > 0) {
+                for (i = 0; i != n; i++) {
+                        if (events[i].data.fd == resolver->notify[0])
+                                read_fallbacks (resolver);
+                        else
+                                read_answers (resolver, events[i].data.fd);
+                }
+        }
+#endif
+}
+
+/*
+ * Ask again for the answers which are overdue, or give up on them.
+ */
+void dns_resolver_expire (struct dns_resolver *resolver)
+{
+        struct dns_lookup *lookup, *next;
+        time_t now = get_monotonic_time ();
+
+        for (lookup = resolver->lookups; lookup; lookup = next) {
+                next = lookup->next;
+
+                if (lookup->fallback || now - lookup->sent < DNS_TIMEOUT
+                    || send_lookup (resolver, lookup) == 0)
+                        continue;
+
+                lookup->failed = TRUE;
+                finish_lookup (resolver, lookup);
+        }
+}
+
+/*
+ * Start looking up "host".  Returns 1 if the answer is known already
+ * ("addrs" is set, to NULL if the host doesn't resolve), and 0 if the
+ * callback will be called with it later on.
+ */
+int dns_lookup (struct dns_resolver *resolver, const char *host, int port,
+                void *arg, struct addrinfo **addrs)
+{
+        struct dns_entry entry;
+        struct dns_lookup *lookup;
+        struct dns_waiter *waiter;
+
+        if (resolve_now (host, &entry)) {
+                *addrs = make_addrs (&entry, port);
+                return 1;
+        }
+
+        /* Somebody may be waiting for the same name already */
+        for (lookup = resolver->lookups; lookup; lookup = lookup->next)
+                if (strcasecmp (lookup->entry.host, host) == 0)
+                        break;
+
+        if (!lookup) {
+                lookup = (struct dns_lookup *)
+                    safecalloc (1, sizeof (struct dns_lookup));
+                if (!lookup)
+                        goto fallback;
+
+                lookup->fd = -1;
+                strlcpy (lookup->entry.host, host, sizeof (lookup->entry.host));
+                lookup->ttl = DNS_MAX_TTL;
+
+                if ((needs_fallback (host)
+                     || encode_name (host, lookup->qname, &lookup->qlen) < 0
+                     || send_lookup (resolver, lookup) < 0)
+                    && start_fallback (resolver, lookup) < 0) {
+                        safefree (lookup);
+                        goto fallback;
+                }
+
+                lookup->next = resolver->lookups;
+                resolver->lookups = lookup;
+        }
+
+        waiter = (struct dns_waiter *) safemalloc (sizeof (*waiter));
+        if (!waiter)
+                goto fallback;
+
+        waiter->arg = arg;
+        waiter->port = port;
+        waiter->next = lookup->waiters;
+        lookup->waiters = waiter;
+
+        return 0;
+
+fallback:
+        resolve_fallback (host, &entry);
+        *addrs = make_addrs (&entry, port);
+        return 1;
+}
+
+/*
+ * Start looking up the name of the address "sa".  Returns 1 if the
+ * answer is known already ("name" is set, to an empty string if the
+ * address has no name), and 0 if the resolver's name callback will be
+ * called with it later on.
+ */
+int dns_lookup_name (struct dns_resolver *resolver,
+                     const struct sockaddr *sa, void *arg,
+                     char *name, size_t size)
+{
+        struct dns_addr addr;
+        struct dns_lookup *lookup;
+        struct dns_waiter *waiter;
+        char host[DNS_MAX_NAME + 1];
+
+        name[0] = '\0';
+        if (get_address (sa, &addr) < 0)
+                return 1;
+
+        if (resolve_name_now (&addr, name, size))
+                return 1;
+
+        reverse_name (&addr, host, sizeof (host));
+
+        /* Somebody may be waiting for the same address already */
+        for (lookup = resolver->lookups; lookup; lookup = lookup->next)
+                if (lookup->reverse
+                    && strcasecmp (lookup->entry.host, host) == 0)
+                        break;
+
+        if (!lookup) {
+                lookup = (struct dns_lookup *)
+                    safecalloc (1, sizeof (struct dns_lookup));
+                if (!lookup)
+                        goto fallback;
+
+                lookup->fd = -1;
+                lookup->reverse = TRUE;
+                strlcpy (lookup->entry.host, host, sizeof (lookup->entry.host));
+                lookup->entry.addrs[0] = addr;
+                lookup->ttl = DNS_MAX_TTL;
+
+                /* There is only the PTR query */
+                lookup->answered[QUERY_AAAA] = TRUE;
+
+                if ((count_servers () == 0
+                     || encode_name (host, lookup->qname, &lookup->qlen) < 0
+                     || send_lookup (resolver, lookup) < 0)
+                    && start_fallback (resolver, lookup) < 0) {
+                        safefree (lookup);
+                        goto fallback;
+                }
+
+                lookup->next = resolver->lookups;
+                resolver->lookups = lookup;
+        }
+
+        waiter = (struct dns_waiter *) safecalloc (1, sizeof (*waiter));
+        if (!waiter)
+                goto fallback;
+
+        waiter->arg = arg;
+        waiter->next = lookup->waiters;
+        lookup->waiters = waiter;
+
+        return 0;
+
+fallback:
+        resolve_name_fallback (&addr, name, size);
+        return 1;
+}
+
+/*
+ * Forget about the lookup started for "arg".  The answer is still
+ * cached when it comes.
+ */
+void dns_cancel (struct dns_resolver *resolver, void *arg)
+{
+        struct dns_lookup *lookup;
+        struct dns_waiter **waiter, *tmp;
+
+        for (lookup = resolver->lookups; lookup; lookup = lookup->next) {
+                for (waiter = &lookup->waiters; *waiter;) {
+                        if ((*waiter)->arg != arg) {
+                                waiter = &(*waiter)->next;
+                                continue;
+                        }
+
+                        tmp = *waiter;
+                        *waiter = tmp->next;
+                        safefree (tmp);
+                }
+        }
+}
+
+struct dns_resolver *dns_resolver_create (dns_callback done,
+                                          dns_name_callback name_done)
+{
+#ifdef HAVE_SYS_EPOLL_H
+        struct dns_resolver *resolver;
+        struct epoll_event ev;
+
+        resolver = (struct dns_resolver *) safecalloc (1, sizeof (*resolver));
+        if (!resolver)
+                return NULL;
+
+        resolver->notify[0] = resolver->notify[1] = -1;
+        resolver->fd = epoll_create (DNS_EVENTS);
+        if (resolver->fd < 0 || pipe (resolver->notify) < 0)
+                goto fail;
+
+        socket_nonblocking (resolver->notify[0]);
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = resolver->notify[0];
+        if (epoll_ctl (resolver->fd, EPOLL_CTL_ADD, resolver->notify[0],
+                       &ev) < 0)
+                goto fail;
+
+        resolver->done = done;
+        resolver->name_done = name_done;
+        return resolver;
+
+fail:
+        log_message (LOG_ERR, "Could not create the DNS resolver: %s",
+                     strerror (errno));
+        if (resolver->fd >= 0)
+                close (resolver->fd);
+        if (resolver->notify[0] >= 0) {
+                close (resolver->notify[0]);
+                close (resolver->notify[1]);
+        }
+        safefree (resolver);
+        return NULL;
+#else
+        /* Without epoll, getaddrinfo() is used instead */
+        return NULL;
+#endif
+}
+
+void dns_resolver_free (struct dns_resolver *resolver)
+{
+        struct dns_lookup *lookup;
+        struct dns_waiter *waiter;
+
+        while ((lookup = resolver->lookups) != NULL) {
+                resolver->lookups = lookup->next;
+
+                while ((waiter = lookup->waiters) != NULL) {
+                        lookup->waiters = waiter->next;
+                        safefree (waiter);
+                }
+#ifdef HAVE_PTHREAD_H
+                if (lookup->fallback)
+                        pthread_join (lookup->thread, NULL);
+#endif
+                close_query_socket (lookup);
+                safefree (lookup);
+        }
+
+        close (resolver->fd);
+        close (resolver->notify[0]);
+        close (resolver->notify[1]);
+        safefree (resolver);
+}
+
+int dns_resolver_fd (struct dns_resolver *resolver)
+{
+        return resolver->fd;
+}
+
+struct blocking_lookup {
+        unsigned int done;
+        struct addrinfo *addrs;
+        char *name;
+        size_t size;
+};
+
+static void blocking_done (void *arg, struct addrinfo *addrs)
+{
+        struct blocking_lookup *result = (struct blocking_lookup *) arg;
+
+        result->done = TRUE;
+        result->addrs = addrs;
+}
+
+static void blocking_name_done (void *arg, const char *name)
+{
+        struct blocking_lookup *result = (struct blocking_lookup *) arg;
+
+        result->done = TRUE;
+        if (name)
+                strlcpy (result->name, name, result->size);
+}
+
+/*
+ * Wait for the resolver to finish the lookup for "result".
+ */
+static void
+wait_for_lookup (struct dns_resolver *resolver,
+                 struct blocking_lookup *result)
+{
+        struct pollfd pfd;
+
+        pfd.fd = resolver->fd;
+        pfd.events = POLLIN;
+
+        while (!result->done) {
+                if (poll (&pfd, 1, 1000) > 0)
+                        dns_resolver_read (resolver);
+                if (!result->done)
+                        dns_resolver_expire (resolver);
+        }
+}
+
+/*
+ * Look up the addresses of "host", waiting for the answer.  The list
+ * returned must be released with dns_free_addrs().  NULL is returned if
+ * the host could not be resolved.
+ */
+struct addrinfo *dns_resolve (const char *host, int port)
+{
+        struct dns_resolver *resolver;
+        struct blocking_lookup result;
+        struct dns_entry entry;
+
+        if (resolve_now (host, &entry))
+                return make_addrs (&entry, port);
+
+        resolver = needs_fallback (host) ? NULL
+            : dns_resolver_create (blocking_done, NULL);
+        if (!resolver) {
+                resolve_fallback (host, &entry);
+                return make_addrs (&entry, port);
+        }
+
+        result.done = FALSE;
+        result.addrs = NULL;
+
+        if (dns_lookup (resolver, host, port, &result, &result.addrs) == 0)
+                wait_for_lookup (resolver, &result);
+
+        dns_resolver_free (resolver);
+        return result.addrs;
+}
+
+/*
+ * Look up the name of the address "sa", waiting for the answer.  Returns
+ * -1 (and an empty "name") if it has none.
+ */
+int dns_resolve_name (const struct sockaddr *sa, char *name, size_t size)
+{
+        struct dns_resolver *resolver;
+        struct blocking_lookup result;
+        struct dns_addr addr;
+
+        name[0] = '\0';
+        if (get_address (sa, &addr) < 0)
+                return -1;
+
+        if (!resolve_name_now (&addr, name, size)) {
+                resolver = count_servers () == 0 ? NULL
+                    : dns_resolver_create (NULL, blocking_name_done);
+                if (!resolver) {
+                        resolve_name_fallback (&addr, name, size);
+                } else {
+                        result.done = FALSE;
+                        result.name = name;
+                        result.size = size;
+
+                        if (dns_lookup_name (resolver, sa, &result, name,
+                                             size) == 0)
+                                wait_for_lookup (resolver, &result);
+                        dns_resolver_free (resolver);
+                }
+        }
+
+        return name[0] ? 0 : -1;
+}
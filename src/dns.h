@@ -0,0 +1,62 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'dns.c' for detailed information. */
+
+#ifndef TINYPROXY_DNS_H
+#define TINYPROXY_DNS_H
+
+#include "common.h"
+#include "vector.h"
+
+struct dns_resolver;
+
+/*
+ * Called once a lookup started with dns_lookup() has finished.  "addrs"
+ * (NULL if the host could not be resolved) belongs to the callee, and
+ * must be released with dns_free_addrs().
+ */
+typedef void (*dns_callback) (void *arg, struct addrinfo *addrs);
+
+/*
+ * Called once a lookup started with dns_lookup_name() has finished, with
+ * the name found for the address (NULL if it has none.)
+ */
+typedef void (*dns_name_callback) (void *arg, const char *name);
+
+extern void dns_init (void);
+extern int dns_add_server (const char *addr, int port, vector_t *servers);
+
+extern struct addrinfo *dns_resolve (const char *host, int port);
+extern void dns_free_addrs (struct addrinfo *addrs);
+extern int dns_resolve_name (const struct sockaddr *sa, char *name,
+                             size_t size);
+
+extern struct dns_resolver *dns_resolver_create (dns_callback done,
+                                                 dns_name_callback name_done);
+extern void dns_resolver_free (struct dns_resolver *resolver);
+extern int dns_resolver_fd (struct dns_resolver *resolver);
+extern int dns_lookup (struct dns_resolver *resolver, const char *host,
+                       int port, void *arg, struct addrinfo **addrs);
+extern int dns_lookup_name (struct dns_resolver *resolver,
+                            const struct sockaddr *sa, void *arg,
+                            char *name, size_t size);
+extern void dns_cancel (struct dns_resolver *resolver, void *arg);
+extern void dns_resolver_read (struct dns_resolver *resolver);
+extern void dns_resolver_expire (struct dns_resolver *resolver);
+
+#endif
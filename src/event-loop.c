@@ -0,0 +1,1510 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* An event driven alternative to handling one connection per child.
+ * Each worker runs a single epoll loop which accepts connections and
+ * moves every one of them through the same steps as handle_connection()
+ * (reading the request, connecting to the server, sending the request,
+ * reading the response and relaying the data) as the sockets become
+ * ready, so a handful of workers can serve a large number of clients.
+ */
+
+#include "main.h"
+
+#include "buffer.h"
+#include "cache.h"
+#include "conn-pool.h"
+#include "conns.h"
+#include "dns.h"
+#include "event-loop.h"
+#include "filter.h"
+#include "header-map.h"
+#include "heap.h"
+#include "html-error.h"
+#include "http-head.h"
+#include "log.h"
+#include "reqs.h"
+#include "sock.h"
+#include "stats.h"
+#include "text.h"
+#include "utils.h"
+#include "conf.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/*
+ * Number of events collected from each call to epoll_wait()
+ */
+#define EVENT_BATCH 64
+
+/*
+ * The steps a connection goes through.  They match the order of the
+ * work done in handle_connection().
+ */
+enum event_state {
+        STATE_ACCESS,           /* looking up names for the access list */
+        STATE_REQUEST,          /* reading the request line and headers */
+        STATE_CACHE,            /* waiting for the cache to get the response */
+        STATE_RESOLVE,          /* looking up the server's address */
+        STATE_CONNECT,          /* connecting to the server's addresses */
+        STATE_RESPONSE,         /* reading the response line and headers */
+        STATE_RELAY,            /* relaying data in both directions */
+        STATE_FLUSH,            /* sending the rest of the buffered data */
+        STATE_CLOSED
+};
+
+struct event_conn;
+struct event_loop;
+
+/*
+ * The addresses of a host named in the access list, looked up for a
+ * connection's access check.
+ */
+struct acl_answer {
+        struct acl_answer *next;
+        char *name;
+        struct addrinfo *addrs;
+        unsigned int pending:1;         /* still being looked up */
+};
+
+/*
+ * Connections in order of last activity, least recently active first.
+ */
+struct event_list {
+        struct event_conn *oldest, *newest;
+};
+
+/*
+ * One registered file descriptor.  The epoll data pointer refers to one
+ * of these, so the side of the connection is known for each event.
+ */
+struct event_handle {
+        struct event_conn *conn;        /* NULL for the listening socket */
+        int fd;
+        uint32_t events;                /* events currently asked for */
+};
+
+struct event_conn {
+        struct event_loop *loop;
+        struct conn_s *connptr;
+        enum event_state state;
+
+        struct event_handle client;
+        struct event_handle server;
+
+        /*
+         * The request head, which also holds whatever the client sent
+         * after it, and the response head while it is being read.
+         */
+        struct http_head_s head;
+        struct http_head_s response;
+
+        struct header_map *hashofheaders;
+        struct request_s *request;
+
+        /*
+         * The server's addresses, the next one to try, and the ones
+         * being connected to at the same time (see opensock().)
+         */
+        struct addrinfo *addrs;
+        struct addrinfo *addr;
+        struct event_handle attempts[CONNECT_ATTEMPTS];
+        struct addrinfo *attempt_addrs[CONNECT_ATTEMPTS];
+        double attempt_started[CONNECT_ATTEMPTS];
+        unsigned int nattempts;
+        double next_attempt, connect_deadline;
+        int connect_error;
+
+        /* The access list's host names looked up so far */
+        struct acl_answer *acl_answers;
+
+        unsigned int client_eof:1;
+        unsigned int server_failed:1;
+        unsigned int server_shut:1;
+
+        /* Open connections are kept in order of last activity */
+        time_t last_access;
+        struct event_list *list;
+        struct event_conn *prev, *next;
+};
+
+struct event_loop {
+        int epfd;
+        struct event_handle listener;
+        unsigned int listening;         /* boolean */
+
+        /* Looks up the servers' addresses, on its own socket */
+        struct dns_resolver *resolver;
+        struct event_handle dns;
+
+        unsigned int nconns, maxconns;
+        unsigned int accepted, maxrequests;
+        time_t accept_paused;
+
+        /*
+         * Connections with a request under way, those connecting to
+         * their server (with timeouts of their own), those kept open
+         * while waiting for the client's next request, and those whose
+         * response another worker is fetching into the cache.
+         */
+        struct event_list active, connecting, idle, waiting;
+        double cache_retry;     /* when to look in the cache again */
+
+        /* Closed during the current batch of events, freed after it */
+        struct event_conn *closed;
+
+        time_t now;             /* from get_monotonic_time () */
+        double clock;           /* from get_monotonic_clock () */
+};
+
+static int
+set_interest (struct event_loop *loop, struct event_handle *handle,
+              uint32_t events)
+{
+        struct epoll_event ev;
+
+        if (handle->fd < 0 || handle->events == events)
+                return 0;
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = events;
+        ev.data.ptr = handle;
+
+        if (epoll_ctl (loop->epfd, EPOLL_CTL_MOD, handle->fd, &ev) < 0) {
+                log_message (LOG_ERR,
+                             "event_loop: epoll_ctl() error \"%s\" on "
+                             "file descriptor %d", strerror (errno),
+                             handle->fd);
+                return -1;
+        }
+
+        handle->events = events;
+        return 0;
+}
+
+static int
+add_handle (struct event_loop *loop, struct event_handle *handle, int fd,
+            uint32_t events)
+{
+        struct epoll_event ev;
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = events;
+        ev.data.ptr = handle;
+
+        if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                log_message (LOG_ERR,
+                             "event_loop: epoll_ctl() error \"%s\" on "
+                             "file descriptor %d", strerror (errno), fd);
+                return -1;
+        }
+
+        handle->fd = fd;
+        handle->events = events;
+        return 0;
+}
+
+/*
+ * Start or stop watching the listening socket.  With EPOLLEXCLUSIVE the
+ * registration can't be modified, so it is removed and added again.
+ */
+static void listen_for_clients (struct event_loop *loop, unsigned int on)
+{
+        uint32_t events = EPOLLIN;
+
+        if (loop->listening == on)
+                return;
+
+#ifdef EPOLLEXCLUSIVE
+        events |= EPOLLEXCLUSIVE;
+#endif
+
+        if (on) {
+                if (add_handle (loop, &loop->listener, loop->listener.fd,
+                                events) < 0)
+                        return;
+        } else {
+                epoll_ctl (loop->epfd, EPOLL_CTL_DEL, loop->listener.fd,
+                           NULL);
+        }
+
+        loop->listening = on;
+}
+
+/*
+ * Keep the lists of connections in order of their last activity.
+ */
+static void unlink_conn (struct event_conn *ev)
+{
+        struct event_list *list = ev->list;
+
+        if (!list)
+                return;
+
+        if (ev->prev)
+                ev->prev->next = ev->next;
+        else
+                list->oldest = ev->next;
+
+        if (ev->next)
+                ev->next->prev = ev->prev;
+        else
+                list->newest = ev->prev;
+
+        ev->prev = ev->next = NULL;
+        ev->list = NULL;
+}
+
+static void
+append_conn (struct event_loop *loop, struct event_list *list,
+             struct event_conn *ev)
+{
+        ev->prev = list->newest;
+        ev->next = NULL;
+
+        if (list->newest)
+                list->newest->next = ev;
+        else
+                list->oldest = ev;
+
+        list->newest = ev;
+        ev->list = list;
+        ev->last_access = loop->now;
+}
+
+static void touch_conn (struct event_loop *loop, struct event_conn *ev)
+{
+        if (ev->list == &loop->connecting || ev->list == &loop->waiting
+            || (ev->last_access == loop->now && loop->active.newest == ev))
+                return;
+
+        unlink_conn (ev);
+        append_conn (loop, &loop->active, ev);
+}
+
+/*
+ * Give up on the connections still being attempted.
+ */
+static void close_attempts (struct event_conn *ev)
+{
+        unsigned int i;
+
+        for (i = 0; i != CONNECT_ATTEMPTS; i++) {
+                if (ev->attempts[i].fd < 0)
+                        continue;
+
+                close (ev->attempts[i].fd);
+                ev->attempts[i].fd = -1;
+        }
+        ev->nattempts = 0;
+}
+
+static void free_acl_answers (struct event_conn *ev)
+{
+        struct acl_answer *answer;
+
+        while ((answer = ev->acl_answers) != NULL) {
+                ev->acl_answers = answer->next;
+                dns_free_addrs (answer->addrs);
+                safefree (answer->name);
+                safefree (answer);
+        }
+}
+
+/*
+ * Close the connection.  The structure itself stays around until the
+ * current batch of events has been processed, since later events in
+ * the batch may still refer to it.
+ */
+static void close_conn (struct event_loop *loop, struct event_conn *ev)
+{
+        if (ev->state == STATE_CLOSED)
+                return;
+
+        if ((ev->state == STATE_ACCESS || ev->state == STATE_RESOLVE)
+            && loop->resolver)
+                dns_cancel (loop->resolver, ev);
+
+        unlink_conn (ev);
+        ev->state = STATE_CLOSED;
+        ev->next = loop->closed;
+        loop->closed = ev;
+        loop->nconns--;
+
+        /* Closing the sockets also removes them from the epoll set */
+        ev->client.fd = ev->server.fd = -1;
+        close_attempts (ev);
+
+        free_acl_answers (ev);
+        ev->request = NULL;
+        ev->hashofheaders = NULL;
+        if (ev->addrs) {
+                dns_free_addrs (ev->addrs);
+                ev->addrs = NULL;
+        }
+        http_head_free (&ev->head);
+        http_head_free (&ev->response);
+
+        destroy_conn (ev->connptr);
+        ev->connptr = NULL;
+}
+
+static void free_closed_conns (struct event_loop *loop)
+{
+        struct event_conn *ev;
+
+        while ((ev = loop->closed) != NULL) {
+                loop->closed = ev->next;
+                safefree (ev);
+        }
+}
+
+static void update_interest (struct event_loop *loop,
+                             struct event_conn *ev);
+
+/*
+ * Send the error page (or statistics page) for a connection which could
+ * not be completed, and close it.  Whatever the client won't take
+ * straight away is flushed first, and the server is done with.
+ */
+static void fail_conn (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+
+        handle_connection_failure (connptr);
+        if (buffer_size (connptr->client_pending) == 0) {
+                close_conn (loop, ev);
+                return;
+        }
+
+        if ((ev->state == STATE_ACCESS || ev->state == STATE_RESOLVE)
+            && loop->resolver)
+                dns_cancel (loop->resolver, ev);
+        close_attempts (ev);
+
+        unlink_conn (ev);
+        append_conn (loop, &loop->active, ev);
+
+        connptr->keep_alive = FALSE;
+        ev->server_failed = TRUE;
+        ev->state = STATE_FLUSH;
+        update_interest (loop, ev);
+}
+
+/*
+ * Stop relaying.  Whatever is left in the buffers is written out before
+ * the connection is closed, just like at the end of relay_connection(),
+ * or before the next request is read if the client connection can be
+ * kept open.
+ */
+static void flush_conn (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+
+        if (connptr->content_length.server != 0
+            || connptr->content_length.client > 0
+            || ev->client_eof || ev->server_failed)
+                connptr->keep_alive = FALSE;
+
+        ev->state = STATE_FLUSH;
+}
+
+/*
+ * Start connecting to the next address for the server, if there is one
+ * left and fewer than CONNECT_ATTEMPTS are under way.  Returns -1 once
+ * nothing is being attempted any more.
+ */
+static int connect_next (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        unsigned int i;
+        int fd;
+
+        for (i = 0; i != CONNECT_ATTEMPTS && ev->attempts[i].fd >= 0; i++) ;
+
+        if (i != CONNECT_ATTEMPTS && ev->addr) {
+                fd = opensock_nonblocking (&ev->addr, connptr->server_ip_addr);
+                if (fd < 0) {
+                        ev->connect_error = errno;
+                } else if (add_handle (loop, &ev->attempts[i], fd,
+                                       EPOLLOUT) < 0) {
+                        close (fd);
+                        ev->addr = ev->addr->ai_next;
+                } else {
+                        ev->attempt_addrs[i] = ev->addr;
+                        ev->attempt_started[i] = loop->clock;
+                        ev->addr = ev->addr->ai_next;
+                        ev->nattempts++;
+                        ev->next_attempt = loop->clock + CONNECT_ATTEMPT_DELAY;
+                }
+        }
+
+        return ev->nattempts > 0 ? 0 : -1;
+}
+
+static void server_connected (struct event_loop *loop,
+                              struct event_conn *ev);
+static void start_connect (struct event_loop *loop, struct event_conn *ev);
+static void check_access (struct event_loop *loop, struct event_conn *ev);
+static void acl_looked_up (struct event_conn *ev, struct addrinfo *addrs);
+#ifdef REVERSE_SUPPORT
+static unsigned int look_in_cache (struct event_loop *loop,
+                                   struct event_conn *ev);
+#endif
+
+/*
+ * None of the server's addresses could be connected to.  If the server
+ * is a proxy of an upstream group, start again with another of them.
+ */
+static void connect_failed (struct event_loop *loop, struct event_conn *ev)
+{
+        if (try_next_upstream (ev->connptr, ev->request) == 0) {
+                close_attempts (ev);
+                dns_free_addrs (ev->addrs);
+                ev->addrs = ev->addr = NULL;
+
+                start_connect (loop, ev);
+                update_interest (loop, ev);
+                return;
+        }
+
+        log_message (LOG_ERR,
+                     "opensock: Could not establish a connection to %s",
+                     ev->request->host);
+        indicate_connect_error (ev->connptr, ev->connect_error);
+        fail_conn (loop, ev);
+}
+
+/*
+ * Connect to the addresses found for the server, if there are any.
+ * While connecting the connection is on a list of its own, since it
+ * has a timeout of its own.
+ */
+static void resolved (struct event_loop *loop, struct event_conn *ev)
+{
+        sort_addresses (&ev->addrs);
+        ev->addr = ev->addrs;
+        ev->connect_deadline = loop->clock + config.connecttimeout;
+        ev->connect_error = EHOSTUNREACH;
+
+        ev->state = STATE_CONNECT;
+        unlink_conn (ev);
+        append_conn (loop, &loop->connecting, ev);
+
+        if (connect_next (loop, ev) < 0)
+                connect_failed (loop, ev);
+}
+
+/*
+ * The server's addresses have been looked up.
+ */
+static void lookup_done (void *arg, struct addrinfo *addrs)
+{
+        struct event_conn *ev = (struct event_conn *) arg;
+
+        if (ev->state == STATE_ACCESS) {
+                acl_looked_up (ev, addrs);
+                return;
+        }
+
+        ev->addrs = addrs;
+        if (!addrs)
+                log_message (LOG_ERR, "opensock: Could not retrieve info for %s",
+                             ev->request->host);
+
+        resolved (ev->loop, ev);
+        update_interest (ev->loop, ev);
+}
+
+static void start_connect (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        const char *host;
+        int port;
+
+        if (reuse_server_conn (connptr, ev->request) == 0) {
+                if (add_handle (loop, &ev->server, connptr->server_fd,
+                                0) == 0) {
+                        server_connected (loop, ev);
+                        return;
+                }
+
+                close (connptr->server_fd);
+                connptr->server_fd = -1;
+        }
+
+        host = get_next_hop (connptr, ev->request, &port);
+
+        if (!loop->resolver) {
+                ev->addrs = resolve_host (host, port);
+        } else if (dns_lookup (loop->resolver, host, port, ev,
+                               &ev->addrs) == 0) {
+                ev->state = STATE_RESOLVE;
+                return;
+        } else if (!ev->addrs) {
+                log_message (LOG_ERR, "opensock: Could not retrieve info for %s",
+                             host);
+        }
+
+        resolved (loop, ev);
+}
+
+/*
+ * Read the request from the client and, once all the headers have
+ * arrived, work out where it's going and start connecting there.
+ */
+static void read_request (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        ssize_t ret;
+
+        /* Some of it may have been read along with the last request */
+        ret = http_head_find_end (&ev->head);
+        if (ret == 0) {
+                ret = http_head_read (&ev->head, connptr->client_fd);
+                if (ret == 0)
+                        return;
+
+                /* A kept open connection may simply be closed */
+                if (ret < 0 && connptr->requests > 0 && ev->head.len == 0) {
+                        close_conn (loop, ev);
+                        return;
+                }
+
+                if (ret > 0)
+                        ret = http_head_find_end (&ev->head);
+                if (ret == 0)
+                        return;
+        }
+
+        if (ret < 0) {
+                indicate_request_head_error (connptr, &ev->head);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        connptr->request_line = http_head_start_line (&connptr->arena,
+                                                      &ev->head);
+        if (!connptr->request_line) {
+                fail_conn (loop, ev);
+                return;
+        }
+
+        log_message (LOG_CONN, "Request (file descriptor %d): %s",
+                     connptr->client_fd, connptr->request_line);
+
+        ev->hashofheaders = header_map_create (&connptr->arena);
+        if (ev->hashofheaders == NULL) {
+                update_stats (STAT_BADCONN);
+                indicate_http_error (connptr, 503, "Internal error",
+                                     "detail",
+                                     "An internal server error occurred while processing "
+                                     "your request. Please contact the administrator.",
+                                     NULL);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        if (add_headers_to_connection (ev->hashofheaders, &ev->head) < 0) {
+                log_message (LOG_WARNING,
+                             "Could not retrieve all the headers from the client");
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "Could not retrieve all the headers from "
+                                     "the client.", NULL);
+                update_stats (STAT_BADCONN);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        ev->request = prepare_request (connptr, ev->hashofheaders, &ev->head);
+        if (!ev->request) {
+                fail_conn (loop, ev);
+                return;
+        }
+
+#ifdef REVERSE_SUPPORT
+        if (look_in_cache (loop, ev))
+                return;
+#endif
+
+        start_connect (loop, ev);
+}
+
+#ifdef REVERSE_SUPPORT
+/*
+ * Look for the response in the cache.  If another worker is fetching it
+ * the connection waits on a list of its own, and is looked at again
+ * every CACHE_RETRY_INTERVAL milliseconds.  Returns FALSE if the request
+ * has to go to the server.
+ */
+static unsigned int
+look_in_cache (struct event_loop *loop, struct event_conn *ev)
+{
+        switch (cache_lookup (ev->connptr, ev->request, ev->hashofheaders)) {
+        case CACHE_HIT:
+                unlink_conn (ev);
+                append_conn (loop, &loop->active, ev);
+                flush_conn (loop, ev);
+                return TRUE;
+
+        case CACHE_WAIT:
+                if (ev->list != &loop->waiting) {
+                        ev->state = STATE_CACHE;
+                        unlink_conn (ev);
+                        append_conn (loop, &loop->waiting, ev);
+                }
+                return TRUE;
+
+        default:
+                if (ev->list == &loop->waiting) {
+                        unlink_conn (ev);
+                        append_conn (loop, &loop->active, ev);
+                }
+                return FALSE;
+        }
+}
+
+/*
+ * Look in the cache again for the connections waiting on it.  Returns
+ * how many milliseconds there are until the next look is due.
+ */
+static int retry_cache_waits (struct event_loop *loop)
+{
+        struct event_conn *ev, *next;
+
+        if (!loop->waiting.oldest)
+                return 1000;
+
+        if (loop->clock < loop->cache_retry)
+                return (int) ((loop->cache_retry - loop->clock) * 1000) + 1;
+
+        loop->cache_retry = loop->clock + CACHE_RETRY_INTERVAL / 1000.0;
+
+        for (ev = loop->waiting.oldest; ev; ev = next) {
+                next = ev->next;
+
+                if (!look_in_cache (loop, ev))
+                        start_connect (loop, ev);
+                update_interest (loop, ev);
+        }
+
+        return CACHE_RETRY_INTERVAL;
+}
+#endif
+
+/*
+ * One of the connections being attempted has either been made or failed.
+ * The first one made is used, and the others are dropped (those started
+ * before it count as failed.)
+ */
+static void
+finish_connect (struct event_loop *loop, struct event_conn *ev,
+                struct event_handle *handle)
+{
+        struct conn_s *connptr = ev->connptr;
+        struct epoll_event event;
+        unsigned int i = handle - ev->attempts, j;
+        int err;
+
+        err = socket_error (handle->fd);
+        if (err != 0) {
+                remember_failed_address (ev->attempt_addrs[i]);
+                close (handle->fd);
+                handle->fd = -1;
+                ev->nattempts--;
+                ev->connect_error = err;
+
+                /* Move on to the next address straight away */
+                if (connect_next (loop, ev) < 0)
+                        connect_failed (loop, ev);
+                return;
+        }
+
+        /* The socket's events are for the server side from now on */
+        memset (&event, 0, sizeof (event));
+        event.data.ptr = &ev->server;
+        if (epoll_ctl (loop->epfd, EPOLL_CTL_MOD, handle->fd, &event) < 0) {
+                connect_failed (loop, ev);
+                return;
+        }
+
+        connptr->server_fd = ev->server.fd = handle->fd;
+        ev->server.events = 0;
+        handle->fd = -1;
+
+        for (j = 0; j != CONNECT_ATTEMPTS; j++)
+                if (ev->attempts[j].fd >= 0
+                    && ev->attempt_started[j] < ev->attempt_started[i])
+                        remember_failed_address (ev->attempt_addrs[j]);
+        close_attempts (ev);
+
+        dns_free_addrs (ev->addrs);
+        ev->addrs = ev->addr = NULL;
+
+        server_connected (loop, ev);
+}
+
+/*
+ * Send the request on over the server connection, which is either newly
+ * made or taken from the pool.
+ */
+static void server_connected (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+
+        unlink_conn (ev);
+        append_conn (loop, &loop->active, ev);
+
+        if (send_request (connptr, ev->request, ev->hashofheaders) < 0) {
+                update_stats (STAT_BADCONN);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        if (connptr->connect_method && (connptr->upstream_proxy == NULL)) {
+                if (send_ssl_response (connptr) < 0) {
+                        log_message (LOG_ERR,
+                                     "handle_connection: Could not send SSL greeting "
+                                     "to client.");
+                        update_stats (STAT_BADCONN);
+                        fail_conn (loop, ev);
+                        return;
+                }
+                relay_splice (connptr);
+                ev->state = STATE_RELAY;
+        } else {
+                ev->state = STATE_RESPONSE;
+        }
+}
+
+/*
+ * Read the response line and headers from the server and send them on
+ * to the client.
+ */
+static void read_response (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        ssize_t ret;
+
+        ret = http_head_read (&ev->response, connptr->server_fd);
+        if (ret == 0)
+                return;
+
+        if (ret > 0)
+                ret = http_head_find_end (&ev->response);
+        if (ret == 0)
+                return;
+
+        if (ret < 0) {
+                if (ev->response.parser.state != HTTP_STATE_START)
+                        log_message (LOG_WARNING,
+                                     "Could not retrieve all the headers from the remote server.");
+                update_stats (STAT_BADCONN);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        if (process_response (connptr, &ev->response) < 0) {
+                update_stats (STAT_BADCONN);
+                fail_conn (loop, ev);
+                return;
+        }
+
+        start_response_body (connptr, &ev->response);
+        relay_splice (connptr);
+
+        ev->state = STATE_RELAY;
+        if (connptr->content_length.server == 0)
+                flush_conn (loop, ev);
+}
+
+/*
+ * Write what there is for one side of the connection: first what
+ * tinyproxy queued itself, then the data being relayed.
+ */
+static ssize_t
+write_side (int fd, struct buffer_s *pending, struct buffer_s *buffptr)
+{
+        ssize_t len;
+
+        if (buffer_size (pending) > 0) {
+                len = write_buffer (fd, pending);
+                if (len < 0 || buffer_size (pending) > 0)
+                        return len;
+        }
+
+        return write_buffer (fd, buffptr);
+}
+
+/*
+ * Move data between the client and the server.  This is the same work
+ * relay_connection() does for a single connection.
+ */
+static void
+relay_event (struct event_loop *loop, struct event_conn *ev,
+             struct event_handle *handle, uint32_t events)
+{
+        struct conn_s *connptr = ev->connptr;
+        unsigned int readable, writable;
+        ssize_t bytes_received = 0;
+
+        readable = (handle->events & EPOLLIN)
+            && (events & (EPOLLIN | EPOLLHUP | EPOLLERR));
+        writable = (handle->events & EPOLLOUT)
+            && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+
+        if (handle == &ev->server) {
+                if (readable && ev->state == STATE_RESPONSE) {
+                        read_response (loop, ev);
+                } else if (readable) {
+                        bytes_received = read_response_body (connptr);
+                        if (bytes_received < 0
+                            || connptr->content_length.server == 0)
+                                flush_conn (loop, ev);
+                }
+
+                if (ev->state != STATE_CLOSED && !ev->server_failed
+                    && writable
+                    && write_side (connptr->server_fd,
+                                   connptr->server_pending,
+                                   connptr->cbuffer) < 0) {
+                        ev->server_failed = TRUE;
+                        flush_conn (loop, ev);
+                }
+        } else {
+                if (readable)
+                        bytes_received = read_request_body (connptr);
+
+                /*
+                 * A client which has finished sending may still be
+                 * waiting for the response, so only a failed write to it
+                 * ends the relay.
+                 */
+                if (readable && bytes_received < 0)
+                        ev->client_eof = TRUE;
+
+                if (writable
+                    && write_side (connptr->client_fd,
+                                   connptr->client_pending,
+                                   connptr->sbuffer) < 0) {
+                        close_conn (loop, ev);
+                        return;
+                }
+
+                /* Nothing to read or write, yet the client has gone */
+                if (!readable && !writable && (events & (EPOLLHUP | EPOLLERR))) {
+                        close_conn (loop, ev);
+                        return;
+                }
+        }
+}
+
+/*
+ * Put the server connection in the pool if it can take another request.
+ * It leaves the epoll set first, since the pool may hand it to a
+ * connection on another loop.
+ */
+static void release_server (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+
+        if (ev->server.fd < 0 || !connptr->server_keep_alive
+            || ev->server_failed || connptr->content_length.client > 0
+            || connptr->content_length.server != 0)
+                return;
+
+        epoll_ctl (loop->epfd, EPOLL_CTL_DEL, ev->server.fd, NULL);
+        ev->server.fd = -1;
+        ev->server.events = 0;
+
+        release_server_conn (connptr, ev->request);
+}
+
+/*
+ * The response has been sent in full and the client connection stays
+ * open: forget about the request, and start on the next one.
+ */
+static void next_request (struct event_loop *loop, struct event_conn *ev)
+{
+        /* Both go with the request's part of the arena in reset_conn() */
+        ev->request = NULL;
+        ev->hashofheaders = NULL;
+
+        /* Closing the server socket also removes it from the epoll set */
+        ev->server.fd = -1;
+        ev->server.events = 0;
+        ev->client_eof = ev->server_failed = ev->server_shut = FALSE;
+
+        reset_conn (ev->connptr);
+        http_head_reset (&ev->response, HTTP_PARSE_RESPONSE);
+        http_head_reset (&ev->head, HTTP_PARSE_REQUEST);
+        ev->state = STATE_REQUEST;
+
+        /* The client may have sent the next request already */
+        if (ev->head.len > 0) {
+                read_request (loop, ev);
+        } else {
+                unlink_conn (ev);
+                append_conn (loop, &loop->idle, ev);
+        }
+}
+
+/*
+ * Ask for the events each side of the connection needs next, or finish
+ * off a connection which has nothing left to send.
+ */
+static void update_interest (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        uint32_t client = 0, server = 0;
+
+        switch (ev->state) {
+        case STATE_REQUEST:
+                client = EPOLLIN;
+                break;
+
+        case STATE_ACCESS:
+        case STATE_CACHE:
+        case STATE_RESOLVE:
+        case STATE_CONNECT:
+                break;
+
+        case STATE_RESPONSE:
+        case STATE_RELAY:
+                if (ev->state == STATE_RESPONSE
+                    || !buffer_full (connptr->sbuffer))
+                        server |= EPOLLIN;
+                if (buffer_size (connptr->server_pending) > 0
+                    || buffer_size (connptr->cbuffer) > 0)
+                        server |= EPOLLOUT;
+                if (!ev->client_eof
+                    && !buffer_full (connptr->cbuffer)
+                    && (!connptr->keep_alive
+                        || connptr->content_length.client > 0))
+                        client |= EPOLLIN;
+                if (buffer_size (connptr->client_pending) > 0
+                    || buffer_size (connptr->sbuffer) > 0)
+                        client |= EPOLLOUT;
+
+                /*
+                 * A tunnel passes on the end of what the client sent,
+                 * once it has all gone to the server.
+                 */
+                if (ev->state == STATE_RELAY && ev->client_eof
+                    && !ev->server_shut && connptr->connect_method
+                    && buffer_size (connptr->server_pending) == 0
+                    && buffer_size (connptr->cbuffer) == 0) {
+                        shutdown (connptr->server_fd, SHUT_WR);
+                        ev->server_shut = TRUE;
+                }
+                break;
+
+        case STATE_FLUSH:
+                if ((buffer_size (connptr->server_pending) > 0
+                     || buffer_size (connptr->cbuffer) > 0)
+                    && !ev->server_failed)
+                        server = EPOLLOUT;
+                if (buffer_size (connptr->client_pending) > 0
+                    || buffer_size (connptr->sbuffer) > 0)
+                        client = EPOLLOUT;
+
+                if (client == 0 && server == 0)
+                        release_server (loop, ev);
+
+                if (client == 0 && server == 0 && connptr->keep_alive) {
+                        next_request (loop, ev);
+                        update_interest (loop, ev);
+                        return;
+                }
+
+                if (client == 0 && server == 0) {
+                        shutdown (connptr->client_fd, SHUT_WR);
+                        log_message (LOG_INFO,
+                                     "Closed connection between local client (fd:%d) "
+                                     "and remote client (fd:%d)",
+                                     connptr->client_fd, connptr->server_fd);
+                        close_conn (loop, ev);
+                        return;
+                }
+                break;
+
+        case STATE_CLOSED:
+                return;
+        }
+
+        if (set_interest (loop, &ev->client, client) < 0
+            || set_interest (loop, &ev->server, server) < 0)
+                close_conn (loop, ev);
+}
+
+static void
+handle_event (struct event_loop *loop, struct event_handle *handle,
+              uint32_t events)
+{
+        struct event_conn *ev = handle->conn;
+
+        /* Attempts given up on earlier in the same batch */
+        if (ev->state == STATE_CLOSED || handle->fd < 0)
+                return;
+
+        touch_conn (loop, ev);
+
+        switch (ev->state) {
+        case STATE_REQUEST:
+                read_request (loop, ev);
+                break;
+
+        case STATE_ACCESS:
+        case STATE_CACHE:
+        case STATE_RESOLVE:
+        case STATE_CONNECT:
+                if (handle == &ev->client) {
+                        if (events & (EPOLLHUP | EPOLLERR))
+                                close_conn (loop, ev);
+                } else if (handle != &ev->server) {
+                        finish_connect (loop, ev, handle);
+                }
+                break;
+
+        case STATE_RESPONSE:
+        case STATE_RELAY:
+        case STATE_FLUSH:
+                relay_event (loop, ev, handle, events);
+                break;
+
+        case STATE_CLOSED:
+                break;
+        }
+
+        update_interest (loop, ev);
+}
+
+/*
+ * Find the addresses of a host named in the access list for
+ * check_acl().  They are kept with the connection until its access has
+ * been decided, since the list is gone through again each time a
+ * lookup it waited for has finished.
+ */
+static int acl_lookup (void *arg, const char *name, struct addrinfo **addrs)
+{
+        struct event_conn *ev = (struct event_conn *) arg;
+        struct event_loop *loop = ev->loop;
+        struct acl_answer *answer;
+
+        for (answer = ev->acl_answers; answer; answer = answer->next) {
+                if (strcasecmp (answer->name, name) == 0) {
+                        *addrs = answer->addrs;
+                        return !answer->pending;
+                }
+        }
+
+        *addrs = NULL;
+
+        answer = (struct acl_answer *) safecalloc (1, sizeof (*answer));
+        if (!answer)
+                return 1;
+        answer->name = safestrdup (name);
+        if (!answer->name) {
+                safefree (answer);
+                return 1;
+        }
+        answer->next = ev->acl_answers;
+        ev->acl_answers = answer;
+
+        if (!loop->resolver) {
+                answer->addrs = dns_resolve (name, 0);
+        } else if (dns_lookup (loop->resolver, name, 0, ev,
+                               &answer->addrs) == 0) {
+                answer->pending = TRUE;
+                return 0;
+        }
+
+        *addrs = answer->addrs;
+        return 1;
+}
+
+/*
+ * The addresses of the host named in the access list which the
+ * connection was waiting for have been looked up.
+ */
+static void acl_looked_up (struct event_conn *ev, struct addrinfo *addrs)
+{
+        struct acl_answer *answer;
+
+        for (answer = ev->acl_answers; answer; answer = answer->next) {
+                if (answer->pending) {
+                        answer->pending = FALSE;
+                        answer->addrs = addrs;
+                        break;
+                }
+        }
+        if (!answer)
+                dns_free_addrs (addrs);
+
+        check_access (ev->loop, ev);
+        update_interest (ev->loop, ev);
+}
+
+/*
+ * Check the client against the access control list, first looking up
+ * its host name, or the addresses of the hosts named in the list, if
+ * need be.  The connection waits for the answers which have to be asked
+ * for.
+ */
+static void check_access (struct event_loop *loop, struct event_conn *ev)
+{
+        struct conn_s *connptr = ev->connptr;
+        char name[HOSTNAME_LENGTH];
+        int allowed;
+
+        allowed = check_connection_access (connptr, acl_lookup, ev);
+        if (allowed == -1) {
+                if (!loop->resolver) {
+                        dns_resolve_name ((struct sockaddr *)
+                                          &connptr->client_addr, name,
+                                          sizeof (name));
+                } else if (dns_lookup_name (loop->resolver,
+                                            (struct sockaddr *)
+                                            &connptr->client_addr, ev,
+                                            name, sizeof (name)) == 0) {
+                        ev->state = STATE_ACCESS;
+                        return;
+                }
+
+                set_client_name (connptr, name[0] ? name : NULL);
+                allowed = check_connection_access (connptr, acl_lookup, ev);
+        }
+
+        if (allowed == -2) {
+                ev->state = STATE_ACCESS;
+                return;
+        }
+
+        free_acl_answers (ev);
+
+        if (allowed > 0)
+                ev->state = STATE_REQUEST;
+        else
+                fail_conn (loop, ev);
+}
+
+/*
+ * The client's host name has been looked up.
+ */
+static void client_named (void *arg, const char *name)
+{
+        struct event_conn *ev = (struct event_conn *) arg;
+
+        set_client_name (ev->connptr, name);
+        check_access (ev->loop, ev);
+        update_interest (ev->loop, ev);
+}
+
+/*
+ * Accept as many new connections as are waiting (and allowed).
+ */
+static void accept_clients (struct event_loop *loop)
+{
+        struct event_conn *ev;
+        struct conn_s *connptr;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        unsigned int i;
+        int fd;
+
+        while (loop->nconns < loop->maxconns
+               && (loop->maxrequests == 0
+                   || loop->accepted < loop->maxrequests)) {
+                addrlen = sizeof (addr);
+                fd = accept (loop->listener.fd, (struct sockaddr *) &addr,
+                             &addrlen);
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno == EAGAIN)
+                                break;
+
+                        log_message (LOG_ERR,
+                                     "Accept returned an error (%s) ... retrying.",
+                                     strerror (errno));
+
+                        /* Most likely out of descriptors, so back off */
+                        loop->accept_paused = loop->now;
+                        listen_for_clients (loop, FALSE);
+                        return;
+                }
+
+                loop->accepted++;
+                socket_nonblocking (fd);
+
+                connptr = open_connection (fd, (struct sockaddr *) &addr,
+                                           addrlen);
+                if (!connptr)
+                        continue;
+
+                /* Nothing may wait for a socket to become writable */
+                if (conn_queue_writes (connptr) < 0) {
+                        destroy_conn (connptr);
+                        continue;
+                }
+
+                ev = (struct event_conn *) safecalloc (1, sizeof (*ev));
+                if (!ev) {
+                        destroy_conn (connptr);
+                        continue;
+                }
+
+                ev->loop = loop;
+                ev->connptr = connptr;
+                ev->state = STATE_ACCESS;
+                http_head_init (&ev->head, HTTP_PARSE_REQUEST);
+                http_head_init (&ev->response, HTTP_PARSE_RESPONSE);
+                ev->client.conn = ev->server.conn = ev;
+                ev->server.fd = -1;
+                for (i = 0; i != CONNECT_ATTEMPTS; i++) {
+                        ev->attempts[i].conn = ev;
+                        ev->attempts[i].fd = -1;
+                }
+
+                if (add_handle (loop, &ev->client, fd, 0) < 0) {
+                        destroy_conn (connptr);
+                        safefree (ev);
+                        continue;
+                }
+
+                append_conn (loop, &loop->active, ev);
+                loop->nconns++;
+
+                check_access (loop, ev);
+                update_interest (loop, ev);
+        }
+}
+
+/*
+ * Close the connections which have been idle for too long.
+ */
+static void expire_idle_conns (struct event_loop *loop)
+{
+        struct event_conn *ev;
+        double tdiff;
+
+        conn_pool_expire ();
+
+        while ((ev = loop->idle.oldest) != NULL) {
+                if (difftime (loop->now, ev->last_access)
+                    <= config.keepalivetimeout)
+                        break;
+
+                close_conn (loop, ev);
+        }
+
+        while ((ev = loop->active.oldest) != NULL) {
+                tdiff = difftime (loop->now, ev->last_access);
+                if (tdiff <= config.idletimeout)
+                        break;
+
+                log_message (LOG_INFO, "Idle Timeout as %g > %u.",
+                             tdiff, config.idletimeout);
+
+                switch (ev->state) {
+                case STATE_REQUEST:
+                        update_stats (STAT_BADCONN);
+                        indicate_http_error (ev->connptr, 408, "Timeout",
+                                             "detail",
+                                             "Server timeout waiting for the HTTP request "
+                                             "from the client.", NULL);
+                        fail_conn (loop, ev);
+                        break;
+
+                case STATE_RESOLVE:
+                        indicate_connect_error (ev->connptr, ETIMEDOUT);
+                        fail_conn (loop, ev);
+                        break;
+
+                default:
+                        close_conn (loop, ev);
+                        break;
+                }
+        }
+}
+
+/*
+ * Start on the next address for the connections which have waited long
+ * enough, and fail those which have run out of time.  Returns how many
+ * milliseconds there are until the next of these is due.
+ */
+static int expire_connects (struct event_loop *loop)
+{
+        struct event_conn *ev, *next;
+        double wait = 1;
+        unsigned int i;
+
+        for (ev = loop->connecting.oldest; ev; ev = next) {
+                next = ev->next;
+
+                if (loop->clock >= ev->connect_deadline) {
+                        for (i = 0; i != CONNECT_ATTEMPTS; i++)
+                                if (ev->attempts[i].fd >= 0)
+                                        remember_failed_address
+                                            (ev->attempt_addrs[i]);
+                        ev->connect_error = ETIMEDOUT;
+                        connect_failed (loop, ev);
+                        continue;
+                }
+
+                if (ev->addr && ev->nattempts < CONNECT_ATTEMPTS
+                    && loop->clock >= ev->next_attempt)
+                        connect_next (loop, ev);
+
+                wait = min (wait, ev->connect_deadline - loop->clock);
+                if (ev->addr && ev->nattempts < CONNECT_ATTEMPTS)
+                        wait = min (wait, ev->next_attempt - loop->clock);
+        }
+
+        return (int) (max (wait, 0) * 1000) + 1;
+}
+
+/*
+ * Run the event loop on the listening socket until the program is told
+ * to quit.  At most "maxconns" connections are handled at once, and if
+ * "maxrequests" is not zero, the loop returns once that many connections
+ * have been handled.  A loop running in its own process reloads the
+ * configuration itself on SIGHUP ("reload" is set); with worker threads
+ * that is left to the main thread.
+ */
+void event_loop_run (int listenfd, unsigned int maxconns,
+                     unsigned int maxrequests, unsigned int reload)
+{
+        struct event_loop loop;
+        struct epoll_event events[EVENT_BATCH];
+        struct event_conn *ev;
+        int i, n, timeout = 1000;
+
+        memset (&loop, 0, sizeof (loop));
+        loop.maxconns = maxconns;
+        loop.maxrequests = maxrequests;
+        loop.listener.fd = listenfd;
+        loop.now = get_monotonic_time ();
+        loop.clock = get_monotonic_clock ();
+
+        loop.epfd = epoll_create (EVENT_BATCH);
+        if (loop.epfd < 0) {
+                log_message (LOG_CRIT, "Could not create epoll instance: %s",
+                             strerror (errno));
+                return;
+        }
+
+        socket_nonblocking (listenfd);
+        listen_for_clients (&loop, TRUE);
+
+        /* Without a resolver the lookups simply block */
+        loop.resolver = dns_resolver_create (lookup_done, client_named);
+        if (loop.resolver
+            && add_handle (&loop, &loop.dns,
+                           dns_resolver_fd (loop.resolver), EPOLLIN) < 0) {
+                dns_resolver_free (loop.resolver);
+                loop.resolver = NULL;
+        }
+
+        while (!config.quit) {
+                n = epoll_wait (loop.epfd, events, EVENT_BATCH, timeout);
+                loop.now = get_monotonic_time ();
+                loop.clock = get_monotonic_clock ();
+
+                if (n < 0 && errno != EINTR) {
+                        log_message (LOG_ERR,
+                                     "event_loop: epoll_wait() error \"%s\".",
+                                     strerror (errno));
+                        break;
+                }
+
+                config_read_lock ();
+
+                for (i = 0; i < n; i++) {
+                        struct event_handle *handle =
+                            (struct event_handle *) events[i].data.ptr;
+
+                        if (handle == &loop.listener)
+                                accept_clients (&loop);
+                        else if (handle == &loop.dns)
+                                dns_resolver_read (loop.resolver);
+                        else
+                                handle_event (&loop, handle,
+                                              events[i].events);
+                }
+
+                if (loop.resolver)
+                        dns_resolver_expire (loop.resolver);
+                timeout = expire_connects (&loop);
+#ifdef REVERSE_SUPPORT
+                timeout = min (timeout, retry_cache_waits (&loop));
+#endif
+                expire_idle_conns (&loop);
+                free_closed_conns (&loop);
+
+                config_unlock ();
+
+                if (reload && received_sighup) {
+                        received_sighup = FALSE;
+
+                        /*
+                         * Ignore the return value of reload_config for now.
+                         * This should actually be handled somehow...
+                         */
+                        reload_config ();
+
+#ifdef FILTER_ENABLE
+                        filter_reload ();
+#endif /* FILTER_ENABLE */
+                }
+
+                if (loop.maxrequests != 0
+                    && loop.accepted >= loop.maxrequests) {
+                        listen_for_clients (&loop, FALSE);
+                        if (loop.nconns == 0) {
+                                log_message (LOG_NOTICE,
+                                             "Child has reached MaxRequestsPerChild (%u). "
+                                             "Killing child.", loop.accepted);
+                                break;
+                        }
+                } else if (loop.nconns < loop.maxconns
+                           && difftime (loop.now, loop.accept_paused) >= 1) {
+                        listen_for_clients (&loop, TRUE);
+                } else if (loop.nconns >= loop.maxconns) {
+                        listen_for_clients (&loop, FALSE);
+                }
+        }
+
+        config_read_lock ();
+        while ((ev = loop.active.oldest) != NULL)
+                close_conn (&loop, ev);
+        while ((ev = loop.connecting.oldest) != NULL)
+                close_conn (&loop, ev);
+        while ((ev = loop.idle.oldest) != NULL)
+                close_conn (&loop, ev);
+        while ((ev = loop.waiting.oldest) != NULL)
+                close_conn (&loop, ev);
+        free_closed_conns (&loop);
+        config_unlock ();
+
+        if (loop.resolver)
+                dns_resolver_free (loop.resolver);
+        close (loop.epfd);
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
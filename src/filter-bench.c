@@ -0,0 +1,236 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A microbenchmark for the filter.  It makes up a block list of the
+ * sort found in the wild (plain domains, anchored suffixes and
+ * prefixes, and a few real regular expressions), then checks a mix of
+ * listed and unlisted host names against it, once by running regexec()
+ * for every entry as the filter used to and once with a pattern set
+ * from pattern-set.c, and prints how long a lookup took.  It also times
+ * saving the set and loading it back, as tinyproxy-filter and the
+ * filter do.  All must agree on every host.  It is not built by
+ * default; use "make filter-bench" and run it as
+ *
+ *      ./filter-bench [entries] [iterations]
+ */
+
+#include "common.h"
+
+#include "pattern-set.h"
+
+#define DEFAULT_ENTRIES 50000
+#define DEFAULT_ITERATIONS 200000
+#define HOSTS 64
+
+static double now (void)
+{
+        struct timeval tv;
+
+        gettimeofday (&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void make_entry (char *buf, size_t size, unsigned long i)
+{
+        switch (i % 8) {
+        case 0:
+        case 1:
+        case 2:
+                snprintf (buf, size, "tracker%lu.example.com", i);
+                break;
+        case 3:
+        case 4:
+                snprintf (buf, size, "\\.ads%lu\\.example\\.net$", i);
+                break;
+        case 5:
+                snprintf (buf, size, "^banner%lu\\.", i);
+                break;
+        case 6:
+                snprintf (buf, size, "/pixel%lu\\.gif", i);
+                break;
+        default:
+                if (i % 1000 == 7)
+                        snprintf (buf, size, "^[0-9]*\\.[0-9]*\\.%lu$", i);
+                else
+                        snprintf (buf, size, "ad[0-9]*\\.click%lu\\.", i);
+                break;
+        }
+}
+
+static void make_host (char *buf, size_t size, unsigned long i,
+                       unsigned long entries)
+{
+        unsigned long n = (i * 7919) % entries;
+
+        switch (i % 4) {
+        case 0:
+                snprintf (buf, size, "tracker%lu.example.com", n - n % 8);
+                break;
+        case 1:
+                snprintf (buf, size, "cdn.ads%lu.example.net", n - n % 8 + 3);
+                break;
+        case 2:
+                snprintf (buf, size, "www.site%lu.example.org", n);
+                break;
+        default:
+                snprintf (buf, size, "static%lu.images.example.com", n);
+                break;
+        }
+}
+
+int main (int argc, char **argv)
+{
+        unsigned long entries = DEFAULT_ENTRIES;
+        unsigned long iterations = DEFAULT_ITERATIONS;
+        unsigned long linear_iterations, i, j, hits;
+        int cflags = REG_NEWLINE | REG_NOSUB | REG_ICASE;
+        char hosts[HOSTS][128], buf[128];
+        char expected[HOSTS];
+        struct pattern_set *set, *loaded;
+        struct pattern_set_stats stats;
+        char path[] = "/tmp/filter-bench.XXXXXX";
+        const char *error;
+        int fd;
+        regex_t *list;
+        double start, elapsed;
+
+        if (argc > 1)
+                entries = strtoul (argv[1], NULL, 10);
+        if (argc > 2)
+                iterations = strtoul (argv[2], NULL, 10);
+        if (entries == 0)
+                entries = DEFAULT_ENTRIES;
+        if (iterations == 0)
+                iterations = DEFAULT_ITERATIONS;
+
+        /* The old way gets slow quickly; don't wait for it all day. */
+        linear_iterations = iterations * 50 / entries;
+        if (linear_iterations < HOSTS)
+                linear_iterations = HOSTS;
+
+        list = (regex_t *) malloc (entries * sizeof (regex_t));
+        set = pattern_set_create (cflags);
+        if (!list || !set) {
+                fprintf (stderr, "out of memory\n");
+                return EXIT_FAILURE;
+        }
+
+        start = now ();
+        for (i = 0; i != entries; i++) {
+                make_entry (buf, sizeof (buf), i);
+                if (regcomp (&list[i], buf, cflags) != 0) {
+                        fprintf (stderr, "bad regex: %s\n", buf);
+                        return EXIT_FAILURE;
+                }
+        }
+        printf ("%-12s %10.1f ms to compile %lu entries\n", "regexec",
+                (now () - start) * 1e3, entries);
+
+        start = now ();
+        for (i = 0; i != entries; i++) {
+                make_entry (buf, sizeof (buf), i);
+                if (pattern_set_add (set, buf) < 0) {
+                        fprintf (stderr, "bad regex: %s\n", buf);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (pattern_set_compile (set) < 0) {
+                fprintf (stderr, "could not compile the pattern set\n");
+                return EXIT_FAILURE;
+        }
+        pattern_set_get_stats (set, &stats);
+        printf ("%-12s %10.1f ms to compile %lu entries "
+                "(%u plain, %u shape, %u checked, %u regex)\n",
+                "pattern set", (now () - start) * 1e3, entries,
+                stats.literal, stats.shape, stats.checked, stats.regex);
+
+        fd = mkstemp (path);
+        if (fd < 0 || pattern_set_save (set, path) < 0) {
+                fprintf (stderr, "could not save the pattern set\n");
+                return EXIT_FAILURE;
+        }
+        close (fd);
+
+        start = now ();
+        loaded = pattern_set_load (path, &error);
+        if (!loaded) {
+                fprintf (stderr, "could not load the pattern set: %s\n",
+                         error);
+                return EXIT_FAILURE;
+        }
+        printf ("%-12s %10.1f ms to load\n", "saved set",
+                (now () - start) * 1e3);
+        unlink (path);
+
+        for (i = 0; i != HOSTS; i++)
+                make_host (hosts[i], sizeof (hosts[i]), i, entries);
+
+        hits = 0;
+        start = now ();
+        for (i = 0; i != linear_iterations; i++) {
+                const char *host = hosts[i % HOSTS];
+                int found = FALSE;
+
+                for (j = 0; j != entries; j++) {
+                        if (regexec (&list[j], host, 0, NULL, 0) == 0) {
+                                found = TRUE;
+                                break;
+                        }
+                }
+                if (i < HOSTS)
+                        expected[i] = found;
+                hits += found;
+        }
+        elapsed = now () - start;
+        printf ("%-12s %10.1f ns/lookup  (%lu of %lu found)\n", "regexec",
+                elapsed * 1e9 / linear_iterations, hits, linear_iterations);
+
+        hits = 0;
+        start = now ();
+        for (i = 0; i != iterations; i++)
+                hits += pattern_set_match (set, hosts[i % HOSTS]) ? 1 : 0;
+        elapsed = now () - start;
+        printf ("%-12s %10.1f ns/lookup  (%lu of %lu found)\n",
+                "pattern set", elapsed * 1e9 / iterations, hits,
+                iterations);
+
+        hits = 0;
+        start = now ();
+        for (i = 0; i != iterations; i++)
+                hits += pattern_set_match (loaded, hosts[i % HOSTS]) ? 1 : 0;
+        elapsed = now () - start;
+        printf ("%-12s %10.1f ns/lookup  (%lu of %lu found)\n",
+                "saved set", elapsed * 1e9 / iterations, hits, iterations);
+
+        for (i = 0; i != HOSTS; i++) {
+                if ((pattern_set_match (set, hosts[i]) ? 1 : 0)
+                    != expected[i]
+                    || (pattern_set_match (loaded, hosts[i]) ? 1 : 0)
+                    != expected[i]) {
+                        fprintf (stderr, "disagreement on %s\n", hosts[i]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        pattern_set_free (set);
+        pattern_set_free (loaded);
+        for (i = 0; i != entries; i++)
+                regfree (&list[i]);
+        free (list);
+
+        return EXIT_SUCCESS;
+}
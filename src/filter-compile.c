@@ -0,0 +1,114 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* tinyproxy-filter compiles a filter file into a database which
+ * Tinyproxy maps instead of compiling the file itself, in every worker
+ * process, each time it starts or is sent SIGHUP:
+ *
+ *      tinyproxy-filter [-E] [-c] <filter file> <database>
+ *
+ * The options must match FilterExtended and FilterCaseSensitive in the
+ * configuration.  The database is written next to its old copy and
+ * renamed over it, so a running Tinyproxy never sees half of one.
+ */
+
+#include "common.h"
+
+#include "pattern-set.h"
+
+static void usage (const char *name)
+{
+        fprintf (stderr,
+                 "Usage: %s [-E] [-c] <filter file> <database>\n"
+                 "Compiles a Tinyproxy filter file into a database for the "
+                 "Filter directive.\n"
+                 "  -E  use extended regular expressions "
+                 "(FilterExtended Yes)\n"
+                 "  -c  match case sensitively (FilterCaseSensitive Yes)\n",
+                 name);
+        exit (EXIT_FAILURE);
+}
+
+int main (int argc, char **argv)
+{
+        struct pattern_set *set;
+        struct pattern_set_stats stats;
+        char bad[512];
+        FILE *fd;
+        int cflags = REG_NEWLINE | REG_NOSUB | REG_ICASE;
+        int opt;
+
+        while ((opt = getopt (argc, argv, "Ech")) != EOF) {
+                switch (opt) {
+                case 'E':
+                        cflags |= REG_EXTENDED;
+                        break;
+                case 'c':
+                        cflags &= ~REG_ICASE;
+                        break;
+                default:
+                        usage (argv[0]);
+                }
+        }
+        if (argc - optind != 2)
+                usage (argv[0]);
+
+        fd = fopen (argv[optind], "r");
+        if (!fd) {
+                fprintf (stderr, "%s: %s: %s\n", argv[0], argv[optind],
+                         strerror (errno));
+                return EXIT_FAILURE;
+        }
+
+        set = pattern_set_create (cflags);
+        if (!set) {
+                fprintf (stderr, "%s: Could not allocate memory.\n",
+                         argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (pattern_set_read (set, fd, bad, sizeof (bad)) < 0) {
+                if (*bad)
+                        fprintf (stderr, "%s: Bad regex in %s: %s\n",
+                                 argv[0], argv[optind], bad);
+                else
+                        fprintf (stderr, "%s: Could not read %s\n",
+                                 argv[0], argv[optind]);
+                return EXIT_FAILURE;
+        }
+        fclose (fd);
+
+        if (pattern_set_compile (set) < 0) {
+                fprintf (stderr, "%s: Could not allocate memory.\n",
+                         argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        if (pattern_set_save (set, argv[optind + 1]) < 0) {
+                fprintf (stderr, "%s: %s: %s\n", argv[0], argv[optind + 1],
+                         strerror (errno));
+                return EXIT_FAILURE;
+        }
+
+        pattern_set_get_stats (set, &stats);
+        printf ("%u plain strings, %u compared around their plain part, "
+                "%u checked by regexec(), %u regular expressions\n",
+                stats.literal, stats.shape, stats.checked, stats.regex);
+
+        pattern_set_free (set);
+        return EXIT_SUCCESS;
+}
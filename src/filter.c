@@ -19,7 +19,10 @@
  */
 
 /* A substring of the domain to be filtered goes into the file
- * pointed at by DEFAULT_FILTER.
+ * pointed at by DEFAULT_FILTER.  The expressions are compiled into a
+ * pattern set (see pattern-set.c), so a long list costs little more to
+ * check than a short one.  The file may also be a pattern set compiled
+ * ahead of time by tinyproxy-filter, which is mapped rather than read.
  */
 
 #include "main.h"
@@ -27,108 +30,116 @@
 #include "filter.h"
 #include "heap.h"
 #include "log.h"
+#include "pattern-set.h"
 #include "reqs.h"
 #include "conf.h"
 
 #define FILTER_BUFFER_LEN (512)
 
-static int err;
-
-struct filter_list {
-        struct filter_list *next;
-        char *pat;
-        regex_t *cpat;
-};
-
-static struct filter_list *fl = NULL;
+static struct pattern_set *fl = NULL;
 static int already_init = 0;
 static filter_policy_t default_policy = FILTER_DEFAULT_ALLOW;
 
 /*
- * Initializes a linked list of strings containing hosts/urls to be filtered
+ * Read the filter file, which is either a list of expressions or a
+ * database compiled from one with tinyproxy-filter.  Returns NULL, after
+ * logging why, if it can't be used; "missing" is set if it isn't there.
  */
-void filter_init (void)
+static struct pattern_set *filter_load (int *missing)
 {
-        FILE *fd;
-        struct filter_list *p;
+        struct pattern_set *set;
+        struct pattern_set_stats stats;
         char buf[FILTER_BUFFER_LEN];
-        char *s;
+        const char *error;
+        FILE *fd;
         int cflags;
 
-        if (fl || already_init) {
-                return;
-        }
-
-        fd = fopen (config.filter, "r");
-        if (!fd) {
-                return;
-        }
-
-        p = NULL;
-
         cflags = REG_NEWLINE | REG_NOSUB;
         if (config.filter_extended)
                 cflags |= REG_EXTENDED;
         if (!config.filter_casesensitive)
                 cflags |= REG_ICASE;
 
-        while (fgets (buf, FILTER_BUFFER_LEN, fd)) {
-                /*
-                 * Remove any trailing white space and
-                 * comments.
-                 */
-                s = buf;
-                while (*s) {
-                        if (isspace ((unsigned char) *s))
-                                break;
-                        if (*s == '#') {
-                                /*
-                                 * If the '#' char is preceeded by
-                                 * an escape, it's not a comment
-                                 * string.
-                                 */
-                                if (s == buf || *(s - 1) != '\\')
-                                        break;
-                        }
-                        ++s;
+        *missing = FALSE;
+        fd = fopen (config.filter, "r");
+        if (!fd) {
+                *missing = TRUE;
+                return NULL;
+        }
+
+        if (fread (buf, 1, PATTERN_SET_MAGIC_LEN, fd) == PATTERN_SET_MAGIC_LEN
+            && memcmp (buf, PATTERN_SET_MAGIC, PATTERN_SET_MAGIC_LEN) == 0) {
+                fclose (fd);
+
+                set = pattern_set_load (config.filter, &error);
+                if (!set) {
+                        log_message (LOG_ERR,
+                                     "Could not load the filter database "
+                                     "%s: %s", config.filter, error);
+                        return NULL;
+                }
+                if (pattern_set_get_cflags (set) != cflags) {
+                        log_message (LOG_ERR,
+                                     "The filter database %s was compiled "
+                                     "for other FilterExtended or "
+                                     "FilterCaseSensitive settings",
+                                     config.filter);
+                        pattern_set_free (set);
+                        return NULL;
                 }
-                *s = '\0';
-
-                /* skip leading whitespace */
-                s = buf;
-                while (*s && isspace ((unsigned char) *s))
-                        s++;
-
-                /* skip blank lines and comments */
-                if (*s == '\0')
-                        continue;
-
-                if (!p) /* head of list */
-                        fl = p =
-                            (struct filter_list *)
-                            safecalloc (1, sizeof (struct filter_list));
-                else {  /* next entry */
-                        p->next =
-                            (struct filter_list *)
-                            safecalloc (1, sizeof (struct filter_list));
-                        p = p->next;
+        } else {
+                rewind (fd);
+                *buf = '\0';
+
+                set = pattern_set_create (cflags);
+                if (set && (pattern_set_read (set, fd, buf, sizeof (buf)) < 0
+                            || pattern_set_compile (set) < 0)) {
+                        pattern_set_free (set);
+                        set = NULL;
                 }
+                fclose (fd);
 
-                p->pat = safestrdup (s);
-                p->cpat = (regex_t *) safemalloc (sizeof (regex_t));
-                err = regcomp (p->cpat, p->pat, cflags);
-                if (err != 0) {
-                        fprintf (stderr,
-                                 "Bad regex in %s: %s\n",
-                                 config.filter, p->pat);
-                        exit (0);
+                if (!set) {
+                        if (*buf)
+                                log_message (LOG_ERR, "Bad regex in %s: %s",
+                                             config.filter, buf);
+                        else
+                                log_message (LOG_ERR,
+                                             "Could not read the filter "
+                                             "file %s", config.filter);
+                        return NULL;
                 }
         }
-        if (ferror (fd)) {
-                perror ("fgets");
+
+        pattern_set_get_stats (set, &stats);
+        log_message (LOG_INFO,
+                     "Filter: %u plain strings, %u compared around their "
+                     "plain part, %u checked by regexec() when their plain "
+                     "part is found, %u regular expressions",
+                     stats.literal, stats.shape, stats.checked, stats.regex);
+
+        return set;
+}
+
+/*
+ * Read the filter file for the first time.
+ */
+void filter_init (void)
+{
+        int missing;
+
+        if (fl || already_init) {
+                return;
+        }
+
+        fl = filter_load (&missing);
+        if (!fl) {
+                if (missing)
+                        return;
+                fprintf (stderr, "Could not load the filter file %s\n",
+                         config.filter);
                 exit (0);
         }
-        fclose (fd);
 
         already_init = 1;
 }
@@ -136,52 +147,49 @@ void filter_init (void)
 /* unlink the list */
 void filter_destroy (void)
 {
-        struct filter_list *p, *q;
-
         if (already_init) {
-                for (p = q = fl; p; p = q) {
-                        regfree (p->cpat);
-                        safefree (p->cpat);
-                        safefree (p->pat);
-                        q = p->next;
-                        safefree (p);
-                }
+                pattern_set_free (fl);
                 fl = NULL;
                 already_init = 0;
         }
 }
 
 /**
- * reload the filter file if filtering is enabled
+ * reload the filter file if filtering is enabled.  The old filters are
+ * only let go once the new ones are ready, and kept if they aren't.
  */
 void filter_reload (void)
 {
+        struct pattern_set *set;
+        int missing;
+
         if (config.filter) {
                 log_message (LOG_NOTICE, "Re-reading filter file.");
-                filter_destroy ();
-                filter_init ();
+
+                set = filter_load (&missing);
+                if (!set && !missing) {
+                        log_message (LOG_WARNING,
+                                     "Keeping the filters loaded before.");
+                        return;
+                }
+
+                pattern_set_free (fl);
+                fl = set;
+                already_init = set != NULL;
         }
 }
 
 /* Return 0 to allow, non-zero to block */
 int filter_domain (const char *host)
 {
-        struct filter_list *p;
-        int result;
-
         if (!fl || !already_init)
                 goto COMMON_EXIT;
 
-        for (p = fl; p; p = p->next) {
-                result =
-                    regexec (p->cpat, host, (size_t) 0, (regmatch_t *) 0, 0);
-
-                if (result == 0) {
-                        if (default_policy == FILTER_DEFAULT_ALLOW)
-                                return 1;
-                        else
-                                return 0;
-                }
+        if (pattern_set_match (fl, host)) {
+                if (default_policy == FILTER_DEFAULT_ALLOW)
+                        return 1;
+                else
+                        return 0;
         }
 
 COMMON_EXIT:
@@ -194,22 +202,14 @@ COMMON_EXIT:
 /* returns 0 to allow, non-zero to block */
 int filter_url (const char *url)
 {
-        struct filter_list *p;
-        int result;
-
         if (!fl || !already_init)
                 goto COMMON_EXIT;
 
-        for (p = fl; p; p = p->next) {
-                result =
-                    regexec (p->cpat, url, (size_t) 0, (regmatch_t *) 0, 0);
-
-                if (result == 0) {
-                        if (default_policy == FILTER_DEFAULT_ALLOW)
-                                return 1;
-                        else
-                                return 0;
-                }
+        if (pattern_set_match (fl, url)) {
+                if (default_policy == FILTER_DEFAULT_ALLOW)
+                        return 1;
+                else
+                        return 0;
         }
 
 COMMON_EXIT:
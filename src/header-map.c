@@ -0,0 +1,437 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The header fields of one request or response.  The names and values
+ * are not copied: they point into the head the fields were read into,
+ * which already holds them terminated.  The fields are kept in an array
+ * in the order they arrived, with an open addressing index over it
+ * keyed on a case-insensitive hash of the name.  The fields tinyproxy
+ * asks for itself are recognised when they are added, so those can be
+ * found without hashing anything.  The map, and anything it needs
+ * later, comes from the arena of the request it belongs to and goes
+ * with it.  A typical head fits in the space inside the map.
+ */
+
+#include "main.h"
+
+#include "header-map.h"
+#include "heap.h"
+
+#define INLINE_FIELDS   16
+#define INLINE_SLOTS    32      /* a power of two, twice INLINE_FIELDS */
+
+struct header_field {
+        const char *name;
+        char *value;
+        size_t name_len;
+        uint32_t hash;
+        unsigned char id;
+        unsigned char dead;
+};
+
+struct header_map {
+        struct header_field *fields;
+        size_t nfields, fields_size;
+
+        /*
+         * Each slot holds a field's index plus one, or zero if it is
+         * empty.  Removed fields keep their slots until the index is
+         * rebuilt, so "used" counts those too.
+         */
+        unsigned int *slots;
+        size_t nslots, used;
+
+        /* The first live field with each known name, plus one */
+        unsigned int first[HEADER_KNOWN];
+
+        struct arena *arena;
+
+        struct header_field field_space[INLINE_FIELDS];
+        unsigned int slot_space[INLINE_SLOTS];
+};
+
+/* Indexed by enum header_id */
+static const struct {
+        const char *name;
+        size_t len;
+} known_headers[HEADER_KNOWN] = {
+        { NULL, 0 },
+        { "age", 3 },
+        { "authorization", 13 },
+        { "cache-control", 13 },
+        { "connection", 10 },
+        { "content-length", 14 },
+        { "cookie", 6 },
+        { "date", 4 },
+        { "etag", 4 },
+        { "expires", 7 },
+        { "host", 4 },
+        { "if-modified-since", 17 },
+        { "if-none-match", 13 },
+        { "keep-alive", 10 },
+        { "last-modified", 13 },
+        { "location", 8 },
+        { "pragma", 6 },
+        { "proxy-authenticate", 18 },
+        { "proxy-authorization", 19 },
+        { "proxy-connection", 16 },
+        { "range", 5 },
+        { "set-cookie", 10 },
+        { "te", 2 },
+        { "trailers", 8 },
+        { "transfer-encoding", 17 },
+        { "upgrade", 7 },
+        { "vary", 4 },
+        { "via", 3 }
+};
+
+/*
+ * FNV-1a over the lowercased name.
+ */
+static uint32_t hash_name (const char *name, size_t len)
+{
+        uint32_t hash = 2166136261U;
+
+        while (len--) {
+                hash ^= (unsigned char) tolower ((unsigned char) *name++);
+                hash *= 16777619U;
+        }
+
+        return hash;
+}
+
+static enum header_id find_id (const char *name, size_t len)
+{
+        unsigned int i;
+
+        for (i = 1; i != HEADER_KNOWN; i++) {
+                if (known_headers[i].len == len
+                    && strncasecmp (known_headers[i].name, name, len) == 0)
+                        return (enum header_id) i;
+        }
+
+        return HEADER_OTHER;
+}
+
+struct header_map *header_map_create (struct arena *arena)
+{
+        struct header_map *map;
+
+        map = (struct header_map *)
+            arena_alloc (arena, sizeof (struct header_map));
+        if (!map)
+                return NULL;
+
+        map->fields = map->field_space;
+        map->nfields = 0;
+        map->fields_size = INLINE_FIELDS;
+
+        memset (map->slot_space, 0, sizeof (map->slot_space));
+        map->slots = map->slot_space;
+        map->nslots = INLINE_SLOTS;
+        map->used = 0;
+
+        memset (map->first, 0, sizeof (map->first));
+        map->arena = arena;
+
+        return map;
+}
+
+static void index_field (unsigned int *slots, size_t nslots, uint32_t hash,
+                         unsigned int n)
+{
+        size_t i = hash & (nslots - 1);
+
+        while (slots[i] != 0)
+                i = (i + 1) & (nslots - 1);
+        slots[i] = n;
+}
+
+/*
+ * Make room for one more field, rebuilding the index without the
+ * removed fields (and twice the size, if the live ones need it) once
+ * it gets half full.
+ */
+static int make_room (struct header_map *map)
+{
+        if (map->nfields == map->fields_size) {
+                size_t size = map->fields_size * 2;
+                struct header_field *fields;
+
+                fields = (struct header_field *)
+                    arena_alloc (map->arena,
+                                 size * sizeof (struct header_field));
+                if (!fields)
+                        return -ENOMEM;
+                memcpy (fields, map->fields,
+                        map->nfields * sizeof (struct header_field));
+
+                map->fields = fields;
+                map->fields_size = size;
+        }
+
+        if ((map->used + 1) * 2 > map->nslots) {
+                size_t live = 0, nslots = map->nslots;
+                unsigned int *slots;
+                size_t i;
+
+                for (i = 0; i != map->nfields; i++)
+                        if (!map->fields[i].dead)
+                                live++;
+                while ((live + 1) * 2 > nslots)
+                        nslots *= 2;
+
+                if (nslots == map->nslots) {
+                        slots = map->slots;
+                        memset (slots, 0, nslots * sizeof (unsigned int));
+                } else {
+                        slots = (unsigned int *)
+                            arena_calloc (map->arena, nslots,
+                                          sizeof (unsigned int));
+                        if (!slots)
+                                return -ENOMEM;
+                }
+
+                /* In order, so earlier fields are still found first */
+                for (i = 0; i != map->nfields; i++)
+                        if (!map->fields[i].dead)
+                                index_field (slots, nslots,
+                                             map->fields[i].hash, i + 1);
+
+                map->slots = slots;
+                map->nslots = nslots;
+                map->used = live;
+        }
+
+        return 0;
+}
+
+int header_map_add (struct header_map *map, const char *name,
+                    size_t name_len, char *value)
+{
+        struct header_field *field;
+        enum header_id id;
+        int ret;
+
+        assert (map != NULL);
+        assert (name != NULL && value != NULL);
+
+        ret = make_room (map);
+        if (ret < 0)
+                return ret;
+
+        id = find_id (name, name_len);
+
+        field = &map->fields[map->nfields++];
+        field->name = name;
+        field->value = value;
+        field->name_len = name_len;
+        field->hash = hash_name (name, name_len);
+        field->id = (unsigned char) id;
+        field->dead = FALSE;
+
+        index_field (map->slots, map->nslots, field->hash, map->nfields);
+        map->used++;
+
+        if (id != HEADER_OTHER && map->first[id] == 0)
+                map->first[id] = map->nfields;
+
+        return 0;
+}
+
+int header_map_add_copy (struct header_map *map, const char *name,
+                         const char *value)
+{
+        char *name_copy, *value_copy;
+
+        name_copy = arena_strdup (map->arena, name);
+        value_copy = arena_strdup (map->arena, value);
+        if (!name_copy || !value_copy)
+                return -ENOMEM;
+
+        return header_map_add (map, name_copy, strlen (name_copy),
+                               value_copy);
+}
+
+char *header_map_get_id (struct header_map *map, enum header_id id)
+{
+        assert (map != NULL);
+        assert (id > HEADER_OTHER && id < HEADER_KNOWN);
+
+        if (map->first[id] == 0)
+                return NULL;
+        return map->fields[map->first[id] - 1].value;
+}
+
+char *header_map_get (struct header_map *map, const char *name)
+{
+        size_t len = strlen (name);
+        enum header_id id;
+        uint32_t hash;
+        size_t i;
+
+        assert (map != NULL);
+
+        id = find_id (name, len);
+        if (id != HEADER_OTHER)
+                return header_map_get_id (map, id);
+
+        hash = hash_name (name, len);
+        for (i = hash & (map->nslots - 1); map->slots[i] != 0;
+             i = (i + 1) & (map->nslots - 1)) {
+                struct header_field *field = &map->fields[map->slots[i] - 1];
+
+                if (!field->dead && field->hash == hash
+                    && field->name_len == len
+                    && strncasecmp (field->name, name, len) == 0)
+                        return field->value;
+        }
+
+        return NULL;
+}
+
+unsigned int header_map_count_id (struct header_map *map, enum header_id id)
+{
+        unsigned int count = 0;
+        size_t i;
+
+        assert (map != NULL);
+        assert (id > HEADER_OTHER && id < HEADER_KNOWN);
+
+        if (map->first[id] == 0)
+                return 0;
+
+        for (i = map->first[id] - 1; i != map->nfields; i++) {
+                if (map->fields[i].id == id && !map->fields[i].dead)
+                        count++;
+        }
+
+        return count;
+}
+
+char *header_map_join_id (struct header_map *map, enum header_id id)
+{
+        size_t i, len = 0;
+        char *joined, *p;
+
+        assert (map != NULL);
+        assert (id > HEADER_OTHER && id < HEADER_KNOWN);
+
+        if (map->first[id] == 0)
+                return NULL;
+        if (header_map_count_id (map, id) == 1)
+                return map->fields[map->first[id] - 1].value;
+
+        for (i = map->first[id] - 1; i != map->nfields; i++) {
+                if (map->fields[i].id == id && !map->fields[i].dead)
+                        len += strlen (map->fields[i].value) + 2;
+        }
+
+        joined = (char *) arena_alloc (map->arena, len);
+        if (!joined)
+                return NULL;
+
+        p = joined;
+        for (i = map->first[id] - 1; i != map->nfields; i++) {
+                if (map->fields[i].id != id || map->fields[i].dead)
+                        continue;
+                if (p != joined) {
+                        *p++ = ',';
+                        *p++ = ' ';
+                }
+                len = strlen (map->fields[i].value);
+                memcpy (p, map->fields[i].value, len);
+                p += len;
+        }
+        *p = '\0';
+
+        return joined;
+}
+
+unsigned int header_map_remove_id (struct header_map *map, enum header_id id)
+{
+        unsigned int removed = 0;
+        size_t i;
+
+        assert (map != NULL);
+        assert (id > HEADER_OTHER && id < HEADER_KNOWN);
+
+        if (map->first[id] == 0)
+                return 0;
+
+        for (i = map->first[id] - 1; i != map->nfields; i++) {
+                if (map->fields[i].id == id && !map->fields[i].dead) {
+                        map->fields[i].dead = TRUE;
+                        removed++;
+                }
+        }
+        map->first[id] = 0;
+
+        return removed;
+}
+
+unsigned int header_map_remove (struct header_map *map, const char *name)
+{
+        unsigned int removed = 0;
+        size_t len = strlen (name);
+        enum header_id id;
+        uint32_t hash;
+        size_t i;
+
+        assert (map != NULL);
+
+        id = find_id (name, len);
+        if (id != HEADER_OTHER)
+                return header_map_remove_id (map, id);
+
+        hash = hash_name (name, len);
+        for (i = hash & (map->nslots - 1); map->slots[i] != 0;
+             i = (i + 1) & (map->nslots - 1)) {
+                struct header_field *field = &map->fields[map->slots[i] - 1];
+
+                if (!field->dead && field->hash == hash
+                    && field->name_len == len
+                    && strncasecmp (field->name, name, len) == 0) {
+                        field->dead = TRUE;
+                        removed++;
+                }
+        }
+
+        return removed;
+}
+
+unsigned int header_map_next (struct header_map *map, header_map_iter *iter,
+                              const char **name, char **value)
+{
+        assert (map != NULL);
+        assert (iter != NULL);
+
+        while (*iter < map->nfields) {
+                struct header_field *field = &map->fields[(*iter)++];
+
+                if (field->dead)
+                        continue;
+
+                if (name)
+                        *name = field->name;
+                if (value)
+                        *value = field->value;
+                return TRUE;
+        }
+
+        return FALSE;
+}
@@ -0,0 +1,125 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'header-map.c' for detailed information. */
+
+#ifndef TINYPROXY_HEADER_MAP_H
+#define TINYPROXY_HEADER_MAP_H
+
+#include "common.h"
+#include "heap.h"
+
+/*
+ * The header fields tinyproxy looks at itself.  These can be looked up
+ * by number, without hashing or comparing the name.
+ */
+enum header_id {
+        HEADER_OTHER,
+        HEADER_AGE,
+        HEADER_AUTHORIZATION,
+        HEADER_CACHE_CONTROL,
+        HEADER_CONNECTION,
+        HEADER_CONTENT_LENGTH,
+        HEADER_COOKIE,
+        HEADER_DATE,
+        HEADER_ETAG,
+        HEADER_EXPIRES,
+        HEADER_HOST,
+        HEADER_IF_MODIFIED_SINCE,
+        HEADER_IF_NONE_MATCH,
+        HEADER_KEEP_ALIVE,
+        HEADER_LAST_MODIFIED,
+        HEADER_LOCATION,
+        HEADER_PRAGMA,
+        HEADER_PROXY_AUTHENTICATE,
+        HEADER_PROXY_AUTHORIZATION,
+        HEADER_PROXY_CONNECTION,
+        HEADER_RANGE,
+        HEADER_SET_COOKIE,
+        HEADER_TE,
+        HEADER_TRAILERS,
+        HEADER_TRANSFER_ENCODING,
+        HEADER_UPGRADE,
+        HEADER_VARY,
+        HEADER_VIA,
+        HEADER_KNOWN            /* how many there are */
+};
+
+struct header_map;
+
+/* Where header_map_next() has got to; start it at zero */
+typedef size_t header_map_iter;
+
+/*
+ * The map is allocated from the arena, and is gone once the arena gives
+ * back what it holds.
+ */
+extern struct header_map *header_map_create (struct arena *arena);
+
+/*
+ * Add a field whose name and value stay where they are (in the head
+ * they were read into) for as long as the map is used.  Both have to be
+ * terminated.  header_map_add_copy() copies them into the arena instead.
+ *
+ * Returns: negative on error
+ *          0 upon success
+ */
+extern int header_map_add (struct header_map *map, const char *name,
+                           size_t name_len, char *value);
+extern int header_map_add_copy (struct header_map *map, const char *name,
+                                const char *value);
+
+/*
+ * The value of the first field with the name, or NULL if there is none.
+ */
+extern char *header_map_get (struct header_map *map, const char *name);
+extern char *header_map_get_id (struct header_map *map, enum header_id id);
+
+/*
+ * How many fields there are with the name.
+ */
+extern unsigned int header_map_count_id (struct header_map *map,
+                                         enum header_id id);
+
+/*
+ * The values of all the fields with the name, joined with commas the
+ * way a list sent over several fields is read (RFC 7230, 3.2.2), or NULL
+ * if there are none (or no memory for the joined value.)
+ */
+extern char *header_map_join_id (struct header_map *map, enum header_id id);
+
+/*
+ * Remove all the fields with the name.
+ *
+ * Returns: the number removed
+ */
+extern unsigned int header_map_remove (struct header_map *map,
+                                       const char *name);
+extern unsigned int header_map_remove_id (struct header_map *map,
+                                          enum header_id id);
+
+/*
+ * Go through the fields in the order they were added.  Fields removed
+ * along the way are skipped.
+ *
+ * Returns: FALSE once there are no more
+ */
+extern unsigned int header_map_next (struct header_map *map,
+                                     header_map_iter *iter,
+                                     const char **name, char **value);
+
+#endif
@@ -97,6 +97,178 @@ char *debugging_strdup (const char *s, const char *file, unsigned long line)
 
 #endif /* !NDEBUG */
 
+#define ARENA_BLOCK_SIZE 4096
+
+/* Everything handed out is aligned for the strictest of these */
+union arena_align {
+        long l;
+        double d;
+        void *p;
+};
+
+#define ARENA_ALIGN(n) \
+        (((n) + sizeof (union arena_align) - 1) \
+         & ~(sizeof (union arena_align) - 1))
+
+struct arena_block {
+        struct arena_block *next;
+        union arena_align data[1];
+};
+
+void arena_init (struct arena *arena)
+{
+        arena->blocks = NULL;
+        arena->next = arena->end = NULL;
+}
+
+/*
+ * Take "size" bytes from the newest block, starting another if they
+ * don't fit.  What was left of the old one is not used again.
+ */
+static void *arena_take (struct arena *arena, size_t size)
+{
+        struct arena_block *block;
+        size_t space;
+        void *ptr;
+
+        assert (arena != NULL);
+        assert (size > 0);
+
+        size = ARENA_ALIGN (size);
+        if ((size_t) (arena->end - arena->next) < size) {
+                space = max (size, ARENA_BLOCK_SIZE
+                             - offsetof (struct arena_block, data));
+
+                block = (struct arena_block *)
+                    safemalloc (offsetof (struct arena_block, data) + space);
+                if (!block)
+                        return NULL;
+
+                block->next = arena->blocks;
+                arena->blocks = block;
+                arena->next = (char *) block->data;
+                arena->end = arena->next + space;
+        }
+
+        ptr = arena->next;
+        arena->next += size;
+        return ptr;
+}
+
+#ifndef NDEBUG
+
+void *debugging_arena_alloc (struct arena *arena, size_t size,
+                             const char *file, unsigned long line)
+{
+        void *ptr;
+
+        ptr = arena_take (arena, size);
+        fprintf (stderr, "{arena_alloc: %p:%lu in %p} %s:%lu\n", ptr,
+                 (unsigned long) size, (void *) arena, file, line);
+        return ptr;
+}
+
+void *debugging_arena_calloc (struct arena *arena, size_t nmemb, size_t size,
+                              const char *file, unsigned long line)
+{
+        void *ptr;
+
+        assert (nmemb > 0);
+
+        ptr = arena_take (arena, nmemb * size);
+        if (ptr)
+                memset (ptr, 0, nmemb * size);
+        fprintf (stderr, "{arena_calloc: %p:%lu x %lu in %p} %s:%lu\n", ptr,
+                 (unsigned long) nmemb, (unsigned long) size, (void *) arena,
+                 file, line);
+        return ptr;
+}
+
+char *debugging_arena_strdup (struct arena *arena, const char *s,
+                              const char *file, unsigned long line)
+{
+        char *ptr;
+        size_t len;
+
+        assert (s != NULL);
+
+        len = strlen (s) + 1;
+        ptr = (char *) arena_take (arena, len);
+        if (!ptr)
+                return NULL;
+        memcpy (ptr, s, len);
+
+        fprintf (stderr, "{arena_strdup: %p:%lu in %p} %s:%lu\n", ptr,
+                 (unsigned long) len, (void *) arena, file, line);
+        return ptr;
+}
+
+#else
+
+void *arena_alloc (struct arena *arena, size_t size)
+{
+        return arena_take (arena, size);
+}
+
+void *arena_calloc (struct arena *arena, size_t nmemb, size_t size)
+{
+        void *ptr;
+
+        ptr = arena_take (arena, nmemb * size);
+        if (ptr)
+                memset (ptr, 0, nmemb * size);
+        return ptr;
+}
+
+char *arena_strdup (struct arena *arena, const char *s)
+{
+        size_t len = strlen (s) + 1;
+        char *ptr;
+
+        ptr = (char *) arena_take (arena, len);
+        if (ptr)
+                memcpy (ptr, s, len);
+        return ptr;
+}
+
+#endif /* !NDEBUG */
+
+void arena_save (struct arena *arena, struct arena_mark *mark)
+{
+        mark->blocks = arena->blocks;
+        mark->next = arena->next;
+        mark->end = arena->end;
+}
+
+/*
+ * Give back everything allocated since the mark was saved.  Only the
+ * blocks started since then are freed, which is usually none.
+ */
+void arena_restore (struct arena *arena, const struct arena_mark *mark)
+{
+        struct arena_block *block;
+
+        while (arena->blocks != mark->blocks) {
+                block = arena->blocks;
+                arena->blocks = block->next;
+                safefree (block);
+        }
+
+        arena->next = mark->next;
+        arena->end = mark->end;
+
+#ifndef NDEBUG
+        fprintf (stderr, "{arena_restore: %p}\n", (void *) arena);
+#endif
+}
+
+void arena_free (struct arena *arena)
+{
+        struct arena_mark empty = { NULL, NULL, NULL };
+
+        arena_restore (arena, &empty);
+}
+
 /*
  * Allocate a block of memory in the "shared" memory region.
  *
@@ -52,6 +52,53 @@ extern char *debugging_strdup (const char *s, const char *file,
 
 #endif
 
+/*
+ * An arena hands out memory from blocks it gets with safemalloc(), and
+ * gives it all back at once.  Nothing is freed on its own.  Everything
+ * allocated after arena_save() goes when arena_restore() is given what
+ * it saved; the block in use at the time is kept for what comes next.
+ */
+struct arena_block;
+
+struct arena {
+        struct arena_block *blocks;     /* the newest first */
+        char *next, *end;               /* what is left of the newest */
+};
+
+struct arena_mark {
+        struct arena_block *blocks;
+        char *next, *end;
+};
+
+#ifndef NDEBUG
+
+extern void *debugging_arena_alloc (struct arena *arena, size_t size,
+                                    const char *file, unsigned long line);
+extern void *debugging_arena_calloc (struct arena *arena, size_t nmemb,
+                                     size_t size, const char *file,
+                                     unsigned long line);
+extern char *debugging_arena_strdup (struct arena *arena, const char *s,
+                                     const char *file, unsigned long line);
+
+#  define arena_alloc(a, x) debugging_arena_alloc(a, x, __FILE__, __LINE__)
+#  define arena_calloc(a, x, y) \
+        debugging_arena_calloc(a, x, y, __FILE__, __LINE__)
+#  define arena_strdup(a, x) debugging_arena_strdup(a, x, __FILE__, __LINE__)
+
+#else
+
+extern void *arena_alloc (struct arena *arena, size_t size);
+extern void *arena_calloc (struct arena *arena, size_t nmemb, size_t size);
+extern char *arena_strdup (struct arena *arena, const char *s);
+
+#endif
+
+extern void arena_init (struct arena *arena);
+extern void arena_save (struct arena *arena, struct arena_mark *mark);
+extern void arena_restore (struct arena *arena,
+                           const struct arena_mark *mark);
+extern void arena_free (struct arena *arena);
+
 /*
  * Allocate memory from the "shared" region of memory.
  */
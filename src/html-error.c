@@ -88,36 +88,31 @@ static char *get_html_file (unsigned int errornum)
  */
 static char *lookup_variable (struct conn_s *connptr, const char *varname)
 {
-        hashmap_iter result_iter;
-        char *key;
-        char *data;
-
-        result_iter = hashmap_find (connptr->error_variables, varname);
-
-        if (hashmap_is_end (connptr->error_variables, result_iter))
-                return (NULL);
-
-        if (hashmap_return_entry (connptr->error_variables, result_iter,
-                                  &key, (void **) &data) < 0)
+        if (!connptr->error_variables)
                 return (NULL);
 
-        return (data);
+        return header_map_get (connptr->error_variables, varname);
 }
 
 /*
  * Send an already-opened file to the client with variable substitution.
+ * The page is put together first, and sent in one go.
  */
 int
 send_html_file (FILE *infile, struct conn_s *connptr)
 {
+        struct header_buffer hb;
         char *inbuf;
         char *varstart = NULL;
         char *p;
         const char *varval;
         int in_variable = 0;
-        int r = 0;
 
         inbuf = (char *) safemalloc (4096);
+        if (!inbuf)
+                return -1;
+
+        header_buffer_init (&hb);
 
         while (fgets (inbuf, 4096, infile) != NULL) {
                 for (p = inbuf; *p; p++) {
@@ -130,12 +125,11 @@ send_html_file (FILE *infile, struct conn_s *connptr)
                                                                  varstart);
                                         if (!varval)
                                                 varval = "(unknown)";
-                                        r = write_message (connptr->client_fd,
-                                                           "%s", varval);
+                                        header_buffer_add (&hb, varval,
+                                                           strlen (varval));
                                         in_variable = 0;
                                 } else {
-                                        r = write_message (connptr->client_fd,
-                                                           "%c", *p);
+                                        header_buffer_add (&hb, p, 1);
                                 }
 
                                 break;
@@ -155,24 +149,18 @@ send_html_file (FILE *infile, struct conn_s *connptr)
 
                         default:
                                 if (!in_variable) {
-                                        r = write_message (connptr->client_fd,
-                                                           "%c", *p);
+                                        header_buffer_add (&hb, p, 1);
                                 }
                         }
-
-                        if (r)
-                                break;
                 }
 
-                if (r)
-                        break;
-
                 in_variable = 0;
         }
 
         safefree (inbuf);
 
-        return r;
+        return header_buffer_send (&hb, connptr->client_fd,
+                                   connptr->client_pending);
 }
 
 int send_http_headers (struct conn_s *connptr, int code, const char *message)
@@ -181,9 +169,13 @@ int send_http_headers (struct conn_s *connptr, int code, const char *message)
             "HTTP/1.0 %d %s\r\n"
             "Server: %s/%s\r\n"
             "Content-Type: text/html\r\n" "Connection: close\r\n" "\r\n";
+        struct header_buffer hb;
+
+        header_buffer_init (&hb);
+        header_buffer_printf (&hb, headers, code, message, PACKAGE, VERSION);
 
-        return (write_message (connptr->client_fd, headers,
-                               code, message, PACKAGE, VERSION));
+        return header_buffer_send (&hb, connptr->client_fd,
+                                   connptr->client_pending);
 }
 
 /*
@@ -213,11 +205,16 @@ int send_http_error_message (struct conn_s *connptr)
         error_file = get_html_file (connptr->error_number);
         if (!(infile = fopen (error_file, "r"))) {
                 char *detail = lookup_variable (connptr, "detail");
-                return (write_message (connptr->client_fd, fallback_error,
-                                       connptr->error_number,
-                                       connptr->error_string,
-                                       connptr->error_string,
-                                       detail, PACKAGE, VERSION));
+                struct header_buffer hb;
+
+                header_buffer_init (&hb);
+                header_buffer_printf (&hb, fallback_error,
+                                      connptr->error_number,
+                                      connptr->error_string,
+                                      connptr->error_string,
+                                      detail, PACKAGE, VERSION);
+                return header_buffer_send (&hb, connptr->client_fd,
+                                           connptr->client_pending);
         }
 
         ret = send_html_file (infile, connptr);
@@ -226,22 +223,19 @@ int send_http_error_message (struct conn_s *connptr)
 }
 
 /*
- * Add a key -> value mapping for HTML file substitution.
+ * Add a key -> value mapping for HTML file substitution.  Both are
+ * copied into the connection's arena, and go with the request.
  */
-
-#define ERRVAR_BUCKETCOUNT 16
-
 int
 add_error_variable (struct conn_s *connptr, const char *key, const char *val)
 {
         if (!connptr->error_variables)
                 if (!
                     (connptr->error_variables =
-                     hashmap_create (ERRVAR_BUCKETCOUNT)))
+                     header_map_create (&connptr->arena)))
                         return (-1);
 
-        return hashmap_insert (connptr->error_variables, key, val,
-                               strlen (val) + 1);
+        return header_map_add_copy (connptr->error_variables, key, val);
 }
 
 #define ADD_VAR_RET(x, y)				   \
@@ -260,6 +254,11 @@ int add_standard_vars (struct conn_s *connptr)
         char errnobuf[16];
         char timebuf[30];
         time_t global_time;
+        const char *clienthost;
+
+        /* The host name is only known if the access list needed it */
+        clienthost = connptr->client_string_addr ?
+            connptr->client_string_addr : connptr->client_ip_addr;
 
         snprintf (errnobuf, sizeof errnobuf, "%d", connptr->error_number);
         ADD_VAR_RET ("errno", errnobuf);
@@ -267,7 +266,7 @@ int add_standard_vars (struct conn_s *connptr)
         ADD_VAR_RET ("cause", connptr->error_string);
         ADD_VAR_RET ("request", connptr->request_line);
         ADD_VAR_RET ("clientip", connptr->client_ip_addr);
-        ADD_VAR_RET ("clienthost", connptr->client_string_addr);
+        ADD_VAR_RET ("clienthost", clienthost);
 
         /* The following value parts are all non-NULL and will
          * trigger warnings in ADD_VAR_RET(), so we use
@@ -309,7 +308,7 @@ indicate_http_error (struct conn_s *connptr, int number,
         }
 
         connptr->error_number = number;
-        connptr->error_string = safestrdup (message);
+        connptr->error_string = arena_strdup (&connptr->arena, message);
 
         va_end (ap);
 
@@ -0,0 +1,240 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Reads the head of an HTTP request or response (the start line and the
+ * headers) from a socket.  The data is read in large chunks into a single
+ * block, and fed to the parser in http-parser.c as it arrives; the start
+ * line and the header fields are then available as slices of the block.
+ * Whatever was read past the end of the head belongs to the body, and is
+ * passed on to the connection's buffer for the relay.
+ */
+
+#include "main.h"
+
+#include "buffer.h"
+#include "heap.h"
+#include "http-head.h"
+
+/*
+ * Largest head accepted, and how much more is read at a time.
+ */
+#define MAX_HEAD_LENGTH (128 * 1024)
+#define HEAD_CHUNK 4096
+
+/*
+ * How many more header fields to make room for at a time.
+ */
+#define HEAD_FIELDS 32
+
+/*
+ * Keep the position of each header field as the parser finds it.
+ */
+static int add_field (void *arg, const struct http_field_s *field)
+{
+        struct http_head_s *head = (struct http_head_s *) arg;
+        struct http_field_s *tmp;
+
+        if (head->nfields == head->maxfields) {
+                tmp = (struct http_field_s *)
+                    saferealloc (head->fields, (head->maxfields + HEAD_FIELDS)
+                                 * sizeof (struct http_field_s));
+                if (!tmp)
+                        return -1;
+
+                head->fields = tmp;
+                head->maxfields += HEAD_FIELDS;
+        }
+
+        head->fields[head->nfields++] = *field;
+        return 0;
+}
+
+void http_head_init (struct http_head_s *head, unsigned int type)
+{
+        memset (head, 0, sizeof (struct http_head_s));
+        http_parser_init (&head->parser, type, add_field, head);
+}
+
+/*
+ * Get ready to read another head, keeping the memory already allocated.
+ * Anything read past the body of the last head (a pipelined request) is
+ * kept as the start of the next one.
+ */
+void http_head_reset (struct http_head_s *head, unsigned int type)
+{
+        size_t keep = head->next > 0 ? head->len - head->next : 0;
+
+        if (keep > 0)
+                memmove (head->data, head->data + head->next, keep);
+
+        head->len = keep;
+        head->end = head->next = 0;
+        head->nfields = 0;
+        http_parser_init (&head->parser, type, add_field, head);
+}
+
+void http_head_free (struct http_head_s *head)
+{
+        safefree (head->data);
+        safefree (head->fields);
+        http_head_init (head, head->parser.type);
+}
+
+/*
+ * Read more of the head.  Returns the number of bytes read, zero if
+ * nothing was available, and -1 if the peer closed the connection, an
+ * error occurred, or the head grew too large.
+ */
+ssize_t http_head_read (struct http_head_s *head, int fd)
+{
+        ssize_t len;
+        char *tmp;
+
+        if (head->size - head->len < HEAD_CHUNK) {
+                if (head->size >= MAX_HEAD_LENGTH)
+                        return -1;
+
+                tmp = (char *) saferealloc (head->data,
+                                            head->size + HEAD_CHUNK);
+                if (!tmp)
+                        return -1;
+
+                head->data = tmp;
+                head->size += HEAD_CHUNK;
+        }
+
+        len = recv (fd, head->data + head->len, head->size - head->len, 0);
+        if (len < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                        return 0;
+                return -1;
+        }
+        if (len == 0)
+                return -1;
+
+        head->len += len;
+        return len;
+}
+
+/*
+ * Parse what has been read so far.  Returns the length of the whole
+ * head, zero if more data is needed, and -1 if the head is malformed.
+ */
+ssize_t http_head_find_end (struct http_head_s *head)
+{
+        if (head->len == 0)
+                return 0;
+
+        switch (http_parser_execute (&head->parser, head->data, head->len)) {
+        case HTTP_PARSE_DONE:
+                head->end = head->parser.pos;
+                return head->end;
+        case HTTP_PARSE_MORE:
+                return 0;
+        default:
+                return -1;
+        }
+}
+
+/*
+ * Read from a blocking socket until the whole head has arrived.
+ * Returns -1 if the connection was closed (or failed) first, or if the
+ * head is malformed; the parser's state tells which.
+ */
+int http_head_receive (struct http_head_s *head, int fd)
+{
+        ssize_t ret;
+
+        while ((ret = http_head_find_end (head)) == 0) {
+                if (http_head_read (head, fd) < 0)
+                        return -1;
+        }
+
+        return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Take a whole head from memory instead of a socket, as a kept copy of
+ * a response is.  Returns -1 if "data" is not a head or holds more.
+ */
+int http_head_parse (struct http_head_s *head, const char *data, size_t len)
+{
+        char *tmp;
+
+        if (len > head->size) {
+                tmp = (char *) saferealloc (head->data, len);
+                if (!tmp)
+                        return -1;
+
+                head->data = tmp;
+                head->size = len;
+        }
+
+        memcpy (head->data, data, len);
+        head->len = len;
+
+        return http_head_find_end (head) == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * Copy a part of the head into a string of its own, in the arena.
+ */
+char *http_head_copy (struct arena *arena, struct http_head_s *head,
+                      const struct http_span_s *span)
+{
+        char *str;
+
+        str = (char *) arena_alloc (arena, span->len + 1);
+        if (!str)
+                return NULL;
+
+        memcpy (str, head->data + span->off, span->len);
+        str[span->len] = '\0';
+
+        return str;
+}
+
+/*
+ * Copy the start line out of the head, without the line ending.
+ */
+char *http_head_start_line (struct arena *arena, struct http_head_s *head)
+{
+        return http_head_copy (arena, head, &head->parser.line);
+}
+
+/*
+ * Pass the data following the head (the start of the body) on to the
+ * buffer, but no more than "length" bytes of it unless "length" is
+ * negative.  The head itself stays around until it is reset or freed.
+ * Returns the number of bytes passed on.
+ */
+size_t http_head_finish (struct http_head_s *head, struct buffer_s *buffptr,
+                         long int length)
+{
+        size_t extra = head->len - head->end;
+
+        if (length >= 0 && extra > (unsigned long int) length)
+                extra = length;
+        head->next = head->end + extra;
+
+        if (extra > 0)
+                add_to_buffer (buffptr,
+                               (unsigned char *) head->data + head->end,
+                               extra);
+
+        return extra;
+}
@@ -0,0 +1,62 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http-head.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP_HEAD_H
+#define TINYPROXY_HTTP_HEAD_H
+
+#include "http-parser.h"
+
+struct arena;
+struct buffer_s;
+
+/*
+ * A request or response head (the start line plus the headers) as it is
+ * read from a socket.
+ */
+struct http_head_s {
+        char *data;
+        size_t len, size;
+        size_t end;             /* length of the whole head, once found */
+        size_t next;            /* where the next head starts, if known */
+
+        struct http_parser_s parser;
+
+        /* The header fields, in the order they arrived */
+        struct http_field_s *fields;
+        size_t nfields, maxfields;
+};
+
+extern void http_head_init (struct http_head_s *head, unsigned int type);
+extern void http_head_reset (struct http_head_s *head, unsigned int type);
+extern void http_head_free (struct http_head_s *head);
+
+extern ssize_t http_head_read (struct http_head_s *head, int fd);
+extern ssize_t http_head_find_end (struct http_head_s *head);
+extern int http_head_receive (struct http_head_s *head, int fd);
+extern int http_head_parse (struct http_head_s *head, const char *data,
+                            size_t len);
+
+extern char *http_head_start_line (struct arena *arena,
+                                   struct http_head_s *head);
+extern char *http_head_copy (struct arena *arena, struct http_head_s *head,
+                             const struct http_span_s *span);
+extern size_t http_head_finish (struct http_head_s *head,
+                                struct buffer_s *buffptr, long int length);
+
+#endif
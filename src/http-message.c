@@ -227,8 +227,9 @@ http_message_add_headers (http_message_t msg, const char **headers,
 /*
  * Send the completed HTTP message via the supplied file descriptor.
  */
-int http_message_send (http_message_t msg, int fd)
+int http_message_send (http_message_t msg, int fd, struct buffer_s *pending)
 {
+        struct header_buffer hb;
         char timebuf[30];
         time_t global_time;
         unsigned int i;
@@ -243,29 +244,32 @@ int http_message_send (http_message_t msg, int fd)
         if (!is_http_message_valid (msg))
                 return -EINVAL;
 
+        header_buffer_init (&hb);
+
         /* Write the response line */
-        write_message (fd, "HTTP/1.0 %d %s\r\n",
-                       msg->response.code, msg->response.string);
+        header_buffer_printf (&hb, "HTTP/1.0 %d %s\r\n",
+                              msg->response.code, msg->response.string);
 
         /* Go through all the headers */
         for (i = 0; i != msg->headers.used; ++i)
-                write_message (fd, "%s\r\n", msg->headers.strings[i]);
+                header_buffer_printf (&hb, "%s\r\n", msg->headers.strings[i]);
 
         /* Output the date */
         global_time = time (NULL);
         strftime (timebuf, sizeof (timebuf), "%a, %d %b %Y %H:%M:%S GMT",
                   gmtime (&global_time));
-        write_message (fd, "Date: %s\r\n", timebuf);
+        header_buffer_printf (&hb, "Date: %s\r\n", timebuf);
 
         /* Output the content-length */
-        write_message (fd, "Content-length: %u\r\n", msg->body.length);
+        header_buffer_printf (&hb, "Content-length: %u\r\n",
+                              msg->body.length);
 
         /* Write the separator between the headers and body */
-        safe_write (fd, "\r\n", 2);
+        header_buffer_add (&hb, "\r\n", 2);
 
-        /* If there's a body, send it! */
+        /* If there's a body, send it along with the head */
         if (msg->body.length > 0)
-                safe_write (fd, msg->body.text, msg->body.length);
+                header_buffer_add (&hb, msg->body.text, msg->body.length);
 
-        return 0;
+        return header_buffer_send (&hb, fd, pending);
 }
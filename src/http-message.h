@@ -50,6 +50,8 @@
 /* Use the "http_message_t" as a cookie or handle to the structure. */
 typedef struct http_message_s *http_message_t;
 
+struct buffer_s;
+
 /*
  * Macro to test if an error occurred with the API.  All the HTTP message
  * functions will return 0 if no error occurred, or a negative number if
@@ -66,9 +68,11 @@ extern int http_message_destroy (http_message_t msg);
 
 /*
  * Send an HTTP message via the supplied file descriptor.  This function
- * will add the "Date" header before it's sent.
+ * will add the "Date" header before it's sent.  What the socket won't
+ * take yet goes in "pending", if there is one (see write_or_queue().)
  */
-extern int http_message_send (http_message_t msg, int fd);
+extern int http_message_send (http_message_t msg, int fd,
+                              struct buffer_s *pending);
 
 /*
  * Change the internal state of the HTTP message.  Either set the
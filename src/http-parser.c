@@ -0,0 +1,360 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* An incremental parser for HTTP/1.x request and response heads.  It is
+ * handed the bytes read so far and splits them into the start line and
+ * the header fields, without copying anything: the parts are given back
+ * as offsets into the caller's data.  When a head is incomplete the parser
+ * remembers how far it got, and carries on from there once it is called
+ * again with more data.  Nothing is allocated, so the caller decides what
+ * to keep.
+ */
+
+#include "main.h"
+
+#include "http-parser.h"
+
+/*
+ * The characters allowed in methods and header field names ("tchar" in
+ * RFC 7230.)
+ */
+static const unsigned char token_chars[256] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+        0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#define IS_TOKEN(c) (token_chars[(unsigned char) (c)])
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+void http_parser_init (struct http_parser_s *parser, unsigned int type,
+                       http_field_fn on_field, void *arg)
+{
+        memset (parser, 0, sizeof (struct http_parser_s));
+
+        parser->type = type;
+        parser->state = HTTP_STATE_START;
+        parser->on_field = on_field;
+        parser->arg = arg;
+}
+
+/*
+ * Find the next word of the start line, starting at "*pos" and stopping
+ * at "end".  Returns the length of the word.
+ */
+static size_t
+next_word (const char *data, size_t *pos, size_t end,
+           struct http_span_s *span)
+{
+        size_t i = *pos;
+
+        while (i < end && IS_SPACE (data[i]))
+                i++;
+
+        span->off = i;
+        while (i < end && !IS_SPACE (data[i]))
+                i++;
+
+        span->len = i - span->off;
+        *pos = i;
+
+        return span->len;
+}
+
+/*
+ * Read a decimal number of at most "max" digits.  Returns -1 if there is
+ * none.
+ */
+static int
+read_number (const char *p, size_t len, size_t max, unsigned int *value,
+             size_t *used)
+{
+        size_t i;
+
+        *value = 0;
+        for (i = 0; i < len && i < max && IS_DIGIT (p[i]); i++)
+                *value = *value * 10 + (p[i] - '0');
+
+        *used = i;
+        return i > 0 ? 0 : -1;
+}
+
+/*
+ * Check an "HTTP/x.y" version and keep the numbers.
+ */
+static int parse_version (struct http_parser_s *parser, const char *data)
+{
+        const char *p = data + parser->version.off;
+        size_t len = parser->version.len;
+        size_t used;
+
+        if (len < 5 || strncasecmp (p, "HTTP/", 5) != 0)
+                return -1;
+        p += 5;
+        len -= 5;
+
+        if (read_number (p, len, 3, &parser->major, &used) < 0)
+                return -1;
+        p += used;
+        len -= used;
+
+        if (len < 2 || *p != '.')
+                return -1;
+        p++;
+        len--;
+
+        if (read_number (p, len, 3, &parser->minor, &used) < 0)
+                return -1;
+
+        return used == len ? 0 : -1;
+}
+
+/*
+ * "Method SP Request-URI SP HTTP-Version", where a GET without a version
+ * is an HTTP/0.9 request.
+ */
+static int parse_request_line (struct http_parser_s *parser, const char *data)
+{
+        size_t pos = parser->line.off;
+        size_t end = pos + parser->line.len;
+        struct http_span_s rest;
+        size_t i;
+
+        if (next_word (data, &pos, end, &parser->method) == 0
+            || next_word (data, &pos, end, &parser->uri) == 0)
+                return -1;
+
+        for (i = 0; i != parser->method.len; i++)
+                if (!IS_TOKEN (data[parser->method.off + i]))
+                        return -1;
+
+        if (next_word (data, &pos, end, &parser->version) == 0) {
+                if (parser->method.len != 3
+                    || strncasecmp (data + parser->method.off, "GET", 3) != 0)
+                        return -1;
+
+                parser->major = 0;
+                parser->minor = 9;
+                return 0;
+        }
+
+        if (next_word (data, &pos, end, &rest) != 0)
+                return -1;
+
+        return parse_version (parser, data);
+}
+
+/*
+ * "HTTP-Version SP Status-Code SP Reason-Phrase"
+ */
+static int parse_status_line (struct http_parser_s *parser, const char *data)
+{
+        size_t pos = parser->line.off;
+        size_t end = pos + parser->line.len;
+        size_t used;
+
+        if (next_word (data, &pos, end, &parser->version) == 0
+            || parse_version (parser, data) < 0)
+                return -1;
+
+        if (next_word (data, &pos, end, &parser->status) != 3
+            || read_number (data + parser->status.off, 3, 3,
+                            &parser->code, &used) < 0
+            || used != 3)
+                return -1;
+
+        while (pos < end && IS_SPACE (data[pos]))
+                pos++;
+
+        parser->reason.off = pos;
+        parser->reason.len = end - pos;
+
+        return 0;
+}
+
+/*
+ * Hand the last header field to the caller, now that it is known not to
+ * be continued.
+ */
+static int emit_field (struct http_parser_s *parser, const char *data)
+{
+        struct http_field_s *field = &parser->field;
+
+        if (!parser->pending)
+                return 0;
+        parser->pending = FALSE;
+
+        while (field->value.len > 0
+               && IS_SPACE (data[field->value.off + field->value.len - 1]))
+                field->value.len--;
+
+        if (parser->on_field && (*parser->on_field) (parser->arg, field) != 0)
+                return -1;
+
+        return 0;
+}
+
+/*
+ * Start a new header field.
+ */
+static int
+parse_field (struct http_parser_s *parser, const char *data,
+             size_t off, size_t len)
+{
+        struct http_field_s *field = &parser->field;
+        const char *line = data + off;
+        size_t i;
+
+        /*
+         * BUG FIX: Some servers send a second status line in the
+         * middle of their headers (a "Double CGI", first seen on
+         * cgi.ebay.com.)  Everything from there on is ignored.
+         */
+        if (len >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
+                parser->double_cgi = TRUE;
+                return 0;
+        }
+
+        for (i = 0; i < len && IS_TOKEN (line[i]); i++) ;
+        if (i == 0 || i == len || line[i] != ':')
+                return -1;
+
+        field->name.off = off;
+        field->name.len = i;
+
+        for (i++; i < len && IS_SPACE (line[i]); i++) ;
+
+        field->value.off = off + i;
+        field->value.len = len - i;
+        field->folded = FALSE;
+        parser->pending = TRUE;
+
+        return 0;
+}
+
+/*
+ * Add a continuation line to the last header field.
+ */
+static int
+continue_field (struct http_parser_s *parser, const char *data,
+                size_t off, size_t len)
+{
+        struct http_field_s *field = &parser->field;
+        size_t i;
+
+        if (!parser->pending)
+                return -1;
+
+        if (field->value.len == 0) {
+                for (i = 0; i < len && IS_SPACE (data[off + i]); i++) ;
+                field->value.off = off + i;
+        }
+        field->value.len = off + len - field->value.off;
+        field->folded = TRUE;
+
+        return 0;
+}
+
+/*
+ * Parse as much of the head as possible.  "data" holds everything read
+ * so far, including what was passed in the previous calls.  Returns
+ * HTTP_PARSE_DONE once the blank line ending the head has been seen (and
+ * "pos" is then the length of the head), HTTP_PARSE_MORE if more data is
+ * needed, and HTTP_PARSE_ERROR if the head is malformed.
+ */
+int http_parser_execute (struct http_parser_s *parser,
+                         const char *data, size_t len)
+{
+        const char *eol;
+        size_t off, linelen;
+        int ret;
+
+        if (parser->state == HTTP_STATE_ERROR)
+                return HTTP_PARSE_ERROR;
+
+        while (parser->state != HTTP_STATE_DONE) {
+                eol = (const char *) memchr (data + parser->scan, '\n',
+                                             len - parser->scan);
+                if (!eol) {
+                        parser->scan = len;
+                        return HTTP_PARSE_MORE;
+                }
+
+                off = parser->pos;
+                linelen = eol - (data + off);
+                if (linelen > 0 && data[off + linelen - 1] == '\r')
+                        linelen--;
+
+                parser->pos = parser->scan = eol + 1 - data;
+
+                if (parser->state == HTTP_STATE_START) {
+                        /* Blank lines before the start line are skipped */
+                        if (linelen == 0)
+                                continue;
+
+                        parser->line.off = off;
+                        parser->line.len = linelen;
+
+                        if (parser->type == HTTP_PARSE_REQUEST)
+                                ret = parse_request_line (parser, data);
+                        else
+                                ret = parse_status_line (parser, data);
+                        if (ret < 0)
+                                break;
+
+                        parser->state = HTTP_STATE_FIELDS;
+                        continue;
+                }
+
+                if (linelen == 0) {
+                        ret = emit_field (parser, data);
+                        parser->state = HTTP_STATE_DONE;
+                } else if (parser->double_cgi) {
+                        ret = 0;
+                } else if (IS_SPACE (data[off])) {
+                        ret = continue_field (parser, data, off, linelen);
+                } else {
+                        ret = emit_field (parser, data);
+                        if (ret == 0)
+                                ret = parse_field (parser, data, off, linelen);
+                }
+
+                if (ret < 0)
+                        break;
+        }
+
+        if (parser->state != HTTP_STATE_DONE) {
+                parser->state = HTTP_STATE_ERROR;
+                return HTTP_PARSE_ERROR;
+        }
+
+        return HTTP_PARSE_DONE;
+}
@@ -0,0 +1,102 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http-parser.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP_PARSER_H
+#define TINYPROXY_HTTP_PARSER_H
+
+#include <stddef.h>
+
+/*
+ * What kind of head is being parsed.
+ */
+#define HTTP_PARSE_REQUEST  0
+#define HTTP_PARSE_RESPONSE 1
+
+/*
+ * Return values of http_parser_execute().
+ */
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_MORE   0
+#define HTTP_PARSE_DONE   1
+
+/*
+ * How far the parser has got.  An error is final.
+ */
+enum http_parser_state {
+        HTTP_STATE_START,       /* expecting the start line */
+        HTTP_STATE_FIELDS,
+        HTTP_STATE_DONE,
+        HTTP_STATE_ERROR
+};
+
+/*
+ * A piece of the head, given as an offset from the start of the data
+ * so that it stays valid if the caller moves the data around.
+ */
+struct http_span_s {
+        size_t off;
+        size_t len;
+};
+
+/*
+ * A header field.  The value has the surrounding white space removed;
+ * a value continued over several lines still contains the line breaks.
+ */
+struct http_field_s {
+        struct http_span_s name;
+        struct http_span_s value;
+        unsigned int folded:1;  /* continued over several lines */
+};
+
+/*
+ * Called for each header field once it is complete.  Returning anything
+ * but zero stops the parser with an error.
+ */
+typedef int (*http_field_fn) (void *arg, const struct http_field_s *field);
+
+struct http_parser_s {
+        unsigned int type;
+        enum http_parser_state state;
+
+        size_t pos;             /* start of the next line to parse */
+        size_t scan;            /* where to continue looking for its end */
+
+        /* The start line, without the line ending, and its parts */
+        struct http_span_s line;
+        struct http_span_s method, uri;         /* requests */
+        struct http_span_s status, reason;      /* responses */
+        struct http_span_s version;
+        unsigned int major, minor;
+        unsigned int code;
+
+        /* A field which may still be continued on the next line */
+        struct http_field_s field;
+        unsigned int pending:1;
+        unsigned int double_cgi:1;
+
+        http_field_fn on_field;
+        void *arg;
+};
+
+extern void http_parser_init (struct http_parser_s *parser, unsigned int type,
+                              http_field_fn on_field, void *arg);
+extern int http_parser_execute (struct http_parser_s *parser,
+                                const char *data, size_t len);
+
+#endif
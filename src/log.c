@@ -102,6 +102,7 @@ void log_message (int level, const char *fmt, ...)
 {
         va_list args;
         time_t nowtime;
+        struct tm tm;
 
         char time_string[TIME_LENGTH];
         char str[STRING_LENGTH];
@@ -167,7 +168,7 @@ void log_message (int level, const char *fmt, ...)
                 nowtime = time (NULL);
                 /* Format is month day hour:minute:second (24 time) */
                 strftime (time_string, TIME_LENGTH, "%b %d %H:%M:%S",
-                          localtime (&nowtime));
+                          localtime_r (&nowtime, &tm));
 
                 snprintf (str, STRING_LENGTH, "%-9s %s [%ld]: ",
                           syslog_level[level], time_string,
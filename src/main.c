@@ -34,8 +34,10 @@
 #include "anonymous.h"
 #include "authors.h"
 #include "buffer.h"
+#include "cache.h"
 #include "conf.h"
 #include "daemon.h"
+#include "dns.h"
 #include "heap.h"
 #include "filter.h"
 #include "child.h"
@@ -43,6 +45,7 @@
 #include "reqs.h"
 #include "sock.h"
 #include "stats.h"
+#include "upstream.h"
 #include "utils.h"
 
 /*
@@ -52,6 +55,42 @@ struct config_s config;
 struct config_s config_defaults;
 unsigned int received_sighup = FALSE;   /* boolean */
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * Held for reading by the worker threads while they use the
+ * configuration, and for writing while it is being reloaded.
+ */
+static pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+/*
+ * A configuration which connections still refer to (at the upstream
+ * proxy they use, for one) outlives a reload: it is moved out of the
+ * way and only freed once the last of them lets it go.  The current
+ * one is read from "config" itself.
+ */
+struct config_generation {
+        struct config_s conf;           /* once retired */
+        unsigned int refs;
+        unsigned int retired;           /* boolean */
+};
+
+static struct config_generation *current_generation = NULL;
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * The worker threads hold and let go of the configuration at the same
+ * time, under the read lock above, so the counts need a lock of their
+ * own.
+ */
+static pthread_mutex_t generation_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define GENERATION_LOCK() pthread_mutex_lock (&generation_lock)
+#  define GENERATION_UNLOCK() pthread_mutex_unlock (&generation_lock)
+#else
+#  define GENERATION_LOCK() do { } while (0)
+#  define GENERATION_UNLOCK() do { } while (0)
+#endif
+
 /*
  * Handle a signal
  */
@@ -345,10 +384,109 @@ static void initialize_config_defaults (struct config_s *conf)
         conf->errorpages = NULL;
         conf->stathost = safestrdup (TINYPROXY_STATHOST);
         conf->idletimeout = MAX_IDLE_TIME;
+        conf->maxkeepaliverequests = MAX_KEEPALIVE_REQUESTS;
+        conf->keepalivetimeout = KEEPALIVE_TIMEOUT;
+        conf->serverkeepalivetimeout = SERVER_KEEPALIVE_TIMEOUT;
+        conf->connecttimeout = CONNECT_TIMEOUT;
+#ifdef UPSTREAM_SUPPORT
+        conf->upstream_max_fails = UPSTREAM_MAX_FAILS;
+        conf->upstream_fail_timeout = UPSTREAM_FAIL_TIMEOUT;
+#endif
+#ifdef REVERSE_SUPPORT
+        conf->cache_size = CACHE_SIZE;
+        conf->cache_memory = CACHE_MEMORY;
+        conf->cache_max_object = CACHE_MAX_OBJECT;
+#endif
         conf->logf_name = safestrdup ("/data/tinyproxy/tinyproxy.log");
         conf->pidpath = safestrdup ("/data/tinyproxy/tinyproxy.pid");
 }
 
+/*
+ * Lock/Unlock the configuration (only needed with worker threads).
+ */
+void config_read_lock (void)
+{
+#ifdef HAVE_PTHREAD_H
+        pthread_rwlock_rdlock (&config_lock);
+#endif
+}
+
+void config_write_lock (void)
+{
+#ifdef HAVE_PTHREAD_H
+        pthread_rwlock_wrlock (&config_lock);
+#endif
+}
+
+void config_unlock (void)
+{
+#ifdef HAVE_PTHREAD_H
+        pthread_rwlock_unlock (&config_lock);
+#endif
+}
+
+/*
+ * Keep the current configuration for as long as the caller refers to
+ * it.  Returns NULL if there is no memory to keep track of it, in which
+ * case it is not kept.
+ */
+struct config_generation *config_hold (void)
+{
+        struct config_generation *generation;
+
+        GENERATION_LOCK ();
+        if (!current_generation)
+                current_generation = (struct config_generation *)
+                    safecalloc (1, sizeof (struct config_generation));
+        generation = current_generation;
+        if (generation)
+                generation->refs++;
+        GENERATION_UNLOCK ();
+
+        return generation;
+}
+
+/*
+ * Let go of a configuration kept with config_hold().  One which has
+ * been reloaded since is freed with the last of these.
+ */
+void config_release (struct config_generation *generation)
+{
+        unsigned int done;
+
+        if (!generation)
+                return;
+
+        GENERATION_LOCK ();
+        assert (generation->refs > 0);
+        done = --generation->refs == 0 && generation->retired;
+        GENERATION_UNLOCK ();
+
+        if (done) {
+                free_config (&generation->conf);
+                safefree (generation);
+        }
+}
+
+/*
+ * Move the current configuration out of the way of a reload if anything
+ * still refers to it; otherwise the reload frees it as usual.  With
+ * worker threads this happens under the write lock, so none of them is
+ * using "config" meanwhile, and a retired configuration is only freed
+ * by whichever thread lets go of it last.
+ */
+static void retire_config (void)
+{
+        GENERATION_LOCK ();
+        if (current_generation && current_generation->refs > 0) {
+                current_generation->conf = config;
+                current_generation->retired = TRUE;
+                memset (&config, 0, sizeof (config));
+                current_generation = NULL;
+        }
+        GENERATION_UNLOCK ();
+}
+
 /**
  * convenience wrapper around reload_config_file
  * that also re-initializes logging.
@@ -359,6 +497,8 @@ int reload_config (void)
 
         shutdown_logging ();
 
+        retire_config ();
+
         ret = reload_config_file (config_defaults.config_file, &config,
                                   &config_defaults);
         if (ret != 0) {
@@ -395,6 +535,13 @@ main (int argc, char **argv)
         }
 
         init_stats ();
+        init_failed_addresses ();
+#ifdef UPSTREAM_SUPPORT
+        init_upstream_state (config.upstream_list);
+#endif
+#ifdef REVERSE_SUPPORT
+        init_cache ();
+#endif
 
         /* If ANONYMOUS is turned on, make sure that Content-Length is
          * in the list of allowed headers, since it is required in a
@@ -419,6 +566,9 @@ main (int argc, char **argv)
                 filter_init ();
 #endif /* FILTER_ENABLE */
 
+        /* Read resolv.conf and hosts while they can still be read */
+        dns_init ();
+
         /* Start listening on the selected port. */
         if (child_listening_sock (config.port) < 0) {
                 fprintf (stderr, "%s: Could not create listening socket.\n",
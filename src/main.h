@@ -26,7 +26,17 @@
 
 /* Global variables for the main controls of the program */
 #define MAXBUFFSIZE     ((size_t)(1024 * 96))   /* Max size of buffer */
+#define READBUFFSIZE    ((size_t)(1024 * 2))    /* Bytes asked for per read */
 #define MAX_IDLE_TIME   (60 * 10)       /* 10 minutes of no activity */
+#define KEEPALIVE_TIMEOUT 5             /* seconds to wait for a request */
+#define MAX_KEEPALIVE_REQUESTS 100      /* requests per client connection */
+#define SERVER_KEEPALIVE_TIMEOUT 4      /* seconds to keep an idle server */
+#define CONNECT_TIMEOUT 10              /* seconds to connect to a server */
+#define UPSTREAM_MAX_FAILS 3            /* before a proxy is left out */
+#define UPSTREAM_FAIL_TIMEOUT 30        /* seconds to leave it out for */
+#define CACHE_SIZE (1024 * 1024 * 64)   /* bytes of responses kept on disk */
+#define CACHE_MEMORY (1024 * 1024 * 8)  /* and in each worker's memory */
+#define CACHE_MAX_OBJECT (1024 * 1024)  /* the largest response kept */
 
 /* Global Structures used in the program */
 extern struct config_s config;
@@ -34,4 +44,12 @@ extern unsigned int received_sighup;    /* boolean */
 
 extern int reload_config (void);
 
+struct config_generation;
+extern struct config_generation *config_hold (void);
+extern void config_release (struct config_generation *generation);
+
+extern void config_read_lock (void);
+extern void config_write_lock (void);
+extern void config_unlock (void);
+
 #endif /* __MAIN_H__ */
@@ -25,17 +25,24 @@
 
 #include "main.h"
 
+#include "buffer.h"
+#include "conf.h"
 #include "heap.h"
 #include "network.h"
 
 /*
  * Write the buffer to the socket. If an EINTR occurs, pick up and try
- * again. Keep sending until the buffer has been sent.
+ * again. Keep sending until the buffer has been sent.  If the socket is
+ * in non-blocking mode, wait (for at most the idle timeout) for room to
+ * become available.  Only a connection handled on its own should wait
+ * like this; the event loop uses write_or_queue() instead.
  */
 ssize_t safe_write (int fd, const char *buffer, size_t count)
 {
         ssize_t len;
         size_t bytestosend;
+        struct pollfd pfd;
+        int ready;
 
         assert (fd >= 0);
         assert (buffer != NULL);
@@ -49,8 +56,16 @@ ssize_t safe_write (int fd, const char *buffer, size_t count)
                 if (len < 0) {
                         if (errno == EINTR)
                                 continue;
-                        else
+                        if (errno != EAGAIN)
                                 return -errno;
+
+                        pfd.fd = fd;
+                        pfd.events = POLLOUT;
+                        ready = poll (&pfd, 1, config.idletimeout * 1000);
+                        if (ready > 0 || (ready < 0 && errno == EINTR))
+                                continue;
+
+                        return -EAGAIN;
                 }
 
                 if ((size_t) len == bytestosend)
@@ -63,6 +78,45 @@ ssize_t safe_write (int fd, const char *buffer, size_t count)
         return count;
 }
 
+/*
+ * Write to the socket without waiting for it.  Whatever the socket won't
+ * take yet is added to "pending", to be written once it is writable, and
+ * so is all of it if "pending" already holds something, to keep it in
+ * order.  Without a "pending" buffer this is safe_write().
+ */
+ssize_t write_or_queue (int fd, struct buffer_s *pending, const char *buffer,
+                        size_t count)
+{
+        ssize_t len = 0;
+
+        assert (fd >= 0);
+        assert (buffer != NULL);
+        assert (count > 0);
+
+        if (!pending)
+                return safe_write (fd, buffer, count);
+
+        if (buffer_size (pending) == 0) {
+                do {
+                        len = send (fd, buffer, count, MSG_NOSIGNAL);
+                } while (len < 0 && errno == EINTR);
+
+                if (len < 0) {
+                        if (errno != EAGAIN)
+                                return -errno;
+                        len = 0;
+                }
+        }
+
+        if ((size_t) len < count
+            && add_to_buffer (pending,
+                              (const unsigned char *) buffer + len,
+                              count - len) < 0)
+                return -ENOMEM;
+
+        return count;
+}
+
 /*
  * Matched pair for safe_write(). If an EINTR occurs, pick up and try
  * again.
@@ -127,117 +181,131 @@ int write_message (int fd, const char *fmt, ...)
         return 0;
 }
 
+void header_buffer_init (struct header_buffer *hb)
+{
+        hb->data = hb->space;
+        hb->len = 0;
+        hb->size = sizeof (hb->space);
+        hb->failed = FALSE;
+}
+
+void header_buffer_free (struct header_buffer *hb)
+{
+        if (hb->data != hb->space)
+                safefree (hb->data);
+        header_buffer_init (hb);
+}
+
 /*
- * Read in a "line" from the socket. It might take a few loops through
- * the read sequence. The full string is allocate off the heap and stored
- * at the whole_buffer pointer. The caller needs to free the memory when
- * it is no longer in use. The returned line is NULL terminated.
- *
- * Returns the length of the buffer on success (not including the NULL
- * termination), 0 if the socket was closed, and -1 on all other errors.
+ * Make room for "len" more bytes.
  */
-#define SEGMENT_LEN (512)
-#define MAXIMUM_BUFFER_LENGTH (128 * 1024)
-ssize_t readline (int fd, char **whole_buffer)
+static int header_buffer_grow (struct header_buffer *hb, size_t len)
 {
-        ssize_t whole_buffer_len;
-        char buffer[SEGMENT_LEN];
-        char *ptr;
-
-        ssize_t ret;
-        ssize_t diff;
-
-        struct read_lines_s {
-                char *data;
-                size_t len;
-                struct read_lines_s *next;
-        };
-        struct read_lines_s *first_line, *line_ptr;
-
-        first_line =
-            (struct read_lines_s *) safecalloc (sizeof (struct read_lines_s),
-                                                1);
-        if (!first_line)
-                return -ENOMEM;
+        size_t size;
+        char *tmp;
 
-        line_ptr = first_line;
+        if (hb->failed)
+                return -1;
+        if (hb->len + len <= hb->size)
+                return 0;
+
+        size = max (hb->size * 2, hb->len + len);
+        if (hb->data == hb->space) {
+                tmp = (char *) safemalloc (size);
+                if (tmp)
+                        memcpy (tmp, hb->data, hb->len);
+        } else {
+                tmp = (char *) saferealloc (hb->data, size);
+        }
 
-        whole_buffer_len = 0;
-        for (;;) {
-                ret = recv (fd, buffer, SEGMENT_LEN, MSG_PEEK);
-                if (ret <= 0)
-                        goto CLEANUP;
+        if (!tmp) {
+                hb->failed = TRUE;
+                return -1;
+        }
 
-                ptr = (char *) memchr (buffer, '\n', ret);
-                if (ptr)
-                        diff = ptr - buffer + 1;
-                else
-                        diff = ret;
+        hb->data = tmp;
+        hb->size = size;
+        return 0;
+}
 
-                whole_buffer_len += diff;
+void header_buffer_add (struct header_buffer *hb, const char *data,
+                        size_t len)
+{
+        if (header_buffer_grow (hb, len) < 0)
+                return;
 
-                /*
-                 * Don't allow the buffer to grow without bound. If we
-                 * get to more than MAXIMUM_BUFFER_LENGTH close.
-                 */
-                if (whole_buffer_len > MAXIMUM_BUFFER_LENGTH) {
-                        ret = -ERANGE;
-                        goto CLEANUP;
-                }
+        memcpy (hb->data + hb->len, data, len);
+        hb->len += len;
+}
 
-                line_ptr->data = (char *) safemalloc (diff);
-                if (!line_ptr->data) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
-                }
+void header_buffer_printf (struct header_buffer *hb, const char *fmt, ...)
+{
+        va_list ap;
+        int n;
 
-                recv (fd, line_ptr->data, diff, 0);
-                line_ptr->len = diff;
+        if (hb->failed)
+                return;
 
-                if (ptr) {
-                        line_ptr->next = NULL;
-                        break;
-                }
+        va_start (ap, fmt);
+        n = vsnprintf (hb->data + hb->len, hb->size - hb->len, fmt, ap);
+        va_end (ap);
 
-                line_ptr->next =
-                    (struct read_lines_s *)
-                    safecalloc (sizeof (struct read_lines_s), 1);
-                if (!line_ptr->next) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
-                }
-                line_ptr = line_ptr->next;
+        if (n < 0) {
+                hb->failed = TRUE;
+                return;
         }
 
-        *whole_buffer = (char *) safemalloc (whole_buffer_len + 1);
-        if (!*whole_buffer) {
-                ret = -ENOMEM;
-                goto CLEANUP;
-        }
+        /* Didn't fit; try again with the room it needs */
+        if ((size_t) n >= hb->size - hb->len) {
+                if (header_buffer_grow (hb, n + 1) < 0)
+                        return;
 
-        *(*whole_buffer + whole_buffer_len) = '\0';
+                va_start (ap, fmt);
+                vsnprintf (hb->data + hb->len, hb->size - hb->len, fmt, ap);
+                va_end (ap);
+        }
 
-        whole_buffer_len = 0;
-        line_ptr = first_line;
-        while (line_ptr) {
-                memcpy (*whole_buffer + whole_buffer_len, line_ptr->data,
-                        line_ptr->len);
-                whole_buffer_len += line_ptr->len;
+        hb->len += n;
+}
 
-                line_ptr = line_ptr->next;
-        }
+/*
+ * Add a "name: value" header line.
+ */
+void header_buffer_field (struct header_buffer *hb, const char *name,
+                          const char *value)
+{
+        size_t name_len = strlen (name), value_len = strlen (value);
+
+        if (header_buffer_grow (hb, name_len + value_len + 4) < 0)
+                return;
+
+        memcpy (hb->data + hb->len, name, name_len);
+        hb->len += name_len;
+        hb->data[hb->len++] = ':';
+        hb->data[hb->len++] = ' ';
+        memcpy (hb->data + hb->len, value, value_len);
+        hb->len += value_len;
+        hb->data[hb->len++] = '\r';
+        hb->data[hb->len++] = '\n';
+}
 
-        ret = whole_buffer_len;
+/*
+ * Send what has been put together, and start again with an empty
+ * buffer.  What the socket won't take yet goes in "pending", if there
+ * is one (see write_or_queue().)
+ */
+int header_buffer_send (struct header_buffer *hb, int fd,
+                        struct buffer_s *pending)
+{
+        int ret = 0;
 
-CLEANUP:
-        do {
-                line_ptr = first_line->next;
-                if (first_line->data)
-                        safefree (first_line->data);
-                safefree (first_line);
-                first_line = line_ptr;
-        } while (first_line);
+        if (hb->failed)
+                ret = -1;
+        else if (hb->len > 0
+                 && write_or_queue (fd, pending, hb->data, hb->len) < 0)
+                ret = -1;
 
+        header_buffer_free (hb);
         return ret;
 }
 
@@ -245,7 +313,7 @@ CLEANUP:
  * Convert the network address into either a dotted-decimal or an IPv6
  * hex string.
  */
-char *get_ip_string (struct sockaddr *sa, char *buf, size_t buflen)
+char *get_ip_string (const struct sockaddr *sa, char *buf, size_t buflen)
 {
         assert (sa != NULL);
         assert (buf != NULL);
@@ -255,15 +323,16 @@ char *get_ip_string (struct sockaddr *sa, char *buf, size_t buflen)
         switch (sa->sa_family) {
         case AF_INET:
                 {
-                        struct sockaddr_in *sa_in = (struct sockaddr_in *) sa;
+                        const struct sockaddr_in *sa_in =
+                            (const struct sockaddr_in *) sa;
 
                         inet_ntop (AF_INET, &sa_in->sin_addr, buf, buflen);
                         break;
                 }
         case AF_INET6:
                 {
-                        struct sockaddr_in6 *sa_in6 =
-                            (struct sockaddr_in6 *) sa;
+                        const struct sockaddr_in6 *sa_in6 =
+                            (const struct sockaddr_in6 *) sa;
 
                         inet_ntop (AF_INET6, &sa_in6->sin6_addr, buf, buflen);
                         break;
@@ -21,13 +21,42 @@
 #ifndef TINYPROXY_NETWORK_H
 #define TINYPROXY_NETWORK_H
 
+struct buffer_s;
+
 extern ssize_t safe_write (int fd, const char *buffer, size_t count);
+extern ssize_t write_or_queue (int fd, struct buffer_s *pending,
+                               const char *buffer, size_t count);
 extern ssize_t safe_read (int fd, char *buffer, size_t count);
 
 extern int write_message (int fd, const char *fmt, ...);
-extern ssize_t readline (int fd, char **whole_buffer);
 
-extern char *get_ip_string (struct sockaddr *sa, char *buf, size_t len);
+/*
+ * A message head (the request or response line and the header fields)
+ * put together in memory, so that it goes out in one write instead of
+ * one for each line.  Adding to it can't fail; running out of memory is
+ * reported by header_buffer_send() instead.
+ */
+#define HEADER_BUFFER_SPACE 2048
+
+struct header_buffer {
+        char *data;
+        size_t len, size;
+        unsigned int failed;    /* boolean */
+        char space[HEADER_BUFFER_SPACE];
+};
+
+extern void header_buffer_init (struct header_buffer *hb);
+extern void header_buffer_free (struct header_buffer *hb);
+extern void header_buffer_add (struct header_buffer *hb, const char *data,
+                               size_t len);
+extern void header_buffer_printf (struct header_buffer *hb,
+                                  const char *fmt, ...);
+extern void header_buffer_field (struct header_buffer *hb, const char *name,
+                                 const char *value);
+extern int header_buffer_send (struct header_buffer *hb, int fd,
+                               struct buffer_s *pending);
+
+extern char *get_ip_string (const struct sockaddr *sa, char *buf, size_t len);
 extern int full_inet_pton (const char *ip, void *dst);
 
 #endif
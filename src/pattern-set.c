@@ -0,0 +1,1568 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Matches a text against a large set of regular expressions, as the
+ * filter needs to.  Running regexec() for every expression in turn
+ * costs time in proportion to the number of expressions, so instead
+ * they are sorted as they are added:
+ *
+ *   - plain strings anchored at the start ("^ads\.") or at both ends go
+ *     into a trie which is walked along the text from its start;
+ *   - plain strings anchored at the end ("\.example\.com$") go into a
+ *     trie of the reversed strings, walked back from the end of the text;
+ *   - other plain strings go into an Aho-Corasick automaton, which finds
+ *     all of them in one pass over the text.  So does the longest plain
+ *     part of most other expressions.  Where the rest of the expression
+ *     is only more characters and '.'s ("ad.example.com"), the text
+ *     around the find is compared with it; otherwise regexec() is run
+ *     for the expressions whose part was found;
+ *   - only the expressions without such a part ("a|b", "[0-9]+") are
+ *     tried on every text, combined into a single one where possible.
+ *
+ * The tries keep their edges in a hash table keyed on the node and the
+ * next byte, so the cost of a step doesn't depend on how many children
+ * a node has.  Matching a text then costs about the same whatever the
+ * number of expressions.
+ *
+ * Once compiled, everything matching needs is laid out in one block of
+ * memory, without pointers, which pattern_set_save() writes to a file
+ * as it is.  pattern_set_load() maps such a file instead of reading and
+ * compiling the expressions again, so processes loading the same file
+ * share its pages.  Only the regex_t's can't be saved; each process
+ * compiles those when it first needs them.
+ */
+
+#include "main.h"
+
+#include "heap.h"
+#include "pattern-set.h"
+
+/*
+ * Shorter plain parts would be found in too many texts to be worth it.
+ */
+#define MIN_LITERAL 3
+
+/*
+ * The longest line read from a list, as the filter always did.
+ */
+#define PATTERN_LINE_LEN 512
+
+#define PATTERN_SET_VERSION 1
+#define PATTERN_SET_BYTE_ORDER 0x01020304
+
+/* What there is to know about an expression */
+#define PATTERN_START   0x01    /* anchored at the start of the text */
+#define PATTERN_END     0x02    /* anchored at the end */
+#define PATTERN_SHAPE   0x04    /* compare the text around the find */
+#define PATTERN_REGEXEC 0x08    /* regexec () the text once found */
+#define PATTERN_ALWAYS  0x10    /* regexec () every text */
+#define PATTERN_FLAGS   0x1f
+
+enum {
+        TRIE_SUBSTRINGS,        /* Aho-Corasick */
+        TRIE_PREFIXES,
+        TRIE_SUFFIXES,          /* of reversed strings */
+        NTRIES
+};
+
+/*
+ * The compiled set, as saved.  Everything is a 32 bit number, and what
+ * would be a pointer is an offset from the start of the header, so the
+ * block can be mapped anywhere.  The nodes of each trie are numbered in
+ * order of depth, which puts each node's failure link and output link
+ * before it.
+ */
+struct set_node {
+        uint32_t fail;          /* Aho-Corasick failure link */
+        uint32_t output;        /* nearest node with patterns along it */
+        uint32_t patterns;      /* first pattern ending here, plus one */
+};
+
+struct set_edge {
+        uint32_t parent;
+        uint32_t child;         /* zero for a free slot */
+        uint32_t c;
+};
+
+struct set_pattern {
+        uint32_t flags;
+        uint32_t next;          /* next pattern at the same node, plus one */
+        uint32_t source;        /* the expression, if regexec () needs it */
+        uint32_t shape;         /* a byte per character, zero for '.' */
+        uint32_t shape_len;
+        uint32_t shape_at;      /* where the plain part ends in the shape */
+};
+
+struct set_trie {
+        uint32_t nnodes, nodes;
+        uint32_t mask, edges;
+};
+
+struct set_header {
+        char magic[PATTERN_SET_MAGIC_LEN];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t size;
+        uint32_t cflags;
+
+        uint32_t npatterns, patterns;
+        struct set_trie tries[NTRIES];
+        uint32_t nregexes, regexes;     /* the PATTERN_ALWAYS ones */
+        uint32_t combined;              /* all of those in one, if any */
+        uint32_t strings, strings_size;
+};
+
+/*
+ * The set while expressions are being added.
+ */
+struct build_node {
+        unsigned int parent, depth;
+        unsigned int fail, output, patterns;
+        unsigned char c;
+};
+
+struct build_trie {
+        struct build_node *nodes;
+        unsigned int nnodes, maxnodes;
+
+        struct set_edge *edges;
+        unsigned int nedges, mask;
+};
+
+struct build_pattern {
+        unsigned int flags, next;
+        regex_t *re;
+        char *source;
+        char *shape;
+        size_t shape_len, shape_at;
+};
+
+struct pattern_builder {
+        struct build_pattern *patterns;
+        unsigned int npatterns, maxpatterns;
+
+        struct build_trie tries[NTRIES];
+
+        unsigned int *regexes;
+        unsigned int nregexes;
+};
+
+struct pattern_set {
+        int cflags;
+
+        struct pattern_builder *build;  /* until compiled */
+
+        char *image;
+        size_t size;
+        unsigned int mapped;
+
+        const struct set_header *header;
+        const struct set_pattern *patterns;
+        const uint32_t *regexes;
+        struct {
+                const struct set_node *nodes;
+                const struct set_edge *edges;
+                uint32_t nnodes, mask;
+        } tries[NTRIES];
+
+        regex_t **re;           /* by pattern, compiled when needed */
+        regex_t *combined;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;   /* around "re", for worker threads */
+#endif
+};
+
+/*
+ * Marks an expression which wouldn't compile after all.
+ */
+static regex_t failed_regex;
+
+static unsigned int
+edge_slot (const struct set_edge *edges, uint32_t mask, unsigned int parent,
+           unsigned char c)
+{
+        unsigned int i = (parent << 8 | c) * 2654435761U;
+
+        for (i = (i ^ i >> 16) & mask;
+             edges[i].child && (edges[i].parent != parent || edges[i].c != c);
+             i = (i + 1) & mask) ;
+
+        return i;
+}
+
+static int build_trie_init (struct build_trie *trie)
+{
+        trie->maxnodes = 64;
+        trie->nodes = (struct build_node *)
+            safecalloc (trie->maxnodes, sizeof (struct build_node));
+        trie->nnodes = 1;       /* the root */
+
+        trie->mask = 63;
+        trie->edges = (struct set_edge *)
+            safecalloc (trie->mask + 1, sizeof (struct set_edge));
+        trie->nedges = 0;
+
+        return trie->nodes && trie->edges ? 0 : -1;
+}
+
+static unsigned int
+build_trie_child (const struct build_trie *trie, unsigned int parent,
+                  unsigned char c)
+{
+        return trie->edges[edge_slot (trie->edges, trie->mask, parent,
+                                      c)].child;
+}
+
+/*
+ * Make the edge table twice as large.
+ */
+static int build_trie_grow_edges (struct build_trie *trie)
+{
+        struct set_edge *old = trie->edges;
+        unsigned int i, size = trie->mask + 1;
+
+        trie->edges = (struct set_edge *)
+            safecalloc (size * 2, sizeof (struct set_edge));
+        if (!trie->edges) {
+                trie->edges = old;
+                return -1;
+        }
+        trie->mask = size * 2 - 1;
+
+        for (i = 0; i != size; i++)
+                if (old[i].child)
+                        trie->edges[edge_slot (trie->edges, trie->mask,
+                                               old[i].parent,
+                                               (unsigned char) old[i].c)] =
+                            old[i];
+
+        safefree (old);
+        return 0;
+}
+
+/*
+ * Add the string to the trie, backwards if "reverse" is set, and return
+ * the node it ends at (zero if out of memory.)
+ */
+static unsigned int
+build_trie_insert (struct build_trie *trie, const unsigned char *s,
+                   size_t len, unsigned int reverse)
+{
+        struct build_node *nodes;
+        unsigned int node = 0, child, slot;
+        size_t i;
+
+        for (i = 0; i != len; i++) {
+                unsigned char c = reverse ? s[len - 1 - i] : s[i];
+
+                child = build_trie_child (trie, node, c);
+                if (child) {
+                        node = child;
+                        continue;
+                }
+
+                if ((trie->nedges + 1) * 2 > trie->mask + 1
+                    && build_trie_grow_edges (trie) < 0)
+                        return 0;
+
+                if (trie->nnodes == trie->maxnodes) {
+                        nodes = (struct build_node *)
+                            saferealloc (trie->nodes, trie->maxnodes * 2
+                                         * sizeof (struct build_node));
+                        if (!nodes)
+                                return 0;
+                        trie->nodes = nodes;
+                        trie->maxnodes *= 2;
+                }
+
+                child = trie->nnodes++;
+                memset (&trie->nodes[child], 0, sizeof (struct build_node));
+                trie->nodes[child].parent = node;
+                trie->nodes[child].depth = trie->nodes[node].depth + 1;
+                trie->nodes[child].c = c;
+
+                slot = edge_slot (trie->edges, trie->mask, node, c);
+                trie->edges[slot].parent = node;
+                trie->edges[slot].child = child;
+                trie->edges[slot].c = c;
+                trie->nedges++;
+
+                node = child;
+        }
+
+        return node;
+}
+
+/*
+ * Work out the failure links of the Aho-Corasick automaton.  Each node's
+ * link depends on its parent's, so the nodes are done in order of depth;
+ * that order is returned, to number the nodes by when they are saved.
+ */
+static unsigned int *build_trie_link (struct build_trie *trie)
+{
+        struct build_node *nodes = trie->nodes;
+        unsigned int *order, *count, maxdepth = 0, i, v, f;
+
+        for (i = 1; i != trie->nnodes; i++)
+                maxdepth = max (maxdepth, nodes[i].depth);
+
+        order = (unsigned int *) safemalloc (trie->nnodes
+                                             * sizeof (unsigned int));
+        count = (unsigned int *) safecalloc (maxdepth + 2,
+                                             sizeof (unsigned int));
+        if (!order || !count) {
+                safefree (order);
+                safefree (count);
+                return NULL;
+        }
+
+        for (i = 0; i != trie->nnodes; i++)
+                count[nodes[i].depth + 1]++;
+        for (i = 1; i <= maxdepth + 1; i++)
+                count[i] += count[i - 1];
+        for (i = 0; i != trie->nnodes; i++)
+                order[count[nodes[i].depth]++] = i;
+
+        for (i = 1; i != trie->nnodes; i++) {
+                v = order[i];
+
+                f = 0;
+                if (nodes[v].parent != 0) {
+                        f = nodes[nodes[v].parent].fail;
+                        while (f && !build_trie_child (trie, f, nodes[v].c))
+                                f = nodes[f].fail;
+                        f = build_trie_child (trie, f, nodes[v].c);
+                }
+
+                nodes[v].fail = f;
+                nodes[v].output = nodes[f].patterns ? f : nodes[f].output;
+        }
+
+        safefree (count);
+        return order;
+}
+
+static void builder_free (struct pattern_builder *build)
+{
+        unsigned int i;
+
+        if (!build)
+                return;
+
+        for (i = 0; i != build->npatterns; i++) {
+                if (build->patterns[i].re) {
+                        regfree (build->patterns[i].re);
+                        safefree (build->patterns[i].re);
+                }
+                safefree (build->patterns[i].source);
+                safefree (build->patterns[i].shape);
+        }
+        safefree (build->patterns);
+        safefree (build->regexes);
+
+        for (i = 0; i != NTRIES; i++) {
+                safefree (build->tries[i].nodes);
+                safefree (build->tries[i].edges);
+        }
+        safefree (build);
+}
+
+static struct pattern_set *set_alloc (int cflags)
+{
+        struct pattern_set *set;
+
+        set = (struct pattern_set *) safecalloc (1, sizeof (*set));
+        if (!set)
+                return NULL;
+
+        set->cflags = cflags;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_init (&set->lock, NULL);
+#endif
+        return set;
+}
+
+struct pattern_set *pattern_set_create (int cflags)
+{
+        struct pattern_set *set;
+        unsigned int i;
+
+        set = set_alloc (cflags | REG_NOSUB);
+        if (!set)
+                return NULL;
+
+        set->build = (struct pattern_builder *)
+            safecalloc (1, sizeof (struct pattern_builder));
+        if (!set->build) {
+                pattern_set_free (set);
+                return NULL;
+        }
+
+        for (i = 0; i != NTRIES; i++) {
+                if (build_trie_init (&set->build->tries[i]) < 0) {
+                        pattern_set_free (set);
+                        return NULL;
+                }
+        }
+
+        return set;
+}
+
+void pattern_set_free (struct pattern_set *set)
+{
+        uint32_t i;
+
+        if (!set)
+                return;
+
+        builder_free (set->build);
+
+        if (set->re) {
+                for (i = 0; i != set->header->npatterns; i++) {
+                        if (set->re[i] && set->re[i] != &failed_regex) {
+                                regfree (set->re[i]);
+                                safefree (set->re[i]);
+                        }
+                }
+                safefree (set->re);
+        }
+        if (set->combined) {
+                regfree (set->combined);
+                safefree (set->combined);
+        }
+
+        if (set->mapped)
+                munmap (set->image, set->size);
+        else
+                safefree (set->image);
+
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_destroy (&set->lock);
+#endif
+        safefree (set);
+}
+
+/*
+ * What literal_part() finds out about an expression.
+ */
+struct literal {
+        char *text;             /* the longest plain part */
+        size_t len;
+
+        char *shape;            /* if "fixed", what it matches */
+        size_t shape_len, shape_at;
+
+        unsigned int start, end;        /* anchors */
+        unsigned int whole;     /* nothing but the plain part */
+        unsigned int fixed;     /* nothing but plain characters and '.'s */
+};
+
+/*
+ * Find the longest plain string which every text the expression matches
+ * must contain, and copy it to "lit->text" (which, like "lit->shape",
+ * has room for the whole expression.)  "whole" is set if the expression
+ * is nothing more than that string, between the anchors reported in
+ * "start" and "end", and "fixed" if it is nothing more than characters
+ * and '.'s, which "shape" then spells out with a zero for each '.'.
+ *
+ * This errs on the side of caution: anything in a group, a bracket
+ * expression or an alternation isn't taken to be required, nor is a
+ * character followed by any kind of repetition.
+ */
+static int literal_part (const char *re, unsigned int extended,
+                         struct literal *lit)
+{
+        const char *p = re, *q;
+        char *run;
+        size_t len = 0;
+        unsigned int depth = 0, quantified, wild;
+        int c;
+
+        lit->len = lit->shape_len = lit->shape_at = 0;
+        lit->start = lit->end = FALSE;
+        lit->whole = lit->fixed = TRUE;
+
+        run = (char *) safemalloc (strlen (re) + 1);
+        if (!run)
+                return -1;
+
+        if (*p == '^') {
+                lit->start = TRUE;
+                p++;
+        }
+
+        for (; *p; p = q) {
+                q = p + 1;      /* the next token */
+                c = -1;         /* the character matched, if a plain one */
+                wild = FALSE;   /* whether it is '.' */
+
+                if (*p == '\\' && !p[1]) {
+                        break;
+                } else if (*p == '\\') {
+                        q = p + 2;
+
+                        if (!extended && p[1] == '{') {
+                                q = strstr (q, "\\}");
+                                q = q ? q + 2 : p + strlen (p);
+                        } else if (!extended && p[1] == '(') {
+                                depth++;
+                        } else if (!extended && p[1] == ')') {
+                                depth--;
+                        } else if (!extended && p[1] == '|') {
+                                break;
+                        } else if (!isalnum ((unsigned char) p[1])
+                                   && !strchr ("<>`'\n", p[1])
+                                   && (extended || !strchr ("}?+", p[1]))) {
+                                c = (unsigned char) p[1];
+                        }
+                } else if (*p == '[') {
+                        if (*q == '^')
+                                q++;
+                        if (*q == ']')
+                                q++;
+                        while (*q && *q != ']') {
+                                if (*q == '[' && q[1] && strchr (":.=", q[1])
+                                    && strchr (q + 2, ']'))
+                                        q = strchr (q + 2, ']');
+                                q++;
+                        }
+                        if (*q)
+                                q++;
+                } else if (extended && *p == '{') {
+                        q = strchr (q, '}');
+                        q = q ? q + 1 : p + strlen (p);
+                } else if (*p == '$' && !p[1]) {
+                        lit->end = TRUE;
+                        continue;
+                } else if (extended && *p == '|') {
+                        break;
+                } else if (extended && *p == '(') {
+                        depth++;
+                } else if (extended && *p == ')') {
+                        depth--;
+                } else if (*p == '.') {
+                        wild = TRUE;
+                } else if (!strchr ("*^$\n", *p)
+                           && (!extended || !strchr ("}?+", *p))) {
+                        c = (unsigned char) *p;
+                }
+
+                if (extended)
+                        quantified = *q && strchr ("*?+{", *q);
+                else
+                        quantified = *q == '*'
+                            || (*q == '\\' && q[1] && strchr ("{?+", q[1]));
+
+                if (c >= 0 && depth == 0 && !quantified) {
+                        run[len++] = (char) c;
+                        lit->shape[lit->shape_len++] = (char) c;
+                        continue;
+                }
+
+                lit->whole = FALSE;
+                if (len > lit->len) {
+                        memcpy (lit->text, run, len);
+                        lit->len = len;
+                        lit->shape_at = lit->shape_len;
+                }
+                len = 0;
+
+                if (wild && depth == 0 && !quantified)
+                        lit->shape[lit->shape_len++] = '\0';
+                else
+                        lit->fixed = FALSE;
+        }
+
+        /* An alternation, or a stray backslash */
+        if (*p) {
+                lit->len = 0;
+                lit->whole = lit->fixed = FALSE;
+        } else if (len > lit->len) {
+                memcpy (lit->text, run, len);
+                lit->len = len;
+                lit->shape_at = lit->shape_len;
+        }
+
+        safefree (run);
+        return 0;
+}
+
+/*
+ * Add an expression to the set.  Returns -1 if it is not a valid
+ * regular expression.
+ */
+int pattern_set_add (struct pattern_set *set, const char *pattern)
+{
+        struct pattern_builder *build = set->build;
+        struct build_pattern *pat, *tmp;
+        struct build_trie *trie = NULL;
+        struct literal lit;
+        unsigned int node, reverse = FALSE, *regexes;
+        size_t i, size = strlen (pattern) + 1;
+        int ret = -1;
+
+        if (!build)
+                return -1;
+
+        if (build->npatterns == build->maxpatterns) {
+                tmp = (struct build_pattern *)
+                    saferealloc (build->patterns, (build->maxpatterns + 64)
+                                 * sizeof (struct build_pattern));
+                if (!tmp)
+                        return -1;
+                build->patterns = tmp;
+                build->maxpatterns += 64;
+        }
+
+        pat = &build->patterns[build->npatterns];
+        memset (pat, 0, sizeof (*pat));
+
+        lit.text = (char *) safemalloc (size);
+        lit.shape = (char *) safemalloc (size);
+        if (!lit.text || !lit.shape
+            || literal_part (pattern, set->cflags & REG_EXTENDED, &lit) < 0)
+                goto out;
+
+        if (set->cflags & REG_ICASE) {
+                for (i = 0; i != lit.len; i++)
+                        lit.text[i] = tolower ((unsigned char) lit.text[i]);
+                for (i = 0; i != lit.shape_len; i++)
+                        lit.shape[i] = tolower ((unsigned char) lit.shape[i]);
+        }
+
+        if (lit.start)
+                pat->flags |= PATTERN_START;
+        if (lit.end)
+                pat->flags |= PATTERN_END;
+
+        if (lit.whole && lit.len > 0) {
+                if (lit.start) {
+                        trie = &build->tries[TRIE_PREFIXES];
+                } else if (lit.end) {
+                        trie = &build->tries[TRIE_SUFFIXES];
+                        reverse = TRUE;
+                } else {
+                        trie = &build->tries[TRIE_SUBSTRINGS];
+                }
+        } else if (lit.len >= MIN_LITERAL && lit.fixed) {
+                trie = &build->tries[TRIE_SUBSTRINGS];
+                pat->flags |= PATTERN_SHAPE;
+                pat->shape = lit.shape;
+                pat->shape_len = lit.shape_len;
+                pat->shape_at = lit.shape_at;
+                lit.shape = NULL;
+        } else if (lit.len >= MIN_LITERAL) {
+                trie = &build->tries[TRIE_SUBSTRINGS];
+                pat->flags = PATTERN_REGEXEC;
+        } else {
+                pat->flags = PATTERN_ALWAYS;
+        }
+
+        /* The others are matched without regexec() */
+        if (pat->flags & (PATTERN_REGEXEC | PATTERN_ALWAYS)) {
+                pat->re = (regex_t *) safemalloc (sizeof (regex_t));
+                if (!pat->re || regcomp (pat->re, pattern, set->cflags) != 0) {
+                        safefree (pat->re);
+                        goto out;
+                }
+
+                pat->source = safestrdup (pattern);
+                if (!pat->source)
+                        goto out;
+        }
+
+        if (trie) {
+                node = build_trie_insert (trie, (unsigned char *) lit.text,
+                                          lit.len, reverse);
+                if (node == 0)
+                        goto out;
+                pat->next = trie->nodes[node].patterns;
+                trie->nodes[node].patterns = build->npatterns + 1;
+        } else {
+                regexes = (unsigned int *)
+                    saferealloc (build->regexes, (build->nregexes + 1)
+                                 * sizeof (unsigned int));
+                if (!regexes)
+                        goto out;
+                build->regexes = regexes;
+                build->regexes[build->nregexes++] = build->npatterns;
+        }
+
+        build->npatterns++;
+        ret = 0;
+
+out:
+        if (ret < 0) {
+                if (pat->re) {
+                        regfree (pat->re);
+                        safefree (pat->re);
+                }
+                safefree (pat->source);
+                safefree (pat->shape);
+        }
+        safefree (lit.text);
+        safefree (lit.shape);
+        return ret;
+}
+
+/*
+ * Add the expressions in a list, one to a line, where white space ends
+ * an expression and '#' starts a comment unless escaped.  Returns -1 if
+ * one of them was no good, after copying it to "bad", or if the list
+ * couldn't be read, leaving "bad" empty.
+ */
+int pattern_set_read (struct pattern_set *set, FILE *fd, char *bad,
+                      size_t size)
+{
+        char buf[PATTERN_LINE_LEN];
+        char *s;
+
+        while (fgets (buf, PATTERN_LINE_LEN, fd)) {
+                /*
+                 * Remove any trailing white space and
+                 * comments.
+                 */
+                s = buf;
+                while (*s) {
+                        if (isspace ((unsigned char) *s))
+                                break;
+                        if (*s == '#') {
+                                /*
+                                 * If the '#' char is preceeded by
+                                 * an escape, it's not a comment
+                                 * string.
+                                 */
+                                if (s == buf || *(s - 1) != '\\')
+                                        break;
+                        }
+                        ++s;
+                }
+                *s = '\0';
+
+                /* skip leading whitespace */
+                s = buf;
+                while (*s && isspace ((unsigned char) *s))
+                        s++;
+
+                /* skip blank lines and comments */
+                if (*s == '\0')
+                        continue;
+
+                if (pattern_set_add (set, s) < 0) {
+                        snprintf (bad, size, "%s", s);
+                        return -1;
+                }
+        }
+
+        if (ferror (fd)) {
+                if (size)
+                        *bad = '\0';
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Whether an extended expression means the same inside a group of its
+ * own: it mustn't use back references (which would be renumbered), nor
+ * have a ')' left over, which outside a group stands for itself.
+ */
+static int can_combine (const char *re)
+{
+        const char *p;
+        unsigned int depth = 0;
+
+        for (p = re; *p; p++) {
+                if (*p == '\\') {
+                        if (!p[1] || isdigit ((unsigned char) p[1]))
+                                return FALSE;
+                        p++;
+                } else if (*p == '[') {
+                        p++;
+                        if (*p == '^')
+                                p++;
+                        if (*p == ']')
+                                p++;
+                        while (*p && *p != ']') {
+                                if (*p == '[' && strchr (":.=", p[1])) {
+                                        const char *q = strchr (p + 2, p[1]);
+
+                                        while (q && q[1] != ']')
+                                                q = strchr (q + 1, p[1]);
+                                        if (!q)
+                                                return FALSE;
+                                        p = q + 1;
+                                }
+                                p++;
+                        }
+                        if (!*p)
+                                return FALSE;
+                } else if (*p == '(') {
+                        depth++;
+                } else if (*p == ')') {
+                        if (depth == 0)
+                                return FALSE;
+                        depth--;
+                }
+        }
+
+        return depth == 0;
+}
+
+/*
+ * The expressions tried on every text as one, if they are extended
+ * expressions that can be combined.
+ */
+static char *combine (const struct pattern_set *set)
+{
+        const struct pattern_builder *build = set->build;
+        const char *src;
+        char *combined, *p;
+        size_t len = 1;
+        unsigned int i;
+
+        if (build->nregexes < 2 || !(set->cflags & REG_EXTENDED))
+                return NULL;
+
+        for (i = 0; i != build->nregexes; i++) {
+                src = build->patterns[build->regexes[i]].source;
+                if (!can_combine (src))
+                        return NULL;
+                len += strlen (src) + 3;
+        }
+
+        combined = (char *) safemalloc (len);
+        if (!combined)
+                return NULL;
+
+        for (p = combined, i = 0; i != build->nregexes; i++)
+                p += sprintf (p, "%s(%s)", i ? "|" : "",
+                              build->patterns[build->regexes[i]].source);
+
+        return combined;
+}
+
+/*
+ * Point the set at the parts of its image.
+ */
+static void set_view (struct pattern_set *set)
+{
+        const struct set_header *header;
+        unsigned int t;
+
+        header = (const struct set_header *) set->image;
+        set->header = header;
+        set->patterns = (const struct set_pattern *)
+            (set->image + header->patterns);
+        set->regexes = (const uint32_t *) (set->image + header->regexes);
+
+        for (t = 0; t != NTRIES; t++) {
+                set->tries[t].nodes = (const struct set_node *)
+                    (set->image + header->tries[t].nodes);
+                set->tries[t].edges = (const struct set_edge *)
+                    (set->image + header->tries[t].edges);
+                set->tries[t].nnodes = header->tries[t].nnodes;
+                set->tries[t].mask = header->tries[t].mask;
+        }
+}
+
+/*
+ * Compile the expressions tried on every text up front, rather than
+ * locking for each of them on every text.
+ */
+static void compile_always (struct pattern_set *set)
+{
+        const struct set_header *header = set->header;
+        regex_t *re;
+        uint32_t i, n;
+
+        if (header->combined) {
+                set->combined = (regex_t *) safemalloc (sizeof (regex_t));
+                if (set->combined
+                    && regcomp (set->combined, set->image + header->combined,
+                                set->cflags) == 0)
+                        return;
+                safefree (set->combined);
+        }
+
+        for (i = 0; i != header->nregexes; i++) {
+                n = set->regexes[i];
+                if (set->re[n])
+                        continue;
+
+                re = (regex_t *) safemalloc (sizeof (regex_t));
+                if (re && regcomp (re, set->image + set->patterns[n].source,
+                                   set->cflags) != 0)
+                        safefree (re);
+                set->re[n] = re ? re : &failed_regex;
+        }
+}
+
+/*
+ * Get the set ready for matching, once all the expressions have been
+ * added, by laying it out as it is saved.
+ */
+int pattern_set_compile (struct pattern_set *set)
+{
+        struct pattern_builder *build = set->build;
+        const struct build_pattern *pat;
+        const struct build_trie *trie;
+        struct set_header *header;
+        struct set_pattern *pats;
+        struct set_node *nodes;
+        struct set_edge *edges;
+        unsigned int *order[NTRIES], *rank = NULL, i, t, v;
+        size_t off_patterns, off_nodes[NTRIES], off_edges[NTRIES];
+        size_t off_regexes, off_strings, size;
+        char *combined, *image, *str;
+        int ret = -1;
+
+        if (!build)
+                return 0;
+
+        memset (order, 0, sizeof (order));
+        for (t = 0; t != NTRIES; t++) {
+                order[t] = build_trie_link (&build->tries[t]);
+                if (!order[t])
+                        goto out;
+        }
+
+        combined = combine (set);
+
+        size = sizeof (struct set_header);
+        off_patterns = size;
+        size += build->npatterns * sizeof (struct set_pattern);
+        for (t = 0; t != NTRIES; t++) {
+                off_nodes[t] = size;
+                size += build->tries[t].nnodes * sizeof (struct set_node);
+                off_edges[t] = size;
+                size += (build->tries[t].mask + 1) * sizeof (struct set_edge);
+        }
+        off_regexes = size;
+        size += build->nregexes * sizeof (uint32_t);
+
+        off_strings = size;
+        for (i = 0; i != build->npatterns; i++) {
+                pat = &build->patterns[i];
+                if (pat->source)
+                        size += strlen (pat->source) + 1;
+                size += pat->shape_len;
+        }
+        if (combined)
+                size += strlen (combined) + 1;
+        size = (size + 3) & ~(size_t) 3;
+
+        image = (uint32_t) size == size ? (char *) safecalloc (1, size) : NULL;
+        if (!image) {
+                safefree (combined);
+                goto out;
+        }
+
+        header = (struct set_header *) image;
+        memcpy (header->magic, PATTERN_SET_MAGIC, PATTERN_SET_MAGIC_LEN);
+        header->version = PATTERN_SET_VERSION;
+        header->byte_order = PATTERN_SET_BYTE_ORDER;
+        header->size = size;
+        header->cflags = set->cflags;
+        header->npatterns = build->npatterns;
+        header->patterns = off_patterns;
+        header->nregexes = build->nregexes;
+        header->regexes = off_regexes;
+        header->strings = off_strings;
+        header->strings_size = size - off_strings;
+
+        str = image + off_strings;
+        pats = (struct set_pattern *) (image + off_patterns);
+        for (i = 0; i != build->npatterns; i++) {
+                pat = &build->patterns[i];
+                pats[i].flags = pat->flags;
+                pats[i].next = pat->next;
+
+                if (pat->source) {
+                        pats[i].source = str - image;
+                        strcpy (str, pat->source);
+                        str += strlen (str) + 1;
+                }
+                if (pat->shape) {
+                        pats[i].shape = str - image;
+                        pats[i].shape_len = pat->shape_len;
+                        pats[i].shape_at = pat->shape_at;
+                        memcpy (str, pat->shape, pat->shape_len);
+                        str += pat->shape_len;
+                }
+        }
+
+        for (i = 0; i != build->nregexes; i++)
+                ((uint32_t *) (image + off_regexes))[i] = build->regexes[i];
+
+        if (combined) {
+                header->combined = str - image;
+                strcpy (str, combined);
+                safefree (combined);
+        }
+
+        /* Number the nodes by depth */
+        for (t = 0; t != NTRIES; t++) {
+                trie = &build->tries[t];
+
+                safefree (rank);
+                rank = (unsigned int *) safemalloc (trie->nnodes
+                                                    * sizeof (unsigned int));
+                if (!rank) {
+                        safefree (image);
+                        goto out;
+                }
+                for (i = 0; i != trie->nnodes; i++)
+                        rank[order[t][i]] = i;
+
+                nodes = (struct set_node *) (image + off_nodes[t]);
+                for (i = 0; i != trie->nnodes; i++) {
+                        v = order[t][i];
+                        nodes[i].fail = rank[trie->nodes[v].fail];
+                        nodes[i].output = rank[trie->nodes[v].output];
+                        nodes[i].patterns = trie->nodes[v].patterns;
+                }
+
+                edges = (struct set_edge *) (image + off_edges[t]);
+                for (i = 0; i <= trie->mask; i++) {
+                        const struct set_edge *e = &trie->edges[i];
+
+                        if (!e->child)
+                                continue;
+                        v = edge_slot (edges, trie->mask, rank[e->parent],
+                                       (unsigned char) e->c);
+                        edges[v].parent = rank[e->parent];
+                        edges[v].child = rank[e->child];
+                        edges[v].c = e->c;
+                }
+
+                header->tries[t].nnodes = trie->nnodes;
+                header->tries[t].nodes = off_nodes[t];
+                header->tries[t].mask = trie->mask;
+                header->tries[t].edges = off_edges[t];
+        }
+
+        set->image = image;
+        set->size = size;
+        set_view (set);
+
+        /* Keep what was compiled along the way */
+        set->re = (regex_t **) safecalloc (build->npatterns + 1,
+                                           sizeof (regex_t *));
+        if (!set->re)
+                goto out;
+        for (i = 0; i != build->npatterns; i++) {
+                set->re[i] = build->patterns[i].re;
+                build->patterns[i].re = NULL;
+        }
+
+        compile_always (set);
+
+        builder_free (build);
+        set->build = NULL;
+        ret = 0;
+
+out:
+        for (t = 0; t != NTRIES; t++)
+                safefree (order[t]);
+        safefree (rank);
+        return ret;
+}
+
+/*
+ * Whether "count" items of "size" bytes at "offset" lie within an image
+ * of "image_size" bytes, past its header.
+ */
+static int
+in_image (size_t image_size, uint32_t offset, uint32_t count, size_t size)
+{
+        return offset % 4 == 0 && offset >= sizeof (struct set_header)
+            && offset <= image_size
+            && count <= (image_size - offset) / size;
+}
+
+/*
+ * Whether a string at "offset" lies within the strings of the image.
+ */
+static int
+in_strings (const char *image, uint32_t offset, uint32_t len,
+            unsigned int terminated)
+{
+        const struct set_header *header = (const struct set_header *) image;
+        uint32_t left;
+
+        if (offset < header->strings
+            || offset - header->strings > header->strings_size)
+                return FALSE;
+
+        left = header->strings_size - (offset - header->strings);
+        if (terminated)
+                return memchr (image + offset, '\0', left) != NULL;
+        return len <= left;
+}
+
+/*
+ * Check that an image read from a file won't lead matching astray: that
+ * everything lies within it, that each failure and output link leads to
+ * a shallower node and each pattern to an earlier one, and that every
+ * edge table has a free slot to end a search.  Returns why not, if not.
+ */
+static const char *check_image (const char *image, size_t size)
+{
+        const struct set_header *header = (const struct set_header *) image;
+        const struct set_pattern *pats;
+        const struct set_node *nodes;
+        const struct set_edge *edges;
+        const uint32_t *regexes;
+        uint32_t i, t, nnodes, free_slots;
+
+        if (size < sizeof (struct set_header)
+            || memcmp (header->magic, PATTERN_SET_MAGIC,
+                       PATTERN_SET_MAGIC_LEN) != 0)
+                return "not a filter database";
+        if (header->byte_order != PATTERN_SET_BYTE_ORDER)
+                return "made on a machine with a different byte order";
+        if (header->version != PATTERN_SET_VERSION)
+                return "made by a different version";
+        if (header->size != size)
+                return "truncated";
+
+        if (!in_image (size, header->patterns, header->npatterns,
+                       sizeof (struct set_pattern))
+            || !in_image (size, header->regexes, header->nregexes,
+                          sizeof (uint32_t))
+            || !in_image (size, header->strings, header->strings_size, 1))
+                return "damaged";
+
+        pats = (const struct set_pattern *) (image + header->patterns);
+        for (i = 0; i != header->npatterns; i++) {
+                if ((pats[i].flags & ~PATTERN_FLAGS) || pats[i].next > i)
+                        return "damaged";
+                if ((pats[i].flags & (PATTERN_REGEXEC | PATTERN_ALWAYS))
+                    && !in_strings (image, pats[i].source, 0, TRUE))
+                        return "damaged";
+                if ((pats[i].flags & PATTERN_SHAPE)
+                    && (!in_strings (image, pats[i].shape,
+                                     pats[i].shape_len, FALSE)
+                        || pats[i].shape_at > pats[i].shape_len))
+                        return "damaged";
+        }
+
+        regexes = (const uint32_t *) (image + header->regexes);
+        for (i = 0; i != header->nregexes; i++)
+                if (regexes[i] >= header->npatterns
+                    || !(pats[regexes[i]].flags & PATTERN_ALWAYS))
+                        return "damaged";
+
+        if (header->combined
+            && !in_strings (image, header->combined, 0, TRUE))
+                return "damaged";
+
+        for (t = 0; t != NTRIES; t++) {
+                const struct set_trie *trie = &header->tries[t];
+
+                nnodes = trie->nnodes;
+                if (nnodes == 0 || (trie->mask & (trie->mask + 1))
+                    || !in_image (size, trie->nodes, nnodes,
+                                  sizeof (struct set_node))
+                    || trie->mask == 0xffffffff
+                    || !in_image (size, trie->edges, trie->mask + 1,
+                                  sizeof (struct set_edge)))
+                        return "damaged";
+
+                nodes = (const struct set_node *) (image + trie->nodes);
+                for (i = 0; i != nnodes; i++)
+                        if ((i ? nodes[i].fail >= i || nodes[i].output >= i
+                             : nodes[i].fail || nodes[i].output)
+                            || nodes[i].patterns > header->npatterns)
+                                return "damaged";
+
+                edges = (const struct set_edge *) (image + trie->edges);
+                free_slots = 0;
+                for (i = 0; i <= trie->mask; i++) {
+                        if (!edges[i].child)
+                                free_slots++;
+                        else if (edges[i].child >= nnodes || edges[i].c > 255)
+                                return "damaged";
+                }
+                if (free_slots == 0)
+                        return "damaged";
+        }
+
+        return NULL;
+}
+
+/*
+ * Write the compiled set to a file, which is replaced in one go.
+ */
+int pattern_set_save (const struct pattern_set *set, const char *path)
+{
+        const char *p;
+        char *tmp;
+        size_t left;
+        ssize_t len = 0;
+        int fd, saved;
+
+        if (!set->image) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        tmp = (char *) safemalloc (strlen (path) + 5);
+        if (!tmp)
+                return -1;
+        sprintf (tmp, "%s.tmp", path);
+
+        fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                saved = errno;
+                safefree (tmp);
+                errno = saved;
+                return -1;
+        }
+
+        for (p = set->image, left = set->size; left != 0;
+             p += len, left -= len) {
+                len = write (fd, p, left);
+                if (len < 0 && errno == EINTR)
+                        len = 0;
+                else if (len < 0)
+                        break;
+        }
+
+        if (left == 0 && fsync (fd) == 0) {
+                if (close (fd) == 0 && rename (tmp, path) == 0) {
+                        safefree (tmp);
+                        return 0;
+                }
+                fd = -1;
+        }
+
+        saved = errno;
+        if (fd >= 0)
+                close (fd);
+        unlink (tmp);
+        safefree (tmp);
+        errno = saved;
+        return -1;
+}
+
+/*
+ * Map a file written by pattern_set_save().  Returns NULL, and says why
+ * in "error", if it can't be used.
+ */
+struct pattern_set *pattern_set_load (const char *path, const char **error)
+{
+        struct pattern_set *set;
+        struct stat st;
+        char *image;
+        int fd;
+
+        fd = open (path, O_RDONLY);
+        if (fd < 0) {
+                *error = strerror (errno);
+                return NULL;
+        }
+
+        if (fstat (fd, &st) < 0) {
+                *error = strerror (errno);
+                close (fd);
+                return NULL;
+        }
+        if (st.st_size < (off_t) sizeof (struct set_header)
+            || (uint32_t) st.st_size != st.st_size) {
+                *error = "not a filter database";
+                close (fd);
+                return NULL;
+        }
+
+        image = (char *) mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close (fd);
+        if (image == MAP_FAILED) {
+                *error = strerror (errno);
+                return NULL;
+        }
+
+        *error = check_image (image, st.st_size);
+        if (*error) {
+                munmap (image, st.st_size);
+                return NULL;
+        }
+
+        set = set_alloc (((const struct set_header *) image)->cflags);
+        if (!set) {
+                *error = strerror (ENOMEM);
+                munmap (image, st.st_size);
+                return NULL;
+        }
+
+        set->image = image;
+        set->size = st.st_size;
+        set->mapped = TRUE;
+        set_view (set);
+
+        set->re = (regex_t **) safecalloc (set->header->npatterns + 1,
+                                           sizeof (regex_t *));
+        if (!set->re) {
+                *error = strerror (ENOMEM);
+                pattern_set_free (set);
+                return NULL;
+        }
+        compile_always (set);
+
+        return set;
+}
+
+/*
+ * The regex_t of a pattern, compiled the first time it is asked for.
+ */
+static const regex_t *pattern_regex (struct pattern_set *set, uint32_t n)
+{
+        regex_t *re;
+
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock (&set->lock);
+#endif
+        re = set->re[n];
+        if (!re) {
+                re = (regex_t *) safemalloc (sizeof (regex_t));
+                if (re && regcomp (re, set->image + set->patterns[n].source,
+                                   set->cflags) != 0)
+                        safefree (re);
+                set->re[n] = re ? re : &failed_regex;
+        }
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock (&set->lock);
+#endif
+
+        return re != &failed_regex ? re : NULL;
+}
+
+/*
+ * Compare the line around a find, which ends at "pos", with the shape of
+ * the expression.
+ */
+static int
+shape_matches (const struct pattern_set *set, const struct set_pattern *pat,
+               const unsigned char *line, size_t len, size_t pos)
+{
+        const unsigned char *shape =
+            (const unsigned char *) set->image + pat->shape;
+        unsigned int icase = set->cflags & REG_ICASE;
+        size_t start, i;
+        unsigned char c;
+
+        if (pos < pat->shape_at)
+                return FALSE;
+        start = pos - pat->shape_at;
+        if (pat->shape_len > len - start)
+                return FALSE;
+
+        if ((pat->flags & PATTERN_START) && start != 0)
+                return FALSE;
+        if ((pat->flags & PATTERN_END) && start + pat->shape_len != len)
+                return FALSE;
+
+        for (i = 0; i != pat->shape_len; i++) {
+                c = line[start + i];
+                if (icase)
+                        c = tolower (c);
+                if (shape[i] && shape[i] != c)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/*
+ * Check the patterns ending at a node of one of the tries, found in the
+ * line just before "pos".
+ */
+static int
+node_matches (struct pattern_set *set, uint32_t first, const char *text,
+              const unsigned char *line, size_t len, size_t pos)
+{
+        const struct set_pattern *pat;
+        const regex_t *re;
+
+        for (; first; first = pat->next) {
+                pat = &set->patterns[first - 1];
+
+                if (pat->flags & PATTERN_SHAPE) {
+                        if (shape_matches (set, pat, line, len, pos))
+                                return TRUE;
+                        continue;
+                }
+
+                if ((pat->flags & PATTERN_END) && pos != len)
+                        continue;
+
+                if (!(pat->flags & PATTERN_REGEXEC))
+                        return TRUE;
+
+                re = pattern_regex (set, first - 1);
+                if (re && regexec (re, text, 0, NULL, 0) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+static uint32_t
+trie_child (const struct pattern_set *set, unsigned int t, uint32_t parent,
+            unsigned char c)
+{
+        return set->tries[t].edges[edge_slot (set->tries[t].edges,
+                                              set->tries[t].mask, parent,
+                                              c)].child;
+}
+
+/*
+ * Look for the expressions in the tries along a line of the text.
+ */
+static int
+match_line (struct pattern_set *set, const char *text,
+            const unsigned char *line, size_t len)
+{
+        const struct set_node *nodes;
+        unsigned int icase = set->cflags & REG_ICASE;
+        uint32_t node, next, out;
+        size_t pos;
+        unsigned char c;
+
+#define FOLD(c) (icase ? (unsigned char) tolower (c) : (c))
+
+        /* Anchored at the start (or at both ends) */
+        nodes = set->tries[TRIE_PREFIXES].nodes;
+        for (node = 0, pos = 0;
+             set->tries[TRIE_PREFIXES].nnodes > 1 && pos != len; pos++) {
+                node = trie_child (set, TRIE_PREFIXES, node,
+                                   FOLD (line[pos]));
+                if (!node)
+                        break;
+                if (nodes[node].patterns
+                    && node_matches (set, nodes[node].patterns, text, line,
+                                     len, pos + 1))
+                        return TRUE;
+        }
+
+        /* Anchored at the end */
+        nodes = set->tries[TRIE_SUFFIXES].nodes;
+        for (node = 0, pos = len;
+             set->tries[TRIE_SUFFIXES].nnodes > 1 && pos != 0; pos--) {
+                node = trie_child (set, TRIE_SUFFIXES, node,
+                                   FOLD (line[pos - 1]));
+                if (!node)
+                        break;
+                if (nodes[node].patterns
+                    && node_matches (set, nodes[node].patterns, text, line,
+                                     len, len))
+                        return TRUE;
+        }
+
+        /* Anywhere */
+        nodes = set->tries[TRIE_SUBSTRINGS].nodes;
+        for (node = 0, pos = 0;
+             set->tries[TRIE_SUBSTRINGS].nnodes > 1 && pos != len; pos++) {
+                c = FOLD (line[pos]);
+                while ((next = trie_child (set, TRIE_SUBSTRINGS, node, c)) == 0
+                       && node)
+                        node = nodes[node].fail;
+                node = next;
+
+                out = nodes[node].patterns ? node : nodes[node].output;
+                for (; out; out = nodes[out].output)
+                        if (node_matches (set, nodes[out].patterns, text,
+                                          line, len, pos + 1))
+                                return TRUE;
+        }
+
+#undef FOLD
+
+        return FALSE;
+}
+
+/*
+ * Returns non-zero if any of the expressions matches the text.  With
+ * REG_NEWLINE no match goes past the end of a line, and the anchors
+ * match at either end of each one, so the lines are looked at in turn.
+ */
+int pattern_set_match (struct pattern_set *set, const char *text)
+{
+        const unsigned char *line = (const unsigned char *) text;
+        const unsigned char *eol;
+        const regex_t *re;
+        size_t len = strlen (text);
+        uint32_t i;
+
+        if (!set->image)
+                return FALSE;
+
+        if (set->cflags & REG_NEWLINE) {
+                while ((eol = (const unsigned char *)
+                        memchr (line, '\n', len)) != NULL) {
+                        if (match_line (set, text, line, eol - line))
+                                return TRUE;
+                        len -= eol + 1 - line;
+                        line = eol + 1;
+                }
+        }
+        if (match_line (set, text, line, len))
+                return TRUE;
+
+        if (set->combined)
+                return regexec (set->combined, text, 0, NULL, 0) == 0;
+
+        for (i = 0; i != set->header->nregexes; i++) {
+                re = set->re[set->regexes[i]];
+                if (re != &failed_regex
+                    && regexec (re, text, 0, NULL, 0) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+int pattern_set_get_cflags (const struct pattern_set *set)
+{
+        return set->cflags;
+}
+
+void
+pattern_set_get_stats (const struct pattern_set *set,
+                       struct pattern_set_stats *stats)
+{
+        unsigned int i, n, flags;
+
+        memset (stats, 0, sizeof (*stats));
+
+        n = set->build ? set->build->npatterns : set->header->npatterns;
+        for (i = 0; i != n; i++) {
+                flags = set->build ? set->build->patterns[i].flags
+                    : set->patterns[i].flags;
+
+                if (flags & PATTERN_ALWAYS)
+                        stats->regex++;
+                else if (flags & PATTERN_REGEXEC)
+                        stats->checked++;
+                else if (flags & PATTERN_SHAPE)
+                        stats->shape++;
+                else
+                        stats->literal++;
+        }
+}
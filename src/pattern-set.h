@@ -0,0 +1,58 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'pattern-set.c' for detailed information. */
+
+#ifndef TINYPROXY_PATTERN_SET_H
+#define TINYPROXY_PATTERN_SET_H
+
+/*
+ * A file saved with pattern_set_save() starts with these bytes.
+ */
+#define PATTERN_SET_MAGIC "tpfilter"
+#define PATTERN_SET_MAGIC_LEN 8
+
+struct pattern_set;
+
+/*
+ * How the expressions were sorted, for the curious.
+ */
+struct pattern_set_stats {
+        unsigned int literal;   /* found without regexec () */
+        unsigned int shape;     /* found, then compared around the find */
+        unsigned int checked;   /* found by a literal part, then checked */
+        unsigned int regex;     /* tried on every text */
+};
+
+extern struct pattern_set *pattern_set_create (int cflags);
+extern void pattern_set_free (struct pattern_set *set);
+extern int pattern_set_add (struct pattern_set *set, const char *pattern);
+extern int pattern_set_read (struct pattern_set *set, FILE *fd,
+                             char *bad, size_t size);
+extern int pattern_set_compile (struct pattern_set *set);
+
+extern int pattern_set_save (const struct pattern_set *set,
+                             const char *path);
+extern struct pattern_set *pattern_set_load (const char *path,
+                                             const char **error);
+
+extern int pattern_set_match (struct pattern_set *set, const char *text);
+extern int pattern_set_get_cflags (const struct pattern_set *set);
+extern void pattern_set_get_stats (const struct pattern_set *set,
+                                   struct pattern_set_stats *stats);
+
+#endif
@@ -27,14 +27,20 @@
 
 #include "main.h"
 
+#include <limits.h>
+
 #include "acl.h"
 #include "anonymous.h"
 #include "buffer.h"
+#include "chunked.h"
+#include "conn-pool.h"
 #include "conns.h"
+#include "dns.h"
 #include "filter.h"
-#include "hashmap.h"
+#include "header-map.h"
 #include "heap.h"
 #include "html-error.h"
+#include "http-head.h"
 #include "log.h"
 #include "network.h"
 #include "reqs.h"
@@ -44,6 +50,7 @@
 #include "utils.h"
 #include "vector.h"
 #include "reverse-proxy.h"
+#include "cache.h"
 #include "transparent-proxy.h"
 #include "upstream.h"
 #include "connect-ports.h"
@@ -54,31 +61,24 @@
  */
 #define HTTP_LINE_LENGTH (MAXBUFFSIZE / 6)
 
+/*
+ * Response bodies shorter than this are not worth setting up a pipe to
+ * splice() them through.
+ */
+#define SPLICE_MIN_LENGTH (1024 * 64)
+
 /*
  * Macro to help test if the Upstream proxy supported is compiled in and
  * enabled.
  */
 #ifdef UPSTREAM_SUPPORT
 #  define UPSTREAM_CONFIGURED() (config.upstream_list != NULL)
-#  define UPSTREAM_HOST(host) upstream_get(host, config.upstream_list)
+#  define UPSTREAM_HOST(host, use) upstream_get(host, config.upstream_list, use)
 #else
 #  define UPSTREAM_CONFIGURED() (0)
-#  define UPSTREAM_HOST(host) (NULL)
+#  define UPSTREAM_HOST(host, use) (NULL)
 #endif
 
-/*
- * Codify the test for the carriage return and new line characters.
- */
-#define CHECK_CRLF(header, len)                                 \
-  (((len) == 1 && header[0] == '\n') ||                         \
-   ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
-
-/*
- * Codify the test for header fields folded over multiple lines.
- */
-#define CHECK_LWS(header, len)                                  \
-  ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
-
 static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 static void encode_base_64(char* src, char* dest, int max_len) {
@@ -116,195 +116,95 @@ static void encode_base_64(char* src, char* dest, int max_len) {
 }
 
 /*
- * Read in the first line from the client (the request line for HTTP
- * connections. The request line is allocated from the heap, but it must
- * be freed in another function.
+ * Pull the host and the port out of the "authority" part of a URL (the
+ * characters from "start" up to "end".)  A username/password in front of
+ * the host is skipped, and the brackets around an IPv6 literal are
+ * removed.  Without a port, "default_port" is used.
  */
-static int read_request_line (struct conn_s *connptr)
+static int
+extract_host_port (struct arena *arena, const char *start, const char *end,
+                   struct request_s *request, uint16_t default_port)
 {
-        ssize_t len;
-
-retry:
-        len = readline (connptr->client_fd, &connptr->request_line);
-        if (len <= 0) {
-                log_message (LOG_ERR,
-                             "read_request_line: Client (file descriptor: %d) "
-                             "closed socket before read.", connptr->client_fd);
+        const char *p;
+        unsigned long port = 0;
+        size_t len;
 
-                return -1;
-        }
+        /* Remove the username/password if they're present */
+        p = (const char *) memchr (start, '@', end - start);
+        if (p)
+                start = p + 1;
 
-        /*
-         * Strip the new line and carriage return from the string.
-         */
-        if (chomp (connptr->request_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (connptr->request_line);
-                goto retry;
+        /* Find a proper port in www.site.com:8001 URLs */
+        for (p = end; p != start && p[-1] != ':' && p[-1] != ']'; p--) ;
+        if (p != start && p[-1] == ':') {
+                end = p - 1;
+                for (; *p >= '0' && *p <= '9' && port <= 65535; p++)
+                        port = port * 10 + (*p - '0');
         }
 
-        log_message (LOG_CONN, "Request (file descriptor %d): %s",
-                     connptr->client_fd, connptr->request_line);
-
-        return 0;
-}
-
-/*
- * Free all the memory allocated in a request.
- */
-static void free_request_struct (struct request_s *request)
-{
-        if (!request)
-                return;
-
-        safefree (request->method);
-        safefree (request->protocol);
-
-        if (request->host)
-                safefree (request->host);
-        if (request->path)
-                safefree (request->path);
-
-        safefree (request);
-}
-
-/*
- * Take a host string and if there is a username/password part, strip
- * it off.
- */
-static void strip_username_password (char *host)
-{
-        char *p;
-
-        assert (host);
-        assert (strlen (host) > 0);
-
-        if ((p = strchr (host, '@')) == NULL)
-                return;
-
-        /*
-         * Move the pointer past the "@" and then copy from that point
-         * until the NUL to the beginning of the host buffer.
-         */
-        p++;
-        while (*p)
-                *host++ = *p++;
-        *host = '\0';
-}
+        request->port = (port > 0 && port <= 65535)
+            ? (uint16_t) port : default_port;
 
-/*
- * Take a host string and if there is a port part, strip
- * it off and set proper port variable i.e. for www.host.com:8001
- */
-static int strip_return_port (char *host)
-{
-        char *ptr1;
-        char *ptr2;
-        int port;
+        /* Remove any surrounding '[' and ']' from IPv6 literals */
+        if (end - start >= 2 && *start == '[' && end[-1] == ']') {
+                start++;
+                end--;
+        }
 
-        ptr1 = strrchr (host, ':');
-        if (ptr1 == NULL)
-                return 0;
+        len = end - start;
+        request->host = (char *) arena_alloc (arena, len + 1);
+        if (!request->host)
+                return -1;
 
-        /* Check for IPv6 style literals */
-        ptr2 = strchr (ptr1, ']');
-        if (ptr2 != NULL)
-                return 0;
+        memcpy (request->host, start, len);
+        request->host[len] = '\0';
 
-        *ptr1++ = '\0';
-        if (sscanf (ptr1, "%d", &port) != 1)    /* one conversion required */
-                return 0;
-        return port;
+        return 0;
 }
 
 /*
  * Pull the information out of the URL line.  This will handle both HTTP
  * and FTP (proxied) URLs.
  */
-static int extract_http_url (const char *url, struct request_s *request)
+static int extract_http_url (struct arena *arena, const char *url,
+                             struct request_s *request)
 {
-        char *p;
-        int len;
-        int port;
+        const char *path;
 
         /* Split the URL on the slash to separate host from path */
-        p = strchr (url, '/');
-        if (p != NULL) {
-                len = p - url;
-                request->host = (char *) safemalloc (len + 1);
-                memcpy (request->host, url, len);
-                request->host[len] = '\0';
-                request->path = safestrdup (p);
-        } else {
-                request->host = safestrdup (url);
-                request->path = safestrdup ("/");
-        }
-
-        if (!request->host || !request->path)
-                goto ERROR_EXIT;
-
-        /* Remove the username/password if they're present */
-        strip_username_password (request->host);
-
-        /* Find a proper port in www.site.com:8001 URLs */
-        port = strip_return_port (request->host);
-        request->port = (port != 0) ? port : HTTP_PORT;
+        path = strchr (url, '/');
+        if (extract_host_port (arena, url, path ? path : url + strlen (url),
+                               request, HTTP_PORT) < 0)
+                return -1;
 
-        /* Remove any surrounding '[' and ']' from IPv6 literals */
-        p = strrchr (request->host, ']');
-        if (p && (*(request->host) == '[')) {
-                request->host++;
-                *p = '\0';
-        }
+        request->path = arena_strdup (arena, path ? path : "/");
+        if (!request->path)
+                return -1;
 
         return 0;
-
-ERROR_EXIT:
-        if (request->host)
-                safefree (request->host);
-        if (request->path)
-                safefree (request->path);
-
-        return -1;
 }
 
 /*
  * Extract the URL from a SSL connection.
  */
-static int extract_ssl_url (const char *url, struct request_s *request)
+static int extract_ssl_url (struct arena *arena, const char *url,
+                            struct request_s *request)
 {
-        request->host = (char *) safemalloc (strlen (url) + 1);
-        if (!request->host)
-                return -1;
-
-        if (sscanf (url, "%[^:]:%hu", request->host, &request->port) == 2) ;
-        else if (sscanf (url, "%s", request->host) == 1)
-                request->port = HTTP_PORT_SSL;
-        else {
-                log_message (LOG_ERR, "extract_ssl_url: Can't parse URL.");
-
-                safefree (request->host);
-                return -1;
-        }
-
-        /* Remove the username/password if they're present */
-        strip_username_password (request->host);
-
-        return 0;
+        return extract_host_port (arena, url, url + strlen (url), request,
+                                  HTTP_PORT_SSL);
 }
 
 /*
- * Create a connection for HTTP connections.
+ * Start the request to the server with the request line and the headers
+ * which tinyproxy sets itself.
  */
-static int
-establish_http_connection (struct conn_s *connptr, struct request_s *request)
+static void
+establish_http_connection (struct conn_s *connptr, struct request_s *request,
+                           struct header_buffer *hb)
 {
         char portbuff[7];
         char dst[sizeof(struct in6_addr)];
+        const char *connection;
 
         /* Build a port string if it's not a standard port */
         if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
@@ -312,15 +212,17 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
         else
                 portbuff[0] = '\0';
 
+        connection = connptr->server_keep_alive ? "keep-alive" : "close";
+
         if (inet_pton(AF_INET6, request->host, dst) > 0) {
                 /* host is an IPv6 address literal, so surround it with
                  * [] */
-                return write_message (connptr->server_fd,
+                header_buffer_printf (hb,
                                       "%s %s HTTP/1.0\r\n"
                                       "Host: [%s]%s\r\n"
-                                      "Connection: close\r\n",
+                                      "Connection: %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         } else {
                 char proxy_auth[200] = "";
                 if (connptr->upstream_proxy != NULL && connptr->upstream_proxy->user)
@@ -333,14 +235,16 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
                         encode_base_64(src, dst2, 512);
                         strcat(proxy_auth, "Proxy-Authorization: Basic ");
                         strcat(proxy_auth, dst2);
+                        strcat(proxy_auth, "\r\n");
                 }
-                return write_message (connptr->server_fd,
+                header_buffer_printf (hb,
                                       "%s %s HTTP/1.0\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n" \
-                                      "%s\r\n\r\n",
+                                      "Connection: %s\r\n" \
+                                      "%s",
                                       request->method, request->path,
-                                      request->host, portbuff, proxy_auth);
+                                      request->host, portbuff, connection,
+                                      proxy_auth);
         }
 }
 
@@ -354,12 +258,16 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
  * Send the appropriate response to the client to establish a SSL
  * connection.
  */
-static int send_ssl_response (struct conn_s *connptr)
+int send_ssl_response (struct conn_s *connptr)
 {
-        return write_message (connptr->client_fd,
-                              "%s\r\n"
-                              "%s\r\n"
-                              "\r\n", SSL_CONNECTION_RESPONSE, PROXY_AGENT);
+        struct header_buffer hb;
+
+        header_buffer_init (&hb);
+        header_buffer_printf (&hb, "%s\r\n" "%s\r\n" "\r\n",
+                              SSL_CONNECTION_RESPONSE, PROXY_AGENT);
+
+        return header_buffer_send (&hb, connptr->client_fd,
+                                   connptr->client_pending);
 }
 
 /*
@@ -367,90 +275,51 @@ static int send_ssl_response (struct conn_s *connptr)
  * build a new request line. Finally connect to the remote server.
  */
 static struct request_s *process_request (struct conn_s *connptr,
-                                          hashmap_t hashofheaders)
+                                          struct header_map *hashofheaders,
+                                          struct http_head_s *head)
 {
+        struct http_parser_s *parser = &head->parser;
         char *url;
         struct request_s *request;
-        int ret;
-        size_t request_len;
 
-        /* NULL out all the fields so frees don't cause segfaults. */
-        request =
-            (struct request_s *) safecalloc (1, sizeof (struct request_s));
+        /*
+         * The request, and everything it points to, lasts until the
+         * connection's arena is reset for the next one.
+         */
+        request = (struct request_s *)
+            arena_calloc (&connptr->arena, 1, sizeof (struct request_s));
         if (!request)
                 return NULL;
 
-        request_len = strlen (connptr->request_line) + 1;
-
-        request->method = (char *) safemalloc (request_len);
-        url = (char *) safemalloc (request_len);
-        request->protocol = (char *) safemalloc (request_len);
+        /*
+         * The parser has already checked the request line, so just
+         * copy its parts out.
+         */
+        request->method = http_head_copy (&connptr->arena, head,
+                                          &parser->method);
+        url = http_head_copy (&connptr->arena, head, &parser->uri);
+        request->protocol = http_head_copy (&connptr->arena, head,
+                                            &parser->version);
 
         if (!request->method || !url || !request->protocol) {
-                goto fail;
+                return NULL;
         }
 
-        ret = sscanf (connptr->request_line, "%[^ ] %[^ ] %[^ ]",
-                      request->method, url, request->protocol);
-        if (ret == 2 && !strcasecmp (request->method, "GET")) {
-                request->protocol[0] = 0;
-
-                /* Indicate that this is a HTTP/0.9 GET request */
-                connptr->protocol.major = 0;
-                connptr->protocol.minor = 9;
-        } else if (ret == 3 && !strncasecmp (request->protocol, "HTTP/", 5)) {
-                /*
-                 * Break apart the protocol and update the connection
-                 * structure.
-                 */
-                ret = sscanf (request->protocol + 5, "%u.%u",
-                              &connptr->protocol.major,
-                              &connptr->protocol.minor);
-
-                /*
-                 * If the conversion doesn't succeed, drop down below and
-                 * send the error to the user.
-                 */
-                if (ret != 2)
-                        goto BAD_REQUEST_ERROR;
-        } else {
-BAD_REQUEST_ERROR:
-                log_message (LOG_ERR,
-                             "process_request: Bad Request on file descriptor %d",
-                             connptr->client_fd);
-                indicate_http_error (connptr, 400, "Bad Request",
-                                     "detail", "Request has an invalid format",
-                                     "url", url, NULL);
-                goto fail;
-        }
+        connptr->protocol.major = parser->major;
+        connptr->protocol.minor = parser->minor;
+        connptr->head_method = (strcasecmp (request->method, "HEAD") == 0);
 
-        if (!url) {
-                log_message (LOG_ERR,
-                             "process_request: Null URL on file descriptor %d",
-                             connptr->client_fd);
-                indicate_http_error (connptr, 400, "Bad Request",
-                                     "detail", "Request has an empty URL",
-                                     "url", url, NULL);
-                goto fail;
-        }
 #ifdef REVERSE_SUPPORT
         if (config.reversepath_list != NULL) {
                 /*
-                 * Rewrite the URL based on the reverse path.  After calling
-                 * reverse_rewrite_url "url" can be freed since we either
-                 * have the newly rewritten URL, or something failed and
-                 * we'll be closing anyway.
+                 * Rewrite the URL based on the reverse path.  If that
+                 * fails we'll be closing anyway.
                  */
-                char *reverse_url;
+                url = reverse_rewrite_url (connptr, hashofheaders, url);
 
-                reverse_url = reverse_rewrite_url (connptr, hashofheaders, url);
-
-                if (!reverse_url) {
-                        goto fail;
+                if (!url) {
+                        return NULL;
                 }
-
-                safefree (url);
-                url = reverse_url;
         }
 #endif
 
@@ -459,18 +328,19 @@ BAD_REQUEST_ERROR:
         {
                 char *skipped_type = strstr (url, "//") + 2;
 
-                if (extract_http_url (skipped_type, request) < 0) {
+                if (extract_http_url (&connptr->arena, skipped_type,
+                                      request) < 0) {
                         indicate_http_error (connptr, 400, "Bad Request",
                                              "detail", "Could not parse URL",
                                              "url", url, NULL);
-                        goto fail;
+                        return NULL;
                 }
         } else if (strcmp (request->method, "CONNECT") == 0) {
-                if (extract_ssl_url (url, request) < 0) {
+                if (extract_ssl_url (&connptr->arena, url, request) < 0) {
                         indicate_http_error (connptr, 400, "Bad Request",
                                              "detail", "Could not parse URL",
                                              "url", url, NULL);
-                        goto fail;
+                        return NULL;
                 }
 
                 /* Verify that the port in the CONNECT method is allowed */
@@ -485,7 +355,7 @@ BAD_REQUEST_ERROR:
                         log_message (LOG_INFO,
                                      "Refused CONNECT method on port %d",
                                      request->port);
-                        goto fail;
+                        return NULL;
                 }
 
                 connptr->connect_method = TRUE;
@@ -493,7 +363,7 @@ BAD_REQUEST_ERROR:
 #ifdef TRANSPARENT_PROXY
                 if (!do_transparent_proxy
                     (connptr, hashofheaders, request, &config, &url)) {
-                        goto fail;
+                        return NULL;
                 }
 #else
                 indicate_http_error (connptr, 501, "Not Implemented",
@@ -502,7 +372,7 @@ BAD_REQUEST_ERROR:
                                      "url", url, NULL);
                 log_message (LOG_INFO, "Unknown method (%s) or protocol (%s)",
                              request->method, url);
-                goto fail;
+                return NULL;
 #endif
         }
 
@@ -511,6 +381,8 @@ BAD_REQUEST_ERROR:
          * Filter restricted domains/urls
          */
         if (config.filter) {
+                int ret;
+
                 if (config.filter_url)
                         ret = filter_url (url);
                 else
@@ -532,7 +404,7 @@ BAD_REQUEST_ERROR:
                                              "detail",
                                              "The request you made has been filtered",
                                              "url", url, NULL);
-                        goto fail;
+                        return NULL;
                 }
         }
 #endif
@@ -544,78 +416,10 @@ BAD_REQUEST_ERROR:
         if (config.stathost && strcmp (config.stathost, request->host) == 0) {
                 log_message (LOG_NOTICE, "Request for the stathost.");
                 connptr->show_stats = TRUE;
-                goto fail;
+                return NULL;
         }
 
-        safefree (url);
-
         return request;
-
-fail:
-        safefree (url);
-        free_request_struct (request);
-        return NULL;
-}
-
-/*
- * pull_client_data is used to pull across any client data (like in a
- * POST) which needs to be handled before an error can be reported, or
- * server headers can be processed.
- *	- rjkaes
- */
-static int pull_client_data (struct conn_s *connptr, long int length)
-{
-        char *buffer;
-        ssize_t len;
-
-        buffer =
-            (char *) safemalloc (min (MAXBUFFSIZE, (unsigned long int) length));
-        if (!buffer)
-                return -1;
-
-        do {
-                len = safe_read (connptr->client_fd, buffer,
-                                 min (MAXBUFFSIZE, (unsigned long int) length));
-                if (len <= 0)
-                        goto ERROR_EXIT;
-
-                if (!connptr->error_variables) {
-                        if (safe_write (connptr->server_fd, buffer, len) < 0)
-                                goto ERROR_EXIT;
-                }
-
-                length -= len;
-        } while (length > 0);
-
-        /*
-         * BUG FIX: Internet Explorer will leave two bytes (carriage
-         * return and line feed) at the end of a POST message.  These
-         * need to be eaten for tinyproxy to work correctly.
-         */
-        socket_nonblocking (connptr->client_fd);
-        len = recv (connptr->client_fd, buffer, 2, MSG_PEEK);
-        socket_blocking (connptr->client_fd);
-
-        if (len < 0 && errno != EAGAIN)
-                goto ERROR_EXIT;
-
-        if ((len == 2) && CHECK_CRLF (buffer, len)) {
-                ssize_t ret;
-
-                ret = read (connptr->client_fd, buffer, 2);
-                if (ret == -1) {
-                        log_message
-                                (LOG_WARNING,
-                                 "Could not read two bytes from POST message");
-                }
-        }
-
-        safefree (buffer);
-        return 0;
-
-ERROR_EXIT:
-        safefree (buffer);
-        return -1;
 }
 
 #ifdef XTINYPROXY_ENABLE
@@ -624,147 +428,109 @@ ERROR_EXIT:
  * the server.
  *	-rjkaes
  */
-static int add_xtinyproxy_header (struct conn_s *connptr)
+static void
+add_xtinyproxy_header (struct conn_s *connptr, struct header_buffer *hb)
 {
         assert (connptr && connptr->server_fd >= 0);
-        return write_message (connptr->server_fd,
-                              "X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
+        header_buffer_field (hb, "X-Tinyproxy", connptr->client_ip_addr);
 }
 #endif /* XTINYPROXY */
 
 /*
- * Take a complete header line and break it apart (into a key and the data.)
- * Now insert this information into the hashmap for the connection so it
- * can be retrieved and manipulated later.
+ * Insert the header fields found by the parser into the header map for
+ * the connection so they can be retrieved and manipulated later.  The
+ * names and the values are terminated in place, in the head's own data,
+ * and the map refers to them there.
  */
-static int
-add_header_to_connection (hashmap_t hashofheaders, char *header, size_t len)
+int add_headers_to_connection (struct header_map *hashofheaders,
+                               struct http_head_s *head)
 {
-        char *sep;
+        const struct http_field_s *field;
+        char *value, *p;
+        size_t i;
 
-        /* Get rid of the new line and return at the end */
-        len -= chomp (header, len);
+        assert (hashofheaders != NULL);
 
-        sep = strchr (header, ':');
-        if (!sep)
-                return -1;
+        for (i = 0; i != head->nfields; i++) {
+                field = &head->fields[i];
+                value = head->data + field->value.off;
 
-        /* Blank out colons, spaces, and tabs. */
-        while (*sep == ':' || *sep == ' ' || *sep == '\t')
-                *sep++ = '\0';
+                head->data[field->name.off + field->name.len] = '\0';
+                value[field->value.len] = '\0';
+
+                /*
+                 * A value folded over several lines is passed on as one
+                 * line, the line breaks replaced with spaces (RFC 7230,
+                 * section 3.2.4.)
+                 */
+                if (field->folded)
+                        while ((p = strpbrk (value, "\r\n")) != NULL)
+                                *p = ' ';
 
-        /* Calculate the new length of just the data */
-        len -= sep - header - 1;
+                if (header_map_add (hashofheaders,
+                                    head->data + field->name.off,
+                                    field->name.len, value) < 0)
+                        return -1;
+        }
 
-        return hashmap_insert (hashofheaders, header, sep, len);
+        return 0;
 }
 
 /*
- * Read all the headers from the stream
+ * Look for a token (like "close") in the Connection and Proxy-Connection
+ * headers.
  */
-static int get_all_headers (int fd, hashmap_t hashofheaders)
+static unsigned int
+connection_has_token (struct header_map *hashofheaders, const char *token)
 {
-        char *line = NULL;
-        char *header = NULL;
-        char *tmp;
-        ssize_t linelen;
-        ssize_t len = 0;
-        unsigned int double_cgi = FALSE;        /* boolean */
-
-        assert (fd >= 0);
-        assert (hashofheaders != NULL);
-
-        for (;;) {
-                if ((linelen = readline (fd, &line)) <= 0) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
-                }
-
-                /*
-                 * If we received a CR LF or a non-continuation line, then add
-                 * the accumulated header field, if any, to the hashmap, and
-                 * reset it.
-                 */
-                if (CHECK_CRLF (line, linelen) || !CHECK_LWS (line, linelen)) {
-                        if (!double_cgi
-                            && len > 0
-                            && add_header_to_connection (hashofheaders, header,
-                                                         len) < 0) {
-                                safefree (header);
-                                safefree (line);
-                                return -1;
-                        }
-
-                        len = 0;
-                }
-
-                /*
-                 * If we received just a CR LF on a line, the headers are
-                 * finished.
-                 */
-                if (CHECK_CRLF (line, linelen)) {
-                        safefree (header);
-                        safefree (line);
-                        return 0;
-                }
+        static const enum header_id headers[] = {
+                HEADER_CONNECTION,
+                HEADER_PROXY_CONNECTION
+        };
 
-                /*
-                 * BUG FIX: The following code detects a "Double CGI"
-                 * situation so that we can handle the nonconforming system.
-                 * This problem was found when accessing cgi.ebay.com, and it
-                 * turns out to be a wider spread problem as well.
-                 *
-                 * If "Double CGI" is in effect, duplicate headers are
-                 * ignored.
-                 *
-                 * FIXME: Might need to change this to a more robust check.
-                 */
-                if (linelen >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
-                        double_cgi = TRUE;
-                }
+        size_t toklen = strlen (token), len;
+        char *data;
+        int i;
 
-                /*
-                 * Append the new line to the current header field.
-                 */
-                tmp = (char *) saferealloc (header, len + linelen);
-                if (tmp == NULL) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
+        for (i = 0; i != (sizeof (headers) / sizeof (headers[0])); i++) {
+                data = header_map_get_id (hashofheaders, headers[i]);
+                if (!data)
+                        continue;
+
+                while (*data != '\0') {
+                        data += strspn (data, " \t,");
+                        len = strcspn (data, " \t,");
+                        if (len == toklen && strncasecmp (data, token, len) == 0)
+                                return TRUE;
+                        data += len;
                 }
-
-                header = tmp;
-                memcpy (header + len, line, linelen);
-                len += linelen;
-
-                safefree (line);
         }
+
+        return FALSE;
 }
 
 /*
  * Extract the headers to remove.  These headers were listed in the Connection
  * and Proxy-Connection headers.
  */
-static int remove_connection_headers (hashmap_t hashofheaders)
+static int remove_connection_headers (struct header_map *hashofheaders)
 {
-        static const char *headers[] = {
-                "connection",
-                "proxy-connection"
+        static const enum header_id headers[] = {
+                HEADER_CONNECTION,
+                HEADER_PROXY_CONNECTION
         };
 
         char *data;
         char *ptr;
-        ssize_t len;
+        size_t len;
         int i;
 
-        for (i = 0; i != (sizeof (headers) / sizeof (char *)); ++i) {
+        for (i = 0; i != (sizeof (headers) / sizeof (headers[0])); ++i) {
                 /* Look for the connection header.  If it's not found, return. */
-                len =
-                    hashmap_entry_by_key (hashofheaders, headers[i],
-                                          (void **) &data);
-                if (len <= 0)
+                data = header_map_get_id (hashofheaders, headers[i]);
+                if (!data)
                         return 0;
+                len = strlen (data) + 1;
 
                 /*
                  * Go through the data line and replace any special characters
@@ -780,7 +546,8 @@ static int remove_connection_headers (hashmap_t hashofheaders)
                  */
                 ptr = data;
                 while (ptr < data + len) {
-                        hashmap_remove (hashofheaders, ptr);
+                        if (*ptr != '\0')
+                                header_map_remove (hashofheaders, ptr);
 
                         /* Advance ptr to the next token */
                         ptr += strlen (ptr) + 1;
@@ -789,29 +556,85 @@ static int remove_connection_headers (hashmap_t hashofheaders)
                 }
 
                 /* Now remove the connection header it self. */
-                hashmap_remove (hashofheaders, headers[i]);
+                header_map_remove_id (hashofheaders, headers[i]);
         }
 
         return 0;
 }
 
 /*
- * If there is a Content-Length header, then return the value; otherwise, return
- * a negative number.
+ * If there is a Content-Length header, then its value is stored in
+ * "length"; otherwise, a negative number is.  A length which is not a
+ * plain number, or which is given more than once, leaves the end of the
+ * body in doubt: the message can't be passed on (RFC 7230, 3.3.3).
+ *
+ * Returns: negative if the length is not valid
+ *          0 otherwise
  */
-static long get_content_length (hashmap_t hashofheaders)
+static int get_content_length (struct header_map *hashofheaders, long *length)
 {
-        ssize_t len;
-        char *data;
-        long content_length = -1;
+        const char *data;
+        long content_length = 0;
 
-        len =
-            hashmap_entry_by_key (hashofheaders, "content-length",
-                                  (void **) &data);
-        if (len > 0)
-                content_length = atol (data);
+        *length = -1;
+
+        data = header_map_get_id (hashofheaders, HEADER_CONTENT_LENGTH);
+        if (!data)
+                return 0;
+
+        if (header_map_count_id (hashofheaders, HEADER_CONTENT_LENGTH) > 1)
+                return -1;
+
+        if (!isdigit ((unsigned char) *data))
+                return -1;
+
+        for (; isdigit ((unsigned char) *data); data++) {
+                if (content_length > (LONG_MAX - (*data - '0')) / 10)
+                        return -1;
+                content_length = content_length * 10 + (*data - '0');
+        }
+
+        while (*data == ' ' || *data == '\t')
+                data++;
+        if (*data != '\0')
+                return -1;
+
+        *length = content_length;
+        return 0;
+}
+
+/*
+ * Look at the transfer codings of a message, which may be listed over
+ * several Transfer-Encoding fields: the other side will read them all
+ * together, so they are judged that way here.  "chunked" is set if the
+ * body is sent with the chunked coding.
+ *
+ * Returns: negative if the end of the body is in doubt
+ *          0 if there are no transfer codings
+ *          1 otherwise
+ */
+static int get_transfer_encoding (struct header_map *hashofheaders,
+                                  unsigned int *chunked)
+{
+        const char *encoding;
+        int ret;
+
+        *chunked = FALSE;
+
+        if (!header_map_get_id (hashofheaders, HEADER_TRANSFER_ENCODING))
+                return 0;
+
+        encoding = header_map_join_id (hashofheaders,
+                                       HEADER_TRANSFER_ENCODING);
+        if (!encoding)
+                return -1;
+
+        ret = chunked_encoding (encoding);
+        if (ret < 0)
+                return -1;
 
-        return content_length;
+        *chunked = ret;
+        return 1;
 }
 
 /*
@@ -821,19 +644,15 @@ static long get_content_length (hashmap_t hashofheaders)
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
-static int
-write_via_header (int fd, hashmap_t hashofheaders,
+static void
+write_via_header (struct header_buffer *hb, struct header_map *hashofheaders,
                   unsigned int major, unsigned int minor)
 {
-        ssize_t len;
         char hostname[512];
         char *data;
-        int ret;
 
-        if (config.disable_viaheader) {
-                ret = 0;
-                goto done;
-        }
+        if (config.disable_viaheader)
+                return;
 
         if (config.via_proxy_name) {
                 strlcpy (hostname, config.via_proxy_name, sizeof (hostname));
@@ -845,51 +664,47 @@ write_via_header (int fd, hashmap_t hashofheaders,
          * See if there is a "Via" header.  If so, again we need to do a bit
          * of processing.
          */
-        len = hashmap_entry_by_key (hashofheaders, "via", (void **) &data);
-        if (len > 0) {
-                ret = write_message (fd,
-                                     "Via: %s, %hu.%hu %s (%s/%s)\r\n",
-                                     data, major, minor, hostname, PACKAGE,
-                                     VERSION);
-
-                hashmap_remove (hashofheaders, "via");
+        data = header_map_get_id (hashofheaders, HEADER_VIA);
+        if (data) {
+                header_buffer_printf (hb,
+                                      "Via: %s, %hu.%hu %s (%s/%s)\r\n",
+                                      data, major, minor, hostname, PACKAGE,
+                                      VERSION);
+
+                header_map_remove_id (hashofheaders, HEADER_VIA);
         } else {
-                ret = write_message (fd,
-                                     "Via: %hu.%hu %s (%s/%s)\r\n",
-                                     major, minor, hostname, PACKAGE, VERSION);
+                header_buffer_printf (hb,
+                                      "Via: %hu.%hu %s (%s/%s)\r\n",
+                                      major, minor, hostname, PACKAGE,
+                                      VERSION);
         }
-
-done:
-        return ret;
 }
 
-/*
- * Number of buckets to use internally in the hashmap.
- */
-#define HEADER_BUCKETS 32
-
 /*
  * Here we loop through all the headers the client is sending. If we
  * are running in anonymous mode, we will _only_ send the headers listed
- * (plus a few which are required for various methods).
+ * (plus a few which are required for various methods).  Any request
+ * body is left for the caller to pass along.
  *	- rjkaes
  */
-static int
-process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
+static void
+process_client_headers (struct conn_s *connptr,
+                        struct header_map *hashofheaders,
+                        struct header_buffer *hb)
 {
-        static const char *skipheaders[] = {
-                "host",
-                "keep-alive",
-                "proxy-connection",
-                "te",
-                "trailers",
-                "upgrade"
+        static const enum header_id skipheaders[] = {
+                HEADER_HOST,
+                HEADER_KEEP_ALIVE,
+                HEADER_PROXY_CONNECTION,
+                HEADER_TE,
+                HEADER_TRAILERS,
+                HEADER_UPGRADE
         };
         int i;
-        hashmap_iter iter;
-        int ret = 0;
+        header_map_iter iter = 0;
 
-        char *data, *header;
+        const char *data;
+        char *header;
 
         /*
          * Don't send headers if there's already an error, if the request was
@@ -900,15 +715,9 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
             || (connptr->connect_method && (connptr->upstream_proxy == NULL))) {
                 log_message (LOG_INFO,
                              "Not sending client headers to remote machine");
-                return 0;
+                return;
         }
 
-        /*
-         * See if there is a "Content-Length" header.  If so, again we need
-         * to do a bit of processing.
-         */
-        connptr->content_length.client = get_content_length (hashofheaders);
-
         /*
          * See if there is a "Connection" header.  If so, we need to do a bit
          * of processing. :)
@@ -918,164 +727,190 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
         /*
          * Delete the headers listed in the skipheaders list
          */
-        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-                hashmap_remove (hashofheaders, skipheaders[i]);
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (skipheaders[0]));
+             i++) {
+                header_map_remove_id (hashofheaders, skipheaders[i]);
         }
 
         /* Send, or add the Via header */
-        ret = write_via_header (connptr->server_fd, hashofheaders,
-                                connptr->protocol.major,
-                                connptr->protocol.minor);
-        if (ret < 0) {
-                indicate_http_error (connptr, 503,
-                                     "Could not send data to remote server",
-                                     "detail",
-                                     "A network error occurred while "
-                                     "trying to write data to the remote web server.",
-                                     NULL);
-                goto PULL_CLIENT_DATA;
-        }
+        write_via_header (hb, hashofheaders, connptr->protocol.major,
+                          connptr->protocol.minor);
 
         /*
          * Output all the remaining headers to the remote machine.
          */
-        iter = hashmap_first (hashofheaders);
-        if (iter >= 0) {
-                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
-                        hashmap_return_entry (hashofheaders,
-                                              iter, &data, (void **) &header);
-
-                        if (!is_anonymous_enabled ()
-                            || anonymous_search (data) > 0) {
-                                ret =
-                                    write_message (connptr->server_fd,
-                                                   "%s: %s\r\n", data, header);
-                                if (ret < 0) {
-                                        indicate_http_error (connptr, 503,
-                                                             "Could not send data to remote server",
-                                                             "detail",
-                                                             "A network error occurred while "
-                                                             "trying to write data to the "
-                                                             "remote web server.",
-                                                             NULL);
-                                        goto PULL_CLIENT_DATA;
-                                }
-                        }
-                }
+        while (header_map_next (hashofheaders, &iter, &data, &header)) {
+                if (!is_anonymous_enabled ()
+                    || anonymous_search (data) > 0)
+                        header_buffer_field (hb, data, header);
         }
 #if defined(XTINYPROXY_ENABLE)
         if (config.add_xtinyproxy)
-                add_xtinyproxy_header (connptr);
+                add_xtinyproxy_header (connptr, hb);
 #endif
 
         /* Write the final "blank" line to signify the end of the headers */
-        if (safe_write (connptr->server_fd, "\r\n", 2) < 0)
-                return -1;
-
-        /*
-         * Spin here pulling the data from the client.
-         */
-PULL_CLIENT_DATA:
-        if (connptr->content_length.client > 0) {
-                ret = pull_client_data (connptr,
-                                        connptr->content_length.client);
-        }
+        header_buffer_add (hb, "\r\n", 2);
+}
 
-        return ret;
+/*
+ * Note that the headers sent by the remote server could not be read or
+ * understood.
+ */
+static void indicate_server_header_error (struct conn_s *connptr)
+{
+        log_message (LOG_WARNING,
+                     "Could not retrieve all the headers from the remote server.");
+
+        indicate_http_error (connptr, 503,
+                             "Could not retrieve all the headers",
+                             "detail",
+                             PACKAGE_NAME " "
+                             "was unable to retrieve and process headers from "
+                             "the remote web server.", NULL);
 }
 
 /*
- * Loop through all the headers (including the response code) from the
- * server.
+ * Take the response line and the headers received from the server, and
+ * send them on to the client with the appropriate changes.
  */
-static int process_server_headers (struct conn_s *connptr)
+int process_response (struct conn_s *connptr, struct http_head_s *head)
 {
-        static const char *skipheaders[] = {
-                "keep-alive",
-                "proxy-authenticate",
-                "proxy-authorization",
-                "proxy-connection",
+        static const enum header_id skipheaders[] = {
+                HEADER_KEEP_ALIVE,
+                HEADER_PROXY_AUTHENTICATE,
+                HEADER_PROXY_AUTHORIZATION,
+                HEADER_PROXY_CONNECTION,
         };
 
-        char *response_line;
+        struct header_map *hashofheaders;
+        header_map_iter iter = 0;
+        struct header_buffer hb;
+        const char *data;
+        char *header;
+        unsigned int chunked;
+        int encoded, i;
 
-        hashmap_t hashofheaders;
-        hashmap_iter iter;
-        char *data, *header;
-        ssize_t len;
-        int i;
-        int ret;
+        /* Whether the server was asked to keep the connection open */
+        unsigned int asked = connptr->server_keep_alive;
 
 #ifdef REVERSE_SUPPORT
-        struct reversepath *reverse = config.reversepath_list;
+        struct reversepath *reverse;
+        ssize_t len;
+        int ret;
 #endif
 
-        /* Get the response line from the remote server. */
-retry:
-        len = readline (connptr->server_fd, &response_line);
-        if (len <= 0)
+        connptr->server_keep_alive = FALSE;
+
+        hashofheaders = header_map_create (&connptr->arena);
+        if (!hashofheaders)
                 return -1;
 
+        if (add_headers_to_connection (hashofheaders, head) < 0) {
+                indicate_server_header_error (connptr);
+                return -1;
+        }
+
         /*
-         * Strip the new line and character return from the string.
+         * At this point we've received the response line and all the
+         * headers.  However, if this is a simple HTTP/0.9 request we
+         * CAN NOT send any of that information back to the client.
+         * Instead we'll just return.
          */
-        if (chomp (response_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (response_line);
-                goto retry;
-        }
+        if (connptr->protocol.major < 1)
+                return 0;
 
-        hashofheaders = hashmap_create (HEADER_BUCKETS);
-        if (!hashofheaders) {
-                safefree (response_line);
+        /*
+         * If there is a "Content-Length" header, retrieve the information
+         * from it for later use.
+         */
+        if (get_content_length (hashofheaders,
+                                &connptr->content_length.server) < 0) {
+                log_message (LOG_WARNING,
+                             "Invalid Content-Length in the response "
+                             "from the server");
+                indicate_server_header_error (connptr);
                 return -1;
         }
 
         /*
-         * Get all the headers from the remote server in a big hash
+         * A transfer coding overrides any Content-Length, which is not
+         * passed on.  The end of the body can only be found if the last
+         * coding is "chunked".
          */
-        if (get_all_headers (connptr->server_fd, hashofheaders) < 0) {
+        encoded = get_transfer_encoding (hashofheaders, &chunked);
+        if (encoded < 0) {
                 log_message (LOG_WARNING,
-                             "Could not retrieve all the headers from the remote server.");
-                hashmap_delete (hashofheaders);
-                safefree (response_line);
-
-                indicate_http_error (connptr, 503,
-                                     "Could not retrieve all the headers",
-                                     "detail",
-                                     PACKAGE_NAME " "
-                                     "was unable to retrieve and process headers from "
-                                     "the remote web server.", NULL);
+                             "Invalid Transfer-Encoding in the response "
+                             "from the server");
+                indicate_server_header_error (connptr);
                 return -1;
         }
+        if (encoded) {
+                connptr->content_length.server = -1;
+                header_map_remove_id (hashofheaders, HEADER_CONTENT_LENGTH);
+        }
 
         /*
-         * At this point we've received the response line and all the
-         * headers.  However, if this is a simple HTTP/0.9 request we
-         * CAN NOT send any of that information back to the client.
-         * Instead we'll free all the memory and return.
+         * The client connection can only be kept open if the end of the
+         * response can be found without the server closing its side.
          */
-        if (connptr->protocol.major < 1) {
-                hashmap_delete (hashofheaders);
-                safefree (response_line);
-                return 0;
+        if (head->parser.code == 204 || head->parser.code == 304
+            || connptr->head_method) {
+                connptr->content_length.server = 0;
+        } else if (head->parser.code < 200
+                   || (connptr->content_length.server < 0 && !chunked)) {
+                connptr->keep_alive = FALSE;
+        } else if (chunked) {
+                chunked_start (&connptr->chunked.server);
+                connptr->content_length.server =
+                    chunked_left (&connptr->chunked.server);
         }
 
-        /* Send the saved response line first */
-        ret = write_message (connptr->client_fd, "%s\r\n", response_line);
-        safefree (response_line);
-        if (ret < 0)
-                goto ERROR_EXIT;
+        /*
+         * The same goes for the server connection, which the server has
+         * to be willing to keep open as well.
+         */
+        connptr->server_keep_alive = asked
+            && connptr->content_length.server >= 0
+            && head->parser.code >= 200
+            && !connection_has_token (hashofheaders, "close")
+            && (head->parser.major > 1
+                || (head->parser.major == 1 && head->parser.minor >= 1)
+                || connection_has_token (hashofheaders, "keep-alive"));
 
         /*
-         * If there is a "Content-Length" header, retrieve the information
-         * from it for later use.
+         * Otherwise only the server closing the connection can end the
+         * response.  If the request has been sent in full, make sure
+         * the server knows that no other request is coming.
+         */
+        if (asked && !connptr->server_keep_alive
+            && connptr->content_length.client <= 0
+            && buffer_size (connptr->cbuffer) == 0
+            && (!connptr->server_pending
+                || buffer_size (connptr->server_pending) == 0))
+                shutdown (connptr->server_fd, SHUT_WR);
+
+#ifdef REVERSE_SUPPORT
+        /* The cache may keep the response, or answer with its own copy */
+        if (connptr->cache) {
+                ret = cache_response (connptr, head, hashofheaders);
+                if (ret != 0)
+                        return ret > 0 ? 0 : -1;
+        }
+#endif
+
+        /*
+         * The response line and the headers are put together, and sent
+         * to the client in one go at the end.  The saved response line
+         * goes first.
          */
-        connptr->content_length.server = get_content_length (hashofheaders);
+        header_buffer_init (&hb);
+        header_buffer_add (&hb, head->data + head->parser.line.off,
+                           head->parser.line.len);
+        header_buffer_add (&hb, "\r\n", 2);
+        header_buffer_field (&hb, "Connection",
+                             connptr->keep_alive ? "keep-alive" : "close");
 
         /*
          * See if there is a connection header.  If so, we need to to a bit of
@@ -1086,56 +921,43 @@ retry:
         /*
          * Delete the headers listed in the skipheaders list
          */
-        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-                hashmap_remove (hashofheaders, skipheaders[i]);
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (skipheaders[0]));
+             i++) {
+                header_map_remove_id (hashofheaders, skipheaders[i]);
         }
 
         /* Send, or add the Via header */
-        ret = write_via_header (connptr->client_fd, hashofheaders,
-                                connptr->protocol.major,
-                                connptr->protocol.minor);
-        if (ret < 0)
-                goto ERROR_EXIT;
+        write_via_header (&hb, hashofheaders, connptr->protocol.major,
+                          connptr->protocol.minor);
 
 #ifdef REVERSE_SUPPORT
         /* Write tracking cookie for the magical reverse proxy path hack */
-        if (config.reversemagic && connptr->reversepath) {
-                ret = write_message (connptr->client_fd,
-                                     "Set-Cookie: " REVERSE_COOKIE
-                                     "=%s; path=/\r\n", connptr->reversepath);
-                if (ret < 0)
-                        goto ERROR_EXIT;
-        }
+        if (config.reversemagic && connptr->reversepath)
+                header_buffer_printf (&hb,
+                                      "Set-Cookie: " REVERSE_COOKIE
+                                      "=%s; path=/\r\n",
+                                      connptr->reversepath);
 
         /* Rewrite the HTTP redirect if needed */
         if (config.reversebaseurl &&
-            hashmap_entry_by_key (hashofheaders, "location",
-                                  (void **) &header) > 0) {
+            (header = header_map_get_id (hashofheaders,
+                                         HEADER_LOCATION)) != NULL) {
 
                 /* Look for a matching entry in the reversepath list */
-                while (reverse) {
-                        if (strncasecmp (header,
-                                         reverse->url, (len =
-                                                        strlen (reverse->
-                                                                url))) == 0)
-                                break;
-                        reverse = reverse->next;
-                }
-
+                reverse = reversepath_get_by_url (header,
+                                                  config.reversepath_list);
                 if (reverse) {
-                        ret =
-                            write_message (connptr->client_fd,
-                                           "Location: %s%s%s\r\n",
-                                           config.reversebaseurl,
-                                           (reverse->path + 1), (header + len));
-                        if (ret < 0)
-                                goto ERROR_EXIT;
+                        len = reverse->url_len;
+                        header_buffer_printf (&hb, "Location: %s%s%s\r\n",
+                                              config.reversebaseurl,
+                                              (reverse->path + 1),
+                                              (header + len));
 
                         log_message (LOG_INFO,
                                      "Rewriting HTTP redirect: %s -> %s%s%s",
                                      header, config.reversebaseurl,
                                      (reverse->path + 1), (header + len));
-                        hashmap_remove (hashofheaders, "location");
+                        header_map_remove_id (hashofheaders, HEADER_LOCATION);
                 }
         }
 #endif
@@ -1143,30 +965,385 @@ retry:
         /*
          * All right, output all the remaining headers to the client.
          */
-        iter = hashmap_first (hashofheaders);
-        if (iter >= 0) {
-                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
-                        hashmap_return_entry (hashofheaders,
-                                              iter, &data, (void **) &header);
-
-                        ret = write_message (connptr->client_fd,
-                                             "%s: %s\r\n", data, header);
-                        if (ret < 0)
-                                goto ERROR_EXIT;
+        while (header_map_next (hashofheaders, &iter, &data, &header))
+                header_buffer_field (&hb, data, header);
+
+        /* Write the final blank line to signify the end of the headers */
+        header_buffer_add (&hb, "\r\n", 2);
+
+        return header_buffer_send (&hb, connptr->client_fd,
+                                   connptr->client_pending);
+}
+
+/*
+ * Pass the start of the response body, read along with the head, on to
+ * the relay.  Of a chunked body only what belongs to it is passed on,
+ * and the decoder takes it from there.
+ */
+void start_response_body (struct conn_s *connptr, struct http_head_s *head)
+{
+        struct chunked_s *chunked = &connptr->chunked.server;
+        size_t extra = head->len - head->end;
+        size_t len;
+
+        if (!chunked_active (chunked)) {
+                connptr->content_length.server -=
+                    http_head_finish (head, connptr->sbuffer, -1);
+                return;
+        }
+
+        len = chunked_scan (chunked, head->data + head->end, extra);
+        connptr->content_length.server = chunked_left (chunked);
+        if (connptr->content_length.server < 0) {
+                chunked_stop (chunked);
+                http_head_finish (head, connptr->sbuffer, -1);
+                return;
+        }
+
+        /* The server sent something after the response */
+        if (len < extra)
+                connptr->server_keep_alive = FALSE;
+        http_head_finish (head, connptr->sbuffer, len);
+}
+
+/*
+ * Relay the bytes of a tunnel, or the rest of a response body of a known
+ * (and large enough) length, with splice() since nothing needs to look
+ * at them.  Anything else keeps going through the buffers.
+ */
+void relay_splice (struct conn_s *connptr)
+{
+        if (connptr->connect_method) {
+                buffer_splice (connptr->sbuffer);
+                buffer_splice (connptr->cbuffer);
+        } else if (connptr->content_length.server >= SPLICE_MIN_LENGTH
+                   && !chunked_active (&connptr->chunked.server)) {
+                buffer_splice (connptr->sbuffer);
+        }
+}
+
+/*
+ * One side of a relayed connection.  Whether the socket is readable or
+ * writable is tracked here rather than asked of the kernel each time
+ * round, which lets the sockets be registered with an edge-triggered
+ * epoll instance once for the whole connection.
+ */
+struct relay_side {
+        int fd;
+        struct buffer_s *in;    /* filled from this socket */
+        struct buffer_s *out;   /* drained to this socket */
+        unsigned int readable, writable;
+        unsigned int reading;   /* whether to read from it at all */
+        unsigned int closed;    /* the connection has been closed */
+        unsigned int shut;      /* nothing more is written to it */
+
+        /* Reads the next part of what this side sends into "in" */
+        ssize_t (*read) (struct conn_s *connptr);
+
+        /* The response head, while it is still being read */
+        struct http_head_s *head;
+};
+
+/*
+ * Read more of the request body from the client.  On a connection which
+ * is kept open only the rest of the body is read, since the next request
+ * comes after it; a chunked body is only ever read as far as the decoder
+ * knows it goes.  Returns what read_buffer() does.
+ */
+ssize_t read_request_body (struct conn_s *connptr)
+{
+        size_t size = max (connptr->content_length.client, 0);
+        ssize_t len;
+
+        if (chunked_active (&connptr->chunked.client) && size > 0) {
+                len = chunked_read (connptr->client_fd, connptr->cbuffer,
+                                    &connptr->chunked.client,
+                                    &connptr->content_length.client);
+                if (connptr->content_length.client < 0)
+                        connptr->keep_alive =
+                            connptr->server_keep_alive = FALSE;
+                return len;
+        }
+
+        if (connptr->keep_alive) {
+                if (size == 0)
+                        return 0;
+                len = read_buffer_max (connptr->client_fd, connptr->cbuffer,
+                                       size);
+                if (len > 0)
+                        connptr->content_length.client -= len;
+                return len;
+        }
+
+        len = read_buffer (connptr->client_fd, connptr->cbuffer);
+
+        /* Only the request body is for the server */
+        if (len > (ssize_t) size)
+                connptr->server_keep_alive = FALSE;
+        if (len > 0)
+                connptr->content_length.client -= min ((size_t) len, size);
+        return len;
+}
+
+/*
+ * Read more of the response body (or of a tunnel) from the server.
+ * Returns what read_buffer() does.
+ */
+ssize_t read_response_body (struct conn_s *connptr)
+{
+        ssize_t len;
+
+        if (connptr->content_length.server == 0)
+                return 0;
+
+        /* The decoder keeps count for a chunked body */
+        if (chunked_active (&connptr->chunked.server))
+                return chunked_read (connptr->server_fd, connptr->sbuffer,
+                                     &connptr->chunked.server,
+                                     &connptr->content_length.server);
+
+        len = read_buffer (connptr->server_fd, connptr->sbuffer);
+        if (len > 0)
+                connptr->content_length.server -= len;
+        return len;
+}
+
+/*
+ * Read from one side until the socket has nothing more to give or the
+ * buffer is full.  Returns the number of bytes read; "closed" is set once
+ * the connection is closed.
+ */
+static ssize_t relay_read (struct conn_s *connptr, struct relay_side *side)
+{
+        ssize_t total = 0, len;
+
+        while (side->reading && side->readable && !buffer_full (side->in)) {
+                len = side->read (connptr);
+                if (len < 0) {
+                        side->closed = TRUE;
+                        break;
                 }
+                if (len == 0 && !buffer_full (side->in))
+                        side->readable = FALSE;
+                total += len;
         }
-        hashmap_delete (hashofheaders);
 
-        /* Write the final blank line to signify the end of the headers */
-        if (safe_write (connptr->client_fd, "\r\n", 2) < 0)
-                return -1;
+        return total;
+}
+
+/*
+ * Write to one side until the buffer is empty or the socket would block.
+ */
+static int relay_write (struct relay_side *side)
+{
+        ssize_t len;
+
+        while (side->writable && buffer_size (side->out) > 0) {
+                len = write_buffer (side->fd, side->out);
+                if (len < 0)
+                        return -1;
+                if (len == 0)
+                        side->writable = FALSE;
+        }
 
         return 0;
+}
 
-ERROR_EXIT:
-        hashmap_delete (hashofheaders);
-        return -1;
+/*
+ * Read the response head from the server, and once the whole of it is
+ * there send it on to the client and go on with the body.  "closed" is
+ * set if the head can't be read or used; the head is then left in
+ * place.
+ */
+static void relay_read_head (struct conn_s *connptr, struct relay_side *server)
+{
+        struct http_head_s *head = server->head;
+        ssize_t ret;
+
+        while (server->readable) {
+                ret = http_head_read (head, server->fd);
+                if (ret == 0) {
+                        server->readable = FALSE;
+                        return;
+                }
+
+                if (ret > 0)
+                        ret = http_head_find_end (head);
+                if (ret == 0)
+                        continue;
+
+                if (ret < 0) {
+                        if (head->parser.state != HTTP_STATE_START)
+                                indicate_server_header_error (connptr);
+                        server->closed = TRUE;
+                        return;
+                }
+
+                if (process_response (connptr, head) < 0) {
+                        server->closed = TRUE;
+                        return;
+                }
+
+                /* Any of the body read along with the head goes on too */
+                start_response_body (connptr, head);
+                relay_splice (connptr);
+                server->head = NULL;
+                return;
+        }
+}
+
+/*
+ * Whether to read from the client: on a connection which is kept open,
+ * only until the request body is in.
+ */
+static unsigned int
+client_reading (struct conn_s *connptr, const struct relay_side *client)
+{
+        return !client->closed
+            && (!connptr->keep_alive || connptr->content_length.client > 0);
+}
+
+/*
+ * Move as many bytes as the sockets allow in both directions: the
+ * request body one way while the response head is awaited, then the
+ * response the other way, with the rest of the body (if any) still
+ * going to the server.  Each side only reads while its buffer has room.
+ * Returns -1 once the relaying is over.
+ */
+static int relay_transfer (struct conn_s *connptr, struct relay_side *client,
+                           struct relay_side *server)
+{
+        do {
+                if (server->head)
+                        relay_read_head (connptr, server);
+                else
+                        relay_read (connptr, server);
+                if (!server->head && connptr->content_length.server == 0)
+                        return -1;
+
+                /*
+                 * A client which has finished sending may still be waiting
+                 * for the response, so only a failed write to it ends the
+                 * relay.
+                 */
+                if (!client->closed) {
+                        client->reading = client_reading (connptr, client);
+                        relay_read (connptr, client);
+                        client->reading = client_reading (connptr, client);
+                }
+
+                if (server->closed
+                    || relay_write (server) < 0 || relay_write (client) < 0)
+                        return -1;
+
+                /*
+                 * A tunnel passes on the end of what the client sent, once
+                 * it has all gone to the server, as the server may be
+                 * waiting for it before it finishes too.
+                 */
+                if (client->closed && !server->shut
+                    && connptr->connect_method
+                    && buffer_size (client->in) == 0) {
+                        shutdown (server->fd, SHUT_WR);
+                        server->shut = TRUE;
+                }
+
+                /*
+                 * Writing may have made room in a full buffer for a
+                 * socket which still has data waiting.
+                 */
+        } while ((server->reading && server->readable
+                  && (server->head || !buffer_full (server->in)))
+                 || (client->reading && client->readable
+                     && !buffer_full (client->in)));
+
+        return 0;
+}
+
+/*
+ * Note the readiness reported for a side by poll() or epoll.  Errors
+ * and hang-ups mark the socket ready so the next read or write finds
+ * out about them.
+ */
+static void relay_ready (struct relay_side *side, int in, int out, int err)
+{
+        if (in || err)
+                side->readable = TRUE;
+        if (out || err)
+                side->writable = TRUE;
+}
+
+/*
+ * Wait with poll() for one of the sockets to be ready for what the
+ * relay needs from it.  Used when epoll is not available.
+ */
+static int relay_poll (struct relay_side *sides, int timeout)
+{
+        struct pollfd pfd[2];
+        int i, ret;
+
+        for (i = 0; i != 2; i++) {
+                pfd[i].fd = sides[i].fd;
+                pfd[i].events = 0;
+                if (sides[i].reading && !sides[i].readable
+                    && !buffer_full (sides[i].in))
+                        pfd[i].events |= POLLIN;
+                if (!sides[i].writable && buffer_size (sides[i].out) > 0)
+                        pfd[i].events |= POLLOUT;
+        }
+
+        ret = poll (pfd, 2, timeout);
+        for (i = 0; ret > 0 && i != 2; i++)
+                relay_ready (&sides[i], pfd[i].revents & POLLIN,
+                             pfd[i].revents & POLLOUT,
+                             pfd[i].revents & (POLLERR | POLLHUP));
+
+        return ret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Wait for either socket on the epoll instance.  Both are registered
+ * edge-triggered for reading and writing, so the interest never has to
+ * be changed; a socket is only reported when it becomes ready again.
+ */
+static int relay_epoll (int epfd, struct relay_side *sides, int timeout)
+{
+        struct epoll_event events[2];
+        int i, ret;
+
+        ret = epoll_wait (epfd, events, 2, timeout);
+        for (i = 0; i < ret; i++)
+                relay_ready (&sides[events[i].data.u32],
+                             events[i].events & EPOLLIN,
+                             events[i].events & EPOLLOUT,
+                             events[i].events & (EPOLLERR | EPOLLHUP));
+
+        return ret;
+}
+
+static int relay_epoll_create (struct relay_side *sides)
+{
+        struct epoll_event event;
+        int epfd, i;
+
+        epfd = epoll_create (2);
+        if (epfd < 0)
+                return -1;
+
+        for (i = 0; i != 2; i++) {
+                memset (&event, 0, sizeof (event));
+                event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                event.data.u32 = i;
+                if (epoll_ctl (epfd, EPOLL_CTL_ADD, sides[i].fd, &event) < 0) {
+                        close (epfd);
+                        return -1;
+                }
+        }
+
+        return epfd;
 }
+#endif /* HAVE_SYS_EPOLL_H */
 
 /*
  * Switch the sockets into nonblocking mode and begin relaying the bytes
@@ -1175,98 +1352,124 @@ ERROR_EXIT:
  * connections (as this was the reason why I originally modified
  * tinyproxy oh so long ago...)
  *	- rjkaes
+ *
+ * Unless "response" is NULL (for a tunnel which has been answered
+ * already) the response head is read into it along the way, while the
+ * request body goes to the server.  Returns -1 if the head never came.
  */
-static void relay_connection (struct conn_s *connptr)
+static int relay_connection (struct conn_s *connptr,
+                             struct http_head_s *response)
 {
-        fd_set rset, wset;
-        struct timeval tv;
-        time_t last_access;
+        struct relay_side sides[2];
+        struct relay_side *client = &sides[0], *server = &sides[1];
+        time_t last_access, now;
+        long int timeout;
+        int epfd = -1;
         int ret;
-        double tdiff;
-        int maxfd = max (connptr->client_fd, connptr->server_fd) + 1;
-        ssize_t bytes_received;
 
         socket_nonblocking (connptr->client_fd);
         socket_nonblocking (connptr->server_fd);
 
-        last_access = time (NULL);
+        if (!response)
+                relay_splice (connptr);
 
-        for (;;) {
-                FD_ZERO (&rset);
-                FD_ZERO (&wset);
+        client->fd = connptr->client_fd;
+        client->in = connptr->cbuffer;
+        client->out = connptr->sbuffer;
+        server->fd = connptr->server_fd;
+        server->in = connptr->sbuffer;
+        server->out = connptr->cbuffer;
 
-                tv.tv_sec =
-                    config.idletimeout - difftime (time (NULL), last_access);
-                tv.tv_usec = 0;
+        /*
+         * Assume the sockets can be written to until a write says
+         * otherwise; data to read is waited for.
+         */
+        client->readable = server->readable = FALSE;
+        client->writable = server->writable = TRUE;
+        client->closed = server->closed = FALSE;
+        client->shut = server->shut = FALSE;
 
-                if (buffer_size (connptr->sbuffer) > 0)
-                        FD_SET (connptr->client_fd, &wset);
-                if (buffer_size (connptr->cbuffer) > 0)
-                        FD_SET (connptr->server_fd, &wset);
-                if (buffer_size (connptr->sbuffer) < MAXBUFFSIZE)
-                        FD_SET (connptr->server_fd, &rset);
-                if (buffer_size (connptr->cbuffer) < MAXBUFFSIZE)
-                        FD_SET (connptr->client_fd, &rset);
+        client->read = read_request_body;
+        server->read = read_response_body;
+        client->head = NULL;
+        server->head = response;
 
-                ret = select (maxfd, &rset, &wset, NULL, &tv);
+        server->reading = TRUE;
+        client->reading = client_reading (connptr, client);
 
-                if (ret == 0) {
-                        tdiff = difftime (time (NULL), last_access);
-                        if (tdiff > config.idletimeout) {
-                                log_message (LOG_INFO,
-                                             "Idle Timeout (after select) as %g > %u.",
-                                             tdiff, config.idletimeout);
-                                return;
-                        } else {
-                                continue;
-                        }
-                } else if (ret < 0) {
+#ifdef HAVE_SYS_EPOLL_H
+        epfd = relay_epoll_create (sides);
+#endif
+
+        last_access = now = get_monotonic_time ();
+
+        while (server->head || connptr->content_length.server != 0) {
+                if (relay_transfer (connptr, client, server) < 0)
+                        break;
+
+                timeout = config.idletimeout - (long int) (now - last_access);
+                if (timeout <= 0) {
+                        log_message (LOG_INFO,
+                                     "Idle Timeout (after poll) as %ld >= %u.",
+                                     (long int) (now - last_access),
+                                     config.idletimeout);
+                        connptr->keep_alive = FALSE;
+                        goto done;
+                }
+
+#ifdef HAVE_SYS_EPOLL_H
+                if (epfd >= 0)
+                        ret = relay_epoll (epfd, sides, timeout * 1000);
+                else
+#endif
+                        ret = relay_poll (sides, timeout * 1000);
+
+                now = get_monotonic_time ();
+
+                if (ret > 0) {
+                        last_access = now;
+                } else if (ret < 0 && errno != EINTR) {
                         log_message (LOG_ERR,
-                                     "relay_connection: select() error \"%s\". "
+                                     "relay_connection: poll() error \"%s\". "
                                      "Closing connection (client_fd:%d, server_fd:%d)",
                                      strerror (errno), connptr->client_fd,
                                      connptr->server_fd);
-                        return;
-                } else {
-                        /*
-                         * All right, something was actually selected so mark it.
-                         */
-                        last_access = time (NULL);
+                        connptr->keep_alive = FALSE;
+                        goto done;
                 }
+        }
 
-                if (FD_ISSET (connptr->server_fd, &rset)) {
-                        bytes_received =
-                            read_buffer (connptr->server_fd, connptr->sbuffer);
-                        if (bytes_received < 0)
-                                break;
-
-                        connptr->content_length.server -= bytes_received;
-                        if (connptr->content_length.server == 0)
-                                break;
-                }
-                if (FD_ISSET (connptr->client_fd, &rset)
-                    && read_buffer (connptr->client_fd, connptr->cbuffer) < 0) {
-                        break;
-                }
-                if (FD_ISSET (connptr->server_fd, &wset)
-                    && write_buffer (connptr->server_fd, connptr->cbuffer) < 0) {
-                        break;
-                }
-                if (FD_ISSET (connptr->client_fd, &wset)
-                    && write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
-                        break;
-                }
+        /* Nothing has been sent to the client yet */
+        if (server->head) {
+                connptr->keep_alive = FALSE;
+                socket_blocking (connptr->client_fd);
+                goto done;
         }
 
+        /*
+         * The response has to be complete to go on with the next one, and
+         * so does the request, which the server may have answered early.
+         */
+        if (connptr->content_length.server != 0
+            || connptr->content_length.client > 0 || client->closed)
+                connptr->keep_alive = FALSE;
+        if (buffer_size (connptr->cbuffer) > 0
+            || connptr->content_length.client > 0)
+                connptr->server_keep_alive = FALSE;
+
         /*
          * Here the server has closed the connection... write the
          * remainder to the client and then exit.
          */
         socket_blocking (connptr->client_fd);
         while (buffer_size (connptr->sbuffer) > 0) {
-                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
+                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
+                        connptr->keep_alive = FALSE;
                         break;
+                }
         }
+        if (connptr->keep_alive)
+                goto done;
         shutdown (connptr->client_fd, SHUT_WR);
 
         /*
@@ -1278,41 +1481,95 @@ static void relay_connection (struct conn_s *connptr)
                         break;
         }
 
-        return;
+done:
+        if (epfd >= 0)
+                close (epfd);
+
+        return server->head ? -1 : 0;
 }
 
 /*
- * Establish a connection to the upstream proxy server.
+ * Work out where the server connection for the request should go: the
+ * upstream proxy if one is in use, otherwise the requested host itself.
  */
-static int
-connect_to_upstream (struct conn_s *connptr, struct request_s *request)
+const char *get_next_hop (struct conn_s *connptr, struct request_s *request,
+                          int *port)
 {
-#ifndef UPSTREAM_SUPPORT
-        /*
-         * This function does nothing if upstream support was not compiled
-         * into tinyproxy.
-         */
-        return -1;
-#else
-        char *combined_string;
-        int len;
-
-        struct upstream *cur_upstream = connptr->upstream_proxy;
-
-        if (!cur_upstream) {
-                log_message (LOG_WARNING,
-                             "No upstream proxy defined for %s.",
-                             request->host);
-                indicate_http_error (connptr, 404,
-                                     "Unable to connect to upstream proxy.");
-                return -1;
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL) {
+                *port = connptr->upstream_proxy->port;
+                return connptr->upstream_proxy->host;
         }
+#endif
+
+        *port = request->port;
+        return request->host;
+}
+
+/*
+ * The address the server connection is bound to, which is part of what
+ * an idle connection is kept under.
+ */
+static const char *server_bind_address (struct conn_s *connptr)
+{
+        return connptr->server_ip_addr ? connptr->server_ip_addr
+            : config.bind_address;
+}
+
+/*
+ * Take an idle connection to the next hop for the request out of the
+ * pool.  Returns -1 if there is none, and a new one has to be made.
+ */
+int reuse_server_conn (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host;
+        int port, fd;
+
+        /* A tunnel needs a connection of its own */
+        if (connptr->connect_method)
+                return -1;
+
+        host = get_next_hop (connptr, request, &port);
+
+        fd = conn_pool_get (host, port, server_bind_address (connptr));
+        if (fd < 0)
+                return -1;
+
+        log_message (LOG_CONN,
+                     "Reusing connection to \"%s\" (file descriptor %d)",
+                     host, fd);
+
+        connptr->server_fd = fd;
+        return 0;
+}
+
+/*
+ * Once the whole response has been relayed, hand the server connection
+ * to the pool if it can take another request.  Otherwise it is left to
+ * be closed.
+ */
+void release_server_conn (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host;
+        int port;
+
+        if (connptr->server_fd < 0 || !connptr->server_keep_alive
+            || connptr->content_length.server != 0)
+                return;
 
-        connptr->server_fd =
-            opensock (cur_upstream->host, cur_upstream->port,
-                      connptr->server_ip_addr);
+        host = get_next_hop (connptr, request, &port);
 
-        if (connptr->server_fd < 0) {
+        conn_pool_put (host, port, server_bind_address (connptr),
+                       connptr->server_fd);
+        connptr->server_fd = -1;
+}
+
+/*
+ * Note that the connection to the next hop could not be established.
+ */
+void indicate_connect_error (struct conn_s *connptr, int err)
+{
+        if (connptr->upstream_proxy != NULL) {
                 log_message (LOG_WARNING,
                              "Could not connect to upstream proxy.");
                 indicate_http_error (connptr, 404,
@@ -1321,68 +1578,178 @@ connect_to_upstream (struct conn_s *connptr, struct request_s *request)
                                      "A network error occurred while trying to "
                                      "connect to the upstream web proxy.",
                                      NULL);
-                return -1;
+        } else {
+                indicate_http_error (connptr, 500, "Unable to connect",
+                                     "detail",
+                                     PACKAGE_NAME " "
+                                     "was unable to connect to the remote web server.",
+                                     "error", strerror (err), NULL);
         }
+}
 
-        log_message (LOG_CONN,
-                     "Established connection to upstream proxy \"%s\" "
-                     "using file descriptor %d.",
-                     cur_upstream->host, connptr->server_fd);
+/*
+ * The connection to the upstream proxy could not be made.  If it is one
+ * of a group, switch to another of them which hasn't been tried yet:
+ * returns 0 if there is one.
+ */
+int try_next_upstream (struct conn_s *connptr, struct request_s *request)
+{
+#ifdef UPSTREAM_SUPPORT
+        struct upstream *next;
+
+        if (connptr->upstream_proxy != NULL) {
+                next = upstream_failed (connptr->upstream_proxy,
+                                        request->host,
+                                        &connptr->upstream_use);
+                if (next) {
+                        connptr->upstream_proxy = next;
+                        return 0;
+                }
+        }
+#endif
+
+        return -1;
+}
+
+/*
+ * Establish a (blocking) connection to the next hop for the request.
+ */
+static int
+connect_to_server (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host;
+        int port, err;
+
+        do {
+                if (reuse_server_conn (connptr, request) == 0) {
+                        socket_blocking (connptr->server_fd);
+                        return 0;
+                }
+
+                host = get_next_hop (connptr, request, &port);
+
+                connptr->server_fd = opensock (host, port,
+                                               connptr->server_ip_addr);
+                if (connptr->server_fd >= 0)
+                        return 0;
+
+                err = errno;
+        } while (try_next_upstream (connptr, request) == 0);
+
+        indicate_connect_error (connptr, err);
+        return -1;
+}
+
+/*
+ * Send the request line and the client's headers over the newly
+ * established server connection, all in one write.  If an upstream
+ * proxy is in use the "path" part of the request is rewritten into a
+ * full URL first.
+ */
+int send_request (struct conn_s *connptr, struct request_s *request,
+                  struct header_map *hashofheaders)
+{
+        struct header_buffer hb;
 
         /*
-         * We need to re-write the "path" part of the request so that we
-         * can reuse the establish_http_connection() function. It expects a
-         * method and path.
+         * Ask the server to keep the connection open if it could be
+         * used again, which needs the end of the request body to be
+         * known.
          */
-        if (connptr->connect_method) {
-                len = strlen (request->host) + 7;
+        connptr->server_keep_alive = config.serverkeepalive > 0
+            && !connptr->connect_method
+            && (!header_map_get_id (hashofheaders, HEADER_TRANSFER_ENCODING)
+                || chunked_active (&connptr->chunked.client));
 
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
-                        return -1;
-                }
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL) {
+                char *combined_string;
+                int len;
 
-                snprintf (combined_string, len, "%s:%d", request->host,
-                          request->port);
-        } else {
-                len = strlen (request->host) + strlen (request->path) + 14;
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
-                        return -1;
+                log_message (LOG_CONN,
+                             "Established connection to upstream proxy \"%s\" "
+                             "using file descriptor %d.",
+                             connptr->upstream_proxy->host,
+                             connptr->server_fd);
+                upstream_connected (&connptr->upstream_use);
+
+                /*
+                 * We need to re-write the "path" part of the request so
+                 * that we can reuse the establish_http_connection()
+                 * function. It expects a method and path.
+                 */
+                if (connptr->connect_method) {
+                        len = strlen (request->host) + 7;
+
+                        combined_string = (char *)
+                            arena_alloc (&connptr->arena, len);
+                        if (!combined_string) {
+                                return -1;
+                        }
+
+                        snprintf (combined_string, len, "%s:%d",
+                                  request->host, request->port);
+                } else {
+                        len = strlen (request->host) + strlen (request->path)
+                            + 14;
+                        combined_string = (char *)
+                            arena_alloc (&connptr->arena, len);
+                        if (!combined_string) {
+                                return -1;
+                        }
+
+                        snprintf (combined_string, len, "http://%s:%d%s",
+                                  request->host, request->port,
+                                  request->path);
                 }
 
-                snprintf (combined_string, len, "http://%s:%d%s", request->host,
-                          request->port, request->path);
+                request->path = combined_string;
+        } else
+#endif
+        {
+                log_message (LOG_CONN,
+                             "Established connection to host \"%s\" using "
+                             "file descriptor %d.", request->host,
+                             connptr->server_fd);
         }
 
-        if (request->path)
-                safefree (request->path);
-        request->path = combined_string;
+        header_buffer_init (&hb);
+        if (!connptr->connect_method || connptr->upstream_proxy != NULL)
+                establish_http_connection (connptr, request, &hb);
+        process_client_headers (connptr, hashofheaders, &hb);
 
-        return establish_http_connection (connptr, request);
-#endif
+        if (header_buffer_send (&hb, connptr->server_fd,
+                                connptr->server_pending) < 0) {
+                indicate_http_error (connptr, 503,
+                                     "Could not send data to remote server",
+                                     "detail",
+                                     "A network error occurred while "
+                                     "trying to write data to the remote web "
+                                     "server.", NULL);
+                return -1;
+        }
+
+        return 0;
 }
 
 static int
 get_request_entity(struct conn_s *connptr)
 {
         int ret;
-        fd_set rset;
-        struct timeval tv;
+        struct pollfd pfd;
 
-        FD_ZERO (&rset);
-        FD_SET (connptr->client_fd, &rset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        ret = select (connptr->client_fd + 1, &rset, NULL, NULL, &tv);
+        pfd.fd = connptr->client_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ret = poll (&pfd, 1, 0);
 
         if (ret == -1) {
                 log_message (LOG_ERR,
-                             "Error calling select on client fd %d: %s",
+                             "Error calling poll on client fd %d: %s",
                              connptr->client_fd, strerror(errno));
         } else if (ret == 0) {
                log_message (LOG_INFO, "no entity");
-        } else if (ret == 1 && FD_ISSET (connptr->client_fd, &rset)) {
+        } else if (ret == 1 && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
                 ssize_t nread;
                 nread = read_buffer (connptr->client_fd, connptr->cbuffer);
                 if (nread < 0) {
@@ -1397,7 +1764,7 @@ get_request_entity(struct conn_s *connptr)
                         ret = 0;
                 }
         } else {
-                log_message (LOG_ERR, "strange situation after select: "
+                log_message (LOG_ERR, "strange situation after poll: "
                              "ret = %d, but client_fd (%d) is not readable...",
                              ret, connptr->client_fd);
                 ret = -1;
@@ -1406,67 +1773,367 @@ get_request_entity(struct conn_s *connptr)
         return ret;
 }
 
-
 /*
- * This is the main drive for each connection. As you can tell, for the
- * first few steps we are using a blocking socket. If you remember the
- * older tinyproxy code, this use to be a very confusing state machine.
- * Well, no more! :) The sockets are only switched into nonblocking mode
- * when we start the relay portion. This makes most of the original
- * tinyproxy code, which was confusing, redundant. Hail progress.
- * 	- rjkaes
+ * Set up the connection structure for a newly accepted client socket and
+ * the address accept() returned for it.  If that isn't possible the
+ * socket is closed and NULL is returned.
  */
-void handle_connection (int fd)
+struct conn_s *open_connection (int fd, const struct sockaddr *addr,
+                                socklen_t addrlen)
 {
-        ssize_t i;
         struct conn_s *connptr;
-        struct request_s *request = NULL;
-        hashmap_t hashofheaders = NULL;
 
         char sock_ipaddr[IP_LENGTH];
         char peer_ipaddr[IP_LENGTH];
-        char peer_string[HOSTNAME_LENGTH];
 
-        getpeer_information (fd, peer_ipaddr, peer_string);
+        /*
+         * The host name is only looked up if the access list needs it
+         * (see connection_allowed()), not for every connection.
+         */
+        if (get_ip_string (addr, peer_ipaddr, sizeof (peer_ipaddr)) == NULL)
+                peer_ipaddr[0] = '\0';
 
         if (config.bindsame)
                 getsock_ip (fd, sock_ipaddr);
 
         log_message (LOG_CONN, config.bindsame ?
-                     "Connect (file descriptor %d): %s [%s] at [%s]" :
-                     "Connect (file descriptor %d): %s [%s]",
-                     fd, peer_string, peer_ipaddr, sock_ipaddr);
+                     "Connect (file descriptor %d): [%s] at [%s]" :
+                     "Connect (file descriptor %d): [%s]",
+                     fd, peer_ipaddr, sock_ipaddr);
 
-        connptr = initialize_conn (fd, peer_ipaddr, peer_string,
+        connptr = initialize_conn (fd, addr, addrlen, peer_ipaddr,
                                    config.bindsame ? sock_ipaddr : NULL);
         if (!connptr) {
                 close (fd);
-                return;
+                return NULL;
         }
 
-        if (check_acl (peer_ipaddr, peer_string, config.access_list) <= 0) {
-                update_stats (STAT_DENIED);
-                indicate_http_error (connptr, 403, "Access denied",
-                                     "detail",
-                                     "The administrator of this proxy has not configured "
-                                     "it to service requests from your host.",
-                                     NULL);
-                goto fail;
+        return connptr;
+}
+
+/*
+ * Check the client against the access control list.  If it is not
+ * allowed to use the proxy, the error is noted in the connection.  If
+ * the answer depends on the client's host name, which has not been
+ * looked up yet, -1 is returned; once set_client_name() has been given
+ * the name, ask again.  If it depends on the addresses of a host named
+ * in the list, which "resolve" is looking up, -2 is returned; ask again
+ * once they are known.
+ */
+int check_connection_access (struct conn_s *connptr,
+                             acl_resolver resolve, void *arg)
+{
+        int ret;
+
+        ret = check_acl ((struct sockaddr *) &connptr->client_addr,
+                         connptr->client_ip_addr, connptr->client_string_addr,
+                         config.access_list, resolve, arg);
+        if (ret != 0)
+                return ret;
+
+        update_stats (STAT_DENIED);
+        indicate_http_error (connptr, 403, "Access denied",
+                             "detail",
+                             "The administrator of this proxy has not configured "
+                             "it to service requests from your host.",
+                             NULL);
+        return FALSE;
+}
+
+/*
+ * Remember the client's host name.  A client without one (NULL) goes by
+ * its address, as getnameinfo() would have it.
+ */
+void set_client_name (struct conn_s *connptr, const char *name)
+{
+        connptr->client_string_addr =
+            arena_strdup (&connptr->arena,
+                          name ? name : connptr->client_ip_addr);
+
+        /*
+         * The name is looked up before the first request, and has to
+         * outlast them all.
+         */
+        arena_save (&connptr->arena, &connptr->request_mark);
+}
+
+/*
+ * Check the client against the access control list, looking up its host
+ * name (and waiting for it) if need be.
+ */
+int connection_allowed (struct conn_s *connptr)
+{
+        char name[HOSTNAME_LENGTH];
+        int ret;
+
+        ret = check_connection_access (connptr, NULL, NULL);
+        if (ret < 0) {
+                dns_resolve_name ((struct sockaddr *) &connptr->client_addr,
+                                  name, sizeof (name));
+                set_client_name (connptr, name[0] ? name : NULL);
+                ret = check_connection_access (connptr, NULL, NULL);
         }
 
-        if (read_request_line (connptr) < 0) {
-                update_stats (STAT_BADCONN);
+        return ret > 0;
+}
+
+/*
+ * Tell the client why its request head could not be read: it was closed
+ * (or timed out) before the request line arrived, it went away in the
+ * middle of the headers, or the head was malformed.
+ */
+void indicate_request_head_error (struct conn_s *connptr,
+                                  const struct http_head_s *head)
+{
+        update_stats (STAT_BADCONN);
+
+        switch (head->parser.state) {
+        case HTTP_STATE_START:
+                log_message (LOG_ERR,
+                             "read_request_line: Client (file descriptor: %d) "
+                             "closed socket before read.", connptr->client_fd);
                 indicate_http_error (connptr, 408, "Timeout",
                                      "detail",
                                      "Server timeout waiting for the HTTP request "
                                      "from the client.", NULL);
+                break;
+        case HTTP_STATE_ERROR:
+                log_message (LOG_ERR,
+                             "process_request: Bad Request on file descriptor %d",
+                             connptr->client_fd);
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail", "Request has an invalid format",
+                                     NULL);
+                break;
+        default:
+                log_message (LOG_WARNING,
+                             "Could not retrieve all the headers from the client");
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "Could not retrieve all the headers from "
+                                     "the client.", NULL);
+                break;
+        }
+}
+
+/*
+ * Decide whether the client connection may stay open for another request
+ * once this one has been answered.  The response can still rule it out.
+ */
+static unsigned int
+client_keep_alive (struct conn_s *connptr, struct header_map *hashofheaders)
+{
+        if (connptr->connect_method
+            || connptr->requests >= config.maxkeepaliverequests)
+                return FALSE;
+
+        /* The end of the request body has to be found */
+        if (header_map_get_id (hashofheaders, HEADER_TRANSFER_ENCODING)
+            && !chunked_active (&connptr->chunked.client))
+                return FALSE;
+
+        if (connection_has_token (hashofheaders, "close"))
+                return FALSE;
+
+        /* HTTP/1.1 connections are persistent unless closed */
+        if (connptr->protocol.major > 1
+            || (connptr->protocol.major == 1 && connptr->protocol.minor >= 1))
+                return TRUE;
+
+        return connection_has_token (hashofheaders, "keep-alive");
+}
+
+/*
+ * Add the user-specified headers to the client's headers, break the
+ * request apart and pick the upstream proxy (if any) to use for it.
+ * What was read past the headers is passed on to the client buffer: just
+ * the start of the body if its length is known, since anything after
+ * that is the client's next request.
+ */
+struct request_s *prepare_request (struct conn_s *connptr,
+                                   struct header_map *hashofheaders,
+                                   struct http_head_s *head)
+{
+        struct request_s *request;
+        struct chunked_s *chunked = &connptr->chunked.client;
+        unsigned int is_chunked;
+        long int length;
+        int encoded;
+        ssize_t i;
+
+        connptr->requests++;
+
+        /*
+         * A body whose length is in doubt can't be passed on, nor can
+         * anything the client sends after it be trusted to be another
+         * request.
+         */
+        if (get_content_length (hashofheaders, &length) < 0) {
+                log_message (LOG_WARNING,
+                             "Invalid Content-Length in the request "
+                             "from the client");
+                connptr->keep_alive = FALSE;
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "The request has a Content-Length "
+                                     "which is invalid or given more than "
+                                     "once.", NULL);
+                update_stats (STAT_BADCONN);
+                return NULL;
+        }
+
+        /* Nor can one sent with "chunked" anywhere but as the last coding */
+        encoded = get_transfer_encoding (hashofheaders, &is_chunked);
+        if (encoded < 0) {
+                log_message (LOG_WARNING,
+                             "Invalid Transfer-Encoding in the request "
+                             "from the client");
+                connptr->keep_alive = FALSE;
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "The request has a Transfer-Encoding "
+                                     "which leaves the end of the body in "
+                                     "doubt.", NULL);
+                update_stats (STAT_BADCONN);
+                return NULL;
+        }
+
+        /*
+         * Add any user-specified headers (AddHeader directive) to the
+         * outgoing HTTP request.
+         */
+        for (i = 0; i < vector_length (config.add_headers); i++) {
+                http_header_t *header = (http_header_t *)
+                        vector_getentry (config.add_headers, i, NULL);
+
+                header_map_add_copy (hashofheaders,
+                                     header->name, header->value);
+        }
+
+        request = process_request (connptr, hashofheaders, head);
+        if (!request) {
+                if (!connptr->show_stats) {
+                        update_stats (STAT_BADCONN);
+                }
+                return NULL;
+        }
+
+        /*
+         * The proxy comes from the configuration as it is now, which a
+         * reload may replace before the request is done with it.
+         */
+        config_release (connptr->generation);
+        connptr->generation = config_hold ();
+        connptr->upstream_proxy = UPSTREAM_HOST (request->host,
+                                                 &connptr->upstream_use);
+
+        /*
+         * See if there is a "Content-Length" header.  If so, again we need
+         * to do a bit of processing.
+         */
+        if (!connptr->connect_method)
+                connptr->content_length.client = length;
+
+        /*
+         * A transfer coding overrides any Content-Length, which is not
+         * passed on.  A chunked body is followed to find its end.
+         */
+        if (encoded && !connptr->connect_method) {
+                connptr->content_length.client = -1;
+                header_map_remove_id (hashofheaders, HEADER_CONTENT_LENGTH);
+                if (is_chunked)
+                        chunked_start (chunked);
+        }
+
+        if (chunked_active (chunked)) {
+                length = chunked_scan (chunked, head->data + head->end,
+                                       head->len - head->end);
+                connptr->content_length.client = chunked_left (chunked);
+                if (connptr->content_length.client < 0) {
+                        chunked_stop (chunked);
+                        length = -1;
+                }
+        } else if (connptr->connect_method || encoded) {
+                length = -1;
+        } else {
+                length = max (connptr->content_length.client, 0);
+        }
+
+        connptr->keep_alive = client_keep_alive (connptr, hashofheaders);
+
+        length = http_head_finish (head, connptr->cbuffer, length);
+        if (connptr->content_length.client > 0
+            && !chunked_active (chunked))
+                connptr->content_length.client -=
+                    min (length, connptr->content_length.client);
+
+        return request;
+}
+
+/*
+ * Send the client whatever is appropriate after the request could not
+ * be completed: either the error page, or the statistics page.
+ */
+void handle_connection_failure (struct conn_s *connptr)
+{
+        /*
+         * First, get the body if there is one.
+         * If we don't read all there is from the socket first,
+         * it is still marked for reading and we won't be able
+         * to send our data properly.
+         */
+        if (get_request_entity (connptr) < 0) {
+                log_message (LOG_WARNING,
+                             "Could not retrieve request entity");
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "Could not retrieve the request entity "
+                                     "the client.", NULL);
+                update_stats (STAT_BADCONN);
+        }
+
+        if (connptr->error_variables) {
+                send_http_error_message (connptr);
+        } else if (connptr->show_stats) {
+                showstats (connptr);
+        }
+}
+
+/*
+ * Read one request from the client, and relay the response to it.
+ * Returns 0 if the connection stays open for another request.
+ */
+static int handle_request (struct conn_s *connptr, struct http_head_s *head)
+{
+        struct http_head_s response;
+        struct request_s *request = NULL;
+        struct header_map *hashofheaders = NULL;
+        int ret = -1;
+
+        /*
+         * Read the request line and the headers from the client in one
+         * go.
+         */
+        if (http_head_receive (head, connptr->client_fd) < 0) {
+                /* A kept open connection may simply be closed */
+                if (connptr->requests > 0 && head->len == 0)
+                        return -1;
+
+                indicate_request_head_error (connptr, head);
                 goto fail;
         }
 
+        connptr->request_line = http_head_start_line (&connptr->arena, head);
+        if (!connptr->request_line)
+                goto fail;
+
+        log_message (LOG_CONN, "Request (file descriptor %d): %s",
+                     connptr->client_fd, connptr->request_line);
+
         /*
          * The "hashofheaders" store the client's headers.
          */
-        hashofheaders = hashmap_create (HEADER_BUCKETS);
+        hashofheaders = header_map_create (&connptr->arena);
         if (hashofheaders == NULL) {
                 update_stats (STAT_BADCONN);
                 indicate_http_error (connptr, 503, "Internal error",
@@ -1480,7 +2147,7 @@ void handle_connection (int fd)
         /*
          * Get all the headers from the client in a big hash.
          */
-        if (get_all_headers (connptr->client_fd, hashofheaders) < 0) {
+        if (add_headers_to_connection (hashofheaders, head) < 0) {
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the client");
                 indicate_http_error (connptr, 400, "Bad Request",
@@ -1491,60 +2158,54 @@ void handle_connection (int fd)
                 goto fail;
         }
 
+        request = prepare_request (connptr, hashofheaders, head);
+        if (!request)
+                goto fail;
+
+#ifdef REVERSE_SUPPORT
         /*
-         * Add any user-specified headers (AddHeader directive) to the
-         * outgoing HTTP request.
+         * The cache may have the response already, or another worker
+         * may be fetching it.
          */
-        for (i = 0; i < vector_length (config.add_headers); i++) {
-                http_header_t *header = (http_header_t *)
-                        vector_getentry (config.add_headers, i, NULL);
+        for (;;) {
+                cache_result_t cached;
+
+                cached = cache_lookup (connptr, request, hashofheaders);
+                if (cached == CACHE_HIT) {
+                        while (buffer_size (connptr->sbuffer) > 0) {
+                                if (write_buffer (connptr->client_fd,
+                                                  connptr->sbuffer) < 0) {
+                                        connptr->keep_alive = FALSE;
+                                        break;
+                                }
+                        }
+                        ret = connptr->keep_alive ? 0 : -1;
+                        goto done;
+                }
+                if (cached != CACHE_WAIT)
+                        break;
 
-                hashmap_insert (hashofheaders,
-                                header->name,
-                                header->value, strlen (header->value) + 1);
+                poll (NULL, 0, CACHE_RETRY_INTERVAL);
         }
+#endif
 
-        request = process_request (connptr, hashofheaders);
-        if (!request) {
-                if (!connptr->show_stats) {
-                        update_stats (STAT_BADCONN);
-                }
+        if (connect_to_server (connptr, request) < 0)
                 goto fail;
-        }
 
-        connptr->upstream_proxy = UPSTREAM_HOST (request->host);
-        if (connptr->upstream_proxy != NULL) {
-                if (connect_to_upstream (connptr, request) < 0) {
-                        goto fail;
-                }
-        } else {
-                connptr->server_fd = opensock (request->host, request->port,
-                                               connptr->server_ip_addr);
-                if (connptr->server_fd < 0) {
-                        indicate_http_error (connptr, 500, "Unable to connect",
-                                             "detail",
-                                             PACKAGE_NAME " "
-                                             "was unable to connect to the remote web server.",
-                                             "error", strerror (errno), NULL);
-                        goto fail;
-                }
-
-                log_message (LOG_CONN,
-                             "Established connection to host \"%s\" using "
-                             "file descriptor %d.", request->host,
-                             connptr->server_fd);
-
-                if (!connptr->connect_method)
-                        establish_http_connection (connptr, request);
-        }
-
-        if (process_client_headers (connptr, hashofheaders) < 0) {
+        if (send_request (connptr, request, hashofheaders) < 0) {
                 update_stats (STAT_BADCONN);
                 goto fail;
         }
 
+        /*
+         * The request body and the response are relayed together, so
+         * the server can answer before it has had the whole body.
+         */
         if (!(connptr->connect_method && (connptr->upstream_proxy == NULL))) {
-                if (process_server_headers (connptr) < 0) {
+                http_head_init (&response, HTTP_PARSE_RESPONSE);
+                ret = relay_connection (connptr, &response);
+                http_head_free (&response);
+                if (ret < 0) {
                         update_stats (STAT_BADCONN);
                         goto fail;
                 }
@@ -1556,43 +2217,91 @@ void handle_connection (int fd)
                         update_stats (STAT_BADCONN);
                         goto fail;
                 }
+                relay_connection (connptr, NULL);
         }
 
-        relay_connection (connptr);
+        release_server_conn (connptr, request);
 
         log_message (LOG_INFO,
                      "Closed connection between local client (fd:%d) "
                      "and remote client (fd:%d)",
                      connptr->client_fd, connptr->server_fd);
 
+        ret = connptr->keep_alive ? 0 : -1;
         goto done;
 
 fail:
+        handle_connection_failure (connptr);
+
+done:
+        return ret;
+}
+
+/*
+ * Wait for the next request on a connection which is kept open.
+ * Returns -1 if the client sent nothing within the time allowed.
+ */
+static int wait_for_request (struct conn_s *connptr, struct http_head_s *head)
+{
+        struct pollfd pfd;
+        int ret;
+
+        /* It may have been read already */
+        if (head->len > 0)
+                return 0;
+
+        pfd.fd = connptr->client_fd;
+        pfd.events = POLLIN;
+
+        do {
+                ret = poll (&pfd, 1, config.keepalivetimeout * 1000);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret > 0 ? 0 : -1;
+}
+
+/*
+ * This is the main drive for each connection. As you can tell, for the
+ * first few steps we are using a blocking socket. If you remember the
+ * older tinyproxy code, this use to be a very confusing state machine.
+ * Well, no more! :) The sockets are only switched into nonblocking mode
+ * when we start the relay portion. This makes most of the original
+ * tinyproxy code, which was confusing, redundant. Hail progress.
+ * 	- rjkaes
+ *
+ * (The event loop in event-loop.c drives the same steps without
+ * blocking, for the "WorkerMode eventloop" setting.)
+ */
+void handle_connection (int fd, const struct sockaddr *addr,
+                        socklen_t addrlen)
+{
+        struct conn_s *connptr;
+        struct http_head_s head;
+
+        http_head_init (&head, HTTP_PARSE_REQUEST);
+
+        connptr = open_connection (fd, addr, addrlen);
+        if (!connptr)
+                return;
+
+        if (!connection_allowed (connptr)) {
+                handle_connection_failure (connptr);
+                goto done;
+        }
+
         /*
-         * First, get the body if there is one.
-         * If we don't read all there is from the socket first,
-         * it is still marked for reading and we won't be able
-         * to send our data properly.
+         * Keep reading requests for as long as the client keeps the
+         * connection open.
          */
-        if (get_request_entity (connptr) < 0) {
-                log_message (LOG_WARNING,
-                             "Could not retrieve request entity");
-                indicate_http_error (connptr, 400, "Bad Request",
-                                     "detail",
-                                     "Could not retrieve the request entity "
-                                     "the client.", NULL);
-                update_stats (STAT_BADCONN);
-        }
+        while (handle_request (connptr, &head) == 0) {
+                reset_conn (connptr);
+                http_head_reset (&head, HTTP_PARSE_REQUEST);
 
-        if (connptr->error_variables) {
-                send_http_error_message (connptr);
-        } else if (connptr->show_stats) {
-                showstats (connptr);
+                if (wait_for_request (connptr, &head) < 0)
+                        break;
         }
 
 done:
-        free_request_struct (request);
-        hashmap_delete (hashofheaders);
+        http_head_free (&head);
         destroy_conn (connptr);
-        return;
 }
@@ -23,6 +23,8 @@
 #define _TINYPROXY_REQS_H_
 
 #include "common.h"
+#include "acl.h"
+#include "header-map.h"
 
 /*
  * Port constants for HTTP (80) and SSL (443)
@@ -43,6 +45,49 @@ struct request_s {
         char *path;
 };
 
-extern void handle_connection (int fd);
+struct conn_s;
+struct http_head_s;
+
+extern void handle_connection (int fd, const struct sockaddr *addr,
+                               socklen_t addrlen);
+
+/*
+ * The individual steps of handling a connection.  handle_connection()
+ * runs through them with blocking sockets, while the event loop drives
+ * them as data arrives.
+ */
+extern struct conn_s *open_connection (int fd, const struct sockaddr *addr,
+                                       socklen_t addrlen);
+extern int connection_allowed (struct conn_s *connptr);
+extern int check_connection_access (struct conn_s *connptr,
+                                    acl_resolver resolve, void *arg);
+extern void set_client_name (struct conn_s *connptr, const char *name);
+extern void indicate_request_head_error (struct conn_s *connptr,
+                                         const struct http_head_s *head);
+extern int add_headers_to_connection (struct header_map *hashofheaders,
+                                      struct http_head_s *head);
+extern struct request_s *prepare_request (struct conn_s *connptr,
+                                          struct header_map *hashofheaders,
+                                          struct http_head_s *head);
+extern const char *get_next_hop (struct conn_s *connptr,
+                                 struct request_s *request, int *port);
+extern int reuse_server_conn (struct conn_s *connptr,
+                              struct request_s *request);
+extern void release_server_conn (struct conn_s *connptr,
+                                 struct request_s *request);
+extern void indicate_connect_error (struct conn_s *connptr, int err);
+extern int try_next_upstream (struct conn_s *connptr,
+                              struct request_s *request);
+extern int send_request (struct conn_s *connptr, struct request_s *request,
+                         struct header_map *hashofheaders);
+extern int send_ssl_response (struct conn_s *connptr);
+extern int process_response (struct conn_s *connptr,
+                             struct http_head_s *head);
+extern void start_response_body (struct conn_s *connptr,
+                                 struct http_head_s *head);
+extern ssize_t read_request_body (struct conn_s *connptr);
+extern ssize_t read_response_body (struct conn_s *connptr);
+extern void handle_connection_failure (struct conn_s *connptr);
+extern void relay_splice (struct conn_s *connptr);
 
 #endif
@@ -27,11 +27,148 @@
 #include "log.h"
 #include "conf.h"
 
+/*
+ * The paths are kept in a radix tree, each edge of which is labelled with
+ * the part of a path it stands for, so finding the longest path which a
+ * request starts with takes one walk along the request, however many
+ * paths there are.  The labels point into the paths themselves.  The
+ * rules are also kept in a list, newest first, for the redirects.
+ */
+struct reverse_node {
+        const char *label;
+        size_t len;
+        struct reversepath *rule;       /* a path ends here */
+        struct reverse_node **children; /* by the first byte of the label */
+        unsigned int count;
+};
+
+struct reversepath_list {
+        struct reversepath *rules;
+        struct reverse_node root;
+};
+
+/*
+ * Find where the child starting with "c" is, or would go.
+ */
+static unsigned int find_child (const struct reverse_node *node,
+                                unsigned char c)
+{
+        unsigned int low = 0, high = node->count;
+
+        while (low < high) {
+                unsigned int mid = (low + high) / 2;
+
+                if ((unsigned char) node->children[mid]->label[0] < c)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        return low;
+}
+
+static struct reverse_node *new_node (const char *label, size_t len,
+                                      struct reversepath *rule)
+{
+        struct reverse_node *node;
+
+        node = (struct reverse_node *)
+            safecalloc (1, sizeof (struct reverse_node));
+        if (node) {
+                node->label = label;
+                node->len = len;
+                node->rule = rule;
+        }
+
+        return node;
+}
+
+static int add_child (struct reverse_node *node, unsigned int i,
+                      struct reverse_node *child)
+{
+        struct reverse_node **children;
+
+        children = (struct reverse_node **)
+            saferealloc (node->children,
+                         (node->count + 1) * sizeof (struct reverse_node *));
+        if (!children)
+                return -1;
+
+        memmove (&children[i + 1], &children[i],
+                 (node->count - i) * sizeof (struct reverse_node *));
+        children[i] = child;
+        node->children = children;
+        node->count++;
+
+        return 0;
+}
+
+/*
+ * Put the rule in the tree.  A later rule for the same path replaces
+ * an earlier one.
+ */
+static int insert_path (struct reverse_node *node, struct reversepath *rule)
+{
+        const char *p = rule->path;
+        const char *end = rule->path + rule->path_len;
+
+        while (p != end) {
+                struct reverse_node *child, *mid;
+                unsigned int i = find_child (node, *p);
+                size_t common = 0;
+
+                if (i == node->count
+                    || node->children[i]->label[0] != *p) {
+                        child = new_node (p, end - p, rule);
+                        if (!child || add_child (node, i, child) < 0) {
+                                safefree (child);
+                                return -1;
+                        }
+                        return 0;
+                }
+
+                child = node->children[i];
+                while (common != child->len && p + common != end
+                       && child->label[common] == p[common])
+                        common++;
+
+                if (common < child->len) {
+                        /* The path parts company with the label */
+                        mid = new_node (child->label, common, NULL);
+                        if (!mid || add_child (mid, 0, child) < 0) {
+                                safefree (mid);
+                                return -1;
+                        }
+                        child->label += common;
+                        child->len -= common;
+                        node->children[i] = mid;
+                        child = mid;
+                }
+
+                node = child;
+                p += common;
+        }
+
+        node->rule = rule;
+        return 0;
+}
+
+static void free_children (struct reverse_node *node)
+{
+        unsigned int i;
+
+        for (i = 0; i != node->count; i++) {
+                free_children (node->children[i]);
+                safefree (node->children[i]);
+        }
+        safefree (node->children);
+}
+
 /*
  * Add entry to the reversepath list
  */
 void reversepath_add (const char *path, const char *url,
-                      struct reversepath **reversepath_list)
+                      struct reversepath_list **reversepath_list)
 {
         struct reversepath *reverse;
 
@@ -55,6 +192,16 @@ void reversepath_add (const char *path, const char *url,
                 return;
         }
 
+        if (!*reversepath_list) {
+                *reversepath_list = (struct reversepath_list *)
+                    safecalloc (1, sizeof (struct reversepath_list));
+                if (!*reversepath_list) {
+                        log_message (LOG_ERR,
+                                     "Unable to allocate memory in reversepath_add()");
+                        return;
+                }
+        }
+
         reverse = (struct reversepath *) safemalloc (sizeof
                                                      (struct reversepath));
         if (!reverse) {
@@ -70,24 +217,82 @@ void reversepath_add (const char *path, const char *url,
 
         reverse->url = safestrdup (url);
 
-        reverse->next = *reversepath_list;
-        *reversepath_list = reverse;
+        if (!reverse->path || !reverse->url) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in reversepath_add()");
+                goto fail;
+        }
+
+        reverse->path_len = strlen (reverse->path);
+        reverse->url_len = strlen (reverse->url);
+
+        if (insert_path (&(*reversepath_list)->root, reverse) < 0) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in reversepath_add()");
+                goto fail;
+        }
+
+        reverse->next = (*reversepath_list)->rules;
+        (*reversepath_list)->rules = reverse;
 
         log_message (LOG_INFO,
                      "Added reverse proxy rule: %s -> %s", reverse->path,
                      reverse->url);
+        return;
+
+fail:
+        safefree (reverse->path);
+        safefree (reverse->url);
+        safefree (reverse);
 }
 
 /*
- * Check if a request url is in the reversepath list
+ * Find the rule with the longest path the request url starts with.
  */
-struct reversepath *reversepath_get (char *url, struct reversepath *reverse)
+struct reversepath *reversepath_get (const char *url,
+                                     struct reversepath_list *list)
 {
-        while (reverse) {
-                if (strstr (url, reverse->path) == url)
-                        return reverse;
+        const struct reverse_node *node;
+        struct reversepath *found;
+
+        if (!list)
+                return NULL;
+
+        node = &list->root;
+        found = node->rule;
+
+        while (*url) {
+                unsigned int i = find_child (node, *url);
+
+                if (i == node->count)
+                        break;
+
+                node = node->children[i];
+                if (node->label[0] != *url
+                    || strncmp (url, node->label, node->len) != 0)
+                        break;
 
-                reverse = reverse->next;
+                url += node->len;
+                if (node->rule)
+                        found = node->rule;
+        }
+
+        return found;
+}
+
+/*
+ * Find the newest rule whose url the given one (from a redirect) starts
+ * with.
+ */
+struct reversepath *reversepath_get_by_url (const char *url,
+                                            struct reversepath_list *list)
+{
+        struct reversepath *reverse;
+
+        for (reverse = list ? list->rules : NULL; reverse;
+             reverse = reverse->next) {
+                if (strncasecmp (url, reverse->url, reverse->url_len) == 0)
+                        return reverse;
         }
 
         return NULL;
@@ -97,22 +302,49 @@ struct reversepath *reversepath_get (char *url, struct reversepath *reverse)
  * Free a reversepath list
  */
 
-void free_reversepath_list (struct reversepath *reverse)
+void free_reversepath_list (struct reversepath_list *list)
 {
-        while (reverse) {
-                struct reversepath *tmp = reverse;
-                reverse = reverse->next;
+        if (!list)
+                return;
+
+        while (list->rules) {
+                struct reversepath *tmp = list->rules;
+                list->rules = tmp->next;
                 safefree (tmp->url);
                 safefree (tmp->path);
                 safefree (tmp);
         }
+
+        free_children (&list->root);
+        safefree (list);
+}
+
+/*
+ * Build the URL to send the request for "url" on to: the rule's url in
+ * place of the "skip" bytes at its start.
+ */
+static char *make_url (struct arena *arena, const struct reversepath *reverse,
+                       const char *url, size_t skip)
+{
+        size_t rest = strlen (url + skip);
+        char *rewrite_url;
+
+        rewrite_url = (char *) arena_alloc (arena,
+                                            reverse->url_len + rest + 1);
+        if (rewrite_url) {
+                memcpy (rewrite_url, reverse->url, reverse->url_len);
+                memcpy (rewrite_url + reverse->url_len, url + skip,
+                        rest + 1);
+        }
+
+        return rewrite_url;
 }
 
 /*
  * Rewrite the URL for reverse proxying.
  */
-char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
-                           char *url)
+char *reverse_rewrite_url (struct conn_s *connptr,
+                           struct header_map *hashofheaders, char *url)
 {
         char *rewrite_url = NULL;
         char *cookie = NULL;
@@ -124,15 +356,11 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
                 /* First try locating the reverse mapping by request url */
                 reverse = reversepath_get (url, config.reversepath_list);
                 if (reverse) {
-                        rewrite_url = (char *)
-                            safemalloc (strlen (url) + strlen (reverse->url) +
-                                        1);
-                        strcpy (rewrite_url, reverse->url);
-                        strcat (rewrite_url, url + strlen (reverse->path));
+                        rewrite_url = make_url (&connptr->arena, reverse,
+                                                url, reverse->path_len);
                 } else if (config.reversemagic
-                           && hashmap_entry_by_key (hashofheaders,
-                                                    "cookie",
-                                                    (void **) &cookie) > 0) {
+                           && (cookie = header_map_get_id (hashofheaders,
+                                                           HEADER_COOKIE))) {
 
                         /* No match - try the magical tracking cookie next */
                         if ((cookieval = strstr (cookie, REVERSE_COOKIE "="))
@@ -142,12 +370,8 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
                                                  config.reversepath_list)))
                         {
 
-                                rewrite_url = (char *) safemalloc
-                                        (strlen (url) +
-                                         strlen (reverse->url) +
-                                         1);
-                                strcpy (rewrite_url, reverse->url);
-                                strcat (rewrite_url, url + 1);
+                                rewrite_url = make_url (&connptr->arena,
+                                                        reverse, url, 1);
 
                                 log_message (LOG_INFO,
                                              "Magical tracking cookie says: %s",
@@ -170,7 +394,8 @@ char *reverse_rewrite_url (struct conn_s *connptr, hashmap_t hashofheaders,
 
         /* Store reverse path so that the magical tracking cookie can be set */
         if (config.reversemagic && reverse)
-                connptr->reversepath = safestrdup (reverse->path);
+                connptr->reversepath = arena_strdup (&connptr->arena,
+                                                     reverse->path);
 
         return rewrite_url;
 }
@@ -22,21 +22,29 @@
 #define TINYPROXY_REVERSE_PROXY_H
 
 #include "conns.h"
+#include "header-map.h"
 
 struct reversepath {
         struct reversepath *next;
         char *path;
         char *url;
+        size_t path_len, url_len;
 };
 
+struct reversepath_list;
+
 #define REVERSE_COOKIE "yummy_magical_cookie"
 
 extern void reversepath_add (const char *path, const char *url,
-                             struct reversepath **reversepath_list);
-extern struct reversepath *reversepath_get (char *url,
-                                            struct reversepath *reverse);
-void free_reversepath_list (struct reversepath *reverse);
+                             struct reversepath_list **reversepath_list);
+extern struct reversepath *reversepath_get (const char *url,
+                                            struct reversepath_list *list);
+extern struct reversepath *reversepath_get_by_url (const char *url,
+                                                   struct reversepath_list
+                                                   *list);
+void free_reversepath_list (struct reversepath_list *list);
 extern char *reverse_rewrite_url (struct conn_s *connptr,
-                                  hashmap_t hashofheaders, char *url);
+                                  struct header_map *hashofheaders,
+                                  char *url);
 
 #endif
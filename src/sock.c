@@ -27,13 +27,44 @@
 
 #include "main.h"
 
+#include "dns.h"
 #include "log.h"
 #include "heap.h"
 #include "network.h"
 #include "sock.h"
 #include "text.h"
+#include "utils.h"
 #include "conf.h"
 
+/*
+ * Addresses which could not be connected to are remembered for this
+ * many seconds, and tried after the others meanwhile.  The list is
+ * shared by all the children.
+ */
+#define FAILED_ADDRESS_TIME 60
+#define FAILED_ADDRESS_MAX 64
+
+struct failed_addresses {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;
+#endif
+        unsigned int next;
+        struct {
+                struct sockaddr_storage addr;
+                time_t expires;
+        } list[FAILED_ADDRESS_MAX];
+};
+
+static struct failed_addresses *failed;
+
+#ifdef HAVE_PTHREAD_H
+#  define FAILED_LOCK()   pthread_mutex_lock (&failed->lock)
+#  define FAILED_UNLOCK() pthread_mutex_unlock (&failed->lock)
+#else
+#  define FAILED_LOCK()
+#  define FAILED_UNLOCK()
+#endif
+
 /*
  * Bind the given socket to the supplied address.  The socket is
  * returned if the bind succeeded.  Otherwise, -1 is returned
@@ -71,71 +102,344 @@ bind_socket (int sockfd, const char *addr, int family)
 }
 
 /*
- * Open a connection to a remote host.  It's been re-written to use
- * the getaddrinfo() library function, which allows for a protocol
- * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ * Look up the addresses of a remote host.  The returned list must be
+ * released with dns_free_addrs() by the caller.  NULL is returned if the
+ * host could not be resolved.
  */
-int opensock (const char *host, int port, const char *bind_to)
+struct addrinfo *resolve_host (const char *host, int port)
 {
-        int sockfd, n;
-        struct addrinfo hints, *res, *ressave;
-        char portstr[6];
+        struct addrinfo *res;
 
         assert (host != NULL);
         assert (port > 0);
 
-        memset (&hints, 0, sizeof (struct addrinfo));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-
-        snprintf (portstr, sizeof (portstr), "%d", port);
-
-        n = getaddrinfo (host, portstr, &hints, &res);
-        if (n != 0) {
+        res = dns_resolve (host, port);
+        if (!res)
                 log_message (LOG_ERR,
                              "opensock: Could not retrieve info for %s", host);
+
+        return res;
+}
+
+/*
+ * Compare two socket addresses, including the port.
+ */
+int same_sockaddr (const struct sockaddr *a, const struct sockaddr *b)
+{
+        const struct sockaddr_in *a4, *b4;
+        const struct sockaddr_in6 *a6, *b6;
+
+        if (a->sa_family != b->sa_family)
+                return FALSE;
+
+        if (a->sa_family == AF_INET) {
+                a4 = (const struct sockaddr_in *) a;
+                b4 = (const struct sockaddr_in *) b;
+                return a4->sin_port == b4->sin_port
+                    && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+        }
+
+        if (a->sa_family == AF_INET6) {
+                a6 = (const struct sockaddr_in6 *) a;
+                b6 = (const struct sockaddr_in6 *) b;
+                return a6->sin6_port == b6->sin6_port
+                    && memcmp (&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+        }
+
+        return FALSE;
+}
+
+/*
+ * Set up the list of failed addresses, before the children are created.
+ */
+void init_failed_addresses (void)
+{
+        failed = (struct failed_addresses *)
+            malloc_shared_memory (sizeof (struct failed_addresses));
+        if (failed == MAP_FAILED) {
+                failed = NULL;
+                return;
+        }
+
+        memset (failed, 0, sizeof (struct failed_addresses));
+
+#ifdef HAVE_PTHREAD_H
+        {
+                pthread_mutexattr_t attr;
+
+                pthread_mutexattr_init (&attr);
+                pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutex_init (&failed->lock, &attr);
+                pthread_mutexattr_destroy (&attr);
+        }
+#endif
+}
+
+/*
+ * Remember that connecting to the address failed.
+ */
+void remember_failed_address (const struct addrinfo *res)
+{
+        unsigned int i;
+
+        if (!failed || res->ai_addrlen > sizeof (failed->list[0].addr))
+                return;
+
+        FAILED_LOCK ();
+        i = failed->next;
+        failed->next = (i + 1) % FAILED_ADDRESS_MAX;
+
+        memset (&failed->list[i].addr, 0, sizeof (failed->list[i].addr));
+        memcpy (&failed->list[i].addr, res->ai_addr, res->ai_addrlen);
+        failed->list[i].expires = get_monotonic_time () + FAILED_ADDRESS_TIME;
+        FAILED_UNLOCK ();
+}
+
+static int failed_recently (const struct addrinfo *res, time_t now)
+{
+        unsigned int i;
+        int found = FALSE;
+
+        if (!failed)
+                return FALSE;
+
+        FAILED_LOCK ();
+        for (i = 0; i != FAILED_ADDRESS_MAX && !found; i++)
+                found = failed->list[i].expires > now
+                    && same_sockaddr ((struct sockaddr *)
+                                      &failed->list[i].addr, res->ai_addr);
+        FAILED_UNLOCK ();
+
+        return found;
+}
+
+/*
+ * Put the addresses in the order to try them in, as RFC 8305 describes:
+ * alternating between IPv6 and IPv4, starting with IPv6, so that a
+ * family which doesn't work only costs one connection attempt delay.
+ * Addresses which failed recently go last.
+ */
+void sort_addresses (struct addrinfo **addrs)
+{
+        struct addrinfo *lists[3] = { NULL, NULL, NULL };
+        struct addrinfo **tails[3];
+        struct addrinfo *res, *next;
+        time_t now = get_monotonic_time ();
+        unsigned int i;
+
+        for (i = 0; i != 3; i++)
+                tails[i] = &lists[i];
+
+        /* IPv6 in lists[0], the rest in lists[1], failed in lists[2] */
+        for (res = *addrs; res; res = next) {
+                next = res->ai_next;
+                res->ai_next = NULL;
+
+                if (failed_recently (res, now))
+                        i = 2;
+                else if (res->ai_family == AF_INET6)
+                        i = 0;
+                else
+                        i = 1;
+
+                *tails[i] = res;
+                tails[i] = &res->ai_next;
+        }
+
+        for (i = 0; lists[0] || lists[1]; i = !i) {
+                if (!lists[i])
+                        i = !i;
+
+                *addrs = lists[i];
+                addrs = &lists[i]->ai_next;
+                lists[i] = lists[i]->ai_next;
+        }
+        *addrs = lists[2];
+}
+
+/*
+ * Create a socket suitable for connecting to the given address, bound
+ * to the outgoing address if one was requested.
+ */
+static int open_bound_socket (const struct addrinfo *res, const char *bind_to)
+{
+        int sockfd;
+
+        sockfd = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sockfd < 0)
+                return -1;
+
+        if (!bind_to)
+                bind_to = config.bind_address;
+
+        if (bind_to && bind_socket (sockfd, bind_to, res->ai_family) < 0) {
+                close (sockfd);
                 return -1;
         }
 
-        ressave = res;
-        do {
-                sockfd =
-                    socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-                if (sockfd < 0)
-                        continue;       /* ignore this one */
-
-                /* Bind to the specified address */
-                if (bind_to) {
-                        if (bind_socket (sockfd, bind_to,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
-                        }
-                } else if (config.bind_address) {
-                        if (bind_socket (sockfd, config.bind_address,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
+        return sockfd;
+}
+
+/*
+ * Open a connection to a remote host.  The addresses are tried as RFC
+ * 8305 ("Happy Eyeballs") describes: if a connection hasn't been made
+ * within CONNECT_ATTEMPT_DELAY, the next address is tried at the same
+ * time, and the first connection made is used.  Addresses overtaken that
+ * way count as failed.  Gives up after the "ConnectTimeout", with errno
+ * set.
+ */
+int opensock (const char *host, int port, const char *bind_to)
+{
+        struct pollfd fds[CONNECT_ATTEMPTS];
+        struct addrinfo *tried[CONNECT_ATTEMPTS];
+        double started[CONNECT_ATTEMPTS];
+        struct addrinfo *res, *next;
+        unsigned int nfds = 0, i;
+        double now, deadline, next_attempt, wait;
+        int sockfd = -1, err = EHOSTUNREACH, ret;
+
+        res = resolve_host (host, port);
+        if (!res)
+                return -1;
+
+        sort_addresses (&res);
+
+        now = next_attempt = get_monotonic_clock ();
+        deadline = now + config.connecttimeout;
+        next = res;
+
+        while (sockfd < 0) {
+                if (next && nfds < CONNECT_ATTEMPTS
+                    && (nfds == 0 || now >= next_attempt)) {
+                        fds[nfds].fd = opensock_nonblocking (&next, bind_to);
+                        if (fds[nfds].fd < 0) {
+                                err = errno;
+                                continue;
                         }
+
+                        fds[nfds].events = POLLOUT;
+                        started[nfds] = now;
+                        tried[nfds++] = next;
+                        next = next->ai_next;
+                        next_attempt = now + CONNECT_ATTEMPT_DELAY;
+                        continue;
                 }
 
-                if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0)
-                        break;  /* success */
+                if (nfds == 0)
+                        break;
 
-                close (sockfd);
-        } while ((res = res->ai_next) != NULL);
+                if (now >= deadline) {
+                        err = ETIMEDOUT;
+                        for (i = 0; i != nfds; i++)
+                                remember_failed_address (tried[i]);
+                        break;
+                }
 
-        freeaddrinfo (ressave);
-        if (res == NULL) {
+                wait = deadline;
+                if (next && nfds < CONNECT_ATTEMPTS && next_attempt < wait)
+                        wait = next_attempt;
+
+                ret = poll (fds, nfds, (int) ((wait - now) * 1000) + 1);
+                now = get_monotonic_clock ();
+                if (ret < 0 && errno != EINTR) {
+                        err = errno;
+                        break;
+                }
+
+                for (i = 0; ret > 0 && i != nfds;) {
+                        if (fds[i].revents == 0) {
+                                i++;
+                                continue;
+                        }
+
+                        err = socket_error (fds[i].fd);
+                        if (err == 0) {
+                                sockfd = fds[i].fd;
+                                wait = started[i];
+                                fds[i] = fds[--nfds];
+                                tried[i] = tried[nfds];
+                                started[i] = started[nfds];
+                                break;
+                        }
+
+                        /* Move on to the next address straight away */
+                        remember_failed_address (tried[i]);
+                        close (fds[i].fd);
+                        fds[i] = fds[--nfds];
+                        tried[i] = tried[nfds];
+                        started[i] = started[nfds];
+                        next_attempt = now;
+                }
+        }
+
+        for (i = 0; i != nfds; i++) {
+                if (sockfd >= 0 && started[i] < wait)
+                        remember_failed_address (tried[i]);
+                close (fds[i].fd);
+        }
+
+        dns_free_addrs (res);
+        if (sockfd < 0) {
                 log_message (LOG_ERR,
                              "opensock: Could not establish a connection to %s",
                              host);
+                errno = err;
                 return -1;
         }
 
+        socket_blocking (sockfd);
         return sockfd;
 }
 
+/*
+ * Start a non-blocking connection to the first usable address in the
+ * list pointed to by "res".  On return "res" points at the address being
+ * connected to, so the caller can move on to the next one if the connect
+ * later fails.  Returns the socket, or -1 if no address could be tried.
+ */
+int opensock_nonblocking (struct addrinfo **res, const char *bind_to)
+{
+        int sockfd, err;
+
+        assert (res != NULL);
+
+        for (; *res != NULL; *res = (*res)->ai_next) {
+                sockfd = open_bound_socket (*res, bind_to);
+                if (sockfd < 0)
+                        continue;
+
+                socket_nonblocking (sockfd);
+
+                if (connect (sockfd, (*res)->ai_addr, (*res)->ai_addrlen) == 0
+                    || errno == EINPROGRESS)
+                        return sockfd;
+
+                err = errno;
+                remember_failed_address (*res);
+                close (sockfd);
+                errno = err;
+        }
+
+        return -1;
+}
+
+/*
+ * Return the pending error on a socket (used to find out how a
+ * non-blocking connect finished.)  Zero means no error.
+ */
+int socket_error (int sock)
+{
+        int err = 0;
+        socklen_t len = sizeof (err);
+
+        assert (sock >= 0);
+
+        if (getsockopt (sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                return errno;
+
+        return err;
+}
+
 /*
  * Set the socket to non blocking -rjkaes
  */
@@ -165,10 +469,12 @@ int socket_blocking (int sock)
 /*
  * Start listening to a socket. Create a socket with the selected port.
  * The size of the socket address will be returned to the caller through
- * the pointer, while the socket is returned as a default return.
+ * the pointer, while the socket is returned as a default return.  If
+ * "reuseport" is set, SO_REUSEPORT is enabled so several sockets can
+ * listen on the same port, with the kernel spreading the connections.
  *      - rjkaes
  */
-int listen_sock (uint16_t port, socklen_t * addrlen)
+int listen_sock (uint16_t port, socklen_t * addrlen, unsigned int reuseport)
 {
         struct addrinfo hints, *result, *rp;
         char portstr[6];
@@ -201,6 +507,17 @@ int listen_sock (uint16_t port, socklen_t * addrlen)
                 setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &on,
                             sizeof (on));
 
+                if (reuseport) {
+#ifdef SO_REUSEPORT
+                        if (setsockopt (listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                        &on, sizeof (on)) < 0)
+#endif
+                        {
+                                close (listenfd);
+                                continue;
+                        }
+                }
+
                 if (bind (listenfd, rp->ai_addr, rp->ai_addrlen) == 0)
                         break;  /* success */
 
@@ -256,31 +573,3 @@ int getsock_ip (int fd, char *ipaddr)
 
         return 0;
 }
-
-/*
- * Return the peer's socket information.
- */
-int getpeer_information (int fd, char *ipaddr, char *string_addr)
-{
-        struct sockaddr_storage sa;
-        socklen_t salen = sizeof sa;
-
-        assert (fd >= 0);
-        assert (ipaddr != NULL);
-        assert (string_addr != NULL);
-
-        /* Set the strings to default values */
-        ipaddr[0] = '\0';
-        strlcpy (string_addr, "[unknown]", HOSTNAME_LENGTH);
-
-        /* Look up the IP address */
-        if (getpeername (fd, (struct sockaddr *) &sa, &salen) != 0)
-                return -1;
-
-        if (get_ip_string ((struct sockaddr *) &sa, ipaddr, IP_LENGTH) == NULL)
-                return -1;
-
-        /* Get the full host name */
-        return getnameinfo ((struct sockaddr *) &sa, salen,
-                            string_addr, HOSTNAME_LENGTH, NULL, 0, 0);
-}
@@ -28,13 +28,27 @@
 
 #define MAXLINE (1024 * 4)
 
+/*
+ * How long to wait for a connection to a server before trying the next
+ * address as well (in seconds), and how many may be tried at once.
+ */
+#define CONNECT_ATTEMPT_DELAY 0.25
+#define CONNECT_ATTEMPTS 4
+
+extern struct addrinfo *resolve_host (const char *host, int port);
+extern void init_failed_addresses (void);
+extern void sort_addresses (struct addrinfo **addrs);
+extern void remember_failed_address (const struct addrinfo *res);
+extern int same_sockaddr (const struct sockaddr *a, const struct sockaddr *b);
 extern int opensock (const char *host, int port, const char *bind_to);
-extern int listen_sock (uint16_t port, socklen_t * addrlen);
+extern int opensock_nonblocking (struct addrinfo **res, const char *bind_to);
+extern int listen_sock (uint16_t port, socklen_t * addrlen,
+                        unsigned int reuseport);
 
 extern int socket_nonblocking (int sock);
 extern int socket_blocking (int sock);
+extern int socket_error (int sock);
 
 extern int getsock_ip (int fd, char *ipaddr);
-extern int getpeer_information (int fd, char *ipaddr, char *string_addr);
 
 #endif
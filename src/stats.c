@@ -40,10 +40,26 @@ struct stat_s {
         unsigned long int num_open;
         unsigned long int num_refused;
         unsigned long int num_denied;
+
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;
+#endif
 };
 
 static struct stat_s *stats;
 
+/*
+ * The counters are shared by all the children (processes or threads),
+ * so they are only updated while holding the lock.
+ */
+#ifdef HAVE_PTHREAD_H
+#  define STATS_LOCK()   pthread_mutex_lock (&stats->lock)
+#  define STATS_UNLOCK() pthread_mutex_unlock (&stats->lock)
+#else
+#  define STATS_LOCK()
+#  define STATS_UNLOCK()
+#endif
+
 /*
  * Initialize the statistics information to zero.
  */
@@ -54,6 +70,17 @@ void init_stats (void)
                 return;
 
         memset (stats, 0, sizeof (struct stat_s));
+
+#ifdef HAVE_PTHREAD_H
+        {
+                pthread_mutexattr_t attr;
+
+                pthread_mutexattr_init (&attr);
+                pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutex_init (&stats->lock, &attr);
+                pthread_mutexattr_destroy (&attr);
+        }
+#endif
 }
 
 /*
@@ -131,6 +158,10 @@ showstats (struct conn_s *connptr)
  */
 int update_stats (status_t update_level)
 {
+        int ret = 0;
+
+        STATS_LOCK ();
+
         switch (update_level) {
         case STAT_BADCONN:
                 ++stats->num_badcons;
@@ -149,8 +180,11 @@ int update_stats (status_t update_level)
                 ++stats->num_denied;
                 break;
         default:
-                return -1;
+                ret = -1;
+                break;
         }
 
-        return 0;
+        STATS_UNLOCK ();
+
+        return ret;
 }
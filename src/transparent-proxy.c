@@ -35,7 +35,8 @@
 /*
  * Build a URL from parts.
  */
-static int build_url (char **url, const char *host, int port, const char *path)
+static int build_url (struct arena *arena, char **url, const char *host,
+                      int port, const char *path)
 {
         int len;
 
@@ -45,7 +46,7 @@ static int build_url (char **url, const char *host, int port, const char *path)
         assert (path != NULL);
 
         len = strlen (host) + strlen (path) + 14;
-        *url = (char *) safemalloc (len);
+        *url = (char *) arena_alloc (arena, len);
         if (*url == NULL)
                 return -1;
 
@@ -53,7 +54,7 @@ static int build_url (char **url, const char *host, int port, const char *path)
 }
 
 int
-do_transparent_proxy (struct conn_s *connptr, hashmap_t hashofheaders,
+do_transparent_proxy (struct conn_s *connptr, struct header_map *hashofheaders,
                       struct request_s *request, struct config_s *conf,
                       char **url)
 {
@@ -61,10 +62,11 @@ do_transparent_proxy (struct conn_s *connptr, hashmap_t hashofheaders,
         char *data;
         size_t ulen = strlen (*url);
 
-        length = hashmap_entry_by_key (hashofheaders, "host", (void **) &data);
-        if (length <= 0) {
+        data = header_map_get_id (hashofheaders, HEADER_HOST);
+        if (!data) {
                 struct sockaddr_in dest_addr;
 
+                length = sizeof (dest_addr);
                 if (getsockname
                     (connptr->client_fd, (struct sockaddr *) &dest_addr,
                      &length) < 0) {
@@ -77,30 +79,36 @@ do_transparent_proxy (struct conn_s *connptr, hashmap_t hashofheaders,
                         return 0;
                 }
 
-                request->host = (char *) safemalloc (17);
+                request->host = (char *) arena_alloc (&connptr->arena, 17);
                 strlcpy (request->host, inet_ntoa (dest_addr.sin_addr), 17);
 
                 request->port = ntohs (dest_addr.sin_port);
 
-                request->path = (char *) safemalloc (ulen + 1);
+                request->path = (char *) arena_alloc (&connptr->arena,
+                                                      ulen + 1);
                 strlcpy (request->path, *url, ulen + 1);
 
-                build_url (url, request->host, request->port, request->path);
+                build_url (&connptr->arena, url, request->host,
+                           request->port, request->path);
                 log_message (LOG_INFO,
                              "process_request: trans IP %s %s for %d",
                              request->method, *url, connptr->client_fd);
         } else {
-                request->host = (char *) safemalloc (length + 1);
+                length = strlen (data) + 1;
+                request->host = (char *) arena_alloc (&connptr->arena,
+                                                      length + 1);
                 if (sscanf (data, "%[^:]:%hu", request->host, &request->port) !=
                     2) {
                         strlcpy (request->host, data, length + 1);
                         request->port = HTTP_PORT;
                 }
 
-                request->path = (char *) safemalloc (ulen + 1);
+                request->path = (char *) arena_alloc (&connptr->arena,
+                                                      ulen + 1);
                 strlcpy (request->path, *url, ulen + 1);
 
-                build_url (url, request->host, request->port, request->path);
+                build_url (&connptr->arena, url, request->host,
+                           request->port, request->path);
                 log_message (LOG_INFO,
                              "process_request: trans Host %s %s for %d",
                              request->method, *url, connptr->client_fd);
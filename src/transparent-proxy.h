@@ -26,11 +26,11 @@
 #ifdef TRANSPARENT_PROXY
 
 #include "conns.h"
-#include "hashmap.h"
+#include "header-map.h"
 #include "reqs.h"
 
 extern int do_transparent_proxy (struct conn_s *connptr,
-                                 hashmap_t hashofheaders,
+                                 struct header_map *hashofheaders,
                                  struct request_s *request,
                                  struct config_s *config, char **url);
 
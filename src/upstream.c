@@ -24,11 +24,105 @@
  * Routines for handling the list of upstream proxies.
  */
 
+#include "main.h"
+
 #include "upstream.h"
+#include "conf.h"
+#include "dns.h"
 #include "heap.h"
 #include "log.h"
+#include "sock.h"
+#include "text.h"
+#include "utils.h"
 
 #ifdef UPSTREAM_SUPPORT
+/*
+ * Looking up a host used to mean walking the whole list and comparing
+ * it with every rule.  Instead the rules are sorted into a table as they
+ * are added: those for domains into a hash table, which is probed with
+ * the host and with each of its dot suffixes from the left, and those for
+ * networks into a binary tree of address prefixes, walked once along the
+ * host's address.  The default is kept aside.  Each rule is numbered as
+ * it is added; when several match, the one added last wins, as it did
+ * when new rules were put at the head of the list, and the default is
+ * only used when none do.
+ *
+ * A rule may name a group of proxies instead of a single one, and one of
+ * them is chosen for each request.  How each proxy is faring (how many
+ * requests are using it, how many connections to it have failed in a
+ * row and whether it is being left out) is kept in shared memory, so
+ * that all the workers see it; so is the round robin position of each
+ * group.  A proxy is left out once it has failed "UpstreamMaxFails"
+ * connections in a row, for "UpstreamFailTimeout" seconds, or until it
+ * passes a health check if those are made.  If all of a group's proxies
+ * are left out they are tried anyway.
+ */
+
+#define DOMAIN_SLOTS 16         /* to begin with; always a power of 2 */
+
+#define UPSTREAM_GROUP_MAX 32   /* proxies in a group, as bits of "tried" */
+#define UPSTREAM_STATE_MAX 256
+#define UPSTREAM_NAME_LEN 128
+#define UPSTREAM_CHECK_TIMEOUT 3        /* seconds for a health check */
+
+struct upstream_group {
+        struct upstream_group *next;
+        char *name;
+        upstream_balance_t balance;
+        struct upstream *parents[UPSTREAM_GROUP_MAX];
+        unsigned int count;
+        unsigned int cursor;    /* when there is no shared state */
+        int slot;
+};
+
+struct upstream_state {
+        char name[UPSTREAM_NAME_LEN];   /* "host:port", or "group name" */
+        unsigned int active;            /* requests using the proxy */
+        unsigned int fails;             /* connections failed in a row */
+        unsigned int cursor;            /* a group's next proxy */
+        unsigned int down;              /* failed its last health check */
+        time_t ejected_until;
+};
+
+struct upstream_shared {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_t lock;
+#endif
+        struct upstream_state slots[UPSTREAM_STATE_MAX];
+};
+
+static struct upstream_shared *shared;
+
+#ifdef HAVE_PTHREAD_H
+#  define STATE_LOCK()   pthread_mutex_lock (&shared->lock)
+#  define STATE_UNLOCK() pthread_mutex_unlock (&shared->lock)
+#else
+#  define STATE_LOCK()
+#  define STATE_UNLOCK()
+#endif
+
+struct upstream_node {
+        struct upstream_node *child[2];
+        struct upstream *rule;
+};
+
+struct upstream_list {
+        struct upstream *rules;         /* all of them, newest first */
+        unsigned int count;
+
+        struct upstream **domains;      /* open addressing, by domain */
+        unsigned int domain_mask;
+        unsigned int domain_count;
+
+        struct upstream_node *networks; /* by address prefix */
+        struct upstream **masked;       /* masks which aren't prefixes */
+        unsigned int masked_count;
+
+        struct upstream *default_rule;
+
+        struct upstream_group *groups;
+};
+
 /**
  * Construct an upstream struct from input data.
  */
@@ -46,6 +140,8 @@ static struct upstream *upstream_build (const char *user, const char *pwd, const
 
         up->host = up->domain = NULL;
         up->ip = up->mask = 0;
+        up->group = NULL;
+        up->slot = -1;
         up->user = up->pwd = "";
         if(user != NULL) up->user = safestrdup(user);
         if(pwd != NULL) up->pwd = safestrdup(pwd);
@@ -83,8 +179,13 @@ static struct upstream *upstream_build (const char *user, const char *pwd, const
                                                 up->mask =
                                                     ntohl (addrstruct.s_addr);
                                 } else {
-                                        up->mask =
-                                            ~((1 << (32 - atoi (ptr))) - 1);
+                                        int bits = atoi (ptr);
+
+                                        if (bits >= 32)
+                                                up->mask = 0xffffffff;
+                                        else if (bits > 0)
+                                                up->mask =
+                                                    ~((1U << (32 - bits)) - 1);
                                 }
                         }
                 } else {
@@ -118,11 +219,337 @@ fail:
         return NULL;
 }
 
+static uint32_t domain_hash (const char *domain)
+{
+        uint32_t hash = 2166136261U;
+
+        while (*domain)
+                hash = (hash ^ tolower ((unsigned char) *domain++))
+                    * 16777619U;
+
+        return hash;
+}
+
+/*
+ * Find the rule for exactly this domain, if there is one.
+ */
+static struct upstream *find_domain (const struct upstream_list *list,
+                                     const char *domain)
+{
+        unsigned int i;
+
+        if (!list->domains)
+                return NULL;
+
+        for (i = domain_hash (domain) & list->domain_mask;
+             list->domains[i]; i = (i + 1) & list->domain_mask) {
+                if (strcasecmp (list->domains[i]->domain, domain) == 0)
+                        return list->domains[i];
+        }
+
+        return NULL;
+}
+
+static void put_domain (struct upstream **domains, unsigned int mask,
+                        struct upstream *up)
+{
+        unsigned int i;
+
+        for (i = domain_hash (up->domain) & mask; domains[i];
+             i = (i + 1) & mask) {
+                if (strcasecmp (domains[i]->domain, up->domain) == 0)
+                        break;
+        }
+        domains[i] = up;
+}
+
+/*
+ * A later rule for the same domain replaces the earlier one, which
+ * could never match again.  The table is kept at most half full.
+ */
+static int add_domain (struct upstream_list *list, struct upstream *up)
+{
+        if (find_domain (list, up->domain)) {
+                put_domain (list->domains, list->domain_mask, up);
+                return 0;
+        }
+
+        if (!list->domains || (list->domain_count + 1) * 2
+            > list->domain_mask + 1) {
+                unsigned int slots, i;
+                struct upstream **domains;
+
+                slots = list->domains ? (list->domain_mask + 1) * 2
+                    : DOMAIN_SLOTS;
+                domains = (struct upstream **)
+                    safecalloc (slots, sizeof (struct upstream *));
+                if (!domains)
+                        return -1;
+
+                for (i = 0; list->domains && i <= list->domain_mask; i++) {
+                        if (list->domains[i])
+                                put_domain (domains, slots - 1,
+                                            list->domains[i]);
+                }
+
+                safefree (list->domains);
+                list->domains = domains;
+                list->domain_mask = slots - 1;
+        }
+
+        put_domain (list->domains, list->domain_mask, up);
+        list->domain_count++;
+
+        return 0;
+}
+
+/*
+ * How many leading bits a mask has set, or -1 if it isn't made of
+ * leading bits only.
+ */
+static int prefix_length (in_addr_t mask)
+{
+        in_addr_t rest = ~mask;
+        int bits = 0;
+
+        if (rest & (rest + 1))
+                return -1;
+
+        while (mask) {
+                mask <<= 1;
+                bits++;
+        }
+
+        return bits;
+}
+
+static int add_network (struct upstream_list *list, struct upstream *up)
+{
+        struct upstream_node **node = &list->networks;
+        int bits = prefix_length (up->mask);
+        int i;
+
+        if (bits < 0) {
+                struct upstream **masked;
+
+                masked = (struct upstream **)
+                    saferealloc (list->masked, (list->masked_count + 1)
+                                 * sizeof (struct upstream *));
+                if (!masked)
+                        return -1;
+
+                masked[list->masked_count++] = up;
+                list->masked = masked;
+                return 0;
+        }
+
+        for (i = 0;; i++) {
+                if (!*node) {
+                        *node = (struct upstream_node *)
+                            safecalloc (1, sizeof (struct upstream_node));
+                        if (!*node)
+                                return -1;
+                }
+                if (i == bits)
+                        break;
+                node = &(*node)->child[(up->ip >> (31 - i)) & 1];
+        }
+
+        (*node)->rule = up;
+        return 0;
+}
+
+static struct upstream *find_network (const struct upstream_list *list,
+                                      in_addr_t ip)
+{
+        const struct upstream_node *node = list->networks;
+        struct upstream *found = NULL;
+        unsigned int i;
+        int bit = 31;
+
+        for (; node; node = node->child[(ip >> bit--) & 1]) {
+                if (node->rule
+                    && (!found || node->rule->order > found->order))
+                        found = node->rule;
+                if (bit < 0)
+                        break;
+        }
+
+        for (i = 0; i != list->masked_count; i++) {
+                struct upstream *up = list->masked[i];
+
+                if ((ip & up->mask) == up->ip
+                    && (!found || up->order > found->order))
+                        found = up;
+        }
+
+        return found;
+}
+
+static void free_nodes (struct upstream_node *node)
+{
+        if (!node)
+                return;
+
+        free_nodes (node->child[0]);
+        free_nodes (node->child[1]);
+        safefree (node);
+}
+
+static void free_rule (struct upstream *up)
+{
+        safefree (up->domain);
+        safefree (up->host);
+        safefree (up);
+}
+
+/*
+ * Find the shared state kept under a name, taking a free place for it if
+ * there is none yet.  Returns -1 if there is no room, or no shared state.
+ */
+static int find_state (const char *name)
+{
+        int i, free_slot = -1;
+
+        if (!shared || strlen (name) >= UPSTREAM_NAME_LEN)
+                return -1;
+
+        STATE_LOCK ();
+        for (i = 0; i != UPSTREAM_STATE_MAX; i++) {
+                if (shared->slots[i].name[0] == '\0') {
+                        if (free_slot < 0)
+                                free_slot = i;
+                } else if (strcmp (shared->slots[i].name, name) == 0) {
+                        break;
+                }
+        }
+
+        if (i == UPSTREAM_STATE_MAX) {
+                i = free_slot;
+                if (i >= 0)
+                        strlcpy (shared->slots[i].name, name,
+                                 UPSTREAM_NAME_LEN);
+        }
+        STATE_UNLOCK ();
+
+        if (i < 0)
+                log_message (LOG_WARNING,
+                             "No room to share the state of %s", name);
+
+        return i;
+}
+
+static void bind_group (struct upstream_group *group)
+{
+        char name[UPSTREAM_NAME_LEN];
+
+        snprintf (name, sizeof (name), "group %s", group->name);
+        group->slot = find_state (name);
+}
+
+static void bind_parent (struct upstream *up)
+{
+        char name[UPSTREAM_NAME_LEN];
+
+        snprintf (name, sizeof (name), "%s:%d", up->host, up->port);
+        up->slot = find_state (name);
+}
+
+static struct upstream_list *get_list (struct upstream_list **upstream_list)
+{
+        if (!*upstream_list) {
+                *upstream_list = (struct upstream_list *)
+                    safecalloc (1, sizeof (struct upstream_list));
+                if (!*upstream_list)
+                        log_message (LOG_ERR,
+                                     "Unable to allocate memory for the "
+                                     "upstream list");
+        }
+
+        return *upstream_list;
+}
+
+/*
+ * Find the named group, creating it if it isn't known yet.
+ */
+static struct upstream_group *get_group (const char *name,
+                                         struct upstream_list **upstream_list)
+{
+        struct upstream_list *list = get_list (upstream_list);
+        struct upstream_group *group;
+
+        if (!list)
+                return NULL;
+
+        for (group = list->groups; group; group = group->next) {
+                if (strcmp (group->name, name) == 0)
+                        return group;
+        }
+
+        group = (struct upstream_group *)
+            safecalloc (1, sizeof (struct upstream_group));
+        if (!group || !(group->name = safestrdup (name))) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory for upstream group "
+                             "\"%s\"", name);
+                safefree (group);
+                return NULL;
+        }
+
+        group->balance = UPSTREAM_ROUND_ROBIN;
+        bind_group (group);
+
+        group->next = list->groups;
+        list->groups = group;
+
+        return group;
+}
+
+static void add_rule (struct upstream_list **upstream_list,
+                      struct upstream *up, const char *domain)
+{
+        struct upstream_list *list = get_list (upstream_list);
+        int ret = 0;
+
+        if (!list) {
+                free_rule (up);
+                return;
+        }
+
+        if (up->domain) {
+                ret = add_domain (list, up);
+        } else if (up->ip) {
+                if ((up->ip & up->mask) != up->ip) {
+                        log_message (LOG_WARNING,
+                                     "No-upstream rule for %s can never "
+                                     "match: the address has bits outside "
+                                     "the mask", domain);
+                        free_rule (up);
+                        return;
+                }
+                ret = add_network (list, up);
+        } else {
+                /* A later default replaces an earlier one */
+                list->default_rule = up;
+        }
+
+        if (ret < 0) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in upstream_add()");
+                free_rule (up);
+                return;
+        }
+
+        up->order = ++list->count;
+        up->next = list->rules;
+        list->rules = up;
+}
+
 /*
  * Add an entry to the upstream list
  */
 void upstream_add (const char *user, const char *pwd, const char *host, int port, const char *domain,
-                   struct upstream **upstream_list)
+                   struct upstream_list **upstream_list)
 {
         struct upstream *up;
 
@@ -131,97 +558,536 @@ void upstream_add (const char *user, const char *pwd, const char *host, int port
                 return;
         }
 
-        if (!up->domain && !up->ip) {   /* always add default to end */
-                struct upstream *tmp = *upstream_list;
+        add_rule (upstream_list, up, domain);
+}
 
-                while (tmp) {
-                        if (!tmp->domain && !tmp->ip) {
-                                log_message (LOG_WARNING,
-                                             "Duplicate default upstream");
-                                goto upstream_cleanup;
-                        }
+/*
+ * Add a rule sending the requests for "domain" (all of them if it is
+ * NULL) to one of the proxies of the named group.
+ */
+void upstream_add_group (const char *name, const char *domain,
+                         struct upstream_list **upstream_list)
+{
+        struct upstream_group *group;
+        struct upstream *up;
 
-                        if (!tmp->next) {
-                                up->next = NULL;
-                                tmp->next = up;
-                                return;
-                        }
+        group = get_group (name, upstream_list);
+        if (!group)
+                return;
+
+        up = (struct upstream *) safecalloc (1, sizeof (struct upstream));
+        if (!up) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in upstream_add_group()");
+                return;
+        }
 
-                        tmp = tmp->next;
+        up->group = group;
+        up->slot = -1;
+        if (domain) {
+                up->domain = safestrdup (domain);
+                if (!up->domain) {
+                        free_rule (up);
+                        return;
                 }
         }
 
-        up->next = *upstream_list;
-        *upstream_list = up;
+        log_message (LOG_INFO, "Added upstream group \"%s\" for %s", name,
+                     domain ? domain : "[default]");
 
-        return;
+        add_rule (upstream_list, up, domain);
+}
 
-upstream_cleanup:
-        safefree (up->host);
-        safefree (up->domain);
-        safefree (up);
+/*
+ * Add a proxy to the named group.
+ */
+void upstream_add_parent (const char *name, const char *user,
+                          const char *pwd, const char *host, int port,
+                          struct upstream_list **upstream_list)
+{
+        struct upstream_group *group;
+        struct upstream *up;
+
+        if (!host || host[0] == '\0' || port < 1) {
+                log_message (LOG_WARNING,
+                             "Nonsense upstream group proxy: invalid host "
+                             "or port");
+                return;
+        }
 
-        return;
+        group = get_group (name, upstream_list);
+        if (!group)
+                return;
+
+        if (group->count == UPSTREAM_GROUP_MAX) {
+                log_message (LOG_WARNING,
+                             "Upstream group \"%s\" already has %d proxies; "
+                             "leaving out %s:%d", name, UPSTREAM_GROUP_MAX,
+                             host, port);
+                return;
+        }
+
+        up = (struct upstream *) safecalloc (1, sizeof (struct upstream));
+        if (!up || !(up->host = safestrdup (host))) {
+                log_message (LOG_ERR,
+                             "Unable to allocate memory in upstream_add_parent()");
+                safefree (up);
+                return;
+        }
+
+        up->port = port;
+        if (user != NULL && pwd != NULL) {
+                up->user = safestrdup (user);
+                up->pwd = safestrdup (pwd);
+                if (!up->pwd)
+                        safefree (up->user);
+        }
+        up->group = group;
+        bind_parent (up);
+
+        group->parents[group->count++] = up;
+
+        log_message (LOG_INFO, "Added upstream %s:%d to group \"%s\"",
+                     host, port, name);
+}
+
+void upstream_set_balance (const char *name, upstream_balance_t balance,
+                           struct upstream_list **upstream_list)
+{
+        struct upstream_group *group = get_group (name, upstream_list);
+
+        if (group)
+                group->balance = balance;
 }
 
 /*
- * Check if a host is in the upstream list
+ * Whether a proxy should be used, as far as anyone knows.  The lock is
+ * held.
  */
-struct upstream *upstream_get (char *host, struct upstream *up)
+static int parent_usable (const struct upstream *up, time_t now)
 {
-        in_addr_t my_ip = INADDR_NONE;
+        const struct upstream_state *state;
 
-        while (up) {
-                if (up->domain) {
-                        if (strcasecmp (host, up->domain) == 0)
-                                break;  /* exact match */
+        if (up->slot < 0)
+                return TRUE;
 
-                        if (up->domain[0] == '.') {
-                                char *dot = strchr (host, '.');
+        state = &shared->slots[up->slot];
+        return state->ejected_until <= now
+            && !(state->down && config.upstream_check_interval > 0);
+}
+
+/*
+ * Spread the hosts over the proxies so that each host keeps going to the
+ * same one, and only the hosts of a proxy which is left out move.
+ */
+static uint32_t parent_score (const char *host, const struct upstream *up)
+{
+        uint32_t h = domain_hash (host) ^ domain_hash (up->host)
+            ^ (uint32_t) up->port * 2654435761U;
 
-                                if (!dot && !up->domain[1])
-                                        break;  /* local host matches "." */
+        h ^= h >> 16;
+        h *= 0x85ebca6bU;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35U;
+        h ^= h >> 16;
 
-                                while (dot && strcasecmp (dot, up->domain))
-                                        dot = strchr (dot + 1, '.');
+        return h;
+}
 
-                                if (dot)
-                                        break;  /* subdomain match */
-                        }
-                } else if (up->ip) {
-                        if (my_ip == INADDR_NONE)
-                                my_ip = ntohl (inet_addr (host));
+/*
+ * Choose the proxy of the group to send the request for "host" to,
+ * among those not tried yet.  The ones left out are only chosen if there
+ * is nothing else.
+ */
+static struct upstream *choose_parent (struct upstream_group *group,
+                                       const char *host,
+                                       struct upstream_use *use)
+{
+        time_t now = get_monotonic_time ();
+        unsigned int i, j, start, *cursor;
+        unsigned int active, best_active = 0;
+        uint32_t score, best_score = 0;
+        int best = -1, pass;
+
+        if (group->count == 0) {
+                log_message (LOG_WARNING, "Upstream group \"%s\" is empty",
+                             group->name);
+                return NULL;
+        }
+
+        if (shared)
+                STATE_LOCK ();
 
-                        if ((my_ip & up->mask) == up->ip)
+        cursor = group->slot >= 0 ? &shared->slots[group->slot].cursor
+            : &group->cursor;
+        start = (*cursor)++ % group->count;
+
+        for (pass = 0; pass != 2 && best < 0; pass++) {
+                for (i = 0; i != group->count; i++) {
+                        struct upstream *up;
+
+                        j = (start + i) % group->count;
+                        up = group->parents[j];
+                        if ((use->tried & (1U << j))
+                            || (pass == 0 && !parent_usable (up, now)))
+                                continue;
+
+                        if (group->balance == UPSTREAM_ROUND_ROBIN) {
+                                best = j;
                                 break;
-                } else {
-                        break;  /* No domain or IP, default upstream */
+                        }
+
+                        if (group->balance == UPSTREAM_LEAST_CONN) {
+                                active = up->slot >= 0
+                                    ? shared->slots[up->slot].active : 0;
+                                if (best < 0 || active < best_active) {
+                                        best = j;
+                                        best_active = active;
+                                }
+                        } else {
+                                score = parent_score (host, up);
+                                if (best < 0 || score > best_score) {
+                                        best = j;
+                                        best_score = score;
+                                }
+                        }
                 }
+        }
 
-                up = up->next;
+        if (best >= 0) {
+                use->tried |= 1U << best;
+                use->slot = group->parents[best]->slot;
+                if (use->slot >= 0)
+                        shared->slots[use->slot].active++;
         }
 
-        if (up && (!up->host || !up->port))
+        if (shared)
+                STATE_UNLOCK ();
+
+        return best >= 0 ? group->parents[best] : NULL;
+}
+
+/*
+ * Check if a host is in the upstream list.  If the rule for it names a
+ * group, one of its proxies is chosen, and noted in "use" until
+ * upstream_release() is called.
+ */
+struct upstream *upstream_get (char *host, struct upstream_list *list,
+                               struct upstream_use *use)
+{
+        struct upstream *up, *found;
+        struct in_addr addr;
+        char *dot;
+
+        if (!list)
+                return NULL;
+
+        up = find_domain (list, host);
+
+        dot = strchr (host, '.');
+        if (!dot) {
+                found = find_domain (list, ".");  /* local host */
+                if (found && (!up || found->order > up->order))
+                        up = found;
+        }
+
+        for (; dot; dot = strchr (dot + 1, '.')) {
+                found = find_domain (list, dot);  /* subdomain */
+                if (found && (!up || found->order > up->order))
+                        up = found;
+        }
+
+        if ((list->networks || list->masked_count)
+            && inet_aton (host, &addr) != 0) {
+                found = find_network (list, ntohl (addr.s_addr));
+                if (found && (!up || found->order > up->order))
+                        up = found;
+        }
+
+        /* The default applies unless a later rule matched */
+        found = list->default_rule;
+        if (found && (!up || found->order > up->order))
+                up = found;
+
+        if (up && up->group)
+                up = choose_parent (up->group, host, use);
+        else if (up && (!up->host || !up->port))
                 up = NULL;
 
         if (up)
-                log_message (LOG_INFO, "Found upstream proxy %s:%d for %s",
+                log_message (LOG_DEBUG, "Found upstream proxy %s:%d for %s",
                              up->host, up->port, host);
         else
-                log_message (LOG_INFO, "No upstream proxy for %s", host);
+                log_message (LOG_DEBUG, "No upstream proxy for %s", host);
 
         return up;
 }
 
-void free_upstream_list (struct upstream *up)
+/*
+ * A connection to the proxy could not be made.  Once it has failed often
+ * enough it is left out for a while.  If it is one of a group, another
+ * which hasn't been tried for the request yet is returned.
+ */
+struct upstream *upstream_failed (struct upstream *up, const char *host,
+                                  struct upstream_use *use)
+{
+        struct upstream *next;
+        time_t now = get_monotonic_time ();
+
+        if (use->slot >= 0) {
+                struct upstream_state *state = &shared->slots[use->slot];
+
+                STATE_LOCK ();
+                if (state->active > 0)
+                        state->active--;
+                if (++state->fails >= config.upstream_max_fails
+                    && state->ejected_until <= now) {
+                        state->ejected_until =
+                            now + config.upstream_fail_timeout;
+                        log_message (LOG_WARNING,
+                                     "Upstream proxy %s:%d has failed %u "
+                                     "times in a row; leaving it out for "
+                                     "%u seconds", up->host, up->port,
+                                     state->fails,
+                                     config.upstream_fail_timeout);
+                }
+                STATE_UNLOCK ();
+                use->slot = -1;
+        }
+
+        if (!up->group)
+                return NULL;
+
+        next = choose_parent (up->group, host, use);
+        if (next)
+                log_message (LOG_WARNING,
+                             "Could not connect to upstream proxy %s:%d; "
+                             "trying %s:%d instead", up->host, up->port,
+                             next->host, next->port);
+
+        return next;
+}
+
+/*
+ * A connection to the proxy has been made, so it is working.
+ */
+void upstream_connected (struct upstream_use *use)
+{
+        if (use->slot < 0)
+                return;
+
+        STATE_LOCK ();
+        shared->slots[use->slot].fails = 0;
+        shared->slots[use->slot].ejected_until = 0;
+        STATE_UNLOCK ();
+}
+
+/*
+ * The request is done with its proxy.
+ */
+void upstream_release (struct upstream_use *use)
+{
+        if (use->slot >= 0) {
+                STATE_LOCK ();
+                if (shared->slots[use->slot].active > 0)
+                        shared->slots[use->slot].active--;
+                STATE_UNLOCK ();
+        }
+
+        use->slot = -1;
+        use->tried = 0;
+}
+
+/*
+ * Set up the state shared by all the workers, before they are created,
+ * and find the places in it of the groups already configured.
+ */
+void init_upstream_state (struct upstream_list *list)
+{
+        struct upstream_group *group;
+        unsigned int i;
+
+        shared = (struct upstream_shared *)
+            malloc_shared_memory (sizeof (struct upstream_shared));
+        if (shared == MAP_FAILED) {
+                shared = NULL;
+                return;
+        }
+
+        memset (shared, 0, sizeof (struct upstream_shared));
+
+#ifdef HAVE_PTHREAD_H
+        {
+                pthread_mutexattr_t attr;
+
+                pthread_mutexattr_init (&attr);
+                pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutex_init (&shared->lock, &attr);
+                pthread_mutexattr_destroy (&attr);
+        }
+#endif
+
+        for (group = list ? list->groups : NULL; group; group = group->next) {
+                bind_group (group);
+                for (i = 0; i != group->count; i++)
+                        bind_parent (group->parents[i]);
+        }
+}
+
+/*
+ * Note how a proxy's health check went.
+ */
+static void checked (struct upstream *up, int ok)
+{
+        struct upstream_state *state = &shared->slots[up->slot];
+        int was_usable;
+
+        STATE_LOCK ();
+        was_usable = !state->down
+            && state->ejected_until <= get_monotonic_time ();
+        state->down = !ok;
+        if (ok) {
+                state->fails = 0;
+                state->ejected_until = 0;
+        }
+        STATE_UNLOCK ();
+
+        if (ok && !was_usable)
+                log_message (LOG_NOTICE,
+                             "Upstream proxy %s:%d passed its health check",
+                             up->host, up->port);
+        else if (!ok && was_usable)
+                log_message (LOG_WARNING,
+                             "Upstream proxy %s:%d failed its health check",
+                             up->host, up->port);
+}
+
+/*
+ * Try connecting to each proxy of each group, all at once, if it is time
+ * to.  Called from the main process, which has nothing else to do.
+ */
+void upstream_check_health (struct upstream_list *list)
 {
-        while (up) {
-                struct upstream *tmp = up;
-                up = up->next;
-                safefree (tmp->domain);
-                safefree (tmp->host);
-                safefree (tmp);
+        static time_t last_check;
+        struct upstream_group *group;
+        struct upstream **parents;
+        struct pollfd *fds;
+        unsigned int n = 0, pending = 0, i;
+        time_t now = get_monotonic_time ();
+        double deadline, wait;
+
+        if (!list || !shared || config.upstream_check_interval == 0
+            || now - last_check < (time_t) config.upstream_check_interval)
+                return;
+
+        last_check = now;
+
+        for (group = list->groups; group; group = group->next)
+                n += group->count;
+        if (n == 0)
+                return;
+
+        parents = (struct upstream **)
+            safemalloc (n * sizeof (struct upstream *));
+        fds = (struct pollfd *) safemalloc (n * sizeof (struct pollfd));
+        if (!parents || !fds) {
+                safefree (parents);
+                safefree (fds);
+                return;
         }
+
+        n = 0;
+        for (group = list->groups; group; group = group->next) {
+                for (i = 0; i != group->count; i++) {
+                        struct upstream *up = group->parents[i];
+                        struct addrinfo *addrs, *res;
+
+                        if (up->slot < 0)
+                                continue;
+
+                        parents[n] = up;
+                        fds[n].fd = -1;
+                        fds[n].events = POLLOUT;
+                        fds[n].revents = 0;
+
+                        res = addrs = resolve_host (up->host, up->port);
+                        if (res) {
+                                fds[n].fd = opensock_nonblocking (&res, NULL);
+                                dns_free_addrs (addrs);
+                        }
+
+                        if (fds[n].fd >= 0)
+                                pending++;
+                        else
+                                checked (up, FALSE);
+                        n++;
+                }
+        }
+
+        deadline = get_monotonic_clock () + UPSTREAM_CHECK_TIMEOUT;
+        while (pending > 0) {
+                wait = deadline - get_monotonic_clock ();
+                if (wait <= 0)
+                        break;
+
+                if (poll (fds, n, (int) (wait * 1000) + 1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                for (i = 0; i != n; i++) {
+                        if (fds[i].fd < 0 || fds[i].revents == 0)
+                                continue;
+
+                        checked (parents[i], socket_error (fds[i].fd) == 0);
+                        close (fds[i].fd);
+                        fds[i].fd = -1;
+                        pending--;
+                }
+        }
+
+        for (i = 0; i != n; i++) {
+                if (fds[i].fd < 0)
+                        continue;
+
+                checked (parents[i], FALSE);
+                close (fds[i].fd);
+        }
+
+        safefree (parents);
+        safefree (fds);
+}
+
+void free_upstream_list (struct upstream_list *list)
+{
+        if (!list)
+                return;
+
+        while (list->rules) {
+                struct upstream *tmp = list->rules;
+                list->rules = tmp->next;
+                free_rule (tmp);
+        }
+
+        while (list->groups) {
+                struct upstream_group *group = list->groups;
+                unsigned int i;
+
+                list->groups = group->next;
+                for (i = 0; i != group->count; i++) {
+                        safefree (group->parents[i]->user);
+                        safefree (group->parents[i]->pwd);
+                        free_rule (group->parents[i]);
+                }
+                safefree (group->name);
+                safefree (group);
+        }
+
+        free_nodes (list->networks);
+        safefree (list->domains);
+        safefree (list->masked);
+        safefree (list);
 }
 
 #endif
@@ -27,6 +27,17 @@
 
 #include "common.h"
 
+/*
+ * How the proxy of an upstream group is chosen for a request.
+ */
+typedef enum {
+        UPSTREAM_ROUND_ROBIN,
+        UPSTREAM_LEAST_CONN,
+        UPSTREAM_HASH           /* by the requested host */
+} upstream_balance_t;
+
+struct upstream_group;
+
 /*
  * Even if upstream support is not compiled into tinyproxy, this
  * structure still needs to be defined.
@@ -39,13 +50,45 @@ struct upstream {
         in_addr_t ip, mask;
         char *user;
         char *pwd;
+        unsigned int order;     /* later rules take precedence */
+        struct upstream_group *group;   /* the proxies to choose from */
+        int slot;               /* a group's proxy's shared state */
+};
+
+/*
+ * Which proxy of a group a connection is using, and which of them it
+ * has tried for the current request.
+ */
+struct upstream_use {
+        int slot;
+        unsigned int tried;
 };
 
+struct upstream_list;
+
 #ifdef UPSTREAM_SUPPORT
 extern void upstream_add (const char *user, const char *pwd, const char *host, int port, const char *domain,
-                          struct upstream **upstream_list);
-extern struct upstream *upstream_get (char *host, struct upstream *up);
-extern void free_upstream_list (struct upstream *up);
+                          struct upstream_list **upstream_list);
+extern void upstream_add_group (const char *name, const char *domain,
+                                struct upstream_list **upstream_list);
+extern void upstream_add_parent (const char *name, const char *user,
+                                 const char *pwd, const char *host, int port,
+                                 struct upstream_list **upstream_list);
+extern void upstream_set_balance (const char *name,
+                                  upstream_balance_t balance,
+                                  struct upstream_list **upstream_list);
+extern struct upstream *upstream_get (char *host,
+                                      struct upstream_list *list,
+                                      struct upstream_use *use);
+extern struct upstream *upstream_failed (struct upstream *up,
+                                         const char *host,
+                                         struct upstream_use *use);
+extern void upstream_connected (struct upstream_use *use);
+extern void upstream_release (struct upstream_use *use);
+extern void free_upstream_list (struct upstream_list *list);
+
+extern void init_upstream_state (struct upstream_list *list);
+extern void upstream_check_health (struct upstream_list *list);
 #endif /* UPSTREAM_SUPPORT */
 
 #endif /* _TINYPROXY_UPSTREAM_H_ */
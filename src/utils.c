@@ -52,7 +52,7 @@ send_http_message (struct conn_s *connptr, int http_code,
 
         http_message_add_headers (msg, headers, 3);
         http_message_set_body (msg, message, strlen (message));
-        http_message_send (msg, connptr->client_fd);
+        http_message_send (msg, connptr->client_fd, connptr->client_pending);
         http_message_destroy (msg);
 
         return 0;
@@ -213,3 +213,47 @@ pidfile_create (const char *filename)
         fclose (fd);
         return 0;
 }
+
+/**
+ * get_monotonic_time:
+ *
+ * Get the current time, in seconds, from a clock which is not affected
+ * by changes to the system time.  This is what timeouts are measured
+ * against.  Systems without a monotonic clock fall back to time().
+ *
+ * Returns: the number of seconds since some unspecified starting point.
+ **/
+time_t get_monotonic_time (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+
+        if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+                return ts.tv_sec;
+#endif
+        return time (NULL);
+}
+
+/**
+ * get_monotonic_clock:
+ *
+ * Like get_monotonic_time(), with the fractions of a second as well, for
+ * measuring waits shorter than a second.
+ *
+ * Returns: the number of seconds since some unspecified starting point.
+ **/
+double get_monotonic_clock (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+
+        if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+                return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+        {
+                struct timeval tv;
+
+                gettimeofday (&tv, NULL);
+                return tv.tv_sec + tv.tv_usec / 1e6;
+        }
+}
@@ -34,4 +34,7 @@ extern int pidfile_create (const char *path);
 extern int create_file_safely (const char *filename,
                                unsigned int truncate_file);
 
+extern time_t get_monotonic_time (void);
+extern double get_monotonic_clock (void);
+
 #endif
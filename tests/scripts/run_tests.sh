@@ -34,8 +34,10 @@ TINYPROXY_DATA_DIR=$TESTENV_DIR/usr/share/tinyproxy
 TINYPROXY_CONF_DIR=$TESTENV_DIR/etc/tinyproxy
 TINYPROXY_CONF_FILE=$TINYPROXY_CONF_DIR/tinyproxy.conf
 TINYPROXY_FILTER_FILE=$TINYPROXY_CONF_DIR/filter
+TINYPROXY_FILTER_DB=$TINYPROXY_CONF_DIR/filter.db
 TINYPROXY_STDERR_LOG=$TINYPROXY_LOG_DIR/tinyproxy.stderr.log
 TINYPROXY_BIN=$BASEDIR/src/tinyproxy
+TINYPROXY_FILTER_BIN=$BASEDIR/src/tinyproxy-filter
 TINYPROXY_STATHOST_IP="127.0.0.127"
 
 WEBSERVER_IP=127.0.0.3
@@ -46,6 +48,11 @@ WEBSERVER_LOG_DIR=$TESTENV_DIR/var/log/webserver
 WEBSERVER_BIN_FILE=webserver.pl
 WEBSERVER_BIN=$SCRIPTS_DIR/$WEBSERVER_BIN_FILE
 
+# An upstream proxy which never completes a connection
+STALLED_IP=127.0.0.4
+STALLED_PORT=32124
+STALLED_PID_FILE=$WEBSERVER_PID_DIR/stalled.pid
+
 WEBCLIENT_LOG=$LOG_DIR/webclient.log
 WEBCLIENT_BIN=$SCRIPTS_DIR/webclient.pl
 
@@ -61,7 +68,11 @@ provision_initial() {
 	mkdir -p $LOG_DIR
 }
 
+# provision_tinyproxy <worker mode>
 provision_tinyproxy() {
+	WORKER_MODE=$1
+	FILTER_FILE=$TINYPROXY_FILTER_FILE
+
 	mkdir -p $TINYPROXY_DATA_DIR
 	cp $BASEDIR/data/templates/default.html $TINYPROXY_DATA_DIR
 	cp $BASEDIR/data/templates/debug.html $TINYPROXY_DATA_DIR
@@ -70,7 +81,24 @@ provision_tinyproxy() {
 	mkdir -p $TINYPROXY_LOG_DIR
 	mkdir -p $TINYPROXY_CONF_DIR
 
-	cat >>$TINYPROXY_CONF_FILE<<EOF
+	# One rule for each way the filter has of matching: anchored at the
+	# start or at the end, a plain string, a string with a '.' wildcard,
+	# and an expression with no plain part at all.
+	cat >$TINYPROXY_FILTER_FILE<<EOF
+^http://$WEBSERVER_IP:$WEBSERVER_PORT/filtered-start
+/filtered-end\$
+filtered-anywhere
+filtered.dot
+/x[0-9][0-9]*y/
+EOF
+
+	# The threads mode loads the rules from a compiled database
+	if test "x$WORKER_MODE" = "xthreads" -a -x $TINYPROXY_FILTER_BIN ; then
+		$TINYPROXY_FILTER_BIN $TINYPROXY_FILTER_FILE $TINYPROXY_FILTER_DB
+		FILTER_FILE=$TINYPROXY_FILTER_DB
+	fi
+
+	cat >$TINYPROXY_CONF_FILE<<EOF
 User $TINYPROXY_USER
 #Group $TINYPROXY_GROUP
 Port $TINYPROXY_PORT
@@ -94,27 +122,39 @@ ViaProxyName "tinyproxy"
 ConnectPort 443
 ConnectPort 563
 FilterURLs On
-Filter "$TINYPROXY_FILTER_FILE"
+Filter "$FILTER_FILE"
 XTinyproxy Yes
+WorkerMode $WORKER_MODE
+Workers 2
+ConnectTimeout 3
+UpstreamGroup "parents" $STALLED_IP:$STALLED_PORT
+UpstreamGroup "parents" $WEBSERVER_IP:$WEBSERVER_PORT
+upstream group "parents" "stalled.test"
 EOF
-
-	touch $TINYPROXY_FILTER_FILE
 }
 
 start_tinyproxy() {
-	echo -n "starting tinyproxy..."
-	$VALGRIND $TINYPROXY_BIN -c $TINYPROXY_CONF_FILE 2> $TINYPROXY_STDERR_LOG
+	echo -n "starting tinyproxy ($WORKER_MODE)..."
+	# freed memory is scribbled over, so using it shows
+	MALLOC_PERTURB_=165 $VALGRIND $TINYPROXY_BIN -c $TINYPROXY_CONF_FILE 2> $TINYPROXY_STDERR_LOG
 	echo " done (listening on $TINYPROXY_IP:$TINYPROXY_PORT)"
 }
 
 stop_tinyproxy() {
 	echo -n "killing tinyproxy..."
-	kill $(cat $TINYPROXY_PID_FILE)
+	TINYPROXY_PID=$(cat $TINYPROXY_PID_FILE)
+	kill $TINYPROXY_PID
 	if test "x$?" = "x0" ; then
 		echo " ok"
 	else
 		echo " error"
 	fi
+
+	# the next one can't listen until it is gone
+	for COUNT in $(seq 1 10) ; do
+		kill -0 $TINYPROXY_PID 2>/dev/null || break
+		sleep 1
+	done
 }
 
 provision_webserver() {
@@ -138,6 +178,28 @@ stop_webserver() {
 	fi
 }
 
+# Listen without ever accepting, and fill the queue of connections
+# waiting to be accepted, so that any further one never completes.
+start_stalled_server() {
+	echo -n "starting stalled upstream proxy..."
+	perl -MIO::Socket::INET -e '
+		my $l = IO::Socket::INET->new(LocalAddr => $ARGV[0],
+					      Listen => 0, ReuseAddr => 1)
+			or die "listen: $!";
+		my @c;
+		while (my $c = IO::Socket::INET->new(PeerAddr => $ARGV[0],
+						     Timeout => 1)) {
+			push @c, $c;
+		}
+		sleep;' $STALLED_IP:$STALLED_PORT &
+	echo $! > $STALLED_PID_FILE
+	echo " done (on $STALLED_IP:$STALLED_PORT)"
+}
+
+stop_stalled_server() {
+	kill $(cat $STALLED_PID_FILE)
+}
+
 wait_for_some_seconds() {
 	SECONDS=$1
 	if test "x$SECONDS" = "x" ; then
@@ -154,7 +216,7 @@ wait_for_some_seconds() {
 }
 
 run_basic_webclient_request() {
-	$WEBCLIENT_BIN $1 $2 >> $WEBCLIENT_LOG 2>&1
+	$WEBCLIENT_BIN "$@" >> $WEBCLIENT_LOG 2>&1
 	WEBCLIENT_EXIT_CODE=$?
 	if test "x$WEBCLIENT_EXIT_CODE" = "x0" ; then
 		echo " ok"
@@ -167,16 +229,165 @@ run_basic_webclient_request() {
 	return $WEBCLIENT_EXIT_CODE
 }
 
+# run_proxy_test <description> <webclient options> <documents...>
+run_proxy_test() {
+	echo -n "$1..."
+	shift
+	run_basic_webclient_request "$@"
+	test "x$?" = "x0" || FAILED=$((FAILED + 1))
+}
+
+run_proxy_tests() {
+	PROXY="$TINYPROXY_IP:$TINYPROXY_PORT"
+	URL="http://$WEBSERVER_IP:$WEBSERVER_PORT"
+
+	echo -n "testing connection through tinyproxy..."
+	run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$WEBSERVER_IP:$WEBSERVER_PORT/"
+	test "x$?" = "x0" || FAILED=$((FAILED + 1))
+
+	echo -n "requesting statspage via stathost url..."
+	run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$TINYPROXY_STATHOST_IP"
+	test "x$?" = "x0" || FAILED=$((FAILED + 1))
+
+	# keep-alive
+
+	run_proxy_test "pipelining keep-alive requests" \
+		--http-version 1.1 --pipeline --expect 200,200,200 \
+		$PROXY "$URL/one" "$URL/two" "$URL/three"
+
+	run_proxy_test "pipelining keep-alive requests with bodies" \
+		--http-version 1.1 --pipeline --expect 200,200 \
+		--method POST --header "Content-Length: 10" \
+		--entity "0123456789" --expect-body "0123456789" \
+		$PROXY "$URL/one" "$URL/two"
+
+	# chunked bodies
+
+	run_proxy_test "relaying a chunked response with extensions and trailers" \
+		--http-version 1.1 --pipeline --expect 200,200 \
+		--expect-body "chunked body with extensions" \
+		$PROXY "$URL/chunked" "$URL/"
+
+	run_proxy_test "relaying a chunked request with extensions and trailers" \
+		--http-version 1.1 --pipeline --expect 200,200 \
+		--method POST --header "Transfer-Encoding: chunked" \
+		--entity '4;name=value\r\nchun\r\n6 ; quoted="a;b"\r\nked in\r\n0\r\nX-Trailer: yes\r\n\r\n' \
+		--expect-body "chunked in" \
+		$PROXY "$URL/" "$URL/"
+
+	run_proxy_test "relaying a chunked response with an invalid chunk size" \
+		--http-version 1.1 --pipeline --expect 200 \
+		$PROXY "$URL/chunked-bad-size" "$URL/"
+
+	run_proxy_test "relaying a chunked response with a huge chunk size" \
+		--http-version 1.1 --pipeline --expect 200 \
+		$PROXY "$URL/chunked-huge-size" "$URL/"
+
+	run_proxy_test "relaying a chunked request with an invalid chunk size" \
+		--http-version 1.1 --expect 400 \
+		--method POST --header "Transfer-Encoding: chunked" \
+		--entity 'xyz\r\nabc\r\n0\r\n\r\n' \
+		$PROXY "$URL/"
+
+	run_proxy_test "relaying a chunked request with a huge chunk size" \
+		--http-version 1.1 --expect 400 \
+		--method POST --header "Transfer-Encoding: chunked" \
+		--entity 'fffffffffffffffffffff\r\nabc\r\n0\r\n\r\n' \
+		$PROXY "$URL/"
+
+	run_proxy_test "rejecting a response with a coding after chunked" \
+		--http-version 1.1 --expect 503 \
+		$PROXY "$URL/chunked-not-last"
+
+	# malformed request heads
+
+	run_proxy_test "rejecting a repeated Content-Length" \
+		--http-version 1.1 --expect 400 --method POST \
+		--header "Content-Length: 3" --header "Content-Length: 3" \
+		--entity "abc" $PROXY "$URL/"
+
+	run_proxy_test "rejecting conflicting Content-Length values" \
+		--http-version 1.1 --expect 400 --method POST \
+		--header "Content-Length: 3" --header "Content-Length: 4" \
+		--entity "abcd" $PROXY "$URL/"
+
+	run_proxy_test "rejecting an invalid Content-Length" \
+		--http-version 1.1 --expect 400 --method POST \
+		--header "Content-Length: 3x" --entity "abc" $PROXY "$URL/"
+
+	run_proxy_test "rejecting a Transfer-Encoding field after a chunked one" \
+		--http-version 1.1 --pipeline --expect 400 --method POST \
+		--header "Transfer-Encoding: chunked" \
+		--header "Transfer-Encoding: identity" \
+		--entity '0\r\n\r\nGET /smuggled HTTP/1.1\r\nHost: x\r\n\r\n' \
+		$PROXY "$URL/"
+
+	run_proxy_test "rejecting chunked listed before another coding" \
+		--http-version 1.1 --expect 400 --method POST \
+		--header "Transfer-Encoding: chunked, gzip" \
+		--entity '0\r\n\r\n' $PROXY "$URL/"
+
+	run_proxy_test "rejecting chunked applied twice" \
+		--http-version 1.1 --expect 400 --method POST \
+		--header "Transfer-Encoding: chunked" \
+		--header "Transfer-Encoding: chunked" \
+		--entity '0\r\n\r\n0\r\n\r\n' $PROXY "$URL/"
+
+	run_proxy_test "relaying chunked listed last over several fields" \
+		--http-version 1.1 --pipeline --expect 200,200 --method POST \
+		--header "Transfer-Encoding: gzip" \
+		--header "Transfer-Encoding: chunked" \
+		--entity '3\r\nabc\r\n0\r\n\r\n' \
+		$PROXY "$URL/" "$URL/"
+
+	run_proxy_test "unfolding a header line continued with obs-fold" \
+		--http-version 1.1 --expect 200 \
+		--header "X-Folded: one" --header "  two" \
+		--expect-body "x-folded: one" $PROXY "$URL/"
+
+	run_proxy_test "rejecting an oversized request head" \
+		--http-version 1.1 --expect 400 --pad-headers 200000 \
+		$PROXY "$URL/"
+
+	# filtering (see provision_tinyproxy)
+
+	run_proxy_test "filtering on a rule anchored at the start" \
+		--expect 403 $PROXY "$URL/filtered-start/page"
+
+	run_proxy_test "filtering on a rule anchored at the end" \
+		--expect 403 $PROXY "$URL/page/filtered-end"
+
+	run_proxy_test "filtering on a plain string" \
+		--expect 403 $PROXY "$URL/a/FILTERED-ANYWHERE/b"
+
+	run_proxy_test "filtering on a string with a wildcard" \
+		--expect 403 $PROXY "$URL/filtered-dot"
+
+	run_proxy_test "filtering on an expression" \
+		--expect 403 $PROXY "$URL/a/x123y/b"
+
+	run_proxy_test "passing a request no rule matches" \
+		--expect 200 $PROXY "$URL/filtered/filtered-end/x-y/page"
+
+	# reloading the configuration (see provision_tinyproxy)
+
+	echo -n "reloading while connecting to an upstream proxy..."
+	( sleep 1 ; kill -HUP $(cat $TINYPROXY_PID_FILE) ) &
+	RELOAD_PID=$!
+	run_basic_webclient_request --expect 200 $PROXY "http://stalled.test/"
+	test "x$?" = "x0" || FAILED=$((FAILED + 1))
+	wait $RELOAD_PID
+}
+
 # "main"
 
 provision_initial
-provision_tinyproxy
 provision_webserver
 
 start_webserver
-start_tinyproxy
+start_stalled_server
 
-wait_for_some_seconds 3
+wait_for_some_seconds 1
 
 FAILED=0
 
@@ -184,23 +395,33 @@ echo -n "checking direct connection to web server..."
 run_basic_webclient_request "$WEBSERVER_IP:$WEBSERVER_PORT" /
 test "x$?" = "x0" || FAILED=$((FAILED + 1))
 
-echo -n "testing connection through tinyproxy..."
-run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$WEBSERVER_IP:$WEBSERVER_PORT/"
+echo -n "checking that the web server rejects obs-fold..."
+run_basic_webclient_request --expect 400 \
+	--header "X-Folded: one" --header "  two" \
+	"$WEBSERVER_IP:$WEBSERVER_PORT" /
 test "x$?" = "x0" || FAILED=$((FAILED + 1))
 
-echo -n "requesting statspage via stathost url..."
-run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$TINYPROXY_STATHOST_IP"
-test "x$?" = "x0" || FAILED=$((FAILED + 1))
+# The same tests for each way of handling connections
+for WORKER_MODE in prefork eventloop threads ; do
+	provision_tinyproxy $WORKER_MODE
+	start_tinyproxy
 
-echo "$FAILED errors"
+	wait_for_some_seconds 2
+
+	run_proxy_tests
+
+	if test "x$TINYPROXY_TESTS_WAIT" = "xyes"; then
+		echo "You can continue using the webserver and tinyproxy."
+		echo -n "hit <enter> to stop tinyproxy and go on: "
+		read READ
+	fi
+
+	stop_tinyproxy
+done
 
-if test "x$TINYPROXY_TESTS_WAIT" = "xyes"; then
-	echo "You can continue using the webserver and tinyproxy."
-	echo -n "hit <enter> to stop the servers and exit: "
-	read READ
-fi
+echo "$FAILED errors"
 
-stop_tinyproxy
+stop_stalled_server
 stop_webserver
 
 echo "done"
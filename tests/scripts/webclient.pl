@@ -35,6 +35,12 @@ my $method = "GET";
 my $dry_run = 0;
 my $help = 0;
 my $entity = undef;
+my @headers = ();
+my $pad_headers = 0;
+my $pipeline = 0;
+my $expect = undef;
+my $expect_body = undef;
+my $timeout = 10;
 
 my $default_port = "80";
 my $port = $default_port;
@@ -44,18 +50,29 @@ sub process_options() {
 				"http-version=s" => \$http_version,
 				"method=s" => \$method,
 				"dry-run" => \$dry_run,
-				"entity=s" => \$entity);
+				"entity=s" => \$entity,
+				"header=s" => \@headers,
+				"pad-headers=i" => \$pad_headers,
+				"pipeline" => \$pipeline,
+				"expect=s" => \$expect,
+				"expect-body=s" => \$expect_body,
+				"timeout=i" => \$timeout);
 	die "Error reading cmdline options! $!" unless $result;
 
 	pod2usage(1) if $help;
 
 	# some post-processing:
+
+	if (defined($entity)) {
+		$entity =~ s/\\r/\r/g;
+		$entity =~ s/\\n/\n/g;
+	}
 }
 
 
-sub build_request($$$$$$)
+sub build_request($$$$$$$)
 {
-	my ( $host, $port, $version, $method, $document, $entity ) = @_;
+	my ( $host, $port, $version, $method, $document, $entity, $keep_alive ) = @_;
 	my $request = "";
 
 	$method = uc($method);
@@ -72,11 +89,20 @@ sub build_request($$$$$$)
 		$request = "$method $document HTTP/$version$EOL"
 			 . "Host: $host" . (($port and ($port ne $default_port))?":$port":"") . "$EOL"
 			 . $user_agent_header
-			 . "Connection: close$EOL";
+			 . ($keep_alive ? "" : "Connection: close$EOL");
 	} else {
 		die "invalid version '$version'";
 	}
 
+	if ($version ne '0.9') {
+		foreach my $header (@headers) {
+			$request .= "$header$EOL";
+		}
+		if ($pad_headers > 0) {
+			$request .= "X-Padding: " . ("x" x $pad_headers) . $EOL;
+		}
+	}
+
 	$request .= $EOL;
 
 	if ($entity) {
@@ -86,6 +112,89 @@ sub build_request($$$$$$)
 	return $request;
 }
 
+# Take the next response off the front of what was received, and return
+# its status code and body.  The end of the body is found from the
+# "Content-Length" header or the chunked coding, and is otherwise the
+# end of the data.  A body with a malformed chunk size is taken to run to
+# the end of the data as well.
+sub next_response($$)
+{
+	my ( $data, $method ) = @_;
+
+	return () unless ($$data =~ s/^HTTP\/\d\.\d (\d{3})[^\n]*\n//);
+	my $status = $1;
+
+	my $length = undef;
+	my $chunked = 0;
+	while ($$data =~ s/^([^\n]*)\n//) {
+		my $line = $1;
+		$line =~ s/\r$//;
+		last if ($line eq "");
+
+		if ($line =~ /^content-length:[ \t]*(\d+)/i) {
+			$length = $1;
+		} elsif ($line =~ /^transfer-encoding:.*chunked[ \t]*$/i) {
+			$chunked = 1;
+		}
+	}
+
+	my $body = "";
+	if (uc($method) eq 'HEAD' or $status =~ /^(1..|204|304)$/) {
+		# no body
+	} elsif ($chunked) {
+		while ($$data =~ s/^([0-9a-fA-F]{1,8})([ \t]*;[^\n]*)?\r?\n//) {
+			my $size = hex($1);
+			if ($size == 0) {
+				# the trailer fields and the blank line
+				while ($$data =~ s/^([^\n]*)\n//) {
+					last if ($1 =~ /^\r?$/);
+				}
+				return ($status, $body);
+			}
+			$body .= substr($$data, 0, $size, "");
+			$$data =~ s/^\r?\n//;
+		}
+		$body .= $$data;
+		$$data = "";
+	} elsif (defined($length)) {
+		$body = substr($$data, 0, $length, "");
+	} else {
+		$body = $$data;
+		$$data = "";
+	}
+
+	return ($status, $body);
+}
+
+# Compare the responses with the status codes expected of them, in order.
+sub check_responses($$$)
+{
+	my ( $data, $method, $expected ) = @_;
+	my @expected = split(/,/, $expected);
+	my @got = ();
+	my $first_body = undef;
+
+	while (my ($status, $body) = next_response(\$data, $method)) {
+		push @got, $status;
+		$first_body = $body unless defined($first_body);
+	}
+
+	if (join(",", @got) ne join(",", @expected)) {
+		print STDERR "expected responses " . join(",", @expected)
+			   . ", got " . (@got ? join(",", @got) : "none") . "\n";
+		return 0;
+	}
+
+	if (defined($expect_body) and
+	    (!defined($first_body) or index($first_body, $expect_body) < 0))
+	{
+		print STDERR "response body does not contain '$expect_body'\n";
+		return 0;
+	}
+
+	return 1;
+}
+
 # main
 
 process_options();
@@ -102,8 +211,23 @@ if ($host =~ /^([^:]+):(.*)/) {
 	$host = $1;
 }
 
-foreach my $document (@ARGV) {
-	my $request = build_request($host, $port, $http_version, $method, $document, $entity);
+# With --pipeline all the requests go out together on one connection,
+# which is kept open until the last of them.
+my @requests = ();
+for (my $i = 0; $i < @ARGV; $i++) {
+	my $keep_alive = $pipeline && ($i < @ARGV - 1);
+	my $request = build_request($host, $port, $http_version, $method,
+				    $ARGV[$i], $entity, $keep_alive);
+	if ($pipeline) {
+		$requests[0] .= $request;
+	} else {
+		push @requests, $request;
+	}
+}
+
+my $failed = 0;
+
+foreach my $request (@requests) {
 	if ($dry_run) {
 		print $request;
 		exit(0);
@@ -120,16 +244,27 @@ foreach my $document (@ARGV) {
 
 	$remote->autoflush(1);
 
+	local $SIG{ALRM} = sub { die "timed out after $timeout seconds\n"; };
+	alarm $timeout;
+
 	print $remote $request;
 
+	my $data = "";
 	while (<$remote>) {
 		print;
+		$data .= $_;
 	}
 
+	alarm 0;
+
 	close $remote;
+
+	if (defined($expect) and !check_responses($data, $method, $expect)) {
+		$failed = 1;
+	}
 }
 
-exit(0);
+exit($failed);
 
 __END__
 
@@ -159,7 +294,35 @@ Specify the HTTP request method ('GET', 'CONNECT', ...). Default is 'GET'.
 
 =item B<--entity>
 
-Add the provided string as entity (i.e. body) to the request.
+Add the provided string as entity (i.e. body) to the request.  The
+sequences \r and \n in it stand for a carriage return and a line feed.
+
+=item B<--header>
+
+Add the provided line to the request's header fields.  May be given more
+than once.  A line starting with a space continues the one before it.
+
+=item B<--pad-headers>
+
+Add a header field with a value of the given number of bytes.
+
+=item B<--pipeline>
+
+Send the requests for all the documents on a single connection, all at
+once, and keep it open until the response to the last one.
+
+=item B<--expect>
+
+A comma separated list of the status codes of the responses expected, in
+order.  The client exits with an error if other responses arrive.
+
+=item B<--expect-body>
+
+A string the body of the first response has to contain.
+
+=item B<--timeout>
+
+Give up on a connection after this many seconds. Default is 10.
 
 =item B<--dry-run>
 
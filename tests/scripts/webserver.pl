@@ -77,6 +77,53 @@ sub REAPER {
 	$SIG{CHLD} = \&REAPER;
 }
 
+sub read_chunked_entity($$) {
+	my $client = shift;
+	my $request = shift;
+	my $entity = "";
+
+	while (1) {
+		my $line = <$client>;
+		unless (defined($line) and
+			$line =~ /^([0-9a-fA-F]{1,8})[ \t]*(;.*)?\r?\n$/)
+		{
+			$request->{error} = "invalid chunk size";
+			return;
+		}
+
+		my $size = hex($1);
+		last if ($size == 0);
+
+		my $data = "";
+		while (length($data) < $size) {
+			my $len = read($client, $data, $size - length($data),
+				       length($data));
+			unless ($len) {
+				$request->{error} = "truncated chunk";
+				return;
+			}
+		}
+		$entity .= $data;
+
+		$line = <$client>;
+		unless (defined($line) and $line =~ /^\r?\n$/) {
+			$request->{error} = "missing chunk end";
+			return;
+		}
+	}
+
+	# the trailer fields
+	while (my $line = <$client>) {
+		last if ($line =~ /^\r?\n$/);
+		$line =~ s/\r?\n$//;
+		my ($name, $value) = split(/:[ \t]*/, $line, 2);
+		push(@{$request->{trailers}},
+		     { name => lc($name), value => $value });
+	}
+
+	$request->{entity} = $entity;
+}
+
 sub parse_request($) {
 	my $client = shift;
 	my $request = {};
@@ -87,6 +134,7 @@ sub parse_request($) {
 	my $request_line = <$client>;
 	if (!$request_line) {
 		$request->{error} = "emtpy request";
+		$request->{eof} = 1;
 		return $request;
 	}
 
@@ -109,24 +157,25 @@ sub parse_request($) {
 
 	my $current_header_line;
 	$request->{headers} = [];
+	$request->{trailers} = [];
 	while ($request_line = <$client>) {
 		if ($request_line =~ /^[ \t]/) {
-			# continued header line
-			chomp $request_line;
-			$current_header_line .= $request_line;
-			next;
+			# a proxy has to unfold these (RFC 7230, 3.2.4)
+			$request->{error} = "obsolete line folding";
+			return $request;
 		}
 
 		if ($current_header_line) {
 			# finish current header line
-			my ($name, $value) = split(": ", $current_header_line);
+			my ($name, $value) = split(/:[ \t]*/,
+						   $current_header_line, 2);
 			push(@{$request->{headers}},
 			     { name => lc($name), value => $value });
 		}
 
-		last if ($request_line eq $EOL);
+		last if ($request_line =~ /^\r?\n$/);
 
-		chomp $request_line;
+		$request_line =~ s/\r?\n$//;
 		$current_header_line = $request_line;
 	}
 
@@ -135,13 +184,37 @@ sub parse_request($) {
 
 	$request->{entity} = "";
 
-	# skip for now, don't block...
-	# if ($request_line) {
-	# 	while ($request_line = <$client>) {
-	# 		logmsg "got line '$request_line'";
-	# 		$request->{entity} .= $request_line;
-	# 	}
-	# }
+	my @lengths = ();
+	my $chunked = 0;
+	my $connection = "";
+	foreach my $header (@{$request->{headers}}) {
+		if ($header->{name} eq "content-length") {
+			push @lengths, $header->{value};
+		} elsif ($header->{name} eq "transfer-encoding") {
+			$chunked = ($header->{value} =~ /chunked[ \t]*$/i);
+		} elsif ($header->{name} eq "connection") {
+			$connection .= "," . lc($header->{value});
+		}
+	}
+
+	if ($request->{version} eq "1.1") {
+		$request->{keep_alive} = ($connection !~ /\bclose\b/);
+	} else {
+		$request->{keep_alive} = ($connection =~ /\bkeep-alive\b/);
+	}
+
+	if ($chunked) {
+		read_chunked_entity($client, $request);
+	} elsif (@lengths > 1) {
+		$request->{error} = "more than one Content-Length";
+	} elsif (@lengths and $lengths[0] !~ /^\d+$/) {
+		$request->{error} = "invalid Content-Length";
+	} elsif (@lengths and $lengths[0] > 0) {
+		my $len = read($client, $request->{entity}, $lengths[0]);
+		unless (defined($len) and $len == $lengths[0]) {
+			$request->{error} = "truncated entity";
+		}
+	}
 
 	my @print_headers = ();
 	foreach my $header (@{$request->{headers}}) {
@@ -155,67 +228,81 @@ sub parse_request($) {
 		"\n" .
 		"Headers:\n" .
 		join("\n", @print_headers) . "\n" .
-		#"\n" .
-		#"Body:\n" .
-		#"'" . $request->{entity} . "'\n" .
+		"\n" .
+		"Body:\n" .
+		"'" . $request->{entity} . "'\n" .
 		"------------------------------";
 
 	return $request;
 }
 
-sub child_action($) {
+# Answer with a chunked body, using chunk extensions and trailer fields.
+# The "bad" documents have a malformed chunk size, or a transfer coding
+# listed after "chunked", after which the connection is closed.
+sub send_chunked_response($$) {
 	my $client = shift;
-	my $client_ip = shift;
-
-	logmsg "client_action: client $client_ip";
-
-	$client->autoflush();
-
-	my $fortune_bin = "/usr/games/fortune";
-	my $fortune = "";
-	if ( -x $fortune_bin) {
-		$fortune = qx(/usr/games/fortune);
-		$fortune =~ s/\n/$EOL/g;
+	my $object = shift;
+
+	print $client "HTTP/1.1 200 OK$EOL";
+	print $client "$server_header$EOL";
+	print $client "Content-Type: text/plain$EOL";
+	print $client "Transfer-Encoding: chunked$EOL";
+	if ($object =~ /not-last/) {
+		print $client "Transfer-Encoding: identity$EOL";
+	}
+	print $client "Trailer: X-Checksum$EOL";
+	print $client "$EOL";
+
+	print $client "8;name=value$EOL" . "chunked $EOL";
+	print $client "5 ; quoted=\"a;b\"$EOL" . "body $EOL";
+
+	if ($object =~ /bad-size/) {
+		print $client "xyz$EOL" . "with an invalid chunk size$EOL";
+		return 0;
+	} elsif ($object =~ /huge-size/) {
+		print $client "fffffffffffffffffffff$EOL" . "huge$EOL";
+		return 0;
 	}
 
-	my $request = parse_request($client);
-
-	if ($request->{error}) {
-		print $client "HTTP/1.0 400 Bad Request$EOL";
-		print $client "$server_header$EOL";
-		print $client "Content-Type: text/html$EOL";
+	print $client "f$EOL" . "with extensions$EOL";
+	print $client "0;last$EOL";
+	if ($object =~ /not-last/) {
 		print $client "$EOL";
-		print $client "<html>$EOL";
-		print $client "<h1>400 Bad Request</h1>$EOL";
-		print $client "<p>Error: " . $request->{error} . "</p>$EOL";
-		print $client "</html>$EOL";
-		close $client;
-		return;
+		return 0;
 	}
+	print $client "X-Checksum: 12345$EOL";
+	print $client "X-Trailer: yes$EOL";
+	print $client "$EOL";
 
-	if ($request->{version} ne "0.9") {
-		print $client "HTTP/1.0 200 OK$EOL";
-		print $client "$server_header$EOL";
-		print $client "Content-Type: text/html$EOL";
-		print $client "$EOL";
+	return 1;
+}
+
+sub send_response($$$) {
+	my $client = shift;
+	my $request = shift;
+	my $fortune = shift;
+
+	if ($request->{object} =~ /\/chunked/) {
+		return send_chunked_response($client, $request->{object})
+			&& $request->{keep_alive};
 	}
 
-	print $client "<html>$EOL";
-	print $client "<h1>Tinyproxy test WEB server</h1>$EOL";
-	print $client "<h2>Fortune</h2>$EOL";
+	my $body = "<html>$EOL";
+	$body .= "<h1>Tinyproxy test WEB server</h1>$EOL";
+	$body .= "<h2>Fortune</h2>$EOL";
 	if ($fortune) {
-		print $client "<pre>$fortune</pre>$EOL";
+		$body .= "<pre>$fortune</pre>$EOL";
 	} else {
-		print $client "Sorry, no $fortune_bin not found.$EOL";
+		$body .= "Sorry, no /usr/games/fortune found.$EOL";
 	}
 
 	my @print_headers = ();
-	foreach my $header (@{$request->{headers}}) {
+	foreach my $header (@{$request->{headers}}, @{$request->{trailers}}) {
 		push @print_headers, $header->{name} . ": " . $header->{value};
 	}
-	print $client "<h2>Your request:</h2>$EOL";
-	print $client "<pre>$EOL";
-	print $client "Method:  " . $request->{method} . "\n" .
+	$body .= "<h2>Your request:</h2>$EOL";
+	$body .= "<pre>$EOL";
+	$body .= "Method:  " . $request->{method} . "\n" .
 		"Object:  " . $request->{object} . "\n" .
 		"Version: " . $request->{version} . "\n" .
 		"\n" .
@@ -223,8 +310,65 @@ sub child_action($) {
 		"\n" .
 		"entity (body):\n" .
 		$request->{entity} . "\n";
-	print $client "</pre>$EOL";
-	print $client "</html>$EOL";
+	$body .= "</pre>$EOL";
+	$body .= "</html>$EOL";
+
+	if ($request->{version} ne "0.9") {
+		print $client "HTTP/1.0 200 OK$EOL";
+		print $client "$server_header$EOL";
+		print $client "Content-Type: text/html$EOL";
+		print $client "Content-Length: " . length($body) . "$EOL";
+		if ($request->{keep_alive}) {
+			print $client "Connection: keep-alive$EOL";
+		}
+		print $client "$EOL";
+	}
+
+	print $client $body;
+
+	return $request->{keep_alive};
+}
+
+sub child_action($) {
+	my $client = shift;
+	my $client_ip = shift;
+
+	logmsg "client_action: client $client_ip";
+
+	$client->autoflush();
+
+	my $fortune_bin = "/usr/games/fortune";
+	my $fortune = "";
+	if ( -x $fortune_bin) {
+		$fortune = qx(/usr/games/fortune);
+		$fortune =~ s/\n/$EOL/g;
+	}
+
+	# Requests are answered one after another for as long as the
+	# client keeps the connection open.
+	my $requests = 0;
+	while (1) {
+		my $request = parse_request($client);
+
+		# the client closed a connection it kept open
+		last if ($request->{eof} and $requests > 0);
+
+		if ($request->{error}) {
+			print $client "HTTP/1.0 400 Bad Request$EOL";
+			print $client "$server_header$EOL";
+			print $client "Content-Type: text/html$EOL";
+			print $client "Connection: close$EOL";
+			print $client "$EOL";
+			print $client "<html>$EOL";
+			print $client "<h1>400 Bad Request</h1>$EOL";
+			print $client "<p>Error: " . $request->{error} . "</p>$EOL";
+			print $client "</html>$EOL";
+			last;
+		}
+
+		$requests++;
+		last unless send_response($client, $request, $fortune);
+	}
 
 	close $client;
 
@@ -421,6 +565,18 @@ This is a very simple web server. It currently does not deliver the specific web
 page requested, but constructs the same kind of answer for each request, citing
 a fortune if fortune is available, and printing the originating request.
 
+Documents whose path starts with "/chunked" are sent with the chunked transfer
+coding instead, using chunk extensions and trailer fields.  For
+"/chunked-bad-size" and "/chunked-huge-size" the third chunk has an invalid
+size, and the connection is closed after it.  "/chunked-not-last" has a second
+"Transfer-Encoding" field listing another coding after "chunked".
+
+Connections are kept open for further requests as HTTP/1.1 (or the
+"Connection: keep-alive" header) asks.  Request bodies are read as given by
+"Content-Length" or sent with the chunked coding.  Requests which a proxy
+should not pass on as they are (with obsolete line folding, or more than one
+"Content-Length") are answered with "400 Bad Request".
+
 =head1 COPYRIGHT
 
 Copyright (C) 2009 Michael Adam <obnox@samba.org>